@@ -25,6 +25,7 @@ package Check;
 use strict;
 use Carp;
 use DBI;
+use Grist::Partition;
 
 #
 # constructor
@@ -33,12 +34,15 @@ sub new {
         my ( $package  ) = shift;	
 	my ( $verbose  ) = shift;
 	my ( $pretend  ) = shift;
+	my ( $partition_hours ) = shift;
 	if ( !$verbose ) { $verbose = 0; } else { $verbose = 1; };
 	if ( !$pretend ) { $pretend = 0; } else { $pretend = 1; };
+	if ( !$partition_hours ) { $partition_hours = 0; };
 
 	if ( $verbose && $pretend ) { print "check: pretend mode not applicable, ignoring.\n"; }
 
-	my %hash = ( 'field' => '', 'value' => '', 'verbose' => $verbose, 'pretend' => $pretend );
+	my %hash = ( 'field' => '', 'value' => '', 'verbose' => $verbose, 'pretend' => $pretend,
+		     'partition_hours' => $partition_hours );
 	bless \%hash => $package;
 }
 
@@ -109,7 +113,12 @@ sub perform {
 	my $dbh = DBI->connect( $dsn, $db_username, $db_password ) or 
 		die('db: unable to establish a connection with the database.');
 
-	my $sql_query = "SELECT * FROM requests $sql_clause";
+	# a triplet is in the table of the period it was first seen in
+	my @queries;
+	foreach my $table ( Partition::tables($dbh, $self->{'partition_hours'}) ) {
+		push(@queries, "SELECT * FROM $table->[0] $sql_clause");
+	}
+	my $sql_query = join(' UNION ALL ', @queries);
 	if ( $self->{'verbose'} ) { print "check: $sql_query\n"; }
 
 	my $sth = $dbh->prepare($sql_query) or die('prune: unable to prepare database query.');
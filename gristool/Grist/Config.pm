@@ -39,8 +39,32 @@ sub new {
 		     'db_port'     => '',
 		     'db_username' => '',
 		     'db_password' => '',
+		     'db_max_triplets' => '',
+		     'db_sync_ms' => '',
+		     'db_snapshot_interval' => '',
+		     'db_write_behind_ms' => '',
+		     'db_group_commit_ms' => '',
+		     'db_group_commit_max' => '',
+		     'db_cache_mb' => '',
+		     'db_bloom_mb' => '',
+		     'db_partition_hours' => '',
+		     'db_partitions' => '',
 		     'rq_cooldown' => 0,
-		     'rq_defer_msg'=> '');	
+		     'rq_max_latency_ms' => '',
+		     'rq_auto_whitelist' => '',
+		     'rq_ipv4_netmask' => '',
+		     'rq_ipv6_netmask' => '',
+		     'rq_pending_ttl' => '',
+		     'rq_accepted_ttl' => '',
+		     'whitelist_clients' => '',
+		     'whitelist_recipients' => '',
+		     'whitelist_senders' => '',
+		     'rq_defer_msg'=> '',
+		     'rq_defer_code' => '',
+		     'listen_unix' => '',
+		     'listen_address' => '',
+		     'listen_port' => '',
+		     'rq_workers' => '');	
 	bless \%hash => $package;
 }
 
@@ -96,7 +120,7 @@ sub parse {
 	close(CONF);
 
 	# sqlite fix up
-	if ( lc($self->{'db_driver'}) eq 'sqlite' ) {
+	if ( lc($self->{'db_driver'}) =~ /^sqlite3?$/ ) {
 		$self->{'db_driver'} = 'SQLite';
 		$self->{'db_name'} = $self->{'db_path'}.'/'.$self->{'db_name'};
 	}
@@ -0,0 +1,67 @@
+#!/usr/bin/perl -w
+#
+# file: Partition.pm
+# perl module for finding the tables grist keeps its requests in.
+#
+# Copyright (C) 2004 Michael Hubbard <mhubbard@digital-fallout.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+package Partition;
+
+use strict;
+use Carp;
+use DBI;
+
+#
+# tables - the tables holding requests, oldest first
+#
+# With db_partition_hours set grist keeps the requests first seen in each
+# period of that many hours in a table of their own, requests_<period>.
+# Each table comes back as [ name, the time its period ends ], requests
+# itself, left from before partitioning, as [ 'requests', undef ].
+#
+sub tables {
+	my ( $dbh   ) = shift;
+	my ( $hours ) = shift;
+
+	if ( !$hours ) { return ( [ 'requests', undef ] ); }
+
+	my $driver = $dbh->{'Driver'}->{'Name'};
+	my $sql_query;
+	if ( $driver eq 'Pg' ) {
+		$sql_query = "SELECT tablename FROM pg_tables WHERE schemaname = current_schema() AND tablename LIKE 'requests%'";
+	} elsif ( $driver eq 'mysql' ) {
+		$sql_query = "SELECT table_name FROM information_schema.tables WHERE table_schema = DATABASE() AND table_name LIKE 'requests%'";
+	} else {
+		$sql_query = "SELECT name FROM sqlite_master WHERE type = 'table' AND name LIKE 'requests%'";
+	}
+
+	my $names = $dbh->selectcol_arrayref($sql_query) or die('partition: unable to list the request tables.');
+
+	my @tables;
+	foreach my $name ( @$names ) {
+		if ( $name eq 'requests' ) {
+			unshift(@tables, [ $name, undef, -1 ]);
+		} elsif ( $name =~ /^requests_([0-9]+)$/ ) {
+			push(@tables, [ $name, ($1 + 1) * $hours * 3600, $1 ]);
+		}
+	}
+
+	return map { [ $_->[0], $_->[1] ] } sort { $a->[2] <=> $b->[2] } @tables;
+}
+
+1;
@@ -25,6 +25,12 @@ package Prune;
 use strict;
 use Carp;
 use DBI;
+use Time::HiRes;
+use Grist::Partition;
+
+use constant DEFAULT_BATCH => 1000;	# ids per statement when only --max-rate is given
+use constant PROGRESS_SECS => 5;	# between two progress reports
+use constant VACUUM_PAGES  => 1000;	# pages handed back by one incremental vacuum
 
 #
 # constructor
@@ -33,9 +39,23 @@ sub new {
         my ( $package  ) = shift;	
 	my ( $verbose  ) = shift;
 	my ( $pretend  ) = shift;
+	my ( $batch_size ) = shift;
+	my ( $max_rate ) = shift;
+	my ( $partition_hours ) = shift;
+	my ( $partitions ) = shift;
 	if ( !$verbose ) { $verbose = 0; } else { $verbose = 1; };
 	if ( !$pretend ) { $pretend = 0; } else { $pretend = 1; };
-	my %hash = ( 'age' => -1, 'remove_dead' => 0, 'verbose' => $verbose, 'pretend' => $pretend );
+	if ( !$batch_size ) { $batch_size = 0; };
+	if ( !$max_rate ) { $max_rate = 0; };
+	if ( !$partition_hours ) { $partition_hours = 0; };
+	if ( !$partitions ) { $partitions = 30; };
+
+	# a rate can only be kept to a batch at a time
+	if ( $max_rate > 0 && $batch_size == 0 ) { $batch_size = DEFAULT_BATCH; }
+
+	my %hash = ( 'age' => -1, 'remove_dead' => 0, 'verbose' => $verbose, 'pretend' => $pretend,
+		     'batch_size' => $batch_size, 'max_rate' => $max_rate,
+		     'partition_hours' => $partition_hours, 'partitions' => $partitions );
 	bless \%hash => $package;
 }
 
@@ -118,33 +138,203 @@ sub perform {
 	my $dbh = DBI->connect( $dsn, $db_username, $db_password ) or 
 		die('db: unable to establish a connection with the database.');
 
-	if ( $self->{'pretend'} ) {
-		my $sql_query = "SELECT id FROM requests WHERE timestamp <= $self->{'age'} $sql_clause";
-		if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
+	# with db_partition_hours, grist no longer looks in the tables of the
+	# periods before its last db_partitions, those can go whole
+	my $dropped = time() - $self->{'partitions'} * $self->{'partition_hours'} * 3600;
+	my @pruned;
 
-		my $sth = $dbh->prepare($sql_query) or die('prune: unable to prepare database query.');
-		$sth->execute();
+	foreach my $table ( Partition::tables($dbh, $self->{'partition_hours'}) ) {
+		my ( $name, $ends ) = @$table;
 
-		my $rows = 0;
-		while ( my @junk = $sth->fetchrow_array() ) {
-			++$rows;
+		if ( defined($ends) && $ends <= $self->{'age'} && $ends <= $dropped && !$self->{'remove_dead'} ) {
+			if ( !$self->drop($dbh, $name) ) {
+				$dbh->disconnect();
+				return 0;
+			}
+			next;
 		}
-		print STDOUT "I would have removed $rows request record(s), but I didn't.\n";
-	} else {
-		my $sql_query = "DELETE FROM requests WHERE timestamp <= $self->{'age'} $sql_clause";
-		if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
-		
-		my $rows = $dbh->do($sql_query) or die('prune: unable to do query. records not removed.');
 
-		if ( $self->{'verbose'} ) { print "prune: removed $rows request(s).\n"; }
-		if ( $self->{'verbose'} ) { print "prune: vacuuming database. *click* vrhmmmmm.\n"; }
-		$dbh->do('VACUUM');
+		if ( $self->{'pretend'} ) {
+			my $sql_query = "SELECT id FROM $name WHERE timestamp <= $self->{'age'} $sql_clause";
+			if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
+
+			my $sth = $dbh->prepare($sql_query) or die('prune: unable to prepare database query.');
+			$sth->execute();
+
+			my $rows = 0;
+			while ( my @junk = $sth->fetchrow_array() ) {
+				++$rows;
+			}
+			print STDOUT "I would have removed $rows request record(s) from $name, but I didn't.\n";
+		} elsif ( $self->{'batch_size'} > 0 ) {
+			if ( !$self->removeBatched($dbh, $name, "timestamp <= $self->{'age'} $sql_clause") ) {
+				$dbh->disconnect();
+				return 0;
+			}
+			push(@pruned, $name);
+		} else {
+			my $sql_query = "DELETE FROM $name WHERE timestamp <= $self->{'age'} $sql_clause";
+			if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
+
+			my $rows = $dbh->do($sql_query) or die('prune: unable to do query. records not removed.');
+
+			if ( $self->{'verbose'} ) { print "prune: removed $rows request(s).\n"; }
+			push(@pruned, $name);
+		}
 	}
 
+	if ( @pruned ) { $self->vacuum($dbh, @pruned); }
+
 	if ( $self->{'verbose'} ) { print "prune: disconnecting from database, take care.\n"; }
 	$dbh->disconnect();
 
 	return 1;
 }
 
+#
+# drop - remove a partition table with all its requests in one statement
+#
+sub drop {
+	my ( $self ) = shift;
+	my ( $dbh  ) = shift;
+	my ( $name ) = shift;
+
+	if ( $self->{'pretend'} ) {
+		my ( $rows ) = $dbh->selectrow_array("SELECT COUNT(*) FROM $name");
+		print STDOUT "I would have dropped $name and its $rows request record(s), but I didn't.\n";
+		return 1;
+	}
+
+	my $sql_query = "DROP TABLE $name";
+	if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
+
+	if ( !defined($dbh->do($sql_query)) ) {
+		print STDERR "prune: unable to drop $name.\n";
+		return 0;
+	}
+
+	return 1;
+}
+
+#
+# removeBatched - remove requests a primary key range at a time
+#
+# Each range of --batch-size ids is one short statement, so grist only ever
+# waits on a single batch. Ranges go in id order starting at the first
+# request that matches, an interrupted prune leaves only newer requests 
+# behind and running it again carries on where it stopped.
+#
+sub removeBatched {
+	my ( $self ) = shift;
+	my ( $dbh  ) = shift;
+	my ( $name ) = shift;
+	my ( $sql_where ) = shift;
+
+	my $sql_query = "SELECT MIN(id), MAX(id) FROM $name WHERE $sql_where";
+	if ( $self->{'verbose'} ) { print "prune: $sql_query\n"; }
+
+	my ( $first, $last ) = $dbh->selectrow_array($sql_query);
+	if ( !defined($first) ) {
+		if ( $dbh->err ) {
+			print STDERR "prune: unable to find the requests to remove.\n";
+			return 0;
+		}
+		if ( $self->{'verbose'} ) { print "prune: nothing to remove.\n"; }
+		return 1;
+	}
+
+	if ( $self->{'verbose'} ) { print "prune: removing ids $first to $last, $self->{'batch_size'} at a time.\n"; }
+
+	# the batch under way is finished before we stop
+	my $interrupted = 0;
+	local $SIG{'INT'}  = sub { $interrupted = 1; };
+	local $SIG{'TERM'} = sub { $interrupted = 1; };
+
+	my $report   = $self->{'verbose'} || -t STDOUT;
+	my $started  = Time::HiRes::time();
+	my $reported = $started;
+	my $removed  = 0;
+	my $id       = $first;
+
+	while ( $id <= $last && !$interrupted ) {
+		my $upto = $id + $self->{'batch_size'};
+		my $rows = $dbh->do("DELETE FROM $name WHERE id >= $id AND id < $upto AND $sql_where");
+		if ( !defined($rows) ) {
+			print STDERR "prune: unable to remove requests from id $id on, $removed removed so far.\n";
+			print STDERR "prune: run the same prune again to carry on.\n";
+			return 0;
+		}
+		$removed += $rows;
+		$id = $upto;
+
+		my $now = Time::HiRes::time();
+		if ( $report && ($now - $reported >= PROGRESS_SECS || $id > $last) ) {
+			my $done = $id > $last ? $last : $id - 1;
+			printf STDOUT ("prune: removed %d request(s), up to id %d of %d (%.1f%%), %.0f/s.\n",
+				$removed, $done, $last, 100 * ($done - $first + 1) / ($last - $first + 1),
+				$now > $started ? $removed / ($now - $started) : 0);
+			$reported = $now;
+		}
+
+		# on average no faster than --max-rate
+		if ( $self->{'max_rate'} > 0 ) {
+			my $ahead = $removed / $self->{'max_rate'} - ($now - $started);
+			if ( $ahead > 0 ) { Time::HiRes::sleep($ahead); }
+		}
+	}
+
+	if ( $interrupted ) {
+		print STDOUT "prune: interrupted after removing $removed request(s), run the same prune again to carry on.\n";
+		return 0;
+	}
+
+	if ( $self->{'verbose'} ) { print "prune: removed $removed request(s).\n"; }
+
+	return 1;
+}
+
+#
+# vacuum - hand back the space removed requests took
+#
+# A full VACUUM holds the whole SQLite file, with auto_vacuum set to
+# INCREMENTAL the free pages are handed back a few at a time instead. A
+# batched prune never runs a full one.
+#
+sub vacuum {
+	my ( $self ) = shift;
+	my ( $dbh  ) = shift;
+	my ( @names ) = @_;
+
+	my $driver = $dbh->{'Driver'}->{'Name'};
+
+	if ( $driver eq 'SQLite' ) {
+		my ( $auto_vacuum ) = $dbh->selectrow_array('PRAGMA auto_vacuum');
+
+		if ( defined($auto_vacuum) && $auto_vacuum == 2 ) {
+			my ( $free ) = $dbh->selectrow_array('PRAGMA freelist_count');
+			if ( $self->{'verbose'} ) { print "prune: handing back $free free page(s), ".VACUUM_PAGES." at a time.\n"; }
+
+			while ( $free && $free > 0 ) {
+				# the pragma only frees pages as its rows are stepped through
+				$dbh->selectall_arrayref('PRAGMA incremental_vacuum('.VACUUM_PAGES.')');
+
+				my ( $left ) = $dbh->selectrow_array('PRAGMA freelist_count');
+				if ( !defined($left) || $left >= $free ) { last; }
+				$free = $left;
+			}
+		} elsif ( $self->{'batch_size'} > 0 ) {
+			if ( $self->{'verbose'} ) { print "prune: not vacuuming, auto_vacuum is not INCREMENTAL.\n"; }
+		} else {
+			if ( $self->{'verbose'} ) { print "prune: vacuuming database. *click* vrhmmmmm.\n"; }
+			$dbh->do('VACUUM');
+		}
+	} elsif ( $driver eq 'Pg' ) {
+		# takes no locks that keep grist waiting
+		if ( $self->{'verbose'} ) { print "prune: vacuuming database. *click* vrhmmmmm.\n"; }
+		foreach my $name ( @names ) { $dbh->do("VACUUM $name"); }
+	}
+
+	return 1;
+}
+
 1;
@@ -0,0 +1,173 @@
+#!/usr/bin/perl -w
+#
+# file: Report.pm
+# perl module for reporting on the size of the grist greylist database.
+#
+# Copyright (C) 2004 Michael Hubbard <mhubbard@digital-fallout.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+#
+
+package Report;
+
+use strict;
+use Carp;
+use DBI;
+use Grist::Partition;
+
+# must match db_memory.c
+use constant MEMORY_RECORD   => 48;	# bytes of a triplet's record
+use constant MEMORY_DOMAIN   => 24;	# id and index slots of an interned domain
+use constant TEXT_COLUMNS    => 16;	# id, seen, accepted and timestamp of a row
+
+#
+# constructor
+#
+sub new {
+        my ( $package  ) = shift;
+	my ( $verbose  ) = shift;
+	my ( $pretend  ) = shift;
+	my ( $partition_hours ) = shift;
+	if ( !$verbose ) { $verbose = 0; } else { $verbose = 1; };
+	if ( !$pretend ) { $pretend = 0; } else { $pretend = 1; };
+	if ( !$partition_hours ) { $partition_hours = 0; };
+
+	if ( $verbose && $pretend ) { print "report: pretend mode not applicable, ignoring.\n"; }
+
+	my %hash = ( 'verbose' => $verbose, 'pretend' => $pretend, 'partition_hours' => $partition_hours );
+	bless \%hash => $package;
+}
+
+#
+# checkArguments - checks / processes command arguments
+#
+sub checkArguments {
+	my ( $self ) = shift;
+	my ( @args ) = @_;
+
+	if ( $#args >= 0 ) { return 0; }
+
+	return 1;
+}
+
+#
+# onDisk - bytes the request tables take in the database, undef if unknown
+#
+sub onDisk {
+	my ( $self   ) = shift;
+	my ( $dbh    ) = shift;
+	my ( @tables ) = @_;
+
+	my $driver = $dbh->{'Driver'}->{'Name'};
+	my $names  = join(', ', map { "'$_'" } @tables);
+
+	if ( $driver eq 'Pg' ) {
+		my ( $bytes ) = $dbh->selectrow_array("SELECT SUM(pg_total_relation_size(quote_ident(tablename))) FROM pg_tables WHERE schemaname = current_schema() AND tablename IN ($names)");
+		return $bytes;
+	} elsif ( $driver eq 'mysql' ) {
+		my ( $bytes ) = $dbh->selectrow_array("SELECT SUM(data_length + index_length) FROM information_schema.tables WHERE table_schema = DATABASE() AND table_name IN ($names)");
+		return $bytes;
+	} elsif ( $driver eq 'SQLite' ) {
+		# the requests are all the file holds
+		my ( $pages ) = $dbh->selectrow_array('PRAGMA page_count');
+		my ( $size  ) = $dbh->selectrow_array('PRAGMA page_size');
+		my ( $free  ) = $dbh->selectrow_array('PRAGMA freelist_count');
+		if ( !defined($pages) || !defined($size) ) { return undef; }
+		return ($pages - ($free || 0)) * $size;
+	}
+
+	return undef;
+}
+
+#
+# perform - report bytes per triplet as text and in memory
+#
+# The text figure is what the address, hostname, sender and recipient
+# columns hold plus four integer columns, before the database adds its own
+# row and index overhead, which the figure on disk includes. The memory
+# figure is what db_driver memory would take for the same triplets: a fixed
+# record each, plus every distinct domain once. Local parts are only hashed
+# into the record.
+#
+sub perform {
+	my ( $self ) = shift;
+	my ( $dsn  ) = shift;
+	my ( $db_username ) = shift;
+	my ( $db_password ) = shift;
+
+	my $dbh = DBI->connect( $dsn, $db_username, $db_password ) or
+		die('db: unable to establish a connection with the database.');
+
+	my @tables = map { $_->[0] } Partition::tables($dbh, $self->{'partition_hours'});
+
+	my $rows = 0;
+	my $text = 0;
+	my %domains;
+
+	foreach my $name ( @tables ) {
+		my $sql_query = "SELECT address, hostname, sender, recipient FROM $name";
+		if ( $self->{'verbose'} ) { print "report: $sql_query\n"; }
+
+		my $sth = $dbh->prepare($sql_query) or die('report: unable to prepare database query.');
+		$sth->execute();
+
+		while ( my @request = $sth->fetchrow_array() ) {
+			foreach my $column ( @request ) {
+				if ( defined($column) ) { $text += length($column); }
+			}
+			$text += TEXT_COLUMNS;
+
+			# split at the last @ like grist does
+			foreach my $addr ( $request[2], $request[3] ) {
+				if ( !defined($addr) ) { next; }
+				my $at = rindex($addr, '@');
+				if ( $at >= 0 && $at < length($addr) - 1 && length($addr) - $at - 1 <= 255 ) {
+					$domains{substr($addr, $at + 1)} = 1;
+				}
+			}
+			++$rows;
+		}
+	}
+
+	if ( $rows == 0 ) {
+		print "no requests to report on.\n";
+		$dbh->disconnect();
+		return 1;
+	}
+
+	my $strings = 0;
+	foreach my $str ( keys(%domains) ) {
+		$strings += length($str) + MEMORY_DOMAIN;
+	}
+
+	my $on_disk = $self->onDisk($dbh, @tables);
+
+	printf("requests: %d in %d table(s), %d distinct domain(s).\n",
+		$rows, scalar(@tables), scalar(keys(%domains)));
+	printf("as text : %.1f bytes per triplet in its columns", $text / $rows);
+	if ( $on_disk ) {
+		printf(", %.1f on disk with indexes", $on_disk / $rows);
+	}
+	print ".\n";
+	printf("memory  : %.1f bytes per triplet, %d in records and %.1f in interned domains.\n",
+		MEMORY_RECORD + $strings / $rows, MEMORY_RECORD, $strings / $rows);
+
+	if ( $self->{'verbose'} ) { print "report: disconnecting from database, take care.\n"; }
+	$dbh->disconnect();
+
+	return 1;
+}
+
+1;
@@ -28,6 +28,7 @@ use Getopt::Long qw(:config gnu_getopt );
 use Grist::Config;
 use Grist::Prune;
 use Grist::Check;
+use Grist::Report;
 
 my $appname = `basename $0`; chomp($appname);
 my $appver  = '0.1-DEVEL';
@@ -36,7 +37,7 @@ my $helpstr = "Try '$appname --help' for more information.";
 my $grist_conf = '../src/grist.conf';
 my $config = new Config();
 
-my %opts = ( 'verbose' => 0, 'pretend' => 0, 'conf' => $grist_conf );
+my %opts = ( 'verbose' => 0, 'pretend' => 0, 'conf' => $grist_conf, 'batch-size' => 0, 'max-rate' => 0 );
 my @args = ( );
 
 # trap warn signal
@@ -78,6 +79,8 @@ sub usage {
 		print "\n";
 		print "Options:\n";
 		print "  -c, --conf    \tfull path and name of the grist configuration file.\n";
+		print "  -b, --batch-size N\tprune N ids at a time, each batch a statement of its own.\n";
+		print "  -r, --max-rate N\tprune no more than N requests a second, in batches.\n";
 		print "  -p, --pretend \tdisplay what would be done, will not alter the database.\n";
 		print "  -v, --verbose \tbe verbose.\n";
 		print "  -V, --version \tdisplay version information and exit.\n";
@@ -85,6 +88,7 @@ sub usage {
 		print "Commands:\n";
 		print "  prune AGE <dead-requests>\tremove requests older than AGE.\n";
 		print "  check FIELD VALUE        \tquery FIELD for VALUE and display matches.\n";
+		print "  report                   \tshow bytes per triplet as text and in memory.\n";
 		print "\n";
 	} elsif ( $cmd eq 'prune' ) {
 		print "Usage: $appname [OPTIONS] prune AGE <dead-requests>\n";
@@ -92,6 +96,9 @@ sub usage {
 	} elsif ( $cmd eq 'check' ) {
 		print "Usage: $appname [OPTIONS] check FIELD VALUE\n";
 		print "$helpstr\n";
+	} elsif ( $cmd eq 'report' ) {
+		print "Usage: $appname [OPTIONS] report\n";
+		print "$helpstr\n";
 	}
 	
 	if ( $cmd ne '' ) {
@@ -121,6 +128,8 @@ if ( $#ARGV == -1 ) { usage( $helpstr ); }
 	
 GetOptions(\%opts,
 	   'conf|c=s',
+	   'batch-size|b=i',
+	   'max-rate|r=i',
 	   'verbose|v',
 	   'pretend|p',
 	   'V|version', => sub { version(); },
@@ -135,6 +144,10 @@ if ( $opts{'verbose'} ) {
 	print "$appname: using grist configuration: $opts{'conf'}\n";
 }
 
+if ( $opts{'batch-size'} < 0 || $opts{'max-rate'} < 0 ) {
+	usage($helpstr, "$appname: --batch-size and --max-rate can't be negative");
+}
+
 # final sanity check on our wanted command in $args[0]
 if ( !$args[0] ) { usage($helpstr); } 
 
@@ -175,7 +188,8 @@ if ( lc($command) eq 'prune' ) {
 	
 	if ( $opts{'verbose'} ) { print "$appname: command 'prune' requested, handing over control ...\n"; }
 	# check for prune
-	my $prune = new Prune( $opts{'verbose'}, $opts{'pretend'} );
+	my $prune = new Prune( $opts{'verbose'}, $opts{'pretend'}, $opts{'batch-size'}, $opts{'max-rate'},
+				 $config->get('db_partition_hours'), $config->get('db_partitions') );
 	if ( !$prune->checkArguments(@args) )  { usage('','','prune'); }
 
 	if (! $prune->perform( $dsn, $config->get('db_username'), $config->get('db_password') ) ) {
@@ -186,7 +200,7 @@ if ( lc($command) eq 'prune' ) {
 } elsif ( lc($command) eq 'check' ) {
 	
 	if ( $opts{'verbose'} ) { print "$appname: command 'check' requested, handing over control ...\n"; }
-	my $check = new Check( $opts{'verbose'}, $opts{'pretend'} );
+	my $check = new Check( $opts{'verbose'}, $opts{'pretend'}, $config->get('db_partition_hours') );
 	if ( !$check->checkArguments(@args) ) { usage('','','check'); }
 
 	if ( !$check->perform($dsn, $config->get('db_username'), $config->get('db_password')) ) {
@@ -194,6 +208,17 @@ if ( lc($command) eq 'prune' ) {
 		exit(1);
 	} 
 
+} elsif ( lc($command) eq 'report' ) {
+
+	if ( $opts{'verbose'} ) { print "$appname: command 'report' requested, handing over control ...\n"; }
+	my $report = new Report( $opts{'verbose'}, $opts{'pretend'}, $config->get('db_partition_hours') );
+	if ( !$report->checkArguments(@args) ) { usage('','','report'); }
+
+	if ( !$report->perform($dsn, $config->get('db_username'), $config->get('db_password')) ) {
+		if ( $opts{'verbose'} ) { print "$appname: exiting with error condition.\n"; }
+		exit(1);
+	}
+
 } else {
 	usage($helpstr, "error: unknown command requested '$args[0]'");
 }
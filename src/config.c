@@ -67,8 +67,31 @@ int parse_config_file( char *filename, struct t_grist_config* grist_cfg ) {
 	grist_cfg->db_port 	   = 0;
 	grist_cfg->db_username[0]  = '\0';
 	grist_cfg->db_password[0]  = '\0';
+	grist_cfg->db_max_triplets = 1000000;
+	grist_cfg->db_sync_ms      = 1000;
+	grist_cfg->db_snapshot_interval = 3600;
+	grist_cfg->db_write_behind_ms   = 0;
+	grist_cfg->db_group_commit_ms   = 0;
+	grist_cfg->db_group_commit_max  = 256;
+	grist_cfg->db_cache_mb          = 0;
+	grist_cfg->db_bloom_mb          = 0;
+	grist_cfg->db_partition_hours   = 0;
+	grist_cfg->db_partitions        = 30;
 	grist_cfg->rq_cooldown     = 120;
+	grist_cfg->rq_max_latency_ms = 2000;
+	grist_cfg->rq_auto_whitelist = 0;
+	grist_cfg->rq_ipv4_netmask   = 32;
+	grist_cfg->rq_ipv6_netmask   = 128;
+	grist_cfg->rq_pending_ttl    = 0;
+	grist_cfg->rq_accepted_ttl   = 0;
+	grist_cfg->whitelist_clients[0] = '\0';
+	grist_cfg->whitelist_recipients[0] = '\0';
+	grist_cfg->whitelist_senders[0] = '\0';
 	grist_cfg->rq_defer_msg[0] = '\0';
+	grist_cfg->listen_unix[0]    = '\0';
+	grist_cfg->listen_address[0] = '\0';
+	grist_cfg->listen_port       = 0;
+	grist_cfg->rq_workers        = 0;
 
 	line = (char *)malloc( sizeof(char)*STR_MAX );
 
@@ -124,6 +147,76 @@ int parse_config_file( char *filename, struct t_grist_config* grist_cfg ) {
 			value[dest_size]='\0'; 
 			strncpy(grist_cfg->db_password, value, dest_size);
 		} else 
+		if (strcmp(key,"db_max_triplets")==0) {
+			long tmp_triplets = strtol( value, NULL, 10 );
+			if ( tmp_triplets <= 0 ) {
+				parse_error = CFG_BADTRIPLETS;
+			}
+			grist_cfg->db_max_triplets = tmp_triplets;
+		} else 
+		if (strcmp(key,"db_sync_ms")==0) {
+			long tmp_sync = strtol( value, NULL, 10 );
+			if ( tmp_sync <= 0 ) {
+				parse_error = CFG_BADSYNC;
+			}
+			grist_cfg->db_sync_ms = tmp_sync;
+		} else 
+		if (strcmp(key,"db_snapshot_interval")==0) {
+			long tmp_interval = strtol( value, NULL, 10 );
+			if ( tmp_interval <= 0 ) {
+				parse_error = CFG_BADSNAPSHOT;
+			}
+			grist_cfg->db_snapshot_interval = tmp_interval;
+		} else 
+		if (strcmp(key,"db_write_behind_ms")==0) {
+			long tmp_behind = strtol( value, NULL, 10 );
+			if ( tmp_behind < 0 || tmp_behind > 60000 ) {
+				parse_error = CFG_BADBEHIND;
+			}
+			grist_cfg->db_write_behind_ms = tmp_behind;
+		} else
+		if (strcmp(key,"db_group_commit_ms")==0) {
+			long tmp_group = strtol( value, NULL, 10 );
+			if ( tmp_group < 0 || tmp_group > 1000 ) {
+				parse_error = CFG_BADGROUP;
+			}
+			grist_cfg->db_group_commit_ms = tmp_group;
+		} else
+		if (strcmp(key,"db_group_commit_max")==0) {
+			long tmp_group = strtol( value, NULL, 10 );
+			if ( tmp_group <= 0 || tmp_group > 1000 ) {
+				parse_error = CFG_BADGROUP;
+			}
+			grist_cfg->db_group_commit_max = tmp_group;
+		} else
+		if (strcmp(key,"db_cache_mb")==0) {
+			long tmp_cache = strtol( value, NULL, 10 );
+			if ( tmp_cache < 0 || tmp_cache > 65536 ) {
+				parse_error = CFG_BADCACHE;
+			}
+			grist_cfg->db_cache_mb = tmp_cache;
+		} else
+		if (strcmp(key,"db_bloom_mb")==0) {
+			long tmp_bloom = strtol( value, NULL, 10 );
+			if ( tmp_bloom < 0 || tmp_bloom > 65536 ) {
+				parse_error = CFG_BADBLOOM;
+			}
+			grist_cfg->db_bloom_mb = tmp_bloom;
+		} else
+		if (strcmp(key,"db_partition_hours")==0) {
+			long tmp_hours = strtol( value, NULL, 10 );
+			if ( tmp_hours < 0 || tmp_hours > 8784 ) {
+				parse_error = CFG_BADPARTITION;
+			}
+			grist_cfg->db_partition_hours = tmp_hours;
+		} else
+		if (strcmp(key,"db_partitions")==0) {
+			long tmp_partitions = strtol( value, NULL, 10 );
+			if ( tmp_partitions <= 0 || tmp_partitions > PARTITION_MAX ) {
+				parse_error = CFG_BADPARTITION;
+			}
+			grist_cfg->db_partitions = tmp_partitions;
+		} else
 		if (strcmp(key,"rq_cooldown")==0) {
 			long tmp_cooldown = strtol(value, NULL, 10 );
 			if ( tmp_cooldown <= 0 ) {
@@ -132,10 +225,91 @@ int parse_config_file( char *filename, struct t_grist_config* grist_cfg ) {
 			}
 			grist_cfg->rq_cooldown = tmp_cooldown;
 		} else 
+		if (strcmp(key,"rq_max_latency_ms")==0) {
+			long tmp_latency = strtol( value, NULL, 10 );
+			if ( tmp_latency <= 0 || tmp_latency > 600000 ) {
+				parse_error = CFG_BADLATENCY;
+			}
+			grist_cfg->rq_max_latency_ms = tmp_latency;
+		} else
+		if (strcmp(key,"rq_auto_whitelist")==0) {
+			long tmp_whitelist = strtol( value, NULL, 10 );
+			if ( tmp_whitelist < 0 ) {
+				parse_error = CFG_BADWHITELIST;
+			}
+			grist_cfg->rq_auto_whitelist = tmp_whitelist;
+		} else
+		if (strcmp(key,"rq_ipv4_netmask")==0) {
+			long tmp_netmask = strtol( value, NULL, 10 );
+			if ( tmp_netmask < 0 || tmp_netmask > 32 ) {
+				parse_error = CFG_BADNETMASK;
+			}
+			grist_cfg->rq_ipv4_netmask = tmp_netmask;
+		} else
+		if (strcmp(key,"rq_ipv6_netmask")==0) {
+			long tmp_netmask = strtol( value, NULL, 10 );
+			if ( tmp_netmask < 0 || tmp_netmask > 128 ) {
+				parse_error = CFG_BADNETMASK;
+			}
+			grist_cfg->rq_ipv6_netmask = tmp_netmask;
+		} else
+		if (strcmp(key,"rq_pending_ttl")==0) {
+			long tmp_ttl = strtol( value, NULL, 10 );
+			if ( tmp_ttl < 0 ) {
+				parse_error = CFG_BADTTL;
+			}
+			grist_cfg->rq_pending_ttl = tmp_ttl;
+		} else
+		if (strcmp(key,"rq_accepted_ttl")==0) {
+			long tmp_ttl = strtol( value, NULL, 10 );
+			if ( tmp_ttl < 0 ) {
+				parse_error = CFG_BADTTL;
+			}
+			grist_cfg->rq_accepted_ttl = tmp_ttl;
+		} else
+		if (strcmp(key,"whitelist_clients")==0) {
+			int dest_size = sizeof(grist_cfg->whitelist_clients);
+			strncpy(grist_cfg->whitelist_clients, value, dest_size-1);
+			grist_cfg->whitelist_clients[dest_size-1]='\0';
+		} else
+		if (strcmp(key,"whitelist_recipients")==0) {
+			int dest_size = sizeof(grist_cfg->whitelist_recipients);
+			strncpy(grist_cfg->whitelist_recipients, value, dest_size-1);
+			grist_cfg->whitelist_recipients[dest_size-1]='\0';
+		} else
+		if (strcmp(key,"whitelist_senders")==0) {
+			int dest_size = sizeof(grist_cfg->whitelist_senders);
+			strncpy(grist_cfg->whitelist_senders, value, dest_size-1);
+			grist_cfg->whitelist_senders[dest_size-1]='\0';
+		} else
 		if (strcmp(key,"rq_defer_msg")==0) {
 			int dest_size = sizeof(grist_cfg->rq_defer_msg);
 			value[dest_size]='\0'; // ensure we have a null at last char
 			strncpy(grist_cfg->rq_defer_msg, value, dest_size);
+		} else
+		if (strcmp(key,"listen_unix")==0) {
+			int dest_size = sizeof(grist_cfg->listen_unix);
+			value[dest_size-1]='\0';
+			strncpy(grist_cfg->listen_unix, value, dest_size);
+		} else
+		if (strcmp(key,"listen_address")==0) {
+			int dest_size = sizeof(grist_cfg->listen_address);
+			value[dest_size-1]='\0';
+			strncpy(grist_cfg->listen_address, value, dest_size);
+		} else
+		if (strcmp(key,"listen_port")==0) {
+			long tmp_port = strtol( value, NULL, 10 );
+			if ( tmp_port <= 0 || tmp_port > 65535 ) {
+				parse_error = CFG_BADLISTEN;
+			}
+			grist_cfg->listen_port = tmp_port;
+		} else
+		if (strcmp(key,"rq_workers")==0) {
+			long tmp_workers = strtol( value, NULL, 10 );
+			if ( tmp_workers < 0 || tmp_workers > 256 ) {
+				parse_error = CFG_BADWORKERS;
+			}
+			grist_cfg->rq_workers = tmp_workers;
 		} 
 	
 	}
@@ -0,0 +1,320 @@
+/**
+ * file: db.c
+ * grist - picks the database backend and hands requests to it
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+// requests let through because the database was too slow, see db_check()
+static unsigned long db_late = 0;
+static time_t db_late_logged = 0;
+
+// tried in order, the first one to open a connection for db_driver is used
+static const struct t_db_backend *db_backends[] = {
+#ifdef HAVE_LIBSQLITE3
+	&db_backend_sqlite3,
+#endif
+#ifdef HAVE_LIBPQ
+	&db_backend_pgsql,
+#endif
+	&db_backend_memory,
+	&db_backend_mmap,
+	&db_backend_shm,
+	&db_backend_dbi,
+	NULL
+};
+
+/**
+ * db_open - connect to the configured database
+ *
+ * The native backends refuse databases they can't prepare their statements
+ * against, those are left to libdbi.
+ */
+struct t_db *db_open( struct t_grist_config *config ) {
+	struct t_db *db;
+	int i;
+
+	db = (struct t_db *)malloc(sizeof(struct t_db));
+	if ( db == NULL ) { return NULL; }
+
+	for ( i = 0; db_backends[i] != NULL; i++ ) {
+		if ( db_backends[i]->driver != NULL && strcmp(db_backends[i]->driver, config->db_driver) != 0 ) {
+			continue;
+		}
+
+		db->handle = db_backends[i]->open(config);
+		if ( db->handle != NULL ) {
+			db->backend = db_backends[i];
+			return db;
+		}
+	}
+
+	free(db);
+
+	return NULL;
+}
+
+void db_close( struct t_db *db ) {
+	_ASSERT( db != NULL );
+
+	db->backend->close(db->handle);
+	free(db);
+}
+
+/**
+ * db_needs_dbi - whether db_driver may be connected to through libdbi
+ *
+ * The stores grist keeps itself take no SQL, every other driver either is a
+ * libdbi one or is handed to libdbi when its native backend turns it down.
+ */
+int db_needs_dbi( struct t_grist_config *config ) {
+	int i;
+
+	for ( i = 0; db_backends[i] != NULL; i++ ) {
+		if ( db_backends[i]->driver != NULL && db_backends[i]->execute == NULL &&
+		     strcmp(db_backends[i]->driver, config->db_driver) == 0 ) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * db_shutdown - release what the backends hold for the whole process
+ *
+ * Every handle must have been closed and every worker stopped.
+ */
+void db_shutdown( void ) {
+	int i;
+
+	for ( i = 0; db_backends[i] != NULL; i++ ) {
+		if ( db_backends[i]->shutdown != NULL ) {
+			db_backends[i]->shutdown();
+		}
+	}
+
+	if ( db_late > 0 ) {
+		syslog(LOG_INFO, "db: %lu request(s) were let through over rq_max_latency_ms.", db_late);
+	}
+}
+
+/**
+ * db_count_late - count a request let through over the latency budget
+ */
+static void db_count_late( void ) {
+	unsigned long late;
+	time_t now, last;
+
+	late = __atomic_add_fetch(&db_late, 1, __ATOMIC_RELAXED);
+
+	// once a minute at most, a database stuck on a lock would flood the log
+	now  = time(NULL);
+	last = __atomic_load_n(&db_late_logged, __ATOMIC_RELAXED);
+	if ( now - last >= 60 && __atomic_compare_exchange_n(&db_late_logged, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+		syslog(LOG_WARNING, "db: over rq_max_latency_ms, %lu request(s) let through so far.", late);
+	}
+}
+
+/**
+ * db_check - look up and update the triplet of a request
+ *
+ * A backend that fails once the latency budget is spent was kept waiting,
+ * that is answered with CHECK_TIMEOUT and the connection is kept.
+ */
+int db_check( struct t_db *db, struct t_request *request, struct t_grist_config *config ) {
+	int action;
+
+	_ASSERT( db != NULL );
+
+	// requests that didn't come through grist_io_next() start their budget now
+	if ( request->received.tv_sec == 0 && request->received.tv_nsec == 0 ) {
+		clock_gettime(CLOCK_MONOTONIC, &request->received);
+	}
+
+	// only the SQL backends are slow enough to be worth caching
+	if ( db->backend->execute != NULL && db_cache_active() ) {
+		action = db_cache_check(db, request, config);
+		if ( action >= 0 ) { return action; }
+	}
+
+	action = db->backend->check(db->handle, request, config);
+
+	if ( action == CHECK_NEW || action == CHECK_COOLING || action == CHECK_OKAY ) {
+		db_bloom_add(request);
+	}
+	if ( action == CHECK_NEW ) {
+		db_expire_add(request);
+	}
+
+	if ( action == CHECK_ERR && db_time_left(request, config) <= 0 ) {
+		db_count_late();
+		return CHECK_TIMEOUT;
+	}
+
+	return action;
+}
+
+/**
+ * db_execute - run a statement that returns nothing
+ *
+ * Returns 0 if it failed, or if the backend doesn't take SQL.
+ */
+int db_execute( struct t_db *db, const char *sql ) {
+	_ASSERT( db != NULL );
+
+	if ( db->backend->execute == NULL ) { return 0; }
+
+	return db->backend->execute(db->handle, sql);
+}
+
+/**
+ * db_quote - quote a string for use in a statement run by db_execute()
+ *
+ * Returns a literal including its quotes for the caller to free, NULL if
+ * the backend doesn't take SQL.
+ */
+char *db_quote( struct t_db *db, const char *str ) {
+	_ASSERT( db != NULL );
+
+	if ( db->backend->quote == NULL ) { return NULL; }
+
+	return db->backend->quote(db->handle, str);
+}
+
+/**
+ * db_query - run a statement returning address, sender, recipient and
+ * timestamp columns, handing each row to each()
+ *
+ * Returns the number of rows, -1 if it failed or the backend doesn't take
+ * SQL.
+ */
+long db_query( struct t_db *db, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	_ASSERT( db != NULL );
+
+	if ( db->backend->query == NULL ) { return -1; }
+
+	return db->backend->query(db->handle, sql, each, arg);
+}
+
+/**
+ * db_lookup_first - whether the SQL backends look a triplet up before
+ * writing anything, they can then leave the write to db_behind.c or
+ * db_group.c, and the row id is known for db_cache.c. db_bloom.c lets them
+ * skip the lookup for triplets never stored.
+ */
+int db_lookup_first( void ) {
+	return db_behind_active() || db_group_active() || db_cache_active();
+}
+
+/**
+ * db_stored_action - decide on a triplet a lookup found stored
+ *
+ * Returns TRIPLET_STORED if its counts can't be left to be written behind,
+ * the backend has to write them itself then.
+ */
+int db_stored_action( long r_id, long r_timestamp, struct t_request *request, struct t_grist_config *config ) {
+	int action;
+
+	action = db_triplet_action(1, r_timestamp, request, config);
+	if ( action == CHECK_OKAY ) {
+		db_cache_store(request, r_id, r_timestamp);
+	}
+	if ( !db_behind_add(r_id, action == CHECK_OKAY) ) { return TRIPLET_STORED; }
+
+	return action;
+}
+
+/**
+ * db_time_left - milliseconds left of the request's rq_max_latency_ms
+ */
+long db_time_left( struct t_request *request, struct t_grist_config *config ) {
+	struct timespec now;
+	long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - request->received.tv_sec) * 1000 + (now.tv_nsec - request->received.tv_nsec) / 1000000;
+
+	return config->rq_max_latency_ms - elapsed;
+}
+
+/**
+ * db_backoff - wait before trying a busy database again
+ *
+ * The wait doubles with every attempt and is jittered so that workers and
+ * processes which collided don't all come back at once. Returns 0 without
+ * waiting once the latency budget is spent.
+ */
+int db_backoff( struct t_request *request, struct t_grist_config *config, int attempt ) {
+	struct timespec now;
+	long left_us, wait_us;
+
+	left_us = db_time_left(request, config) * 1000;
+	if ( left_us <= 0 ) { return 0; }
+
+	wait_us = BACKOFF_MIN_US << (attempt < 8 ? attempt : 8);
+	if ( wait_us > BACKOFF_MAX_US ) { wait_us = BACKOFF_MAX_US; }
+
+	// somewhere in the upper half of the window
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait_us = wait_us/2 + (long)(grist_mix64((uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 32) ^ (uintptr_t)&now) % (uint64_t)(wait_us/2 + 1));
+	if ( wait_us > left_us ) { wait_us = left_us; }
+
+	usleep(wait_us);
+
+	return 1;
+}
+
+/**
+ * db_triplet_action - decide on a triplet from what was stored for it
+ *
+ * r_seen is the seen count after this request was counted, zero for a
+ * triplet that was just inserted. r_timestamp is when it was first seen.
+ */
+int db_triplet_action( long r_seen, long r_timestamp, struct t_request *request, struct t_grist_config *config ) {
+	long elapsed;
+
+	if ( r_seen == 0 ) {
+		_DBG("record not found, added to database");
+		return CHECK_NEW;
+	}
+
+	elapsed = request->timestamp - r_timestamp;
+	_DBG("request has been on ice for %ld second(s) valid at %ld second(s)", elapsed, config->rq_cooldown);
+	if ( elapsed < config->rq_cooldown ) {
+		_DBG("record still too hot.");
+		return CHECK_COOLING;
+	}
+
+	_DBG("record accepted.");
+	return CHECK_OKAY;
+}
+
+/**
+ * db_evict_rank - the order a full store gives triplets up in, lowest first
+ *
+ * Triplets never retried go first, then the rest, the oldest first within
+ * each.
+ */
+uint64_t db_evict_rank( uint32_t timestamp, uint32_t seen ) {
+	uint64_t stage = seen == 0 ? 0 : 1;
+
+	return stage << 32 | timestamp;
+}
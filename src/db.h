@@ -0,0 +1,124 @@
+/**
+ * file: db.h
+ * grist - database backends
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#define BACKOFF_MIN_US	250	// first wait before retrying a busy database
+#define BACKOFF_MAX_US	50000	// waits double up to this, never past the latency budget
+
+// db_evict_rank() of the first retried triplet, those ranked below it were
+// never retried
+#define DB_EVICT_RETRIED	((uint64_t)1 << 32)
+
+// a triplet looked up before anything was written, see db_stored_action()
+#define TRIPLET_UNKNOWN	-1	// not stored yet
+#define TRIPLET_STORED	-2	// stored, its counts have to be written now
+
+// rows of the partition tables are told apart by their period in the bits
+// above their id, see db_partition.c. without partitions the key is the id.
+#define PARTITION_MAX		128	// live partitions a handle looks through
+#define PARTITION_ID_BITS	40
+#define DB_PARTITION_KEY(n, id)	(((long)(n) << PARTITION_ID_BITS) | (long)(id))
+#define DB_PARTITION_OF(key)	((long)(key) >> PARTITION_ID_BITS)
+#define DB_PARTITION_ID(key)	((long)(key) & ((1L << PARTITION_ID_BITS) - 1))
+
+/*
+ * Each backend stores triplets its own way and is picked by db_driver. The
+ * handle returned by open() belongs to a single thread, backends may prepare
+ * whatever they need for check() once when it is opened.
+ */
+struct t_db_backend {
+	const char *driver;	// db_driver served, NULL for any libdbi driver
+	void *(*open)( struct t_grist_config *config );
+	void  (*close)( void *handle );
+	int   (*check)( void *handle, struct t_request *request, struct t_grist_config *config );
+	int   (*execute)( void *handle, const char *sql );	// runs a statement, NULL without SQL
+	char *(*quote)( void *handle, const char *str );	// a string literal to be freed, NULL without SQL
+	long  (*scan)( void *handle, void (*each)( struct t_request *triplet, void *arg ), void *arg );	// every stored triplet, NULL without SQL
+	long  (*query)( void *handle, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg );	// the triplets a statement returns, NULL without SQL
+	void  (*shutdown)( void );	// releases what is shared by all handles, may be NULL
+};
+
+struct t_db {
+	const struct t_db_backend *backend;
+	void *handle;
+};
+
+// the live partition tables a handle looks through, see db_partition_rotate()
+struct t_partitions {
+	long newest;		// period the list was made in
+	int  count;		// zero until the first rotation
+	long n[PARTITION_MAX];	// periods of the tables, newest first
+};
+
+extern const struct t_db_backend db_backend_dbi;
+extern const struct t_db_backend db_backend_sqlite3;
+extern const struct t_db_backend db_backend_pgsql;
+extern const struct t_db_backend db_backend_memory;
+extern const struct t_db_backend db_backend_mmap;
+extern const struct t_db_backend db_backend_shm;
+
+struct t_db *db_open( struct t_grist_config *config );
+void db_close( struct t_db *db );
+void db_shutdown( void );
+int  db_needs_dbi( struct t_grist_config *config );
+int  db_check( struct t_db *db, struct t_request *request, struct t_grist_config *config );
+int  db_execute( struct t_db *db, const char *sql );
+char *db_quote( struct t_db *db, const char *str );
+long db_query( struct t_db *db, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg );
+int  db_lookup_first( void );
+int  db_stored_action( long r_id, long r_timestamp, struct t_request *request, struct t_grist_config *config );
+int  mmap_create_table( struct t_grist_config *config );
+long db_time_left( struct t_request *request, struct t_grist_config *config );
+int  db_backoff( struct t_request *request, struct t_grist_config *config, int attempt );
+int  db_behind_start( struct t_grist_config *config );
+int  db_behind_active( void );
+int  db_behind_add( long id, int accepted );
+void db_behind_stop( void );
+int  db_group_start( struct t_grist_config *config );
+int  db_group_active( void );
+int  db_group_insert( struct t_request *request, struct t_grist_config *config );
+void db_group_stop( void );
+int  db_cache_start( struct t_grist_config *config );
+int  db_cache_active( void );
+int  db_cache_check( struct t_db *db, struct t_request *request, struct t_grist_config *config );
+void db_cache_store( struct t_request *request, long id, long timestamp );
+void db_cache_stop( void );
+int  db_bloom_start( struct t_grist_config *config );
+int  db_bloom_check( struct t_request *request );
+void db_bloom_missed( void );
+void db_bloom_add( struct t_request *request );
+void db_bloom_stop( void );
+int  db_expire_start( struct t_grist_config *config );
+void db_expire_add( struct t_request *request );
+void db_expire_stop( void );
+long db_partition_of( struct t_grist_config *config, time_t t );
+long db_partition_current( struct t_grist_config *config );
+void db_partition_table( long n, char *table, size_t len );
+int  db_partition_sql( const char *driver, long n, int i, char *sql, size_t len );
+const char *db_partition_list_sql( const char *driver );
+int  db_partition_create( struct t_db *db, struct t_grist_config *config, long n );
+void db_partition_found( struct t_partitions *parts, const char *table );
+char *db_partition_select_sql( struct t_partitions *parts, const char *columns, const char *where );
+int  db_partition_rotate( struct t_partitions *parts, struct t_grist_config *config, void *handle,
+			  int (*execute)( void *handle, const char *sql ),
+			  int (*list)( void *handle, const char *sql, struct t_partitions *parts ) );
+int  db_triplet_action( long r_seen, long r_timestamp, struct t_request *request, struct t_grist_config *config );
+uint64_t db_evict_rank( uint32_t timestamp, uint32_t seen );
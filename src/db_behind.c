@@ -0,0 +1,335 @@
+/**
+ * file: db_behind.c
+ * grist - seen/accepted counts merged in memory and written behind
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <pthread.h>
+
+/*
+ * A triplet that is already stored is decided from its timestamp alone, so
+ * with db_write_behind_ms set its counts don't have to be written before
+ * the reply goes out. They are added up per row id here instead, and a
+ * writer thread folds them into the database every db_write_behind_ms with
+ * one UPDATE per BEHIND_BATCH rows, all in one transaction. New triplets
+ * are still inserted right away.
+ */
+#define BEHIND_MAX	65536			// rows merged between two writes
+#define BEHIND_SLOTS	(BEHIND_MAX*2)		// a power of two, probes stay short
+#define BEHIND_BATCH	500			// rows per UPDATE statement
+#define BEHIND_ROW_SQL	128			// room for one row's share of an UPDATE
+
+struct t_behind_row {
+	long     id;		// zero for a free slot, row ids start at one
+	uint32_t seen;
+	uint32_t accepted;
+};
+
+struct t_behind_table {
+	struct t_behind_row *slots;
+	size_t count;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	struct t_behind_table tables[2];
+	int       active;		// the table requests are merged into
+	int       running;
+	int       stop;
+	int       full;		// warned that the table filled up
+	pthread_t thread;
+	struct t_grist_config *config;
+} behind = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+/**
+ * behind_merge - add counts to a row, the caller holds behind.lock
+ *
+ * Returns 0 if the table is full.
+ */
+static int behind_merge( struct t_behind_table *table, long id, uint32_t seen, uint32_t accepted ) {
+	struct t_behind_row *row;
+	size_t i;
+
+	for ( i = grist_mix64((uint64_t)id) & (BEHIND_SLOTS-1); ; i = (i+1) & (BEHIND_SLOTS-1) ) {
+		row = &table->slots[i];
+		if ( row->id == id ) { break; }
+		if ( row->id == 0 ) {
+			if ( table->count >= BEHIND_MAX ) { return 0; }
+			row->id = id;
+			++table->count;
+			break;
+		}
+	}
+
+	row->seen     += seen;
+	row->accepted += accepted;
+
+	return 1;
+}
+
+/**
+ * behind_restore - put back counts that could not be written
+ */
+static void behind_restore( struct t_behind_table *table ) {
+	unsigned long lost = 0;
+	size_t i;
+
+	pthread_mutex_lock(&behind.lock);
+	for ( i = 0; i < BEHIND_SLOTS; i++ ) {
+		if ( table->slots[i].id == 0 ) { continue; }
+		if ( !behind_merge(&behind.tables[behind.active], table->slots[i].id, table->slots[i].seen, table->slots[i].accepted) ) {
+			++lost;
+		}
+	}
+	pthread_mutex_unlock(&behind.lock);
+
+	if ( lost > 0 ) {
+		syslog(LOG_ERR, "db: counts of %lu triplet(s) were dropped, the database is not taking writes.", lost);
+	}
+}
+
+/**
+ * behind_update - write one batch of rows of a partition with a single UPDATE
+ */
+static int behind_update( struct t_db *db, char *sql, long part, struct t_behind_row **rows, int n ) {
+	char *p = sql;
+	char table[32];
+	int i, accepted = 0;
+
+	db_partition_table(part, table, sizeof(table));
+
+	p += sprintf(p, "UPDATE %s SET seen = seen + CASE id", table);
+	for ( i = 0; i < n; i++ ) {
+		p += sprintf(p, " WHEN %ld THEN %lu", DB_PARTITION_ID(rows[i]->id), (unsigned long)rows[i]->seen);
+	}
+	p += sprintf(p, " END");
+
+	// a CASE needs at least one WHEN, leave accepted alone if nothing was
+	for ( i = 0; i < n; i++ ) {
+		if ( rows[i]->accepted == 0 ) { continue; }
+		p += sprintf(p, "%s WHEN %ld THEN %lu", accepted++ ? "" : ", accepted = accepted + CASE id",
+			     DB_PARTITION_ID(rows[i]->id), (unsigned long)rows[i]->accepted);
+	}
+	if ( accepted > 0 ) {
+		p += sprintf(p, " ELSE 0 END");
+	}
+
+	p += sprintf(p, " WHERE id IN (");
+	for ( i = 0; i < n; i++ ) {
+		p += sprintf(p, "%s%ld", i > 0 ? "," : "", DB_PARTITION_ID(rows[i]->id));
+	}
+	sprintf(p, ")");
+
+	return db_execute(db, sql);
+}
+
+/**
+ * behind_write - write out a table that has been swapped out
+ */
+static void behind_write( struct t_db **db, struct t_behind_table *table, char *sql ) {
+	struct t_behind_row *rows[BEHIND_BATCH];
+	size_t i;
+	long part, next, row_part;
+	int n = 0, ok;
+
+	if ( table->count == 0 ) { return; }
+
+	if ( *db == NULL ) {
+		*db = db_open(behind.config);
+	}
+
+	// a pass over the table for each partition the rows are in, the first
+	// for those of requests
+	ok = *db != NULL && db_execute(*db, "BEGIN");
+	for ( part = 0; ok && part >= 0; part = next ) {
+		next = -1;
+		for ( i = 0; ok && i < BEHIND_SLOTS; i++ ) {
+			if ( table->slots[i].id == 0 ) { continue; }
+
+			row_part = DB_PARTITION_OF(table->slots[i].id);
+			if ( row_part != part ) {
+				if ( row_part > part && (next < 0 || row_part < next) ) { next = row_part; }
+				continue;
+			}
+
+			rows[n++] = &table->slots[i];
+			if ( n == BEHIND_BATCH ) {
+				ok = behind_update(*db, sql, part, rows, n);
+				n  = 0;
+			}
+		}
+		if ( ok && n > 0 ) {
+			ok = behind_update(*db, sql, part, rows, n);
+			n  = 0;
+		}
+	}
+	if ( ok ) {
+		ok = db_execute(*db, "COMMIT");
+	}
+
+	if ( !ok ) {
+		syslog(LOG_ERR, "db: unable to write the counts of %lu triplet(s), trying again later.", (unsigned long)table->count);
+		if ( *db != NULL ) {
+			db_execute(*db, "ROLLBACK");
+			db_close(*db);
+			*db = NULL;
+		}
+		behind_restore(table);
+	}
+
+	memset(table->slots, 0, BEHIND_SLOTS * sizeof(struct t_behind_row));
+	table->count = 0;
+}
+
+static void *behind_writer( void *arg ) {
+	struct t_behind_table *table;
+	struct t_db *db = NULL;
+	struct timespec until;
+	char *sql = (char *)arg;
+	int stop;
+
+	pthread_mutex_lock(&behind.lock);
+	do {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec  += behind.config->db_write_behind_ms / 1000;
+		until.tv_nsec += (behind.config->db_write_behind_ms % 1000) * 1000000;
+		if ( until.tv_nsec >= 1000000000 ) {
+			until.tv_sec  += 1;
+			until.tv_nsec -= 1000000000;
+		}
+		while ( !behind.stop && pthread_cond_timedwait(&behind.wake, &behind.lock, &until) == 0 ) ;
+
+		// requests go on merging into the other table while this one is written
+		stop  = behind.stop;
+		table = &behind.tables[behind.active];
+		behind.active ^= 1;
+		pthread_mutex_unlock(&behind.lock);
+
+		behind_write(&db, table, sql);
+
+		pthread_mutex_lock(&behind.lock);
+	} while ( !stop );
+	pthread_mutex_unlock(&behind.lock);
+
+	if ( db != NULL ) {
+		db_close(db);
+	}
+	free(sql);
+
+	return NULL;
+}
+
+/**
+ * db_behind_start - start writing counts behind, if db_write_behind_ms is set
+ *
+ * Only worth it for a daemon, a process that answers a single request has
+ * nothing to merge.
+ */
+int db_behind_start( struct t_grist_config *config ) {
+	char *sql;
+
+	if ( config->db_write_behind_ms <= 0 ) { return 1; }
+
+	behind.tables[0].slots = (struct t_behind_row *)calloc(BEHIND_SLOTS, sizeof(struct t_behind_row));
+	behind.tables[1].slots = (struct t_behind_row *)calloc(BEHIND_SLOTS, sizeof(struct t_behind_row));
+	sql = (char *)malloc(BEHIND_BATCH * BEHIND_ROW_SQL + 128);
+	if ( behind.tables[0].slots == NULL || behind.tables[1].slots == NULL || sql == NULL ) {
+		_FREE(behind.tables[0].slots);
+		_FREE(behind.tables[1].slots);
+		_FREE(sql);
+		return 0;
+	}
+
+	behind.config = config;
+	behind.stop   = 0;
+
+	if ( pthread_create(&behind.thread, NULL, behind_writer, sql) != 0 ) {
+		syslog(LOG_ERR, "db: unable to start the write behind thread.");
+		free(behind.tables[0].slots);
+		free(behind.tables[1].slots);
+		free(sql);
+		return 0;
+	}
+
+	__atomic_store_n(&behind.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "db: writing counts behind every %ld ms.", config->db_write_behind_ms);
+
+	return 1;
+}
+
+/**
+ * db_behind_add - count a request for a stored triplet, to be written later
+ *
+ * Returns 0 if it has to be written now, write behind isn't running or
+ * too many triplets are waiting to be written.
+ */
+int db_behind_add( long id, int accepted ) {
+	int merged;
+
+	if ( !__atomic_load_n(&behind.running, __ATOMIC_ACQUIRE) ) { return 0; }
+
+	pthread_mutex_lock(&behind.lock);
+	merged = behind_merge(&behind.tables[behind.active], id, 1, accepted ? 1 : 0);
+	if ( !merged && !behind.full ) {
+		syslog(LOG_WARNING, "db: more than %d triplets waiting to be written, writing the rest as they come.", BEHIND_MAX);
+		behind.full = 1;
+	} else if ( merged ) {
+		behind.full = 0;
+	}
+	pthread_mutex_unlock(&behind.lock);
+
+	return merged;
+}
+
+/**
+ * db_behind_active - whether stored triplets are decided before being written
+ */
+int db_behind_active( void ) {
+	return __atomic_load_n(&behind.running, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * db_behind_stop - write what is left and stop the writer
+ *
+ * Every worker must have been stopped.
+ */
+void db_behind_stop( void ) {
+	if ( !behind.running ) { return; }
+
+	__atomic_store_n(&behind.running, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&behind.lock);
+	behind.stop = 1;
+	pthread_cond_signal(&behind.wake);
+	pthread_mutex_unlock(&behind.lock);
+
+	pthread_join(behind.thread, NULL);
+
+	// counts put back after a failed final write are lost with the process
+	if ( behind.tables[0].count + behind.tables[1].count > 0 ) {
+		syslog(LOG_ERR, "db: counts of %lu triplet(s) could not be written.", (unsigned long)(behind.tables[0].count + behind.tables[1].count));
+	}
+
+	_FREE(behind.tables[0].slots);
+	_FREE(behind.tables[1].slots);
+	behind.tables[0].slots = behind.tables[1].slots = NULL;
+}
@@ -0,0 +1,193 @@
+/**
+ * file: db_bloom.c
+ * grist - lookups of triplets that were never stored skipped
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+/*
+ * With db_bloom_mb set, a daemon keeps a Bloom filter of every triplet in
+ * the database, read from it at startup and added to as triplets are
+ * stored. A triplet the filter has never seen is new for certain, so the
+ * SQL backends skip the lookup they would do before writing and go straight
+ * to inserting it. The filter is blocked: all BLOOM_K bits of a triplet lie
+ * in one cache line picked by the first word of its fingerprint, the bits
+ * come from the second. Triplets are never taken out, those pruned from the
+ * database only cost a lookup that finds nothing.
+ *
+ * Triplets other processes insert are not in the filter, it is meant for a
+ * single grist daemon writing its database.
+ */
+#define BLOOM_BLOCK	512	// bits in a block, one cache line
+#define BLOOM_K		7	// bits set per triplet, 9 bits of the fingerprint each
+#define BLOOM_BITS_PER	10	// filter bits a triplet needs to keep false positives near 1%
+
+static struct {
+	uint64_t *bits;
+	uint64_t mask;		// blocks - 1
+	uint64_t seed;
+	int      running;
+	unsigned long lookups;
+	unsigned long skipped;
+	unsigned long missed;	// passed by the filter but not stored
+} bloom;
+
+static void bloom_add( struct t_request *request ) {
+	uint64_t hash[2], *block;
+	unsigned bit;
+	int i;
+
+	grist_fingerprint(request, bloom.seed, hash);
+	block = &bloom.bits[(hash[0] & bloom.mask) * (BLOOM_BLOCK/64)];
+
+	for ( i = 0; i < BLOOM_K; i++ ) {
+		bit = (hash[1] >> (i*9)) & (BLOOM_BLOCK-1);
+		if ( !(__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))) ) {
+			__atomic_fetch_or(&block[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void bloom_scanned( struct t_request *triplet, void *arg ) {
+	bloom_add(triplet);
+	++*(long *)arg;
+}
+
+/**
+ * db_bloom_start - read every stored triplet into the filter, if
+ * db_bloom_mb is set
+ */
+int db_bloom_start( struct t_grist_config *config ) {
+	struct t_db *db;
+	uint64_t blocks, size;
+	long stored = 0;
+
+	if ( config->db_bloom_mb <= 0 ) { return 1; }
+
+	db = db_open(config);
+	if ( db == NULL ) {
+		syslog(LOG_ERR, "db: unable to connect to the database to fill the filter.");
+		return 0;
+	}
+
+	if ( db->backend->scan == NULL ) {
+		syslog(LOG_WARNING, "db: db_bloom_mb only helps the SQL backends, no filter is kept.");
+		db_close(db);
+		return 1;
+	}
+
+	size = (uint64_t)config->db_bloom_mb * 1024 * 1024;
+	for ( blocks = 1; blocks * 2 * (BLOOM_BLOCK/8) <= size; blocks <<= 1 ) ;
+
+	bloom.bits = (uint64_t *)calloc(blocks, BLOOM_BLOCK/8);
+	if ( bloom.bits == NULL ) {
+		syslog(LOG_ERR, "db: unable to allocate %ld MB for the filter.", config->db_bloom_mb);
+		db_close(db);
+		return 0;
+	}
+	bloom.mask = blocks - 1;
+	bloom.seed = grist_random_seed();
+
+	if ( db->backend->scan(db->handle, bloom_scanned, &stored) < 0 ) {
+		syslog(LOG_ERR, "db: unable to read the stored triplets into the filter.");
+		db_close(db);
+		free(bloom.bits);
+		bloom.bits = NULL;
+		return 0;
+	}
+	db_close(db);
+
+	if ( (uint64_t)stored > blocks * BLOOM_BLOCK / BLOOM_BITS_PER ) {
+		syslog(LOG_WARNING, "db: %ld triplets are stored, db_bloom_mb is too small to keep false positives low.", stored);
+	}
+
+	__atomic_store_n(&bloom.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "db: filtering lookups with %ld stored triplet(s), room for %lu.", stored, (unsigned long)(blocks * BLOOM_BLOCK / BLOOM_BITS_PER));
+
+	return 1;
+}
+
+/**
+ * db_bloom_check - whether a triplet may be stored
+ *
+ * Returns 0 if it is certainly not, the lookup can be skipped then. Always
+ * 1 without a filter.
+ */
+int db_bloom_check( struct t_request *request ) {
+	uint64_t hash[2], *block;
+	unsigned bit;
+	int i;
+
+	if ( !__atomic_load_n(&bloom.running, __ATOMIC_ACQUIRE) ) { return 1; }
+
+	__atomic_add_fetch(&bloom.lookups, 1, __ATOMIC_RELAXED);
+
+	grist_fingerprint(request, bloom.seed, hash);
+	block = &bloom.bits[(hash[0] & bloom.mask) * (BLOOM_BLOCK/64)];
+
+	for ( i = 0; i < BLOOM_K; i++ ) {
+		bit = (hash[1] >> (i*9)) & (BLOOM_BLOCK-1);
+		if ( !(__atomic_load_n(&block[bit >> 6], __ATOMIC_RELAXED) & (1ULL << (bit & 63))) ) {
+			__atomic_add_fetch(&bloom.skipped, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * db_bloom_missed - count a triplet the filter passed that wasn't stored
+ */
+void db_bloom_missed( void ) {
+	if ( !__atomic_load_n(&bloom.running, __ATOMIC_ACQUIRE) ) { return; }
+
+	__atomic_add_fetch(&bloom.missed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * db_bloom_add - remember a triplet that is now stored
+ */
+void db_bloom_add( struct t_request *request ) {
+	if ( !__atomic_load_n(&bloom.running, __ATOMIC_ACQUIRE) ) { return; }
+
+	bloom_add(request);
+}
+
+/**
+ * db_bloom_stop - report how the filter did and release it
+ *
+ * Every worker must have been stopped.
+ */
+void db_bloom_stop( void ) {
+	unsigned long absent;
+
+	if ( !bloom.running ) { return; }
+
+	__atomic_store_n(&bloom.running, 0, __ATOMIC_RELEASE);
+
+	// the false positive rate is taken over the lookups of triplets not stored
+	absent = bloom.skipped + bloom.missed;
+	syslog(LOG_INFO, "db: filter skipped %lu of %lu lookup(s), %lu false positive(s) (%.2f%%).",
+	       bloom.skipped, bloom.lookups, bloom.missed, absent > 0 ? 100.0 * bloom.missed / absent : 0.0);
+
+	_FREE(bloom.bits);
+	bloom.bits = NULL;
+}
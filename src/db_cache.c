@@ -0,0 +1,240 @@
+/**
+ * file: db_cache.c
+ * grist - triplets past their cooldown answered without asking the database
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <pthread.h>
+
+/*
+ * Once a triplet is past rq_cooldown it stays accepted, so with db_cache_mb
+ * set a daemon remembers such triplets and answers them itself. The cache
+ * is split into buckets of CACHE_WAYS entries picked by the fingerprint,
+ * each bucket evicts with its own CLOCK hand: entries used since the hand
+ * last passed get another round, the first one that wasn't is replaced.
+ * Buckets share CACHE_LOCKS locks, so workers rarely wait on each other.
+ */
+#define CACHE_WAYS	8
+#define CACHE_LOCKS	1024	// a power of two
+#define CACHE_LINE	64
+
+struct t_cache_entry {
+	uint64_t hash[2];	// fingerprint, hash[0] is zero for a free entry
+	long     id;		// the triplet's row, for counting it behind
+	uint32_t timestamp;	// first seen
+	uint32_t used;		// since the clock hand last passed
+};
+
+struct t_cache_bucket {
+	struct t_cache_entry ways[CACHE_WAYS];
+};
+
+struct t_cache_lock {
+	pthread_mutex_t mutex;
+	unsigned long   hits;	// counted under the lock, no shared counter
+	unsigned long   misses;
+	char pad[CACHE_LINE];
+};
+
+static struct {
+	struct t_cache_bucket *buckets;
+	uint8_t  *hands;
+	uint64_t mask;
+	uint64_t seed;
+	int      running;
+	struct t_cache_lock locks[CACHE_LOCKS];
+} cache;
+
+/**
+ * db_cache_start - set up the cache, if db_cache_mb is set
+ */
+int db_cache_start( struct t_grist_config *config ) {
+	uint64_t buckets, size;
+	int i;
+
+	if ( config->db_cache_mb <= 0 ) { return 1; }
+
+	size = (uint64_t)config->db_cache_mb * 1024 * 1024;
+	for ( buckets = CACHE_LOCKS; buckets * 2 * sizeof(struct t_cache_bucket) <= size; buckets <<= 1 ) ;
+
+	cache.buckets = (struct t_cache_bucket *)calloc(buckets, sizeof(struct t_cache_bucket));
+	cache.hands   = (uint8_t *)calloc(buckets, sizeof(uint8_t));
+	if ( cache.buckets == NULL || cache.hands == NULL ) {
+		_FREE(cache.buckets);
+		_FREE(cache.hands);
+		syslog(LOG_ERR, "db: unable to allocate %ld MB for the cache.", config->db_cache_mb);
+		return 0;
+	}
+
+	for ( i = 0; i < CACHE_LOCKS; i++ ) {
+		pthread_mutex_init(&cache.locks[i].mutex, NULL);
+		cache.locks[i].hits   = 0;
+		cache.locks[i].misses = 0;
+	}
+
+	cache.mask = buckets - 1;
+	cache.seed = grist_random_seed();
+
+	__atomic_store_n(&cache.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "db: caching up to %lu accepted triplets.", (unsigned long)(buckets * CACHE_WAYS));
+
+	return 1;
+}
+
+int db_cache_active( void ) {
+	return __atomic_load_n(&cache.running, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * cache_count - write the counts of a cached triplet's request right away
+ */
+static int cache_count( struct t_db *db, long id ) {
+	char sql[128];
+	char table[32];
+
+	db_partition_table(DB_PARTITION_OF(id), table, sizeof(table));
+	snprintf(sql, sizeof(sql), "UPDATE %s SET seen = seen + 1, accepted = accepted + 1 WHERE id = %ld",
+		 table, DB_PARTITION_ID(id));
+
+	return db_execute(db, sql);
+}
+
+/**
+ * db_cache_check - answer a request from the cache
+ *
+ * Returns CHECK_OKAY for a cached triplet, with its counts left to be
+ * written behind when that is running and written by id otherwise, which
+ * still spares the lookup. One past rq_accepted_ttl may have been removed
+ * from the database and is looked up again. Returns TRIPLET_UNKNOWN if the
+ * database has to be asked.
+ */
+int db_cache_check( struct t_db *db, struct t_request *request, struct t_grist_config *config ) {
+	struct t_cache_bucket *bucket;
+	struct t_cache_lock *lock;
+	uint64_t hash[2], b;
+	long id = 0;
+	int i, found = 0;
+
+	if ( !__atomic_load_n(&cache.running, __ATOMIC_ACQUIRE) ) { return TRIPLET_UNKNOWN; }
+
+	grist_fingerprint(request, cache.seed, hash);
+	b      = hash[0] & cache.mask;
+	bucket = &cache.buckets[b];
+	lock   = &cache.locks[b & (CACHE_LOCKS-1)];
+
+	pthread_mutex_lock(&lock->mutex);
+	for ( i = 0; i < CACHE_WAYS; i++ ) {
+		if ( bucket->ways[i].hash[0] == hash[0] && bucket->ways[i].hash[1] == hash[1]
+		     && request->timestamp - (time_t)bucket->ways[i].timestamp >= config->rq_cooldown
+		     && (config->rq_accepted_ttl <= 0 || request->timestamp - (time_t)bucket->ways[i].timestamp < config->rq_accepted_ttl) ) {
+			bucket->ways[i].used = 1;
+			id    = bucket->ways[i].id;
+			found = 1;
+			break;
+		}
+	}
+	if ( found ) { ++lock->hits; } else { ++lock->misses; }
+	pthread_mutex_unlock(&lock->mutex);
+
+	if ( !found ) { return TRIPLET_UNKNOWN; }
+
+	// written behind when it can be, the backend counts it if neither works
+	if ( db_behind_active() ) {
+		if ( !db_behind_add(id, 1) ) { return TRIPLET_UNKNOWN; }
+	} else if ( !cache_count(db, id) ) {
+		return TRIPLET_UNKNOWN;
+	}
+
+	return CHECK_OKAY;
+}
+
+/**
+ * db_cache_store - remember a triplet the database found accepted
+ */
+void db_cache_store( struct t_request *request, long id, long timestamp ) {
+	struct t_cache_bucket *bucket;
+	struct t_cache_lock *lock;
+	struct t_cache_entry *way;
+	uint64_t hash[2], b;
+	int i;
+
+	if ( !__atomic_load_n(&cache.running, __ATOMIC_ACQUIRE) ) { return; }
+
+	grist_fingerprint(request, cache.seed, hash);
+	b      = hash[0] & cache.mask;
+	bucket = &cache.buckets[b];
+	lock   = &cache.locks[b & (CACHE_LOCKS-1)];
+
+	pthread_mutex_lock(&lock->mutex);
+
+	// another worker may have stored it already
+	for ( i = 0; i < CACHE_WAYS; i++ ) {
+		if ( bucket->ways[i].hash[0] == hash[0] && bucket->ways[i].hash[1] == hash[1] ) {
+			pthread_mutex_unlock(&lock->mutex);
+			return;
+		}
+	}
+
+	// the hand stops at the first entry not used since it last came by,
+	// after one full turn every entry has had its second chance
+	for ( ;; ) {
+		way = &bucket->ways[cache.hands[b]];
+		cache.hands[b] = (cache.hands[b] + 1) % CACHE_WAYS;
+
+		if ( !way->used ) { break; }
+		way->used = 0;
+	}
+
+	way->hash[0]   = hash[0];
+	way->hash[1]   = hash[1];
+	way->id        = id;
+	way->timestamp = (uint32_t)timestamp;
+	way->used      = 0;
+
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+/**
+ * db_cache_stop - report how the cache did and release it
+ *
+ * Every worker must have been stopped.
+ */
+void db_cache_stop( void ) {
+	unsigned long hits = 0, misses = 0;
+	int i;
+
+	if ( !cache.running ) { return; }
+
+	__atomic_store_n(&cache.running, 0, __ATOMIC_RELEASE);
+
+	for ( i = 0; i < CACHE_LOCKS; i++ ) {
+		hits   += cache.locks[i].hits;
+		misses += cache.locks[i].misses;
+		pthread_mutex_destroy(&cache.locks[i].mutex);
+	}
+
+	syslog(LOG_INFO, "db: cache answered %lu of %lu request(s).", hits, hits + misses);
+
+	_FREE(cache.buckets);
+	_FREE(cache.hands);
+	cache.buckets = NULL;
+	cache.hands   = NULL;
+}
@@ -0,0 +1,511 @@
+/**
+ * file: db_expire.c
+ * grist - stale triplets removed a slice at a time as they come due
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <pthread.h>
+
+/*
+ * With rq_pending_ttl or rq_accepted_ttl set, a daemon removes stale
+ * triplets itself instead of leaving them to 'gristool prune'. Triplets are
+ * taken by when they were first seen: a timer covers a range of first seen
+ * times and counts the triplets stored in it, the ranges of all timers run
+ * on from the oldest stored triplet without a gap. Each new EXPIRE_GRAIN
+ * seconds that sees a new triplet starts a timer. A timer is due once the
+ * end of its range is rq_pending_ttl old, when the triplets in it that were
+ * never retried are deleted, and again at rq_accepted_ttl for the others,
+ * whichever comes first going first.
+ *
+ * Timers wait in a hierarchical wheel: EXPIRE_LEVELS rings of EXPIRE_SLOTS
+ * slots, a slot of level 0 is one tick of EXPIRE_GRAIN seconds and each
+ * level above has slots EXPIRE_SLOTS times as wide. A timer goes into the
+ * finest level that reaches its tick and moves down a level whenever the
+ * wheel comes round to its slot, so starting and firing timers costs the
+ * same however many are waiting.
+ *
+ * A thread takes the timers that are due one DELETE every EXPIRE_TICK_MS,
+ * each about EXPIRE_SLICE triplets: the range of a crowded timer is split
+ * and those of sparse neighbours joined, so the database is never held for
+ * long, not even when a backlog is first worked off. The counts are only
+ * what this daemon stored, others writing the database make them less
+ * exact but their triplets are removed all the same.
+ */
+#define EXPIRE_GRAIN	60		// seconds of first seen times per tick
+#define EXPIRE_BITS	6
+#define EXPIRE_SLOTS	(1L << EXPIRE_BITS)
+#define EXPIRE_LEVELS	4		// 64^4 minutes, over 30 years ahead
+#define EXPIRE_SLICE	500		// triplets deleted by one statement, roughly
+#define EXPIRE_TICK_MS	100		// between two statements
+#define EXPIRE_IDLE_MS	1000		// between looks at the wheel when nothing is due
+#define EXPIRE_SPAN	(1L << 20)	// ticks counted at startup, some two years
+
+#define STAGE_PENDING	0		// triplets never retried, seen = 0
+#define STAGE_ACCEPTED	1		// the others
+#define STAGE_DONE	-1
+
+struct t_expire_timer {
+	time_t from;		// first seen times covered
+	time_t to;		// up to, not including
+	long   rows;
+	int    stage;
+	long   due;		// tick it fires at
+	struct t_expire_timer *next;
+};
+
+struct t_expire_list {
+	struct t_expire_timer *head;
+	struct t_expire_timer *tail;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;
+	struct t_expire_list slots[EXPIRE_LEVELS][EXPIRE_SLOTS];
+	struct t_expire_list due;	// fired, waiting to be deleted
+	struct t_expire_timer *latest;	// new triplets are counted here
+	time_t    covered;		// where the range of the next timer starts
+	time_t    cursor;		// how far into the range of due.head
+	long      now;			// tick the wheel is at
+	long      timers;
+	int       first;		// stage a timer starts in
+	int       running;
+	int       stop;
+	unsigned long statements;
+	pthread_t thread;
+	struct t_grist_config *config;
+} expire = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static long expire_ttl( int stage ) {
+	return stage == STAGE_PENDING ? expire.config->rq_pending_ttl : expire.config->rq_accepted_ttl;
+}
+
+/**
+ * expire_next_stage - the stage after the one a timer has done
+ */
+static int expire_next_stage( int stage ) {
+	if ( stage != expire.first ) { return STAGE_DONE; }
+
+	stage = stage == STAGE_PENDING ? STAGE_ACCEPTED : STAGE_PENDING;
+
+	return expire_ttl(stage) > 0 ? stage : STAGE_DONE;
+}
+
+static void expire_append( struct t_expire_list *list, struct t_expire_timer *timer ) {
+	timer->next = NULL;
+	if ( list->tail != NULL ) { list->tail->next = timer; } else { list->head = timer; }
+	list->tail = timer;
+}
+
+/**
+ * expire_schedule - put a timer where the wheel will find it at its tick,
+ * the caller holds expire.lock
+ */
+static void expire_schedule( struct t_expire_timer *timer ) {
+	long delta, tick;
+	int  level;
+
+	timer->due = (timer->to + expire_ttl(timer->stage) + EXPIRE_GRAIN - 1) / EXPIRE_GRAIN;
+
+	delta = timer->due - expire.now;
+	if ( delta <= 0 ) {
+		expire_append(&expire.due, timer);
+		return;
+	}
+
+	for ( level = 0; level < EXPIRE_LEVELS - 1; level++ ) {
+		if ( delta < 1L << (EXPIRE_BITS * (level + 1)) ) { break; }
+	}
+
+	// beyond the wheel, it is put back in when the top level comes round
+	tick = timer->due;
+	if ( delta >= 1L << (EXPIRE_BITS * EXPIRE_LEVELS) ) {
+		tick = expire.now + (1L << (EXPIRE_BITS * EXPIRE_LEVELS)) - 1;
+	}
+
+	expire_append(&expire.slots[level][(tick >> (EXPIRE_BITS * level)) & (EXPIRE_SLOTS - 1)], timer);
+}
+
+/**
+ * expire_advance - move the wheel on to a tick, the caller holds expire.lock
+ *
+ * Coarser slots coming round hand their timers down a level, the timers in
+ * the slot of level 0 that is reached have fired.
+ */
+static void expire_advance( long tick ) {
+	struct t_expire_timer *timer, *next;
+	struct t_expire_list *slot;
+	int level;
+
+	while ( expire.now < tick ) {
+		++expire.now;
+
+		for ( level = EXPIRE_LEVELS - 1; level > 0; level-- ) {
+			if ( (expire.now & ((1L << (EXPIRE_BITS * level)) - 1)) != 0 ) { continue; }
+
+			slot  = &expire.slots[level][(expire.now >> (EXPIRE_BITS * level)) & (EXPIRE_SLOTS - 1)];
+			timer = slot->head;
+			slot->head = slot->tail = NULL;
+			for ( ; timer != NULL; timer = next ) {
+				next = timer->next;
+				expire_schedule(timer);
+			}
+		}
+
+		slot = &expire.slots[0][expire.now & (EXPIRE_SLOTS - 1)];
+		if ( slot->head != NULL ) {
+			if ( expire.due.tail != NULL ) { expire.due.tail->next = slot->head; } else { expire.due.head = slot->head; }
+			expire.due.tail = slot->tail;
+			slot->head = slot->tail = NULL;
+		}
+	}
+}
+
+/**
+ * expire_start_timer - a timer from expire.covered up to the end of the
+ * tick of first_seen, the caller holds expire.lock
+ */
+static struct t_expire_timer *expire_start_timer( time_t first_seen, long rows ) {
+	struct t_expire_timer *timer;
+
+	timer = (struct t_expire_timer *)malloc(sizeof(struct t_expire_timer));
+	if ( timer == NULL ) { return NULL; }
+
+	timer->from  = expire.covered;
+	timer->to    = (first_seen / EXPIRE_GRAIN + 1) * EXPIRE_GRAIN;
+	timer->rows  = rows;
+	timer->stage = expire.first;
+
+	expire.covered = timer->to;
+	expire.latest  = timer;
+	++expire.timers;
+	expire_schedule(timer);
+
+	return timer;
+}
+
+/**
+ * expire_slice - the next range to delete, the caller holds expire.lock
+ *
+ * Returns how many timers it finishes, 0 if only part of the first one is
+ * taken and -1 if nothing is due.
+ */
+static int expire_slice( time_t *from, time_t *to, int *stage ) {
+	struct t_expire_timer *timer = expire.due.head, *next;
+	long rows, parts, width;
+	int  n = 1;
+
+	if ( timer == NULL ) { return -1; }
+
+	*stage = timer->stage;
+	*from  = expire.cursor > timer->from ? expire.cursor : timer->from;
+
+	// a crowded timer goes in parts, assuming its triplets are spread evenly
+	if ( timer->rows > EXPIRE_SLICE ) {
+		parts = (timer->rows + EXPIRE_SLICE - 1) / EXPIRE_SLICE;
+		width = (timer->to - timer->from + parts - 1) / parts;
+		*to   = *from + (width > 0 ? width : 1);
+		if ( *to < timer->to ) { return 0; }
+
+		*to = timer->to;
+		return 1;
+	}
+
+	// sparse ones that follow on are taken along
+	rows = timer->rows;
+	*to  = timer->to;
+	for ( next = timer->next; next != NULL; next = next->next ) {
+		if ( next->stage != *stage || next->from != *to || rows + next->rows > EXPIRE_SLICE ) { break; }
+		rows += next->rows;
+		*to   = next->to;
+		++n;
+	}
+
+	return n;
+}
+
+/**
+ * expire_finish - take timers whose stage is done off the due list, the
+ * caller holds expire.lock
+ */
+static void expire_finish( int n, time_t to ) {
+	struct t_expire_timer *timer;
+
+	if ( n == 0 ) {
+		expire.cursor = to;
+		return;
+	}
+
+	while ( n-- > 0 ) {
+		timer = expire.due.head;
+		expire.due.head = timer->next;
+		if ( expire.due.head == NULL ) { expire.due.tail = NULL; }
+
+		// a triplet first seen late by a worker must not land in a freed timer
+		if ( expire.latest == timer ) { expire.latest = NULL; }
+
+		timer->stage = expire_next_stage(timer->stage);
+		if ( timer->stage == STAGE_DONE ) {
+			free(timer);
+			--expire.timers;
+		} else {
+			expire_schedule(timer);
+		}
+	}
+	expire.cursor = 0;
+}
+
+/**
+ * expire_delete - delete the triplets of a stage first seen in a range
+ *
+ * With partitions, from the tables of the live ones the range falls in.
+ * Those before them are dropped whole, see db_partition.c.
+ */
+static int expire_delete( struct t_db *db, time_t from, time_t to, int stage ) {
+	char sql[160], table[32];
+	long part, last, oldest;
+	int  ok = 1;
+
+	part   = db_partition_of(expire.config, from);
+	last   = db_partition_of(expire.config, to - 1);
+	oldest = db_partition_current(expire.config) - expire.config->db_partitions + 1;
+	if ( last > 0 && part < oldest ) { part = oldest; }
+
+	for ( ; ok && part <= last; part++ ) {
+		db_partition_table(part, table, sizeof(table));
+		snprintf(sql, sizeof(sql), "DELETE FROM %s WHERE timestamp >= %ld AND timestamp < %ld AND seen %s 0",
+			 table, (long)from, (long)to, stage == STAGE_PENDING ? "=" : ">");
+
+		// a period nothing was stored in has no table yet
+		ok = db_partition_create(db, expire.config, part) && db_execute(db, sql);
+	}
+
+	return ok;
+}
+
+static void *expire_thread( void *arg ) {
+	struct t_db *db = NULL;
+	struct timespec until;
+	time_t from, to;
+	long wait_ms;
+	int  n, stage, ok;
+
+	(void)arg;
+
+	pthread_mutex_lock(&expire.lock);
+	while ( !expire.stop ) {
+		expire_advance((long)(time(NULL) / EXPIRE_GRAIN));
+
+		wait_ms = EXPIRE_IDLE_MS;
+		n = expire_slice(&from, &to, &stage);
+		if ( n >= 0 ) {
+			pthread_mutex_unlock(&expire.lock);
+
+			if ( db == NULL ) {
+				db = db_open(expire.config);
+			}
+			ok = db != NULL && expire_delete(db, from, to, stage);
+			if ( !ok ) {
+				syslog(LOG_ERR, "db: unable to remove stale triplets, trying again later.");
+				if ( db != NULL ) {
+					db_close(db);
+					db = NULL;
+				}
+			}
+
+			pthread_mutex_lock(&expire.lock);
+			if ( ok ) {
+				expire_finish(n, to);
+				++expire.statements;
+				wait_ms = EXPIRE_TICK_MS;
+			}
+		}
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec  += wait_ms / 1000;
+		until.tv_nsec += (wait_ms % 1000) * 1000000;
+		if ( until.tv_nsec >= 1000000000 ) {
+			until.tv_sec  += 1;
+			until.tv_nsec -= 1000000000;
+		}
+		while ( !expire.stop && pthread_cond_timedwait(&expire.wake, &expire.lock, &until) == 0 ) ;
+	}
+	pthread_mutex_unlock(&expire.lock);
+
+	if ( db != NULL ) {
+		db_close(db);
+	}
+
+	return NULL;
+}
+
+static void expire_scanned( struct t_request *triplet, void *arg ) {
+	uint32_t *counts = (uint32_t *)arg;
+	long tick = (long)(triplet->timestamp / EXPIRE_GRAIN) - (expire.now - EXPIRE_SPAN + 1);
+
+	// the oldest and those stamped ahead of our clock are lumped together
+	if ( tick < 0 ) {
+		tick = 0;
+		if ( triplet->timestamp < expire.covered ) { expire.covered = triplet->timestamp; }
+	}
+	if ( tick >= EXPIRE_SPAN ) { tick = EXPIRE_SPAN - 1; }
+
+	++counts[tick];
+}
+
+/**
+ * expire_free - release every timer
+ */
+static void expire_free( void ) {
+	struct t_expire_timer *timer, *next;
+	int level, i;
+
+	for ( level = 0; level < EXPIRE_LEVELS; level++ ) {
+		for ( i = 0; i < EXPIRE_SLOTS; i++ ) {
+			for ( timer = expire.slots[level][i].head; timer != NULL; timer = next ) {
+				next = timer->next;
+				free(timer);
+			}
+			expire.slots[level][i].head = expire.slots[level][i].tail = NULL;
+		}
+	}
+	for ( timer = expire.due.head; timer != NULL; timer = next ) {
+		next = timer->next;
+		free(timer);
+	}
+	expire.due.head = expire.due.tail = NULL;
+	expire.latest   = NULL;
+	expire.timers   = 0;
+}
+
+/**
+ * db_expire_start - start timers for what is stored and the thread that
+ * removes it, if rq_pending_ttl or rq_accepted_ttl is set
+ */
+int db_expire_start( struct t_grist_config *config ) {
+	struct t_db *db;
+	uint32_t *counts;
+	long stored, base, i;
+	int  ok = 1;
+
+	if ( config->rq_pending_ttl <= 0 && config->rq_accepted_ttl <= 0 ) { return 1; }
+
+	db = db_open(config);
+	if ( db == NULL ) {
+		syslog(LOG_ERR, "db: unable to connect to the database to read the stored triplets.");
+		return 0;
+	}
+
+	if ( db->backend->execute == NULL || db->backend->scan == NULL ) {
+		syslog(LOG_WARNING, "db: rq_pending_ttl and rq_accepted_ttl only apply to the SQL backends, nothing is removed.");
+		db_close(db);
+		return 1;
+	}
+
+	counts = (uint32_t *)calloc(EXPIRE_SPAN, sizeof(uint32_t));
+	if ( counts == NULL ) {
+		db_close(db);
+		return 0;
+	}
+
+	expire.config = config;
+	expire.first  = config->rq_pending_ttl > 0 && (config->rq_accepted_ttl <= 0 || config->rq_pending_ttl <= config->rq_accepted_ttl)
+			? STAGE_PENDING : STAGE_ACCEPTED;
+	expire.now     = (long)(time(NULL) / EXPIRE_GRAIN);
+	base           = expire.now - EXPIRE_SPAN + 1;
+	expire.covered = (time_t)base * EXPIRE_GRAIN;
+	expire.cursor  = 0;
+	expire.stop    = 0;
+
+	stored = db->backend->scan(db->handle, expire_scanned, counts);
+	db_close(db);
+	if ( stored < 0 ) {
+		syslog(LOG_ERR, "db: unable to read the stored triplets to expire them.");
+		free(counts);
+		return 0;
+	}
+
+	// the first timer reaches back to the oldest triplet, the others start
+	// where the one before ended
+	for ( i = 0; i < EXPIRE_SPAN && ok; i++ ) {
+		if ( counts[i] == 0 ) { continue; }
+		if ( expire.latest == NULL && i > 0 ) { expire.covered = (time_t)(base + i) * EXPIRE_GRAIN; }
+		ok = expire_start_timer((time_t)(base + i) * EXPIRE_GRAIN, counts[i]) != NULL;
+	}
+	free(counts);
+
+	if ( expire.latest == NULL ) {
+		expire.covered = (time_t)expire.now * EXPIRE_GRAIN;
+	}
+
+	if ( !ok || pthread_create(&expire.thread, NULL, expire_thread, NULL) != 0 ) {
+		syslog(LOG_ERR, "db: unable to start removing stale triplets.");
+		expire_free();
+		return 0;
+	}
+
+	__atomic_store_n(&expire.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "db: expiring %ld stored triplet(s) under %ld timer(s).", stored, expire.timers);
+
+	return 1;
+}
+
+/**
+ * db_expire_add - count a triplet that was just stored
+ */
+void db_expire_add( struct t_request *request ) {
+	if ( !__atomic_load_n(&expire.running, __ATOMIC_ACQUIRE) ) { return; }
+
+	pthread_mutex_lock(&expire.lock);
+
+	// workers may store triplets a little out of order, the ranges behind
+	// us are removed all the same
+	if ( request->timestamp < expire.covered ) {
+		if ( expire.latest != NULL ) { ++expire.latest->rows; }
+	} else if ( expire_start_timer(request->timestamp, 1) == NULL ) {
+		syslog(LOG_ERR, "db: out of memory, a triplet first seen at %ld is left to 'gristool prune'.", (long)request->timestamp);
+	}
+
+	pthread_mutex_unlock(&expire.lock);
+}
+
+/**
+ * db_expire_stop - stop removing triplets and drop the timers
+ *
+ * Every worker must have been stopped. The next start reads what is left
+ * from the database again.
+ */
+void db_expire_stop( void ) {
+	if ( !expire.running ) { return; }
+
+	__atomic_store_n(&expire.running, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&expire.lock);
+	expire.stop = 1;
+	pthread_cond_signal(&expire.wake);
+	pthread_mutex_unlock(&expire.lock);
+
+	pthread_join(expire.thread, NULL);
+
+	syslog(LOG_INFO, "db: stale triplets were removed with %lu statement(s), %ld timer(s) left.", expire.statements, expire.timers);
+
+	expire_free();
+}
@@ -0,0 +1,405 @@
+/**
+ * file: db_group.c
+ * grist - new triplets from concurrent requests inserted together
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * With db_group_commit_ms set, the workers of a daemon hand the triplets a
+ * lookup found to be new to a committer thread rather than inserting them
+ * one at a time. It gathers what arrives within db_group_commit_ms of the
+ * first one, or db_group_commit_max of them, and inserts them with a single
+ * multi-row INSERT, so the whole group costs one transaction and one sync.
+ * The workers wait for it to be committed before they answer, no longer
+ * than rq_max_latency_ms allows.
+ *
+ * A triplet the INSERT skipped because it was stored in the meantime, by
+ * another grist or by an earlier request of the same group, is not new.
+ * Its worker is told so and bumps the stored row's counts itself.
+ */
+#define GROUP_ROW_SQL	96	// a row's share of the statements besides its strings
+
+struct t_group_entry {
+	struct t_request triplet;	// a copy, the request is gone if its worker stops waiting
+	char *strings;			// what the copy points into
+	int  *result;			// the decision, TRIPLET_UNKNOWN until committed, NULL once nobody waits
+	int  inserted;			// the INSERT stored it
+};
+
+struct t_group_batch {
+	struct t_group_entry *entries;
+	int  count;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  wake;		// the committer waits here for new triplets
+	pthread_cond_t  done;		// workers wait here for their group
+	struct t_group_batch batches[2];
+	int       active;		// the batch new triplets join
+	struct timespec first;		// when the first of them arrived
+	long      part;			// partition whose table is known to be there
+	int       running;
+	int       stop;
+	pthread_t thread;
+	struct t_grist_config *config;
+} group = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/**
+ * group_inserted - mark the entry of a row the INSERT stored
+ *
+ * The same triplet may be in the group more than once, only its first
+ * entry not yet marked is.
+ */
+static void group_inserted( struct t_request *row, void *arg ) {
+	struct t_group_batch *batch = (struct t_group_batch *)arg;
+	struct t_request *triplet;
+	int i;
+
+	for ( i = 0; i < batch->count; i++ ) {
+		triplet = &batch->entries[i].triplet;
+		if ( batch->entries[i].inserted || triplet->timestamp != row->timestamp ) { continue; }
+
+		if ( triplet->client_key_len == row->client_key_len && memcmp(triplet->client_key, row->client_key, row->client_key_len) == 0 &&
+		     triplet->sender_len == row->sender_len && memcmp(triplet->sender, row->sender, row->sender_len) == 0 &&
+		     triplet->recipient_len == row->recipient_len && memcmp(triplet->recipient, row->recipient, row->recipient_len) == 0 ) {
+			batch->entries[i].inserted = 1;
+			return;
+		}
+	}
+}
+
+/**
+ * group_write - insert a batch with one statement and find out which of
+ * its triplets it stored
+ */
+static int group_write( struct t_db **db, struct t_group_batch *batch ) {
+	struct t_request *request;
+	char **quoted, *sql, *p;
+	char table[32];
+	size_t len;
+	long part;
+	int i, n = batch->count * 4, ok = 0, mysql;
+
+	if ( *db == NULL ) {
+		*db = db_open(group.config);
+		if ( *db == NULL ) { return 0; }
+	}
+
+	// new triplets go in the table of the current partition
+	part = db_partition_current(group.config);
+	if ( part != group.part ) {
+		if ( !db_partition_create(*db, group.config, part) ) { return 0; }
+		group.part = part;
+	}
+	db_partition_table(part, table, sizeof(table));
+
+	quoted = (char **)calloc(n, sizeof(char *));
+	if ( quoted == NULL ) { return 0; }
+
+	len = 256;
+	for ( i = 0; i < batch->count; i++ ) {
+		request = &batch->entries[i].triplet;
+
+		quoted[i*4]   = db_quote(*db, request->client_key);
+		quoted[i*4+1] = db_quote(*db, request->client_name);
+		quoted[i*4+2] = db_quote(*db, request->sender);
+		quoted[i*4+3] = db_quote(*db, request->recipient);
+		if ( !quoted[i*4] || !quoted[i*4+1] || !quoted[i*4+2] || !quoted[i*4+3] ) { goto done; }
+
+		len += strlen(quoted[i*4]) + strlen(quoted[i*4+1]) + strlen(quoted[i*4+2]) + strlen(quoted[i*4+3]) + GROUP_ROW_SQL;
+	}
+
+	sql = (char *)malloc(len);
+	if ( sql == NULL ) { goto done; }
+
+	// the same triplet may be in the group twice, or already be stored by
+	// another grist. both are let be, it needs the triplet index.
+	mysql = strcmp(group.config->db_driver,"mysql") == 0;
+	p  = sql;
+	p += sprintf(p, "%s INTO %s (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES",
+		     mysql ? "INSERT IGNORE" : "INSERT", table);
+	for ( i = 0; i < batch->count; i++ ) {
+		p += sprintf(p, "%s(%s,%s,%s,%s,0,0,%ld)", i > 0 ? "," : " ",
+			     quoted[i*4], quoted[i*4+1], quoted[i*4+2], quoted[i*4+3], (long)batch->entries[i].triplet.timestamp);
+	}
+
+	if ( !mysql ) {
+		// the rows stored come back, sqlite has RETURNING since 3.35
+		strcpy(p, " ON CONFLICT (address, sender, recipient) DO NOTHING RETURNING address, sender, recipient, timestamp");
+		ok = db_query(*db, sql, group_inserted, batch) >= 0;
+	} else if ( (ok = db_execute(*db, sql)) ) {
+		// mysql doesn't say which rows it skipped. those it stored are the
+		// ones never seen again since that were first seen when they were
+		// sent, looked up through the unique key on their hash.
+		p  = sql;
+		p += sprintf(p, "SELECT address, sender, recipient, timestamp FROM %s WHERE seen = 0 AND triplet IN (", table);
+		for ( i = 0; i < batch->count; i++ ) {
+			p += sprintf(p, "%sUNHEX(MD5(CONCAT_WS(CHAR(0),%s,%s,%s)))", i > 0 ? "," : "",
+				     quoted[i*4], quoted[i*4+2], quoted[i*4+3]);
+		}
+		strcpy(p, ")");
+
+		// without the answer every triplet is taken to be stored already
+		if ( db_query(*db, sql, group_inserted, batch) < 0 ) {
+			syslog(LOG_WARNING, "db: unable to read back %d new triplet(s), their requests update them instead.", batch->count);
+		}
+	}
+	free(sql);
+
+	if ( !ok ) {
+		syslog(LOG_ERR, "db: unable to insert %d new triplet(s), has 'grist migrate-schema' been run?", batch->count);
+		db_close(*db);
+		*db = NULL;
+	}
+
+done:
+	for ( i = 0; i < n; i++ ) {
+		_FREE(quoted[i]);
+	}
+	free(quoted);
+
+	return ok;
+}
+
+static void *group_committer( void *arg ) {
+	struct t_group_batch *batch;
+	struct t_db *db = NULL;
+	struct timespec until;
+	int i, ok, stop;
+
+	(void)arg;
+
+	pthread_mutex_lock(&group.lock);
+	do {
+		while ( !group.stop && group.batches[group.active].count == 0 ) {
+			pthread_cond_wait(&group.wake, &group.lock);
+		}
+
+		// more may join until the group is full or the first waited long enough
+		until = group.first;
+		until.tv_sec  += group.config->db_group_commit_ms / 1000;
+		until.tv_nsec += (group.config->db_group_commit_ms % 1000) * 1000000;
+		if ( until.tv_nsec >= 1000000000 ) {
+			until.tv_sec  += 1;
+			until.tv_nsec -= 1000000000;
+		}
+		while ( !group.stop && group.batches[group.active].count < group.config->db_group_commit_max
+			&& pthread_cond_timedwait(&group.wake, &group.lock, &until) == 0 ) ;
+
+		// the next group gathers in the other batch while this one is written
+		stop  = group.stop;
+		batch = &group.batches[group.active];
+		group.active ^= 1;
+		pthread_mutex_unlock(&group.lock);
+
+		ok = batch->count == 0 || group_write(&db, batch);
+
+		pthread_mutex_lock(&group.lock);
+		for ( i = 0; i < batch->count; i++ ) {
+			if ( batch->entries[i].result != NULL ) {
+				*batch->entries[i].result = !ok ? CHECK_ERR : batch->entries[i].inserted ? CHECK_NEW : TRIPLET_STORED;
+			}
+			_FREE(batch->entries[i].strings);
+		}
+		batch->count = 0;
+		pthread_cond_broadcast(&group.done);
+	} while ( !stop );
+	pthread_mutex_unlock(&group.lock);
+
+	if ( db != NULL ) {
+		db_close(db);
+	}
+
+	return NULL;
+}
+
+/**
+ * db_group_start - start inserting new triplets in groups, if
+ * db_group_commit_ms is set
+ *
+ * Requests are only ever concurrent with worker threads, without them each
+ * would just wait out db_group_commit_ms on its own.
+ */
+int db_group_start( struct t_grist_config *config ) {
+	if ( config->db_group_commit_ms <= 0 ) { return 1; }
+
+	if ( config->rq_workers <= 0 ) {
+		syslog(LOG_WARNING, "db: db_group_commit_ms needs rq_workers, inserting new triplets one at a time.");
+		return 1;
+	}
+
+	group.batches[0].entries = (struct t_group_entry *)calloc(config->db_group_commit_max, sizeof(struct t_group_entry));
+	group.batches[1].entries = (struct t_group_entry *)calloc(config->db_group_commit_max, sizeof(struct t_group_entry));
+	if ( group.batches[0].entries == NULL || group.batches[1].entries == NULL ) {
+		_FREE(group.batches[0].entries);
+		_FREE(group.batches[1].entries);
+		return 0;
+	}
+
+	group.config = config;
+	group.stop   = 0;
+
+	if ( pthread_create(&group.thread, NULL, group_committer, NULL) != 0 ) {
+		syslog(LOG_ERR, "db: unable to start the group commit thread.");
+		free(group.batches[0].entries);
+		free(group.batches[1].entries);
+		return 0;
+	}
+
+	__atomic_store_n(&group.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "db: inserting up to %ld new triplets together every %ld ms.", config->db_group_commit_max, config->db_group_commit_ms);
+
+	return 1;
+}
+
+int db_group_active( void ) {
+	return __atomic_load_n(&group.running, __ATOMIC_ACQUIRE);
+}
+
+static const char *group_copy_string( char **p, const char *str, size_t len ) {
+	char *copy = *p;
+
+	if ( len > 0 ) { memcpy(copy, str, len); }
+	copy[len] = '\0';
+	*p += len + 1;
+
+	return copy;
+}
+
+/**
+ * group_copy - copy the triplet of a request into an entry
+ *
+ * Returns 0 if out of memory.
+ */
+static int group_copy( struct t_group_entry *entry, struct t_request *request ) {
+	struct t_request *triplet = &entry->triplet;
+	char *p;
+
+	p = (char *)malloc(request->client_key_len + request->client_name_len + request->sender_len + request->recipient_len + 4);
+	if ( p == NULL ) { return 0; }
+
+	memset(triplet, 0, sizeof(struct t_request));
+	entry->strings  = p;
+	entry->inserted = 0;
+
+	triplet->client_key      = group_copy_string(&p, request->client_key, request->client_key_len);
+	triplet->client_key_len  = request->client_key_len;
+	triplet->client_name     = group_copy_string(&p, request->client_name, request->client_name_len);
+	triplet->client_name_len = request->client_name_len;
+	triplet->sender          = group_copy_string(&p, request->sender, request->sender_len);
+	triplet->sender_len      = request->sender_len;
+	triplet->recipient       = group_copy_string(&p, request->recipient, request->recipient_len);
+	triplet->recipient_len   = request->recipient_len;
+	triplet->timestamp       = request->timestamp;
+
+	return 1;
+}
+
+/**
+ * db_group_insert - insert a new triplet with the next group
+ *
+ * Waits for the group to be committed and returns CHECK_NEW, TRIPLET_STORED
+ * if it turned out to be stored already, or CHECK_ERR if it couldn't be or
+ * rq_max_latency_ms ran out first. Returns TRIPLET_UNKNOWN if the triplet
+ * has to be inserted on its own, when groups aren't running or the next one
+ * is full.
+ */
+int db_group_insert( struct t_request *request, struct t_grist_config *config ) {
+	struct t_group_batch *batch;
+	struct t_group_entry *entry;
+	struct timespec until;
+	long left;
+	int result = TRIPLET_UNKNOWN;
+
+	if ( !__atomic_load_n(&group.running, __ATOMIC_ACQUIRE) ) { return TRIPLET_UNKNOWN; }
+
+	if ( (left = db_time_left(request, config)) <= 0 ) { return CHECK_ERR; }
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec  += left / 1000;
+	until.tv_nsec += (left % 1000) * 1000000;
+	if ( until.tv_nsec >= 1000000000 ) {
+		until.tv_sec  += 1;
+		until.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&group.lock);
+
+	batch = &group.batches[group.active];
+	if ( group.stop || batch->count >= config->db_group_commit_max ) {
+		pthread_mutex_unlock(&group.lock);
+		return TRIPLET_UNKNOWN;
+	}
+
+	entry = &batch->entries[batch->count];
+	if ( !group_copy(entry, request) ) {
+		pthread_mutex_unlock(&group.lock);
+		return TRIPLET_UNKNOWN;
+	}
+	entry->result = &result;
+
+	if ( batch->count == 0 ) {
+		clock_gettime(CLOCK_REALTIME, &group.first);
+	}
+	++batch->count;
+
+	if ( batch->count == 1 || batch->count == config->db_group_commit_max ) {
+		pthread_cond_signal(&group.wake);
+	}
+
+	// the entry stays where it is until its result has been set
+	while ( result == TRIPLET_UNKNOWN ) {
+		if ( pthread_cond_timedwait(&group.done, &group.lock, &until) == ETIMEDOUT && result == TRIPLET_UNKNOWN ) {
+			entry->result = NULL;
+			result = CHECK_ERR;
+		}
+	}
+
+	pthread_mutex_unlock(&group.lock);
+
+	return result;
+}
+
+/**
+ * db_group_stop - insert what is left and stop the committer
+ *
+ * Every worker must have been stopped.
+ */
+void db_group_stop( void ) {
+	if ( !group.running ) { return; }
+
+	__atomic_store_n(&group.running, 0, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&group.lock);
+	group.stop = 1;
+	pthread_cond_signal(&group.wake);
+	pthread_mutex_unlock(&group.lock);
+
+	pthread_join(group.thread, NULL);
+
+	_FREE(group.batches[0].entries);
+	_FREE(group.batches[1].entries);
+	group.batches[0].entries = group.batches[1].entries = NULL;
+}
@@ -0,0 +1,1612 @@
+/**
+ * file: db_memory.c
+ * grist - triplets kept in a hash table in memory
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Each triplet takes a fixed 48 byte record however long its addresses
+ * are. The client is kept as 16 bytes of binary, see radix_key(). Sender
+ * and recipient are split at their last @, the domains are interned once
+ * for every triplet that shares them and kept as 32 bit ids, the local
+ * parts, which hardly repeat, only as one 64 bit hash of the two.
+ *
+ * The table is split into parts with a lock each so workers rarely wait on
+ * each other, every part is an open addressing table with linear probing
+ * that is sized up front from db_max_triplets and never grows. Once a part
+ * is full a new triplet takes the place of one of the MEMORY_EVICT_WINDOW
+ * from its home slot on, the one db_evict_rank() gives up first. Room is
+ * made before the new triplet's domains are interned, a triplet that isn't
+ * stored never leaves a domain behind.
+ */
+#define MEMORY_PART_BITS	6
+#define MEMORY_PARTS		(1 << MEMORY_PART_BITS)
+#define MEMORY_EVICT_WINDOW	16
+#define MEMORY_DOMAIN_MAX	255		// longer ones are hashed with the local part
+#define MEMORY_NO_DOMAIN	UINT32_MAX	// looked up but not interned, matches no record
+#define MEMORY_TEXT_COLUMNS	16		// id, seen, accepted and timestamp of a text row
+
+struct t_triplet {
+	unsigned char address[16];	// the client, IPv4 mapped into IPv6
+	uint64_t locals;		// hash of both local parts, zero for a free slot
+	uint32_t sender_domain;		// interned, zero for an address kept whole
+	uint32_t recipient_domain;
+	uint32_t timestamp;		// first seen
+	uint32_t seen;
+	uint32_t accepted;
+	uint32_t check;			// bits of the key's hash, a checksum in journal records
+};
+
+// records are compared up to here
+#define MEMORY_KEY_SIZE		offsetof(struct t_triplet, timestamp)
+
+struct t_memory_part {
+	pthread_mutex_t  lock;
+	struct t_triplet *slots;
+	size_t mask;
+	size_t count;
+	size_t max;		// 3/4 of the slots, probes stay short
+};
+
+/*
+ * The interned domains share one arena behind a read write lock, found by
+ * an index of ids. Each counts the triplets using it and is let go with the
+ * last of them, its id and bytes are handed out again. While the store is
+ * restored or a snapshot written, domains nobody uses are held on to until
+ * it is done, so ids the records on disk refer to keep their meaning.
+ */
+struct t_domain {
+	uint32_t offset;	// into the arena, the next free id for an unused one
+	uint32_t refs;		// triplets using it
+	uint32_t hash;		// where the index holds it
+	uint16_t len;
+	uint16_t used;
+};
+
+struct t_memory_domains {
+	pthread_rwlock_t lock;
+	char     *arena;
+	size_t   len;
+	size_t   size;
+	size_t   dead;		// bytes of domains let go, see memory_domains_pack()
+	struct t_domain *ids;	// id 0 is never handed out
+	uint32_t count;		// ids handed out so far
+	uint32_t room;
+	uint32_t free;		// first id to hand out again, zero if none
+	uint32_t live;
+	uint32_t *index;	// ids by hash, never more than half full
+	size_t   mask;
+	int      hold;		// keep unused domains, see memory_domains_sweep()
+};
+
+/*
+ * With a db_path the table is kept on disk as a snapshot of every triplet
+ * plus a journal of the triplets changed since, both are 48 byte records
+ * behind a header. Records carry a triplet's whole state, replaying one
+ * keeps the earliest timestamp and the highest counts so records may be
+ * replayed in any order and more than once. A record with no local parts
+ * defines a domain's id for the records after it, see memory_define(), the
+ * domains of a snapshot follow its records. Workers only add records to a
+ * buffer, a writer thread appends it to the journal and syncs once per
+ * db_sync_ms, and replaces the snapshot every db_snapshot_interval.
+ */
+#define MEMORY_SNAPSHOT_MAGIC	"GRISTSNP"
+#define MEMORY_JOURNAL_MAGIC	"GRISTJNL"
+#define MEMORY_FILE_VERSION	2
+#define JOURNAL_BUFFER		65536	// records collected between writes
+#define MEMORY_DEFINE_RECORDS	(1 + (MEMORY_DOMAIN_MAX + sizeof(struct t_triplet) - 1) / sizeof(struct t_triplet))
+
+struct t_memory_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t seed;		// hashes only match under the same seed
+	uint64_t generation;	// see memory_snapshot()
+	uint64_t count;		// records in a snapshot, unused in the journal
+	uint64_t domains;	// bytes of domains after the records of a snapshot
+	uint64_t text_bytes;	// see memory_report()
+	uint64_t text_count;
+	uint64_t created;
+	uint64_t reserved[2];
+};
+
+struct t_journal {
+	pthread_mutex_t  lock;
+	pthread_cond_t   wake;		// the writer sleeps here until the next sync
+	struct t_triplet *active;	// filled by the workers
+	struct t_triplet *pending;	// being written out by the writer
+	size_t           len;
+	unsigned long    dropped;	// records the buffer had no room for
+	int              stop;
+	int              fd;
+	pthread_t        thread;
+	int              running;
+	long             sync_ms;
+	long             snapshot_interval;
+	time_t           last_snapshot;
+	unsigned long    since_snapshot;	// records written since the last one
+	uint64_t         generation;		// of the journal being written
+	char             dir[4096];
+	char             journal_path[4200];
+	char             old_path[4200];
+	char             snapshot_path[4200];
+	char             tmp_path[4200];
+};
+
+struct t_memory_store {
+	uint64_t seed;
+	int full;			// warned that triplets are given up
+	struct t_journal *journal;	// NULL when nothing is kept on disk
+	uint64_t text_bytes;		// the triplets added as rows of the requests table
+	uint64_t text_count;
+	struct t_memory_domains domains;
+	struct t_memory_part parts[MEMORY_PARTS];
+};
+
+/*
+ * A request's triplet, with the domains it would intern.
+ */
+struct t_memory_key {
+	struct t_triplet rec;
+	const char *domain[2];
+	size_t     domain_len[2];
+	uint32_t   domain_hash[2];
+	uint64_t   hash;
+};
+
+/*
+ * Ids in a file are those of the grist that wrote it, read back they are
+ * mapped to the ids the domains get now.
+ */
+struct t_domain_map {
+	uint32_t *ids;
+	uint32_t room;
+};
+
+// shared by every thread, it lives as long as the process
+static struct t_memory_store *store = NULL;
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void memory_journal_queue( struct t_journal *j, const struct t_triplet *recs, size_t n );
+static size_t memory_define( struct t_triplet *entry, uint32_t id, const char *str, size_t len );
+
+static int memory_domains_init( struct t_memory_domains *d ) {
+	pthread_rwlock_init(&d->lock, NULL);
+
+	d->size  = 65536;
+	d->room  = 1024;
+	d->mask  = 2047;
+	d->count = 1;
+	d->arena = (char *)malloc(d->size);
+	d->ids   = (struct t_domain *)calloc(d->room, sizeof(struct t_domain));
+	d->index = (uint32_t *)calloc(d->mask + 1, sizeof(uint32_t));
+
+	return d->arena != NULL && d->ids != NULL && d->index != NULL;
+}
+
+static void memory_domains_free( struct t_memory_domains *d ) {
+	// never initialized
+	if ( d->size == 0 ) { return; }
+
+	pthread_rwlock_destroy(&d->lock);
+	_FREE(d->arena);
+	_FREE(d->ids);
+	_FREE(d->index);
+}
+
+static void memory_store_free( struct t_memory_store *mem ) {
+	int i;
+
+	for ( i = 0; i < MEMORY_PARTS; i++ ) {
+		if ( mem->parts[i].slots == NULL ) { continue; }
+		pthread_mutex_destroy(&mem->parts[i].lock);
+		free(mem->parts[i].slots);
+	}
+	memory_domains_free(&mem->domains);
+	free(mem);
+}
+
+/**
+ * memory_domain_find - the id of an interned domain, zero if it isn't
+ *
+ * The caller holds the domains' lock.
+ */
+static uint32_t memory_domain_find( struct t_memory_domains *d, const char *str, size_t len, uint32_t h ) {
+	struct t_domain *e;
+	uint32_t id;
+	size_t i;
+
+	for ( i = h & d->mask; (id = d->index[i]) != 0; i = (i+1) & d->mask ) {
+		e = &d->ids[id];
+		if ( e->hash == h && e->len == len && memcmp(d->arena + e->offset, str, len) == 0 ) { return id; }
+	}
+
+	return 0;
+}
+
+/**
+ * memory_domain_add - intern a domain that isn't yet, with the write lock
+ * held
+ *
+ * Returns its id with no triplets counted, 0 if out of memory.
+ */
+static uint32_t memory_domain_add( struct t_memory_domains *d, const char *str, size_t len, uint32_t h ) {
+	struct t_domain *grown_ids;
+	uint32_t *grown, id, other;
+	size_t i, size, mask;
+	char *arena;
+
+	if ( d->len + len > UINT32_MAX ) { return 0; }
+
+	if ( d->len + len > d->size ) {
+		for ( size = d->size * 2; size < d->len + len; size *= 2 ) ;
+		if ( (arena = (char *)realloc(d->arena, size)) == NULL ) { return 0; }
+		d->arena = arena;
+		d->size  = size;
+	}
+
+	if ( d->free == 0 && d->count == d->room ) {
+		// ids stay below MEMORY_NO_DOMAIN
+		if ( d->room >= UINT32_MAX / 2 ) { return 0; }
+		if ( (grown_ids = (struct t_domain *)realloc(d->ids, d->room * 2 * sizeof(struct t_domain))) == NULL ) { return 0; }
+		memset(grown_ids + d->room, 0, d->room * sizeof(struct t_domain));
+		d->ids   = grown_ids;
+		d->room *= 2;
+	}
+
+	// the index is rebuilt twice the size before it gets more than half full
+	if ( (d->live + 1) * 2 > d->mask + 1 ) {
+		mask = d->mask * 2 + 1;
+		if ( (grown = (uint32_t *)calloc(mask + 1, sizeof(uint32_t))) == NULL ) { return 0; }
+		for ( other = 1; other < d->count; other++ ) {
+			if ( !d->ids[other].used ) { continue; }
+			for ( i = d->ids[other].hash & mask; grown[i] != 0; i = (i+1) & mask ) ;
+			grown[i] = other;
+		}
+		free(d->index);
+		d->index = grown;
+		d->mask  = mask;
+	}
+
+	if ( d->free != 0 ) {
+		id      = d->free;
+		d->free = d->ids[id].offset;
+	} else {
+		id = d->count++;
+	}
+
+	d->ids[id].offset = (uint32_t)d->len;
+	d->ids[id].refs   = 0;
+	d->ids[id].hash   = h;
+	d->ids[id].len    = (uint16_t)len;
+	d->ids[id].used   = 1;
+	memcpy(d->arena + d->len, str, len);
+	d->len += len;
+	++d->live;
+
+	for ( i = h & d->mask; d->index[i] != 0; i = (i+1) & d->mask ) ;
+	d->index[i] = id;
+
+	return id;
+}
+
+/**
+ * memory_domains_pack - move the domains still used together, once more
+ * than half the arena was let go
+ */
+static void memory_domains_pack( struct t_memory_domains *d ) {
+	size_t size, len = 0;
+	uint32_t id;
+	char *arena;
+
+	for ( size = d->size; size > 65536 && (d->len - d->dead) * 2 <= size / 2; size /= 2 ) ;
+	if ( (arena = (char *)malloc(size)) == NULL ) { return; }
+
+	for ( id = 1; id < d->count; id++ ) {
+		if ( !d->ids[id].used ) { continue; }
+		memcpy(arena + len, d->arena + d->ids[id].offset, d->ids[id].len);
+		d->ids[id].offset = (uint32_t)len;
+		len += d->ids[id].len;
+	}
+
+	free(d->arena);
+	d->arena = arena;
+	d->size  = size;
+	d->len   = len;
+	d->dead  = 0;
+}
+
+/**
+ * memory_domain_drop - let go of a domain no triplet uses, with the write
+ * lock held
+ *
+ * The ids after it in the index are moved back as far as their home slot
+ * lets them, so no probe ever stops at the gap short of its domain.
+ */
+static void memory_domain_drop( struct t_memory_domains *d, uint32_t id ) {
+	struct t_domain *e = &d->ids[id];
+	size_t i, j, home;
+	uint32_t other;
+
+	for ( i = e->hash & d->mask; d->index[i] != id; i = (i+1) & d->mask ) ;
+	for ( j = (i+1) & d->mask; (other = d->index[j]) != 0; j = (j+1) & d->mask ) {
+		home = d->ids[other].hash & d->mask;
+		if ( ((j - home) & d->mask) >= ((j - i) & d->mask) ) {
+			d->index[i] = other;
+			i = j;
+		}
+	}
+	d->index[i] = 0;
+
+	d->dead  += e->len;
+	e->used   = 0;
+	e->len    = 0;
+	e->offset = d->free;
+	d->free   = id;
+	--d->live;
+
+	if ( d->dead > 65536 && d->dead > d->len / 2 ) {
+		memory_domains_pack(d);
+	}
+}
+
+/**
+ * memory_domains_hold - intern the domains of a triplet about to be stored
+ * and count it against them
+ *
+ * The caller holds the part's lock. A new domain's id is defined in the
+ * journal before any record can use it. Returns 0 if one can't be interned.
+ */
+static int memory_domains_hold( struct t_memory_store *mem, struct t_memory_key *key ) {
+	struct t_memory_domains *d = &mem->domains;
+	struct t_triplet entry[MEMORY_DEFINE_RECORDS];
+	uint32_t ids[2];
+	int k;
+
+	pthread_rwlock_wrlock(&d->lock);
+
+	for ( k = 0; k < 2; k++ ) {
+		ids[k] = 0;
+		if ( key->domain_len[k] == 0 ) { continue; }
+
+		ids[k] = memory_domain_find(d, key->domain[k], key->domain_len[k], key->domain_hash[k]);
+		if ( ids[k] == 0 ) {
+			ids[k] = memory_domain_add(d, key->domain[k], key->domain_len[k], key->domain_hash[k]);
+			if ( ids[k] == 0 ) {
+				if ( k == 1 && ids[0] != 0 && --d->ids[ids[0]].refs == 0 && d->hold == 0 ) {
+					memory_domain_drop(d, ids[0]);
+				}
+				pthread_rwlock_unlock(&d->lock);
+				return 0;
+			}
+			if ( mem->journal != NULL ) {
+				memory_journal_queue(mem->journal, entry, memory_define(entry, ids[k], key->domain[k], key->domain_len[k]));
+			}
+		}
+		++d->ids[ids[k]].refs;
+	}
+
+	pthread_rwlock_unlock(&d->lock);
+
+	key->rec.sender_domain    = ids[0];
+	key->rec.recipient_domain = ids[1];
+
+	return 1;
+}
+
+/**
+ * memory_domains_release - a triplet no longer uses its domains
+ */
+static void memory_domains_release( struct t_memory_store *mem, const struct t_triplet *t ) {
+	struct t_memory_domains *d = &mem->domains;
+	uint32_t ids[2] = { t->sender_domain, t->recipient_domain };
+	int k;
+
+	pthread_rwlock_wrlock(&d->lock);
+	for ( k = 0; k < 2; k++ ) {
+		if ( ids[k] != 0 && --d->ids[ids[k]].refs == 0 && d->hold == 0 ) {
+			memory_domain_drop(d, ids[k]);
+		}
+	}
+	pthread_rwlock_unlock(&d->lock);
+}
+
+/**
+ * memory_domains_sweep - stop holding on to domains, and let go of those
+ * no triplet uses
+ */
+static void memory_domains_sweep( struct t_memory_domains *d ) {
+	uint32_t id;
+
+	pthread_rwlock_wrlock(&d->lock);
+	if ( --d->hold == 0 ) {
+		for ( id = 1; id < d->count; id++ ) {
+			if ( d->ids[id].used && d->ids[id].refs == 0 ) {
+				memory_domain_drop(d, id);
+			}
+		}
+	}
+	pthread_rwlock_unlock(&d->lock);
+}
+
+/**
+ * memory_hash - hash the key of a triplet, with its domains spelled out
+ *
+ * Ids are only handed out once a triplet is stored, the hash has to be
+ * known before to find it.
+ */
+static uint64_t memory_hash( struct t_memory_store *mem, const struct t_triplet *rec, const char *domain[2], const size_t domain_len[2] ) {
+	unsigned char buf[sizeof(rec->address) + sizeof(rec->locals) + 2 * (MEMORY_DOMAIN_MAX + 1)];
+	size_t len;
+	int k;
+
+	memcpy(buf, rec->address, sizeof(rec->address));
+	memcpy(buf + sizeof(rec->address), &rec->locals, sizeof(rec->locals));
+	len = sizeof(rec->address) + sizeof(rec->locals);
+
+	for ( k = 0; k < 2; k++ ) {
+		memcpy(buf + len, domain[k], domain_len[k]);
+		len += domain_len[k];
+		buf[len++] = '\0';
+	}
+
+	return grist_hash(buf, len, mem->seed);
+}
+
+/**
+ * memory_record_hash - hash the key of a record whose domains are interned
+ */
+static uint64_t memory_record_hash( struct t_memory_store *mem, const struct t_triplet *rec ) {
+	struct t_memory_domains *d = &mem->domains;
+	uint32_t ids[2] = { rec->sender_domain, rec->recipient_domain };
+	const char *domain[2];
+	size_t domain_len[2];
+	uint64_t h;
+	int k;
+
+	pthread_rwlock_rdlock(&d->lock);
+	for ( k = 0; k < 2; k++ ) {
+		domain[k]     = ids[k] != 0 ? d->arena + d->ids[ids[k]].offset : "";
+		domain_len[k] = ids[k] != 0 ? d->ids[ids[k]].len : 0;
+	}
+	h = memory_hash(mem, rec, domain, domain_len);
+	pthread_rwlock_unlock(&d->lock);
+
+	return h;
+}
+
+/**
+ * memory_split - where the domain of an address starts, 0 if the address
+ * is kept whole with the local parts
+ *
+ * An address without @, with nothing after it or with a domain too long
+ * to intern is kept whole.
+ */
+static size_t memory_split( const char *addr, size_t len ) {
+	size_t at;
+
+	for ( at = len; at > 0 && addr[at-1] != '@'; at-- ) ;
+
+	if ( at == 0 || at == len || len - at > MEMORY_DOMAIN_MAX ) { return 0; }
+
+	return at;
+}
+
+/**
+ * memory_key - fill in the key of a request's triplet, all but the ids of
+ * its domains
+ */
+static void memory_key( struct t_memory_store *mem, struct t_request *request, struct t_memory_key *key ) {
+	unsigned char buf[REQUEST_BUFFER_MAX];
+	const char *addr[2] = { request->sender, request->recipient };
+	size_t addr_len[2] = { request->sender_len, request->recipient_len };
+	size_t at, local, len = 0;
+	uint64_t h;
+	int k;
+
+	memset(key, 0, sizeof(struct t_memory_key));
+
+	if ( radix_key(request->client_key, key->rec.address) == 0 ) {
+		// not an address, its hash goes behind the discard prefix 100::/64
+		h = grist_hash(request->client_key, request->client_key_len, mem->seed);
+		key->rec.address[0] = 0x01;
+		memcpy(key->rec.address + 8, &h, sizeof(h));
+	}
+
+	// the nuls tell "ab"+"c" from "a"+"bc"
+	for ( k = 0; k < 2; k++ ) {
+		at    = memory_split(addr[k], addr_len[k]);
+		local = at != 0 ? at - 1 : addr_len[k];
+		memcpy(buf + len, addr[k], local);
+		len += local;
+		buf[len++] = '\0';
+
+		key->domain[k]      = at != 0 ? addr[k] + at : "";
+		key->domain_len[k]  = at != 0 ? addr_len[k] - at : 0;
+		key->domain_hash[k] = at != 0 ? (uint32_t)grist_hash(key->domain[k], key->domain_len[k], mem->seed) : 0;
+	}
+	key->rec.locals = grist_hash(buf, len, mem->seed) | 1;
+
+	key->hash      = memory_hash(mem, &key->rec, key->domain, key->domain_len);
+	key->rec.check = (uint32_t)key->hash;
+}
+
+/**
+ * memory_key_domains - look up the ids of a key's domains
+ *
+ * Ids the triplet can't have if they aren't interned yet. The caller holds
+ * the part's lock, so an id found here can't be let go and handed out to
+ * another domain that a triplet of the part then uses before the probe.
+ */
+static void memory_key_domains( struct t_memory_store *mem, struct t_memory_key *key ) {
+	struct t_memory_domains *d = &mem->domains;
+	uint32_t ids[2];
+	int k;
+
+	pthread_rwlock_rdlock(&d->lock);
+	for ( k = 0; k < 2; k++ ) {
+		ids[k] = 0;
+		if ( key->domain_len[k] == 0 ) { continue; }
+
+		ids[k] = memory_domain_find(d, key->domain[k], key->domain_len[k], key->domain_hash[k]);
+		if ( ids[k] == 0 ) { ids[k] = MEMORY_NO_DOMAIN; }
+	}
+	pthread_rwlock_unlock(&d->lock);
+
+	key->rec.sender_domain    = ids[0];
+	key->rec.recipient_domain = ids[1];
+}
+
+/**
+ * memory_slot - find a triplet, or the free slot it would go into
+ */
+static struct t_triplet *memory_slot( struct t_memory_part *part, const struct t_triplet *key ) {
+	struct t_triplet *t;
+	size_t i;
+
+	for ( i = key->check & part->mask; ; i = (i+1) & part->mask ) {
+		t = &part->slots[i];
+		if ( t->locals == 0 ) { return t; }
+		if ( t->check == key->check && memcmp(t, key, MEMORY_KEY_SIZE) == 0 ) { return t; }
+	}
+}
+
+static inline struct t_memory_part *memory_part( struct t_memory_store *mem, uint64_t hash ) {
+	return &mem->parts[hash >> (64 - MEMORY_PART_BITS)];
+}
+
+/**
+ * memory_remove - empty a slot, the caller holds the part's lock
+ *
+ * The triplets after it in its cluster are moved back as far as their home
+ * slot lets them, so no probe ever stops at the gap short of its triplet.
+ */
+static void memory_remove( struct t_memory_part *part, size_t i ) {
+	struct t_triplet *t;
+	size_t j, home;
+
+	for ( j = (i+1) & part->mask; ; j = (j+1) & part->mask ) {
+		t = &part->slots[j];
+		if ( t->locals == 0 ) { break; }
+
+		// it may fill the gap unless the gap lies before its home slot
+		home = t->check & part->mask;
+		if ( ((j - home) & part->mask) >= ((j - i) & part->mask) ) {
+			part->slots[i] = *t;
+			i = j;
+		}
+	}
+
+	memset(&part->slots[i], 0, sizeof(struct t_triplet));
+	--part->count;
+}
+
+/**
+ * memory_evict - give up a triplet to make room for another
+ *
+ * The one of the MEMORY_EVICT_WINDOW slots from check's home slot on that
+ * db_evict_rank() puts first goes, if it ranks below limit, and with it its
+ * hold on its domains. The caller holds the part's lock. Returns 0 if none
+ * was given up.
+ */
+static int memory_evict( struct t_memory_store *mem, struct t_memory_part *part, uint32_t check, uint64_t limit ) {
+	struct t_triplet *t, victim;
+	uint64_t rank, best = limit;
+	size_t i, n, at = 0;
+	int found = 0;
+
+	for ( i = check & part->mask, n = 0; n < MEMORY_EVICT_WINDOW; i = (i+1) & part->mask, n++ ) {
+		t = &part->slots[i];
+		if ( t->locals == 0 ) { continue; }
+
+		rank = db_evict_rank(t->timestamp, t->seen);
+		if ( rank < best ) {
+			best  = rank;
+			at    = i;
+			found = 1;
+		}
+	}
+	if ( !found ) { return 0; }
+
+	victim = part->slots[at];
+	memory_remove(part, at);
+	memory_domains_release(mem, &victim);
+
+	return 1;
+}
+
+/**
+ * memory_merge - fold a record read back from disk into the table
+ *
+ * Its domains are interned already. A full table only takes it in place
+ * of a triplet it would give up first. Returns 0 if there was no room left
+ * for it.
+ */
+static int memory_merge( struct t_memory_store *mem, struct t_triplet *rec ) {
+	struct t_memory_domains *d = &mem->domains;
+	struct t_memory_part *part;
+	struct t_triplet *t;
+	uint64_t h;
+
+	h          = memory_record_hash(mem, rec);
+	rec->check = (uint32_t)h;
+	part       = memory_part(mem, h);
+
+	pthread_mutex_lock(&part->lock);
+
+	t = memory_slot(part, rec);
+	if ( t->locals == 0 ) {
+		if ( part->count >= part->max ) {
+			if ( !memory_evict(mem, part, rec->check, db_evict_rank(rec->timestamp, rec->seen)) ) {
+				pthread_mutex_unlock(&part->lock);
+				return 0;
+			}
+			t = memory_slot(part, rec);
+		}
+		*t = *rec;
+		++part->count;
+
+		pthread_rwlock_wrlock(&d->lock);
+		if ( rec->sender_domain != 0 )    { ++d->ids[rec->sender_domain].refs; }
+		if ( rec->recipient_domain != 0 ) { ++d->ids[rec->recipient_domain].refs; }
+		pthread_rwlock_unlock(&d->lock);
+	} else {
+		if ( rec->timestamp < t->timestamp ) { t->timestamp = rec->timestamp; }
+		if ( rec->seen > t->seen )           { t->seen = rec->seen; }
+		if ( rec->accepted > t->accepted )   { t->accepted = rec->accepted; }
+	}
+
+	pthread_mutex_unlock(&part->lock);
+
+	return 1;
+}
+
+/**
+ * memory_report - log what the triplets take, and what they would as rows
+ *
+ * A row of the requests table holds the client address, hostname, sender
+ * and recipient as text, counted here by their length for the triplets
+ * added, plus four integer columns. The figure for the table counts the
+ * records and every interned domain with its id and index slot.
+ */
+static void memory_report( struct t_memory_store *mem ) {
+	struct t_memory_domains *d = &mem->domains;
+	unsigned long count = 0, domains;
+	uint64_t text_bytes, text_count;
+	size_t bytes;
+	int i;
+
+	for ( i = 0; i < MEMORY_PARTS; i++ ) {
+		pthread_mutex_lock(&mem->parts[i].lock);
+		count += mem->parts[i].count;
+		pthread_mutex_unlock(&mem->parts[i].lock);
+	}
+	if ( count == 0 ) { return; }
+
+	pthread_rwlock_rdlock(&d->lock);
+	bytes   = count * sizeof(struct t_triplet) + (d->len - d->dead) + d->live * sizeof(struct t_domain) + (d->mask + 1) * sizeof(uint32_t);
+	domains = d->live;
+	pthread_rwlock_unlock(&d->lock);
+
+	text_bytes = __atomic_load_n(&mem->text_bytes, __ATOMIC_RELAXED);
+	text_count = __atomic_load_n(&mem->text_count, __ATOMIC_RELAXED);
+
+	syslog(LOG_INFO, "memory: %lu triplets at %.1f bytes each with %lu domains interned, %.1f each as text.",
+	       count, (double)bytes / count, domains, text_count > 0 ? (double)text_bytes / text_count : 0.0);
+}
+
+static uint32_t memory_record_sum( const struct t_triplet *t ) {
+	// never zero, so zero filled garbage at the end of a journal is noticed
+	return (uint32_t)grist_hash(t, offsetof(struct t_triplet, check), 0) | 1;
+}
+
+/**
+ * memory_define - fill in the journal entry that defines a domain's id
+ *
+ * A record with no local parts, holding the id, the domain's length and a
+ * hash of it, followed by the domain padded out to whole records. Returns
+ * the number of records it takes.
+ */
+static size_t memory_define( struct t_triplet *entry, uint32_t id, const char *str, size_t len ) {
+	size_t n = 1 + (len + sizeof(struct t_triplet) - 1) / sizeof(struct t_triplet);
+	uint64_t h = grist_hash(str, len, 0);
+
+	memset(entry, 0, n * sizeof(struct t_triplet));
+	memcpy(entry->address, &h, sizeof(h));
+	entry->sender_domain    = id;
+	entry->recipient_domain = (uint32_t)len;
+	entry->check            = memory_record_sum(entry);
+	memcpy(entry + 1, str, len);
+
+	return n;
+}
+
+/**
+ * memory_map_define - intern a domain read back from disk under the id it
+ * had there
+ */
+static int memory_map_define( struct t_memory_store *mem, struct t_domain_map *map, uint32_t file_id, const char *str, size_t len ) {
+	struct t_memory_domains *d = &mem->domains;
+	uint32_t *grown, room, id, h;
+
+	if ( file_id == 0 || file_id == MEMORY_NO_DOMAIN || len == 0 || len > MEMORY_DOMAIN_MAX ) { return 0; }
+
+	if ( file_id >= map->room ) {
+		for ( room = map->room ? map->room : 1024; room <= file_id; room *= 2 ) {
+			if ( room >= UINT32_MAX / 2 ) { return 0; }
+		}
+		if ( (grown = (uint32_t *)realloc(map->ids, room * sizeof(uint32_t))) == NULL ) { return 0; }
+		memset(grown + map->room, 0, (room - map->room) * sizeof(uint32_t));
+		map->ids  = grown;
+		map->room = room;
+	}
+
+	h = (uint32_t)grist_hash(str, len, mem->seed);
+
+	pthread_rwlock_wrlock(&d->lock);
+	if ( (id = memory_domain_find(d, str, len, h)) == 0 ) {
+		id = memory_domain_add(d, str, len, h);
+	}
+	pthread_rwlock_unlock(&d->lock);
+
+	map->ids[file_id] = id;
+
+	return id != 0;
+}
+
+/**
+ * memory_map_record - turn the ids of a record read back into those now
+ *
+ * Returns 0 if it refers to a domain the file never defined.
+ */
+static int memory_map_record( struct t_domain_map *map, struct t_triplet *rec ) {
+	uint32_t *ids[2] = { &rec->sender_domain, &rec->recipient_domain };
+	int k;
+
+	for ( k = 0; k < 2; k++ ) {
+		if ( *ids[k] == 0 ) { continue; }
+		if ( *ids[k] >= map->room || map->ids[*ids[k]] == 0 ) { return 0; }
+		*ids[k] = map->ids[*ids[k]];
+	}
+
+	return 1;
+}
+
+static int memory_write_all( int fd, const void *buf, size_t len ) {
+	const char *p = (const char *)buf;
+	ssize_t n;
+
+	while ( len > 0 ) {
+		n = write(fd, p, len);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			return -1;
+		}
+		p   += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void memory_fill_header( struct t_memory_header *hdr, const char *magic, uint64_t seed, uint64_t generation ) {
+	memset(hdr, 0, sizeof(struct t_memory_header));
+	memcpy(hdr->magic, magic, sizeof(hdr->magic));
+	hdr->version     = MEMORY_FILE_VERSION;
+	hdr->record_size = sizeof(struct t_triplet);
+	hdr->seed        = seed;
+	hdr->generation  = generation;
+	hdr->created     = (uint64_t)time(NULL);
+}
+
+static int memory_check_header( const struct t_memory_header *hdr, const char *magic ) {
+	return memcmp(hdr->magic, magic, sizeof(hdr->magic)) == 0
+		&& hdr->version == MEMORY_FILE_VERSION
+		&& hdr->record_size == sizeof(struct t_triplet);
+}
+
+/**
+ * memory_peek_seed - read the seed a snapshot or journal was written with
+ */
+static int memory_peek_seed( const char *path, const char *magic, uint64_t *seed ) {
+	struct t_memory_header hdr;
+	int fd, ok;
+
+	if ( (fd = open(path, O_RDONLY)) < 0 ) { return 0; }
+	ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && memory_check_header(&hdr, magic);
+	close(fd);
+
+	if ( ok ) { *seed = hdr.seed; }
+
+	return ok;
+}
+
+static void memory_sync_dir( struct t_journal *j ) {
+	int fd;
+
+	// makes renames and newly created files stick
+	if ( (fd = open(j->dir, O_RDONLY)) >= 0 ) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/**
+ * memory_map_file - map a snapshot or journal to read it back
+ *
+ * Returns 1 if mapped, 0 if the file isn't there or is empty, -1 on error.
+ */
+static int memory_map_file( const char *path, const char *what, const char **file, size_t *size ) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ( (fd = open(path, O_RDONLY)) < 0 ) {
+		if ( errno == ENOENT ) { return 0; }
+		syslog(LOG_ERR, "memory: unable to open %s %s: %m", what, path);
+		return -1;
+	}
+	if ( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		syslog(LOG_ERR, "memory: unable to map %s %s: %m", what, path);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*file = (const char *)map;
+	*size = st.st_size;
+
+	return 1;
+}
+
+/**
+ * memory_load_snapshot - fill the table from the last snapshot
+ *
+ * Returns the number of triplets loaded, or -1 if the snapshot is unusable.
+ */
+static long memory_load_snapshot( struct t_memory_store *mem, struct t_domain_map *map, const char *path ) {
+	struct t_memory_header *hdr;
+	struct t_triplet rec;
+	const char *file, *domains;
+	size_t size, off;
+	uint64_t i;
+	uint32_t id;
+	uint16_t len;
+	long dropped = 0, damaged = 0, loaded;
+	int ok;
+
+	if ( (ok = memory_map_file(path, "snapshot", &file, &size)) <= 0 ) { return ok; }
+
+	hdr = (struct t_memory_header *)file;
+	if ( size < sizeof(struct t_memory_header) || !memory_check_header(hdr, MEMORY_SNAPSHOT_MAGIC) || hdr->seed != mem->seed ||
+	     hdr->count > (size - sizeof(struct t_memory_header)) / sizeof(struct t_triplet) ||
+	     hdr->domains != size - sizeof(struct t_memory_header) - hdr->count * sizeof(struct t_triplet) ) {
+		syslog(LOG_ERR, "memory: %s is not a usable snapshot.", path);
+		munmap((void *)file, size);
+		return -1;
+	}
+
+	// the domains come after the records
+	domains = file + sizeof(struct t_memory_header) + hdr->count * sizeof(struct t_triplet);
+	for ( off = 0; off + sizeof(id) + sizeof(len) <= hdr->domains; off += sizeof(id) + sizeof(len) + len ) {
+		memcpy(&id, domains + off, sizeof(id));
+		memcpy(&len, domains + off + sizeof(id), sizeof(len));
+		if ( off + sizeof(id) + sizeof(len) + len > hdr->domains ||
+		     !memory_map_define(mem, map, id, domains + off + sizeof(id) + sizeof(len), len) ) {
+			break;
+		}
+	}
+	if ( off != hdr->domains ) {
+		syslog(LOG_ERR, "memory: the domains of snapshot %s are damaged.", path);
+		munmap((void *)file, size);
+		return -1;
+	}
+
+	for ( i = 0; i < hdr->count; i++ ) {
+		memcpy(&rec, file + sizeof(struct t_memory_header) + i * sizeof(struct t_triplet), sizeof(rec));
+		if ( rec.locals == 0 || !memory_map_record(map, &rec) ) {
+			++damaged;
+		} else if ( !memory_merge(mem, &rec) ) {
+			++dropped;
+		}
+	}
+
+	mem->journal->generation = hdr->generation;
+	mem->text_bytes          = hdr->text_bytes;
+	mem->text_count          = hdr->text_count;
+	loaded                   = (long)hdr->count - dropped - damaged;
+
+	munmap((void *)file, size);
+
+	if ( damaged > 0 ) {
+		syslog(LOG_WARNING, "memory: %ld records of snapshot %s refer to domains it doesn't hold.", damaged, path);
+	}
+	if ( dropped > 0 ) {
+		syslog(LOG_WARNING, "memory: no room for %ld triplets from the snapshot, raise db_max_triplets.", dropped);
+	}
+
+	return loaded;
+}
+
+/**
+ * memory_replay_journal - apply the records of a journal to the table
+ *
+ * A crash can leave a partly written entry at the end, replay stops there.
+ * With repair set that tail is cut off so new records can be appended, and
+ * a journal a newer snapshot already holds is removed.
+ */
+static long memory_replay_journal( struct t_memory_store *mem, struct t_domain_map *map, const char *path, int repair ) {
+	struct t_journal *j = mem->journal;
+	struct t_memory_header hdr;
+	struct t_triplet rec;
+	const char *file, *str;
+	size_t size, good, n;
+	uint64_t h;
+	long replayed = 0, damaged = 0;
+	int ok;
+
+	if ( (ok = memory_map_file(path, "journal", &file, &size)) <= 0 ) { return ok; }
+
+	if ( size < sizeof(hdr) ) {
+		munmap((void *)file, size);
+		// died before the header made it out, nothing was ever added
+		if ( repair && truncate(path, 0) == 0 ) { return 0; }
+		syslog(LOG_ERR, "memory: journal %s is truncated.", path);
+		return -1;
+	}
+	memcpy(&hdr, file, sizeof(hdr));
+	if ( !memory_check_header(&hdr, MEMORY_JOURNAL_MAGIC) || hdr.seed != mem->seed ) {
+		syslog(LOG_ERR, "memory: %s does not belong to the snapshot, move it away to start over.", path);
+		munmap((void *)file, size);
+		return -1;
+	}
+
+	// the snapshot was written after this journal was moved aside
+	if ( hdr.generation < j->generation ) {
+		munmap((void *)file, size);
+		if ( repair ) { unlink(path); }
+		return 0;
+	}
+	j->generation = hdr.generation;
+
+	for ( good = sizeof(hdr); good + sizeof(rec) <= size; good += n * sizeof(rec) ) {
+		memcpy(&rec, file + good, sizeof(rec));
+		if ( rec.check != memory_record_sum(&rec) ) { break; }
+
+		n = 1;
+		if ( rec.locals == 0 ) {
+			n  += (rec.recipient_domain + sizeof(rec) - 1) / sizeof(rec);
+			str = file + good + sizeof(rec);
+			if ( rec.recipient_domain > MEMORY_DOMAIN_MAX || good + n * sizeof(rec) > size ) { break; }
+
+			memcpy(&h, rec.address, sizeof(h));
+			if ( h != grist_hash(str, rec.recipient_domain, 0) ) { break; }
+
+			if ( !memory_map_define(mem, map, rec.sender_domain, str, rec.recipient_domain) ) { ++damaged; }
+			continue;
+		}
+
+		if ( !memory_map_record(map, &rec) ) {
+			++damaged;
+			continue;
+		}
+		memory_merge(mem, &rec);
+		++replayed;
+	}
+
+	munmap((void *)file, size);
+
+	if ( damaged > 0 ) {
+		syslog(LOG_WARNING, "memory: %ld records of journal %s refer to domains it doesn't define.", damaged, path);
+	}
+	if ( good != size ) {
+		syslog(LOG_WARNING, "memory: journal %s ends in a partly written record.", path);
+		if ( repair && truncate(path, good) != 0 ) {
+			syslog(LOG_ERR, "memory: unable to repair journal %s: %m", path);
+			return -1;
+		}
+	}
+
+	return replayed;
+}
+
+static int memory_journal_open( struct t_journal *j, uint64_t seed ) {
+	struct t_memory_header hdr;
+	struct stat st;
+	int fd;
+
+	fd = open(j->journal_path, O_WRONLY|O_APPEND|O_CREAT, 0600);
+	if ( fd < 0 ) {
+		syslog(LOG_ERR, "memory: unable to open journal %s: %m", j->journal_path);
+		return -1;
+	}
+
+	if ( fstat(fd, &st) == 0 && st.st_size == 0 ) {
+		memory_fill_header(&hdr, MEMORY_JOURNAL_MAGIC, seed, j->generation);
+		if ( memory_write_all(fd, &hdr, sizeof(hdr)) != 0 || fdatasync(fd) != 0 ) {
+			syslog(LOG_ERR, "memory: unable to write journal %s: %m", j->journal_path);
+			close(fd);
+			return -1;
+		}
+		memory_sync_dir(j);
+	}
+
+	return fd;
+}
+
+/**
+ * memory_journal_queue - queue records for the journal
+ *
+ * Never waits on the disk. While the writer is behind and the buffer full
+ * the records are dropped, the change is in the table and the writer takes
+ * a snapshot to get it on disk, see memory_writer().
+ */
+static void memory_journal_queue( struct t_journal *j, const struct t_triplet *recs, size_t n ) {
+	size_t before;
+
+	pthread_mutex_lock(&j->lock);
+
+	before = j->len;
+	if ( j->len + n > JOURNAL_BUFFER ) {
+		++j->dropped;
+	} else {
+		memcpy(j->active + j->len, recs, n * sizeof(struct t_triplet));
+		j->len += n;
+	}
+	if ( (before < JOURNAL_BUFFER/2 && j->len >= JOURNAL_BUFFER/2) || j->dropped == 1 ) {
+		pthread_cond_signal(&j->wake);
+	}
+
+	pthread_mutex_unlock(&j->lock);
+}
+
+/**
+ * memory_journal_append - queue the new state of a triplet for the journal
+ *
+ * Called with the part's lock held, the record is queued before the
+ * triplet can be given up and its domains' ids handed out again.
+ */
+static void memory_journal_append( struct t_journal *j, struct t_triplet *rec ) {
+	rec->check = memory_record_sum(rec);
+
+	memory_journal_queue(j, rec, 1);
+}
+
+/**
+ * memory_journal_flush - write out and sync whatever has been queued
+ *
+ * Only called from the writer thread, or before it is started.
+ */
+static int memory_journal_flush( struct t_journal *j ) {
+	struct t_triplet *recs;
+	size_t len;
+
+	pthread_mutex_lock(&j->lock);
+	recs       = j->active;
+	len        = j->len;
+	j->active  = j->pending;
+	j->pending = recs;
+	j->len     = 0;
+	pthread_mutex_unlock(&j->lock);
+
+	if ( len == 0 ) { return 0; }
+
+	if ( memory_write_all(j->fd, recs, len * sizeof(struct t_triplet)) != 0 || fdatasync(j->fd) != 0 ) {
+		syslog(LOG_ERR, "memory: unable to write journal %s: %m", j->journal_path);
+		return -1;
+	}
+	j->since_snapshot += len;
+
+	return 0;
+}
+
+/**
+ * memory_journal_define_all - define the id of every domain in the journal
+ *
+ * After a restart domains have other ids than those the journal so far
+ * refers to. Only called before the writer is started.
+ */
+static int memory_journal_define_all( struct t_memory_store *mem ) {
+	struct t_memory_domains *d = &mem->domains;
+	struct t_journal *j = mem->journal;
+	struct t_triplet entry[MEMORY_DEFINE_RECORDS];
+	uint32_t id;
+	size_t n;
+
+	pthread_rwlock_rdlock(&d->lock);
+	for ( id = 1; id < d->count; id++ ) {
+		if ( !d->ids[id].used ) { continue; }
+
+		n = memory_define(entry, id, d->arena + d->ids[id].offset, d->ids[id].len);
+		if ( j->len + n > JOURNAL_BUFFER && memory_journal_flush(j) != 0 ) { break; }
+		memcpy(j->active + j->len, entry, n * sizeof(struct t_triplet));
+		j->len += n;
+	}
+	pthread_rwlock_unlock(&d->lock);
+
+	return id == d->count && memory_journal_flush(j) == 0 ? 0 : -1;
+}
+
+/**
+ * memory_write_domains - write every interned domain behind its id and
+ * length
+ *
+ * Returns the bytes written, -1 on error.
+ */
+static long memory_write_domains( struct t_memory_store *mem, int fd ) {
+	struct t_memory_domains *d = &mem->domains;
+	size_t len = 0;
+	uint32_t id;
+	uint16_t n;
+	char *buf;
+
+	pthread_rwlock_rdlock(&d->lock);
+	buf = (char *)malloc(d->live * (sizeof(id) + sizeof(n)) + (d->len - d->dead) + 1);
+	for ( id = 1; buf != NULL && id < d->count; id++ ) {
+		if ( !d->ids[id].used ) { continue; }
+
+		n = d->ids[id].len;
+		memcpy(buf + len, &id, sizeof(id));
+		memcpy(buf + len + sizeof(id), &n, sizeof(n));
+		memcpy(buf + len + sizeof(id) + sizeof(n), d->arena + d->ids[id].offset, n);
+		len += sizeof(id) + sizeof(n) + n;
+	}
+	pthread_rwlock_unlock(&d->lock);
+
+	if ( buf == NULL || memory_write_all(fd, buf, len) != 0 ) {
+		_FREE(buf);
+		return -1;
+	}
+	free(buf);
+
+	return (long)len;
+}
+
+/**
+ * memory_snapshot - write every triplet to a new snapshot
+ *
+ * The journal is moved aside first and only removed once the snapshot is on
+ * disk. Changes made while the snapshot is written land in the new journal
+ * whether or not the snapshot caught them too. Every journal begun before
+ * the snapshot has a lower generation than it, and is only replayed if the
+ * snapshot never made it to disk. Domains are written after the records,
+ * and held on to from before the journal is moved aside until then, so
+ * every id a record in the snapshot or the new journal refers to means
+ * what the snapshot says until the journal defines it again.
+ */
+static int memory_snapshot( struct t_memory_store *mem ) {
+	struct t_journal *j = mem->journal;
+	struct t_memory_header hdr;
+	struct t_memory_part *part;
+	struct t_triplet *buf;
+	size_t i, n;
+	uint64_t count = 0;
+	long domains;
+	int fd, p;
+
+	// from before the journal is moved aside, the new one may refer to them
+	pthread_rwlock_wrlock(&mem->domains.lock);
+	++mem->domains.hold;
+	pthread_rwlock_unlock(&mem->domains.lock);
+
+	if ( memory_journal_flush(j) != 0 ) { goto abandon; }
+
+	// a journal left aside by a failed snapshot isn't in any snapshot yet,
+	// keep appending to the current one until a snapshot succeeds
+	if ( access(j->old_path, F_OK) != 0 ) {
+		if ( rename(j->journal_path, j->old_path) != 0 ) {
+			syslog(LOG_ERR, "memory: unable to move journal aside: %m");
+			goto abandon;
+		}
+		close(j->fd);
+		++j->generation;
+		if ( (j->fd = memory_journal_open(j, mem->seed)) < 0 ) { goto abandon; }
+	}
+
+	fd = open(j->tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if ( fd < 0 ) {
+		syslog(LOG_ERR, "memory: unable to create snapshot %s: %m", j->tmp_path);
+		goto abandon;
+	}
+
+	buf = (struct t_triplet *)malloc((mem->parts[0].mask + 1) * sizeof(struct t_triplet));
+	if ( buf == NULL ) {
+		close(fd);
+		unlink(j->tmp_path);
+		goto abandon;
+	}
+
+	memory_fill_header(&hdr, MEMORY_SNAPSHOT_MAGIC, mem->seed, j->generation);
+	if ( memory_write_all(fd, &hdr, sizeof(hdr)) != 0 ) { goto failed; }
+
+	// one part at a time so workers are only ever held up for a moment
+	for ( p = 0; p < MEMORY_PARTS; p++ ) {
+		part = &mem->parts[p];
+
+		pthread_mutex_lock(&part->lock);
+		for ( i = 0, n = 0; i <= part->mask; i++ ) {
+			if ( part->slots[i].locals != 0 ) {
+				buf[n++] = part->slots[i];
+			}
+		}
+		pthread_mutex_unlock(&part->lock);
+
+		if ( memory_write_all(fd, buf, n * sizeof(struct t_triplet)) != 0 ) { goto failed; }
+		count += n;
+	}
+
+	if ( (domains = memory_write_domains(mem, fd)) < 0 ) { goto failed; }
+
+	hdr.count      = count;
+	hdr.domains    = (uint64_t)domains;
+	hdr.text_bytes = __atomic_load_n(&mem->text_bytes, __ATOMIC_RELAXED);
+	hdr.text_count = __atomic_load_n(&mem->text_count, __ATOMIC_RELAXED);
+	if ( pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(fd) != 0 ) { goto failed; }
+	close(fd);
+	free(buf);
+	memory_domains_sweep(&mem->domains);
+
+	if ( rename(j->tmp_path, j->snapshot_path) != 0 ) {
+		syslog(LOG_ERR, "memory: unable to replace snapshot %s: %m", j->snapshot_path);
+		unlink(j->tmp_path);
+		return -1;
+	}
+	memory_sync_dir(j);
+	unlink(j->old_path);
+
+	j->last_snapshot  = time(NULL);
+	j->since_snapshot = 0;
+
+	syslog(LOG_INFO, "memory: snapshot of %lu triplets written.", (unsigned long)count);
+	memory_report(mem);
+
+	return 0;
+
+failed:
+	syslog(LOG_ERR, "memory: unable to write snapshot %s: %m", j->tmp_path);
+	close(fd);
+	free(buf);
+	unlink(j->tmp_path);
+abandon:
+	memory_domains_sweep(&mem->domains);
+	return -1;
+}
+
+static void *memory_writer( void *arg ) {
+	struct t_memory_store *mem = (struct t_memory_store *)arg;
+	struct t_journal *j = mem->journal;
+	struct timespec deadline;
+	unsigned long dropped;
+	int stop;
+
+	pthread_mutex_lock(&j->lock);
+	for (;;) {
+		if ( !j->stop && j->len < JOURNAL_BUFFER/2 && j->dropped == 0 ) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec  += j->sync_ms / 1000;
+			deadline.tv_nsec += (j->sync_ms % 1000) * 1000000;
+			if ( deadline.tv_nsec >= 1000000000 ) {
+				deadline.tv_sec  += 1;
+				deadline.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&j->wake, &j->lock, &deadline);
+		}
+		stop    = j->stop;
+		dropped = j->dropped;
+		j->dropped = 0;
+		pthread_mutex_unlock(&j->lock);
+
+		// one write and one sync for every request since the last round
+		memory_journal_flush(j);
+
+		// the changes that didn't fit are only in the table, a snapshot has them
+		if ( dropped > 0 ) {
+			syslog(LOG_WARNING, "memory: journal buffer full, %lu change(s) left to a snapshot, the disk is too slow for db_sync_ms.", dropped);
+		}
+		if ( dropped > 0 || (!stop && j->since_snapshot > 0 && time(NULL) - j->last_snapshot >= j->snapshot_interval) ) {
+			memory_snapshot(mem);
+		}
+
+		if ( stop ) { break; }
+
+		pthread_mutex_lock(&j->lock);
+	}
+
+	return NULL;
+}
+
+static void memory_journal_close( struct t_memory_store *mem ) {
+	struct t_journal *j = mem->journal;
+
+	if ( j == NULL ) { return; }
+
+	if ( j->running ) {
+		// the writer flushes what is left before it returns
+		pthread_mutex_lock(&j->lock);
+		j->stop = 1;
+		pthread_cond_signal(&j->wake);
+		pthread_mutex_unlock(&j->lock);
+		pthread_join(j->thread, NULL);
+	}
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->wake);
+
+	if ( j->fd >= 0 ) { close(j->fd); }
+	_FREE(j->active);
+	_FREE(j->pending);
+	free(j);
+	mem->journal = NULL;
+}
+
+/**
+ * memory_recover - load the snapshot and journals and start the writer
+ */
+static int memory_recover( struct t_memory_store *mem, struct t_grist_config *config ) {
+	struct t_journal *j;
+	struct t_domain_map map = { NULL, 0 };
+	struct timespec started, done;
+	uint64_t seed;
+	long loaded, replayed, n;
+	int had_old;
+
+	j = (struct t_journal *)calloc(1, sizeof(struct t_journal));
+	if ( j == NULL ) { return 0; }
+	mem->journal = j;
+
+	j->fd                = -1;
+	j->sync_ms           = config->db_sync_ms;
+	j->snapshot_interval = config->db_snapshot_interval;
+
+	snprintf(j->dir, sizeof(j->dir), "%s", config->db_path);
+	snprintf(j->journal_path, sizeof(j->journal_path), "%s/%s.journal", config->db_path, config->db_name);
+	snprintf(j->old_path, sizeof(j->old_path), "%s/%s.journal.old", config->db_path, config->db_name);
+	snprintf(j->snapshot_path, sizeof(j->snapshot_path), "%s/%s.snapshot", config->db_path, config->db_name);
+	snprintf(j->tmp_path, sizeof(j->tmp_path), "%s/%s.snapshot.tmp", config->db_path, config->db_name);
+
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->wake, NULL);
+
+	j->active  = (struct t_triplet *)malloc(JOURNAL_BUFFER * sizeof(struct t_triplet));
+	j->pending = (struct t_triplet *)malloc(JOURNAL_BUFFER * sizeof(struct t_triplet));
+	if ( j->active == NULL || j->pending == NULL ) { goto failed; }
+
+	// hashes on disk are only any good under the seed they were made with
+	if ( memory_peek_seed(j->snapshot_path, MEMORY_SNAPSHOT_MAGIC, &seed) ||
+	     memory_peek_seed(j->old_path, MEMORY_JOURNAL_MAGIC, &seed) ||
+	     memory_peek_seed(j->journal_path, MEMORY_JOURNAL_MAGIC, &seed) ) {
+		mem->seed = seed;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	had_old = access(j->old_path, F_OK) == 0;
+
+	// the domains of triplets given up along the way may be defined once
+	// and used again further on
+	mem->domains.hold = 1;
+	loaded = memory_load_snapshot(mem, &map, j->snapshot_path);
+	replayed = loaded < 0 ? -1 : memory_replay_journal(mem, &map, j->old_path, 0);
+	n = replayed < 0 ? -1 : memory_replay_journal(mem, &map, j->journal_path, 1);
+	memory_domains_sweep(&mem->domains);
+	_FREE(map.ids);
+	if ( n < 0 ) { goto failed; }
+	replayed += n;
+
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	syslog(LOG_INFO, "memory: %ld triplets from the snapshot and %ld journal records in %.2f s.",
+	       loaded, replayed, (done.tv_sec - started.tv_sec) + (done.tv_nsec - started.tv_nsec) / 1e9);
+	memory_report(mem);
+
+	if ( j->generation == 0 ) { j->generation = 1; }
+	if ( (j->fd = memory_journal_open(j, mem->seed)) < 0 ) { goto failed; }
+	if ( memory_journal_define_all(mem) != 0 ) { goto failed; }
+
+	// an earlier snapshot didn't finish, put what it was saving somewhere safe
+	j->last_snapshot = time(NULL);
+	if ( had_old && memory_snapshot(mem) != 0 ) { goto failed; }
+
+	if ( pthread_create(&j->thread, NULL, memory_writer, mem) != 0 ) {
+		syslog(LOG_ERR, "memory: unable to start the journal writer.");
+		goto failed;
+	}
+	j->running = 1;
+
+	return 1;
+
+failed:
+	memory_journal_close(mem);
+	return 0;
+}
+
+static struct t_memory_store *memory_store_create( struct t_grist_config *config ) {
+	struct t_memory_store *new_store;
+	struct t_memory_part  *part;
+	size_t per_part, size;
+	int i;
+
+	new_store = (struct t_memory_store *)calloc(1, sizeof(struct t_memory_store));
+	if ( new_store == NULL ) { return NULL; }
+
+	new_store->seed = grist_random_seed();
+
+	if ( !memory_domains_init(&new_store->domains) ) {
+		syslog(LOG_ERR, "memory: unable to allocate room for interned domains.");
+		memory_store_free(new_store);
+		return NULL;
+	}
+
+	// every part takes its share of db_max_triplets, rounded up
+	per_part = (config->db_max_triplets + MEMORY_PARTS - 1) / MEMORY_PARTS;
+	for ( size = 16; size - size/4 < per_part; size <<= 1 ) ;
+
+	for ( i = 0; i < MEMORY_PARTS; i++ ) {
+		part = &new_store->parts[i];
+
+		// pages are only touched, and so only really allocated, as slots fill up
+		part->slots = (struct t_triplet *)calloc(size, sizeof(struct t_triplet));
+		if ( part->slots == NULL ) {
+			syslog(LOG_ERR, "memory: unable to allocate room for %ld triplets.", config->db_max_triplets);
+			memory_store_free(new_store);
+			return NULL;
+		}
+
+		pthread_mutex_init(&part->lock, NULL);
+		part->mask = size - 1;
+		part->max  = size - size/4;
+	}
+
+	syslog(LOG_INFO, "memory: room for %lu triplets in %lu kB, plus their interned domains.", (unsigned long)(MEMORY_PARTS * (size - size/4)),
+	       (unsigned long)(MEMORY_PARTS * size * sizeof(struct t_triplet) / 1024));
+
+	if ( config->db_path[0] == '\0' ) {
+		syslog(LOG_INFO, "memory: no db_path, triplets are not kept on disk.");
+	} else if ( !memory_recover(new_store, config) ) {
+		syslog(LOG_ERR, "memory: unable to restore triplets from %s.", config->db_path);
+		memory_store_free(new_store);
+		return NULL;
+	}
+
+	return new_store;
+}
+
+static void *memory_backend_open( struct t_grist_config *config ) {
+	pthread_mutex_lock(&store_lock);
+	if ( store == NULL ) {
+		store = memory_store_create(config);
+	}
+	pthread_mutex_unlock(&store_lock);
+
+	return store;
+}
+
+static void memory_backend_close( void *handle ) {
+	// the triplets outlive any one connection, see memory_backend_shutdown()
+	(void)handle;
+}
+
+static int memory_backend_check( void *handle, struct t_request *request, struct t_grist_config *config ) {
+	struct t_memory_store *mem = (struct t_memory_store *)handle;
+	struct t_memory_part  *part;
+	struct t_memory_key key;
+	struct t_triplet *t, rec;
+
+	memory_key(mem, request, &key);
+
+	part = memory_part(mem, key.hash);
+	pthread_mutex_lock(&part->lock);
+
+	memory_key_domains(mem, &key);
+	t = memory_slot(part, &key.rec);
+	if ( t->locals == 0 ) {
+		if ( part->count >= part->max ) {
+			if ( !__atomic_exchange_n(&mem->full, 1, __ATOMIC_RELAXED) ) {
+				syslog(LOG_WARNING, "memory: table full, old triplets are given up for new ones, raise db_max_triplets.");
+			}
+			if ( !memory_evict(mem, part, key.rec.check, UINT64_MAX) ) {
+				pthread_mutex_unlock(&part->lock);
+				return CHECK_ERR;
+			}
+			t = memory_slot(part, &key.rec);
+		}
+
+		// only now that there is room
+		if ( !memory_domains_hold(mem, &key) ) {
+			pthread_mutex_unlock(&part->lock);
+			syslog(LOG_ERR, "memory: unable to intern the domains of a triplet, let through.");
+			return CHECK_ERR;
+		}
+
+		*t = key.rec;
+		t->timestamp = (uint32_t)request->timestamp;
+		++part->count;
+
+		__atomic_add_fetch(&mem->text_bytes, request->client_key_len + request->client_name_len + request->sender_len +
+				   request->recipient_len + MEMORY_TEXT_COLUMNS, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&mem->text_count, 1, __ATOMIC_RELAXED);
+	} else {
+		if ( t->seen < UINT32_MAX ) { ++t->seen; }
+		if ( request->timestamp - (time_t)t->timestamp >= config->rq_cooldown && t->accepted < UINT32_MAX ) {
+			++t->accepted;
+		}
+	}
+	rec = *t;
+
+	if ( mem->journal != NULL ) {
+		memory_journal_append(mem->journal, &rec);
+	}
+
+	pthread_mutex_unlock(&part->lock);
+
+	return db_triplet_action(rec.seen, rec.timestamp, request, config);
+}
+
+static void memory_backend_shutdown( void ) {
+	if ( store == NULL ) { return; }
+
+	memory_journal_close(store);
+	memory_report(store);
+	memory_store_free(store);
+	store = NULL;
+}
+
+const struct t_db_backend db_backend_memory = {
+	"memory",
+	memory_backend_open,
+	memory_backend_close,
+	memory_backend_check,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	memory_backend_shutdown
+};
@@ -0,0 +1,563 @@
+/**
+ * file: db_mmap.c
+ * grist - triplets kept in a hash table mapped into every process, from a
+ *         file or a POSIX shared memory segment
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * The table file is created and sized by 'grist setup', after that it is
+ * only ever mapped, never read or loaded, so every grist on the host works
+ * on the same pages in the page cache. Slots are claimed by swapping the
+ * first fingerprint word in, filled in and then marked ready. Counts are
+ * bumped with atomic adds on the mapped record, no process ever takes a
+ * lock on the table. A slot left half written by a process that died is
+ * filled in by the next one looking for the same triplet.
+ *
+ * Slots hold a fingerprint rather than the memory store's record of the
+ * triplet: interned domains would need an arena every process allocates
+ * from and counts against, under a lock shared across processes, which is
+ * just what the table is laid out to do without.
+ *
+ * Once the table holds max triplets a new one takes over the slot of one
+ * of the MAPPED_EVICT_WINDOW from its home slot on, the one db_evict_rank()
+ * gives up first. The slot is rewritten in place while marked not ready, so
+ * no slot is ever emptied again and probes still stop at the first empty
+ * one. A request counted just as its triplet is given up may be counted
+ * against the one taking its place. As the probe only sees the slots up
+ * to the first empty one, those may all hold retried triplets: rather than
+ * give one up, the new triplet then takes the empty slot, until all but
+ * 1/MAPPED_SPARE of the slots are taken.
+ *
+ * db_driver = shm keeps the same table in a shared memory segment instead,
+ * made by whichever grist needs it first and gone after a reboot.
+ */
+#define MAPPED_MAGIC	"GRISTMAP"
+#define MAPPED_VERSION	1
+#define MAPPED_HEADER	4096	// slots start on a page of their own
+#define MAPPED_SPINS	100	// yields before sleeping on a half written slot
+#define MAPPED_CLAIM_MS	100	// before a half written slot is taken over
+#define MAPPED_EVICT_WINDOW	16	// slots a new triplet may take over
+#define MAPPED_EVICT_TRIES	4	// before giving up on a crowded window
+#define MAPPED_SPARE	8	// of the slots always left empty
+#define SHM_WAIT_MS	1000	// for another process to finish making the segment
+
+struct t_mapped_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t seed;		// fingerprints only match under the same seed
+	uint64_t slots;		// a power of two
+	uint64_t max;		// 3/4 of the slots, probes stay short
+	uint64_t count;
+	uint64_t created;
+	uint64_t ready;		// set last, once the rest of the header is written
+};
+
+struct t_mapped_triplet {
+	uint64_t hash[2];	// fingerprint, hash[0] is zero for a free slot
+	uint32_t timestamp;	// first seen
+	uint32_t seen;
+	uint32_t accepted;
+	uint32_t ready;		// the claiming process has filled in the rest
+};
+
+struct t_mapped_table {
+	struct t_mapped_header  *header;
+	struct t_mapped_triplet *slots;
+	uint64_t mask;
+	size_t   size;
+	int      full;
+};
+
+// mapped once per process and shared by its threads
+static struct t_mapped_table *table = NULL;
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void mmap_table_path( struct t_grist_config *config, char *path, size_t len ) {
+	snprintf(path, len, "%s/%s", config->db_path, config->db_name);
+}
+
+/**
+ * mmap_init_header - describe a new table sized for db_max_triplets
+ *
+ * Returns the size of the table including its header.
+ */
+static off_t mmap_init_header( struct t_mapped_header *hdr, struct t_grist_config *config ) {
+	uint64_t slots;
+
+	for ( slots = 16; slots - slots/4 < (uint64_t)config->db_max_triplets; slots <<= 1 ) ;
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, MAPPED_MAGIC, sizeof(hdr->magic));
+	hdr->version     = MAPPED_VERSION;
+	hdr->record_size = sizeof(struct t_mapped_triplet);
+	hdr->seed        = grist_random_seed();
+	hdr->slots       = slots;
+	hdr->max         = slots - slots/4;
+	hdr->created     = (uint64_t)time(NULL);
+
+	return MAPPED_HEADER + slots * sizeof(struct t_mapped_triplet);
+}
+
+/**
+ * mmap_create_table - create the table file, called by 'grist setup'
+ */
+int mmap_create_table( struct t_grist_config *config ) {
+	struct t_mapped_header hdr;
+	char path[sizeof(config->db_path)+sizeof(config->db_name)+1];
+	char tmp_path[sizeof(path)+4];
+	off_t size;
+	int fd;
+
+	mmap_table_path(config, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	if ( access(path, F_OK) == 0 ) {
+		fprintf(stderr, "fatal: %s exists, have you already initialized the database?\n", path);
+		return 1;
+	}
+
+	size = mmap_init_header(&hdr, config);
+	hdr.ready = 1;
+
+	// the slots are a hole in the file until they are first written to,
+	// the finished file is renamed into place so it is never seen half made
+	fd = open(tmp_path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if ( fd < 0 ) {
+		fprintf(stderr, "fatal: unable to create %s: %s\n", tmp_path, strerror(errno));
+		return 1;
+	}
+	if ( ftruncate(fd, size) != 0 || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(fd) != 0 ) {
+		fprintf(stderr, "fatal: unable to write %s: %s\n", tmp_path, strerror(errno));
+		close(fd);
+		unlink(tmp_path);
+		return 1;
+	}
+	close(fd);
+
+	if ( rename(tmp_path, path) != 0 ) {
+		fprintf(stderr, "fatal: unable to create %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return 1;
+	}
+
+	printf("created %s with room for %lu triplets in %lu kB.\n", path, (unsigned long)hdr.max, (unsigned long)(size / 1024));
+
+	return 0;
+}
+
+/**
+ * mmap_table_attach - check a mapped table and keep hold of it
+ *
+ * The mapping is released if it isn't a table this grist can use.
+ */
+static struct t_mapped_table *mmap_table_attach( void *map, size_t size, const char *what ) {
+	struct t_mapped_table *new_table;
+	struct t_mapped_header *hdr = (struct t_mapped_header *)map;
+
+	if ( memcmp(hdr->magic, MAPPED_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != MAPPED_VERSION
+	     || hdr->record_size != sizeof(struct t_mapped_triplet) || (hdr->slots & (hdr->slots-1)) != 0
+	     || (uint64_t)size != MAPPED_HEADER + hdr->slots * sizeof(struct t_mapped_triplet) ) {
+		syslog(LOG_ERR, "mmap: %s is not a triplet table.", what);
+		munmap(map, size);
+		return NULL;
+	}
+
+	new_table = (struct t_mapped_table *)calloc(1, sizeof(struct t_mapped_table));
+	if ( new_table == NULL ) {
+		munmap(map, size);
+		return NULL;
+	}
+
+	new_table->header = hdr;
+	new_table->slots  = (struct t_mapped_triplet *)((char *)map + MAPPED_HEADER);
+	new_table->mask   = hdr->slots - 1;
+	new_table->size   = size;
+
+	// every lookup lands somewhere else, reading ahead only wastes the cache
+	madvise(new_table->slots, size - MAPPED_HEADER, MADV_RANDOM);
+
+	return new_table;
+}
+
+static struct t_mapped_table *mmap_table_open( struct t_grist_config *config ) {
+	char path[sizeof(config->db_path)+sizeof(config->db_name)+1];
+	struct stat st;
+	void *map;
+	int fd;
+
+	mmap_table_path(config, path, sizeof(path));
+
+	fd = open(path, O_RDWR);
+	if ( fd < 0 ) {
+		syslog(LOG_ERR, "mmap: unable to open %s: %m, has 'grist setup' been run?", path);
+		return NULL;
+	}
+
+	if ( fstat(fd, &st) != 0 || st.st_size < MAPPED_HEADER ) {
+		syslog(LOG_ERR, "mmap: %s is not a triplet table.", path);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if ( map == MAP_FAILED ) {
+		syslog(LOG_ERR, "mmap: unable to map %s: %m", path);
+		return NULL;
+	}
+
+	return mmap_table_attach(map, st.st_size, path);
+}
+
+/**
+ * shm_table_create - make the shared memory segment and its header
+ *
+ * The pages of a new segment read as zero, so only the header is written.
+ * Nobody uses the table until ready is set.
+ */
+static void *shm_table_create( int fd, const char *name, struct t_grist_config *config, off_t *size ) {
+	struct t_mapped_header hdr, *shared;
+	void *map;
+
+	*size = mmap_init_header(&hdr, config);
+
+	if ( ftruncate(fd, *size) != 0 ) {
+		syslog(LOG_ERR, "shm: unable to size %s: %m", name);
+		return MAP_FAILED;
+	}
+
+	map = mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( map == MAP_FAILED ) {
+		syslog(LOG_ERR, "shm: unable to map %s: %m", name);
+		return MAP_FAILED;
+	}
+
+	shared = (struct t_mapped_header *)map;
+	memcpy(shared, &hdr, sizeof(hdr));
+	__atomic_store_n(&shared->ready, 1, __ATOMIC_RELEASE);
+
+	syslog(LOG_INFO, "shm: created %s with room for %lu triplets.", name, (unsigned long)hdr.max);
+
+	return map;
+}
+
+/**
+ * shm_table_join - map a segment made by another process
+ *
+ * It may still be making it, so wait for it to be sized and for its header
+ * to be marked ready.
+ */
+static void *shm_table_join( int fd, const char *name, off_t *size ) {
+	struct stat st;
+	void *map;
+	int waited;
+
+	for ( waited = 0; ; waited++ ) {
+		if ( fstat(fd, &st) != 0 ) {
+			syslog(LOG_ERR, "shm: unable to stat %s: %m", name);
+			return MAP_FAILED;
+		}
+		if ( st.st_size >= MAPPED_HEADER ) { break; }
+		if ( waited >= SHM_WAIT_MS ) { goto abandoned; }
+		usleep(1000);
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if ( map == MAP_FAILED ) {
+		syslog(LOG_ERR, "shm: unable to map %s: %m", name);
+		return MAP_FAILED;
+	}
+
+	for ( ; !__atomic_load_n(&((struct t_mapped_header *)map)->ready, __ATOMIC_ACQUIRE); waited++ ) {
+		if ( waited >= SHM_WAIT_MS ) {
+			munmap(map, st.st_size);
+			goto abandoned;
+		}
+		usleep(1000);
+	}
+
+	*size = st.st_size;
+
+	return map;
+
+abandoned:
+	syslog(LOG_ERR, "shm: %s was never finished, the grist making it died. remove /dev/shm%s to start over.", name, name);
+	return MAP_FAILED;
+}
+
+static struct t_mapped_table *shm_table_open( struct t_grist_config *config ) {
+	char name[sizeof(config->db_name)+1];
+	off_t size;
+	void *map;
+	int fd;
+
+	if ( config->db_name[0] == '\0' || strchr(config->db_name, '/') != NULL ) {
+		syslog(LOG_ERR, "shm: db_name must be set and must not contain a '/'.");
+		return NULL;
+	}
+	snprintf(name, sizeof(name), "/%s", config->db_name);
+
+	// only one process can create it, the others wait for it to be made
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if ( fd >= 0 ) {
+		map = shm_table_create(fd, name, config, &size);
+		if ( map == MAP_FAILED ) { shm_unlink(name); }
+	} else if ( errno == EEXIST ) {
+		fd = shm_open(name, O_RDWR, 0);
+		if ( fd < 0 ) {
+			syslog(LOG_ERR, "shm: unable to open %s: %m", name);
+			return NULL;
+		}
+		map = shm_table_join(fd, name, &size);
+	} else {
+		syslog(LOG_ERR, "shm: unable to create %s: %m", name);
+		return NULL;
+	}
+	close(fd);
+
+	if ( map == MAP_FAILED ) { return NULL; }
+
+	return mmap_table_attach(map, size, name);
+}
+
+static void *mmap_backend_open( struct t_grist_config *config ) {
+	pthread_mutex_lock(&table_lock);
+	if ( table == NULL ) {
+		table = mmap_table_open(config);
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	return table;
+}
+
+static void *shm_backend_open( struct t_grist_config *config ) {
+	pthread_mutex_lock(&table_lock);
+	if ( table == NULL ) {
+		table = shm_table_open(config);
+	}
+	pthread_mutex_unlock(&table_lock);
+
+	return table;
+}
+
+static void mmap_backend_close( void *handle ) {
+	// the mapping is shared by every thread, see mmap_backend_shutdown()
+	(void)handle;
+}
+
+/**
+ * mmap_fill - fill in a claimed slot and mark it ready
+ *
+ * Returns 1 if this call made it ready, 0 if another process did first.
+ */
+static int mmap_fill( struct t_mapped_header *hdr, struct t_mapped_triplet *t, const uint64_t hash[2], time_t timestamp ) {
+	uint32_t ready = 0;
+
+	t->hash[1]   = hash[1];
+	t->timestamp = (uint32_t)timestamp;
+	t->seen      = 0;
+	t->accepted  = 0;
+
+	if ( !__atomic_compare_exchange_n(&t->ready, &ready, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) { return 0; }
+	__atomic_add_fetch(&hdr->count, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+/**
+ * mmap_replace - put a new triplet in the slot of one given up for it
+ *
+ * Only one process gets to rewrite a slot, it is marked not ready until
+ * the new triplet is all in. Returns 0 if another process took it first.
+ */
+static int mmap_replace( struct t_mapped_triplet *t, const uint64_t hash[2], time_t timestamp ) {
+	uint32_t ready = 1;
+
+	if ( !__atomic_compare_exchange_n(&t->ready, &ready, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) { return 0; }
+
+	__atomic_store_n(&t->hash[0], hash[0], __ATOMIC_RELEASE);
+	t->hash[1]   = hash[1];
+	t->timestamp = (uint32_t)timestamp;
+	t->seen      = 0;
+	t->accepted  = 0;
+	__atomic_store_n(&t->ready, 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+/**
+ * mmap_wait_ready - wait for the process that claimed a slot to fill it in
+ *
+ * The slot holds the first word of this triplet's fingerprint, so if it is
+ * still not ready after MAPPED_CLAIM_MS the process that claimed it is taken
+ * to have died half way through and the slot is filled in here instead.
+ * Returns 1 if this call did that.
+ */
+static int mmap_wait_ready( struct t_mapped_header *hdr, struct t_mapped_triplet *t, const uint64_t hash[2], time_t timestamp ) {
+	struct timespec now, deadline;
+	int spins;
+
+	for ( spins = 0; spins < MAPPED_SPINS; spins++ ) {
+		if ( __atomic_load_n(&t->ready, __ATOMIC_ACQUIRE) ) { return 0; }
+		sched_yield();
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += MAPPED_CLAIM_MS / 1000;
+	deadline.tv_nsec += (MAPPED_CLAIM_MS % 1000) * 1000000;
+	if ( deadline.tv_nsec >= 1000000000 ) {
+		deadline.tv_sec  += 1;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	while ( !__atomic_load_n(&t->ready, __ATOMIC_ACQUIRE) ) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ( now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec) ) {
+			if ( mmap_fill(hdr, t, hash, timestamp) ) {
+				syslog(LOG_WARNING, "mmap: took over a slot left half written by a grist that died.");
+				return 1;
+			}
+			break;
+		}
+		usleep(1000);
+	}
+
+	return 0;
+}
+
+static int mmap_backend_check( void *handle, struct t_request *request, struct t_grist_config *config ) {
+	struct t_mapped_table  *tbl = (struct t_mapped_table *)handle;
+	struct t_mapped_header *hdr = tbl->header;
+	struct t_mapped_triplet *t, *victim;
+	uint64_t hash[2], key, i, probes, rank, best, count;
+	long r_seen, r_timestamp;
+	int tries;
+
+	grist_fingerprint(request, hdr->seed, hash);
+
+	for ( tries = 0; tries < MAPPED_EVICT_TRIES; tries++ ) {
+		victim = NULL;
+		best   = UINT64_MAX;
+
+		for ( i = hash[0] & tbl->mask, probes = 0; probes <= tbl->mask; i = (i+1) & tbl->mask, probes++ ) {
+			t   = &tbl->slots[i];
+			key = __atomic_load_n(&t->hash[0], __ATOMIC_ACQUIRE);
+
+			if ( key == 0 ) {
+				// a full table gives up a triplet rather than fill another slot,
+				// a retried one only once the spare slots are gone too
+				count = __atomic_load_n(&hdr->count, __ATOMIC_RELAXED);
+				if ( victim != NULL && count >= hdr->max
+				     && (best < DB_EVICT_RETRIED || count >= hdr->slots - hdr->slots / MAPPED_SPARE) ) { break; }
+
+				if ( __atomic_compare_exchange_n(&t->hash[0], &key, hash[0], 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ) {
+					// one waiting longer than MAPPED_CLAIM_MS filled it in for us
+					mmap_fill(hdr, t, hash, request->timestamp);
+
+					return db_triplet_action(0, request->timestamp, request, config);
+				}
+				// another process got there first, key is what it put in
+			}
+
+			if ( key != hash[0] ) {
+				if ( probes < MAPPED_EVICT_WINDOW && __atomic_load_n(&t->ready, __ATOMIC_ACQUIRE) ) {
+					rank = db_evict_rank(t->timestamp, t->seen);
+					if ( rank < best ) {
+						best   = rank;
+						victim = t;
+					}
+				}
+				continue;
+			}
+			if ( mmap_wait_ready(hdr, t, hash, request->timestamp) ) {
+				return db_triplet_action(0, request->timestamp, request, config);
+			}
+			if ( t->hash[1] != hash[1] ) { continue; }
+
+			r_timestamp = t->timestamp;
+			r_seen      = __atomic_add_fetch(&t->seen, 1, __ATOMIC_RELAXED);
+			if ( request->timestamp - r_timestamp >= config->rq_cooldown ) {
+				__atomic_add_fetch(&t->accepted, 1, __ATOMIC_RELAXED);
+			}
+
+			return db_triplet_action(r_seen, r_timestamp, request, config);
+		}
+
+		if ( victim == NULL ) { break; }
+
+		if ( !tbl->full ) {
+			syslog(LOG_WARNING, "mmap: table full, old triplets are given up for new ones, recreate it with a larger db_max_triplets.");
+			tbl->full = 1;
+		}
+
+		// another process may have taken the slot, or stored this triplet
+		if ( mmap_replace(victim, hash, request->timestamp) ) {
+			return db_triplet_action(0, request->timestamp, request, config);
+		}
+	}
+
+	syslog(LOG_WARNING, "mmap: no slot for a new triplet, it is let through.");
+
+	return CHECK_ERR;
+}
+
+static void mmap_backend_shutdown( void ) {
+	if ( table == NULL ) { return; }
+
+	// the pages stay in the page cache or the segment, for the next grist
+	munmap(table->header, table->size);
+	free(table);
+	table = NULL;
+}
+
+const struct t_db_backend db_backend_mmap = {
+	"mmap",
+	mmap_backend_open,
+	mmap_backend_close,
+	mmap_backend_check,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	mmap_backend_shutdown
+};
+
+const struct t_db_backend db_backend_shm = {
+	"shm",
+	shm_backend_open,
+	mmap_backend_close,
+	mmap_backend_check,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	mmap_backend_shutdown
+};
@@ -0,0 +1,261 @@
+/**
+ * file: db_partition.c
+ * grist - triplets kept in a table per period, dropped a table at a time
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+/*
+ * With db_partition_hours set, the SQL backends store triplets in a table
+ * per period instead of in requests: requests_<n> holds the triplets first
+ * stored during the n-th period of db_partition_hours since the epoch, and
+ * a triplet stays in the table it was first stored in. The last
+ * db_partitions periods are live, a lookup asks all their tables in one
+ * query and takes the row of the newest. The table of the period before
+ * them is dropped when the next one starts, however many rows it holds,
+ * rather than deleted from row by row. It is dropped a period late, so that
+ * no handle still working from the list of the period before looks into a
+ * table that is gone.
+ *
+ * Every handle keeps its own list of the live tables that exist and brings
+ * it up to date once per period with db_partition_rotate(), creating the
+ * table of the new period. Rows are numbered in each table on its own, a
+ * row is told apart from those of other tables by DB_PARTITION_KEY().
+ */
+
+// the tables of a partition, %ld is its period
+static const char *sql_partition_sqlite[] = {
+	"CREATE TABLE IF NOT EXISTS requests_%ld ( id INTEGER PRIMARY KEY, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)",
+	"CREATE UNIQUE INDEX IF NOT EXISTS requests_%ld_triplet ON requests_%ld (address, sender, recipient)",
+	"CREATE INDEX IF NOT EXISTS requests_%ld_timestamp ON requests_%ld (timestamp)",
+	NULL
+};
+static const char *sql_partition_mysql[] = {
+	"CREATE TABLE IF NOT EXISTS requests_%ld ( id INTEGER PRIMARY KEY AUTO_INCREMENT, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER, "
+	"triplet BINARY(16) AS (" SQL_TRIPLET_MYSQL ") VIRTUAL, UNIQUE KEY requests_triplet (triplet), KEY requests_timestamp (timestamp))",
+	NULL
+};
+static const char *sql_partition_pgsql[] = {
+	"CREATE TABLE IF NOT EXISTS requests_%ld ( id SERIAL, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)",
+	"CREATE UNIQUE INDEX IF NOT EXISTS requests_%ld_triplet ON requests_%ld (address, sender, recipient)",
+	"CREATE INDEX IF NOT EXISTS requests_%ld_timestamp ON requests_%ld (timestamp)",
+	NULL
+};
+
+// the tables there are, each row has their name as its first column
+static const char *sql_list_sqlite = "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB 'requests_[0-9]*'";
+static const char *sql_list_mysql  = "SELECT table_name AS name FROM information_schema.tables WHERE table_schema = DATABASE() AND table_name LIKE 'requests\\_%'";
+static const char *sql_list_pgsql  = "SELECT tablename AS name FROM pg_tables WHERE schemaname = current_schema() AND tablename LIKE 'requests\\_%'";
+
+static const char **partition_ddl( const char *driver ) {
+	if ( strcmp(driver,"mysql") == 0 ) { return sql_partition_mysql; }
+	if ( strcmp(driver,"pgsql") == 0 ) { return sql_partition_pgsql; }
+
+	return sql_partition_sqlite;
+}
+
+/**
+ * db_partition_of - the period triplets stored at t go in, 0 without
+ * db_partition_hours
+ */
+long db_partition_of( struct t_grist_config *config, time_t t ) {
+	if ( config->db_partition_hours <= 0 ) { return 0; }
+
+	return (long)(t / (config->db_partition_hours * 3600));
+}
+
+long db_partition_current( struct t_grist_config *config ) {
+	return db_partition_of(config, time(NULL));
+}
+
+/**
+ * db_partition_table - the name of the table of a period, requests for 0
+ */
+void db_partition_table( long n, char *table, size_t len ) {
+	if ( n == 0 ) {
+		snprintf(table, len, "requests");
+	} else {
+		snprintf(table, len, "requests_%ld", n);
+	}
+}
+
+/**
+ * db_partition_sql - the i-th statement creating the table of period n
+ *
+ * Returns 0 once there are no more.
+ */
+int db_partition_sql( const char *driver, long n, int i, char *sql, size_t len ) {
+	const char **ddl = partition_ddl(driver);
+
+	if ( ddl[i] == NULL ) { return 0; }
+
+	snprintf(sql, len, ddl[i], n, n);
+
+	return 1;
+}
+
+/**
+ * db_partition_list_sql - the query naming the partition tables there are
+ */
+const char *db_partition_list_sql( const char *driver ) {
+	if ( strcmp(driver,"mysql") == 0 ) { return sql_list_mysql; }
+	if ( strcmp(driver,"pgsql") == 0 ) { return sql_list_pgsql; }
+
+	return sql_list_sqlite;
+}
+
+static int partition_create( void *handle, int (*execute)( void *handle, const char *sql ), struct t_grist_config *config, long n ) {
+	char sql[512];
+	int i;
+
+	for ( i = 0; db_partition_sql(config->db_driver, n, i, sql, sizeof(sql)); i++ ) {
+		if ( !execute(handle, sql) ) {
+			syslog(LOG_ERR, "db: unable to create the table of partition %ld.", n);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * db_partition_create - make sure the table of period n is there, for the
+ * threads writing through a handle of their own
+ */
+int db_partition_create( struct t_db *db, struct t_grist_config *config, long n ) {
+	if ( n == 0 || db->backend->execute == NULL ) { return 1; }
+
+	return partition_create(db->handle, db->backend->execute, config, n);
+}
+
+/**
+ * db_partition_found - add a table named by the list query to a handle's
+ * list, the newest PARTITION_MAX are kept
+ */
+void db_partition_found( struct t_partitions *parts, const char *table ) {
+	long n;
+	int i;
+
+	if ( table == NULL || strncmp(table, "requests_", 9) != 0 ) { return; }
+
+	n = strtol(table + 9, NULL, 10);
+	if ( n <= 0 || n > parts->newest ) { return; }
+	if ( parts->count == PARTITION_MAX && n < parts->n[PARTITION_MAX-1] ) { return; }
+
+	// kept newest first
+	i = parts->count < PARTITION_MAX ? parts->count++ : PARTITION_MAX-1;
+	for ( ; i > 0 && parts->n[i-1] < n; i-- ) {
+		parts->n[i] = parts->n[i-1];
+	}
+	parts->n[i] = n;
+}
+
+/**
+ * db_partition_select_sql - one query looking a triplet up in all the live
+ * tables at once
+ *
+ * Each table is asked for columns where where holds, behind its place in
+ * the list as part, and only the row from the newest is kept. That is a
+ * single round trip however many partitions are live.
+ *
+ * Returns the query, to be freed, or NULL.
+ */
+char *db_partition_select_sql( struct t_partitions *parts, const char *columns, const char *where ) {
+	char table[32];
+	size_t size, len = 0;
+	char *sql;
+	int i;
+
+	size = parts->count * (strlen(columns) + strlen(where) + 96) + 32;
+	if ( (sql = (char *)malloc(size)) == NULL ) { return NULL; }
+
+	for ( i = 0; i < parts->count; i++ ) {
+		db_partition_table(parts->n[i], table, sizeof(table));
+		len += snprintf(sql + len, size - len, "%sSELECT %d AS part, %s FROM %s WHERE %s",
+				i > 0 ? " UNION ALL " : "", i, columns, table, where);
+	}
+	snprintf(sql + len, size - len, " ORDER BY part LIMIT 1");
+
+	return sql;
+}
+
+/**
+ * db_partition_rotate - bring a handle's list of live tables up to date
+ *
+ * Once per period: creates the table of the new one, drops the tables that
+ * fell out of the live ones a period ago and lists those left through list(),
+ * which hands each table name to db_partition_found(). Without
+ * db_partition_hours the list is requests alone.
+ *
+ * Returns 1 if the list changed, 0 if it didn't, -1 on error.
+ */
+int db_partition_rotate( struct t_partitions *parts, struct t_grist_config *config, void *handle,
+			 int (*execute)( void *handle, const char *sql ),
+			 int (*list)( void *handle, const char *sql, struct t_partitions *parts ) ) {
+	char sql[64];
+	long newest, n;
+
+	if ( config->db_partition_hours <= 0 ) {
+		if ( parts->count == 1 ) { return 0; }
+
+		parts->newest = 0;
+		parts->n[0]   = 0;
+		parts->count  = 1;
+		return 1;
+	}
+
+	newest = db_partition_current(config);
+	if ( parts->count > 0 && parts->newest == newest ) { return 0; }
+
+	if ( !partition_create(handle, execute, config, newest) ) { return -1; }
+
+	// a handle that missed periods drops what fell out meanwhile, a new one
+	// the table of the period just before
+	n = parts->count > 0 ? parts->newest - config->db_partitions - 1 : newest - config->db_partitions - 1;
+	if ( n < newest - config->db_partitions - PARTITION_MAX ) {
+		n = newest - config->db_partitions - PARTITION_MAX;
+	}
+	for ( ; n <= newest - config->db_partitions - 1; n++ ) {
+		snprintf(sql, sizeof(sql), "DROP TABLE IF EXISTS requests_%ld", n);
+		if ( !execute(handle, sql) ) {
+			syslog(LOG_WARNING, "db: unable to drop the table of partition %ld, 'gristool prune' will.", n);
+		}
+	}
+
+	parts->newest = newest;
+	parts->count  = 0;
+	if ( !list(handle, db_partition_list_sql(config->db_driver), parts) ) {
+		syslog(LOG_ERR, "db: unable to list the tables of the live partitions.");
+		parts->count = 0;
+		return -1;
+	}
+
+	// tables left over from before are for 'gristool prune'
+	while ( parts->count > 0 && parts->n[parts->count-1] <= newest - config->db_partitions ) {
+		--parts->count;
+	}
+	if ( parts->count == 0 || parts->n[0] != newest ) {
+		syslog(LOG_ERR, "db: the table of partition %ld is missing.", newest);
+		parts->count = 0;
+		return -1;
+	}
+
+	return 1;
+}
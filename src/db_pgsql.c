@@ -0,0 +1,375 @@
+/**
+ * file: db_pgsql.c
+ * grist - postgresql backend with statements prepared once per connection
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#ifdef HAVE_LIBPQ
+
+#include <libpq-fe.h>
+
+// same upsert as the libdbi backend, with parameters bound instead of quoted.
+// %s is the table, requests or that of a partition, see db_partition.c
+static const char *sql_upsert = "INSERT INTO %s AS r (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES($1,$2,$3,$4,0,0,$5) "
+				"ON CONFLICT (address, sender, recipient) DO UPDATE SET seen = r.seen + 1, "
+				"accepted = r.accepted + CASE WHEN excluded.timestamp - r.timestamp >= $6 THEN 1 ELSE 0 END "
+				"RETURNING seen, timestamp";
+static const char *sql_select = "address = $1 AND sender = $2 AND recipient = $3";
+static const char *sql_scan   = "SELECT address, sender, recipient, timestamp FROM %s";
+
+// statements are prepared as grist_upsert_<i> for the i-th live partition,
+// newest first, and as grist_select for looking in all of them at once, see
+// db_partition_select_sql()
+struct t_pgsql {
+	PGconn *conn;
+	struct t_partitions parts;
+};
+
+static int pgsql_backend_execute( void *handle, const char *sql ) {
+	PGconn   *conn = ((struct t_pgsql *)handle)->conn;
+	PGresult *result;
+	int ok;
+
+	result = PQexec(conn, sql);
+	ok = PQresultStatus(result) == PGRES_COMMAND_OK || PQresultStatus(result) == PGRES_TUPLES_OK;
+	if ( !ok ) {
+		syslog(LOG_ERR, "pgsql: %s", PQerrorMessage(conn));
+	}
+	PQclear(result);
+
+	return ok;
+}
+
+static int pgsql_list( void *ptr, const char *sql, struct t_partitions *parts ) {
+	PGconn   *conn = ((struct t_pgsql *)ptr)->conn;
+	PGresult *result;
+	int i;
+
+	result = PQexec(conn, sql);
+	if ( PQresultStatus(result) != PGRES_TUPLES_OK ) {
+		syslog(LOG_ERR, "pgsql: %s", PQerrorMessage(conn));
+		PQclear(result);
+		return 0;
+	}
+	for ( i = 0; i < PQntuples(result); i++ ) {
+		db_partition_found(parts, PQgetvalue(result, i, 0));
+	}
+	PQclear(result);
+
+	return 1;
+}
+
+/**
+ * pgsql_prepare - prepare a statement against the table of a partition
+ */
+static int pgsql_prepare( PGconn *conn, const char *prefix, int i, const char *fmt, long n, int params ) {
+	PGresult *result;
+	char name[32], table[32], sql[512];
+	int ok;
+
+	snprintf(name, sizeof(name), "%s_%d", prefix, i);
+	db_partition_table(n, table, sizeof(table));
+	snprintf(sql, sizeof(sql), fmt, table);
+
+	result = PQprepare(conn, name, sql, params, NULL);
+	ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+	if ( !ok ) {
+		syslog(LOG_WARNING, "pgsql: %s", PQerrorMessage(conn));
+	}
+	PQclear(result);
+
+	return ok;
+}
+
+/**
+ * pgsql_rotate - prepare the statements for the live partitions, again
+ * whenever a new one starts
+ *
+ * Returns 0 if they can't be, the next check tries again.
+ */
+static int pgsql_rotate( struct t_pgsql *handle, struct t_grist_config *config ) {
+	PGresult *result;
+	char *sql;
+	int i, rc;
+
+	rc = db_partition_rotate(&handle->parts, config, handle, pgsql_backend_execute, pgsql_list);
+	if ( rc <= 0 ) { return rc == 0; }
+
+	// fails without the triplet index or on servers older than 9.5
+	pgsql_backend_execute(handle, "DEALLOCATE ALL");
+	for ( i = 0; i < handle->parts.count; i++ ) {
+		if ( !pgsql_prepare(handle->conn, "grist_upsert", i, sql_upsert, handle->parts.n[i], 6) ) {
+			handle->parts.count = 0;
+			return 0;
+		}
+	}
+
+	sql = db_partition_select_sql(&handle->parts, "id, timestamp", sql_select);
+	if ( sql == NULL ) {
+		handle->parts.count = 0;
+		return 0;
+	}
+	result = PQprepare(handle->conn, "grist_select", sql, 3, NULL);
+	free(sql);
+	rc = PQresultStatus(result) == PGRES_COMMAND_OK;
+	if ( !rc ) {
+		syslog(LOG_WARNING, "pgsql: %s", PQerrorMessage(handle->conn));
+		handle->parts.count = 0;
+	}
+	PQclear(result);
+
+	return rc;
+}
+
+static void *pgsql_backend_open( struct t_grist_config *config ) {
+	const char *keywords[] = { "host", "port", "dbname", "user", "password", "options", NULL };
+	const char *values[7];
+	char port[24], options[64];
+	struct t_pgsql *handle;
+
+	snprintf(port, sizeof(port), "%ld", config->db_port);
+
+	// the server gives up on a statement stuck behind a lock within the budget
+	snprintf(options, sizeof(options), "-c statement_timeout=%ld", config->rq_max_latency_ms);
+
+	values[0] = config->db_host;
+	values[1] = port;
+	values[2] = config->db_name;
+	values[3] = config->db_username;
+	values[4] = config->db_password;
+	values[5] = options;
+	values[6] = NULL;
+
+	handle = (struct t_pgsql *)calloc(1, sizeof(struct t_pgsql));
+	if ( handle == NULL ) { return NULL; }
+
+	handle->conn = PQconnectdbParams(keywords, values, 0);
+	if ( PQstatus(handle->conn) != CONNECTION_OK ) {
+		syslog(LOG_ERR, "pgsql: unable to connect: %s", PQerrorMessage(handle->conn));
+		PQfinish(handle->conn);
+		free(handle);
+		return NULL;
+	}
+
+	if ( !pgsql_rotate(handle, config) ) {
+		syslog(LOG_WARNING, "pgsql: falling back to libdbi. has 'grist migrate-schema' been run?");
+		PQfinish(handle->conn);
+		free(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+static void pgsql_backend_close( void *handle ) {
+	PQfinish(((struct t_pgsql *)handle)->conn);
+	free(handle);
+}
+
+static char *pgsql_backend_quote( void *handle, const char *str ) {
+	char *literal, *quoted;
+
+	literal = PQescapeLiteral(((struct t_pgsql *)handle)->conn, str, strlen(str));
+	if ( literal == NULL ) { return NULL; }
+
+	// libpq's own allocator, the caller frees with free()
+	quoted = strdup(literal);
+	PQfreemem(literal);
+
+	return quoted;
+}
+
+/**
+ * pgsql_backend_query - hand the triplets a statement returns to each()
+ *
+ * Rows come over one at a time rather than the whole result at once.
+ * Returns how many there were, or -1 on error.
+ */
+static long pgsql_backend_query( void *ptr, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	PGconn   *conn = ((struct t_pgsql *)ptr)->conn;
+	PGresult *result;
+	struct t_request triplet;
+	long n = 0;
+
+	if ( !PQsendQuery(conn, sql) || !PQsetSingleRowMode(conn) ) {
+		syslog(LOG_ERR, "pgsql: %s", PQerrorMessage(conn));
+		return -1;
+	}
+
+	memset(&triplet, 0, sizeof(triplet));
+	while ( (result = PQgetResult(conn)) != NULL ) {
+		if ( PQresultStatus(result) == PGRES_SINGLE_TUPLE ) {
+			triplet.client_key     = PQgetvalue(result, 0, 0);
+			triplet.client_key_len = PQgetlength(result, 0, 0);
+			triplet.sender         = PQgetvalue(result, 0, 1);
+			triplet.sender_len     = PQgetlength(result, 0, 1);
+			triplet.recipient      = PQgetvalue(result, 0, 2);
+			triplet.recipient_len  = PQgetlength(result, 0, 2);
+			triplet.timestamp      = (time_t)strtol(PQgetvalue(result, 0, 3), NULL, 10);
+			each(&triplet, arg);
+			if ( n >= 0 ) { ++n; }
+		} else if ( PQresultStatus(result) != PGRES_TUPLES_OK && PQresultStatus(result) != PGRES_COMMAND_OK ) {
+			syslog(LOG_ERR, "pgsql: error reading request records: %s", PQerrorMessage(conn));
+			n = -1;
+		}
+		PQclear(result);
+	}
+
+	return n;
+}
+
+/**
+ * pgsql_backend_scan - hand every stored triplet to each(), with the
+ * time it was first seen
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long pgsql_backend_scan( void *ptr, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_pgsql *handle = (struct t_pgsql *)ptr;
+	char table[32], sql[128];
+	long n = 0, rows;
+	int  i;
+
+	for ( i = 0; i < handle->parts.count; i++ ) {
+		db_partition_table(handle->parts.n[i], table, sizeof(table));
+		snprintf(sql, sizeof(sql), sql_scan, table);
+
+		if ( (rows = pgsql_backend_query(handle, sql, each, arg)) < 0 ) { return -1; }
+		n += rows;
+	}
+
+	return n;
+}
+
+/**
+ * pgsql_find - look a triplet up in the live partitions
+ *
+ * Returns 1 and the newest it was found in, 0 if it isn't stored, -1 on error.
+ */
+static int pgsql_find( struct t_pgsql *handle, const char **params, int *at, long *r_id, long *r_timestamp ) {
+	PGresult *result;
+	int found;
+
+	result = PQexecPrepared(handle->conn, "grist_select", 3, params, NULL, NULL, 0);
+	if ( PQresultStatus(result) != PGRES_TUPLES_OK ) {
+		syslog(LOG_ERR, "pgsql: error looking up request record: %s", PQerrorMessage(handle->conn));
+		PQclear(result);
+		return -1;
+	}
+
+	found = PQntuples(result) == 1;
+	if ( found ) {
+		*at          = atoi(PQgetvalue(result, 0, 0));
+		*r_id        = atol(PQgetvalue(result, 0, 1));
+		*r_timestamp = atol(PQgetvalue(result, 0, 2));
+	}
+	PQclear(result);
+
+	return found;
+}
+
+/**
+ * pgsql_select_stored - look a triplet up before anything is written
+ *
+ * Returns the decision, or TRIPLET_UNKNOWN / TRIPLET_STORED, see
+ * db_stored_action(). at is set to the partition it was found in.
+ */
+static int pgsql_select_stored( struct t_pgsql *handle, const char **params, struct t_request *request, struct t_grist_config *config, int *at ) {
+	long r_id, r_timestamp;
+	int  rc;
+
+	rc = pgsql_find(handle, params, at, &r_id, &r_timestamp);
+	if ( rc == 0 ) { return TRIPLET_UNKNOWN; }
+	if ( rc < 0 ) { return CHECK_ERR; }
+
+	return db_stored_action(DB_PARTITION_KEY(handle->parts.n[*at], r_id), r_timestamp, request, config);
+}
+
+static int pgsql_backend_check( void *ptr, struct t_request *request, struct t_grist_config *config ) {
+	struct t_pgsql *handle = (struct t_pgsql *)ptr;
+	PGresult *result;
+	const char *params[6];
+	const char *lookup[3] = { request->client_key, request->sender, request->recipient };
+	char timestamp[24], cooldown[24], name[32];
+	long r_seen, r_timestamp;
+	int  action, at = 0;
+
+	if ( !pgsql_rotate(handle, config) ) { return CHECK_ERR; }
+
+	// counts written behind and new triplets inserted in groups need to know
+	// whether the triplet is stored first
+	if ( db_lookup_first() ) {
+		// a triplet the filter has never seen is inserted without looking
+		action = TRIPLET_UNKNOWN;
+		if ( db_bloom_check(request) ) {
+			action = pgsql_select_stored(handle, lookup, request, config, &at);
+			if ( action == TRIPLET_UNKNOWN ) { db_bloom_missed(); }
+		}
+		if ( action == TRIPLET_UNKNOWN ) { action = db_group_insert(request, config); }
+		if ( action >= 0 ) { return action; }
+	} else if ( handle->parts.count > 1 && db_bloom_check(request) ) {
+		// the upsert would store a triplet of an older partition again
+		action = pgsql_find(handle, lookup, &at, &r_seen, &r_timestamp);
+		if ( action < 0 ) { return CHECK_ERR; }
+		if ( action == 0 ) { db_bloom_missed(); }
+	}
+
+	snprintf(timestamp, sizeof(timestamp), "%ld", (long)request->timestamp);
+	snprintf(cooldown, sizeof(cooldown), "%ld", config->rq_cooldown);
+
+	// the views are terminated in place so they go over as they are
+	params[0] = request->client_key;
+	params[1] = request->client_name;
+	params[2] = request->sender;
+	params[3] = request->recipient;
+	params[4] = timestamp;
+	params[5] = cooldown;
+
+	// new triplets go in the newest partition
+	snprintf(name, sizeof(name), "grist_upsert_%d", at);
+
+	result = PQexecPrepared(handle->conn, name, 6, params, NULL, NULL, 0);
+	if ( PQresultStatus(result) != PGRES_TUPLES_OK || PQntuples(result) != 1 ) {
+		syslog(LOG_ERR, "pgsql: error updating request record: %s", PQerrorMessage(handle->conn));
+		PQclear(result);
+		return CHECK_ERR;
+	}
+
+	r_seen      = atol(PQgetvalue(result, 0, 0));
+	r_timestamp = atol(PQgetvalue(result, 0, 1));
+	PQclear(result);
+
+	return db_triplet_action(r_seen, r_timestamp, request, config);
+}
+
+const struct t_db_backend db_backend_pgsql = {
+	"pgsql",
+	pgsql_backend_open,
+	pgsql_backend_close,
+	pgsql_backend_check,
+	pgsql_backend_execute,
+	pgsql_backend_quote,
+	pgsql_backend_scan,
+	pgsql_backend_query,
+	NULL
+};
+
+#endif /* HAVE_LIBPQ */
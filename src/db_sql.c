@@ -24,12 +24,38 @@
 
 #include "grist.h"
 
-// SQL query string templates
-char *sql_insert_req = "INSERT INTO requests (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES(%s,%s,%s,%s,'0','0','%d')";
-char *sql_update_req = "UPDATE requests SET seen='%d', accepted='%d' WHERE id='%d'"; 
-char *sql_select_req = "SELECT id, seen, accepted, timestamp FROM requests WHERE address=%s AND sender=%s AND recipient=%s";
+// SQL query string templates, the first %s is the table: requests, or that of
+// a partition, see db_partition.c
+char *sql_insert_req = "INSERT INTO %s (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES(%s,%s,%s,%s,'0','0','%d')";
+char *sql_update_req = "UPDATE %s SET seen='%d', accepted='%d' WHERE id='%d'"; 
+char *sql_select_req = "SELECT id, seen, accepted, timestamp FROM %s WHERE address=%s AND sender=%s AND recipient=%s";
 
-#define MAX_QUERY_ATTEMPTS	10
+// the same through all the live partitions at once, see db_partition_select_sql()
+char *sql_select_columns = "id, seen, accepted, timestamp";
+char *sql_select_where   = "address=%s AND sender=%s AND recipient=%s";
+
+// insert or bump a triplet in one statement, both need the triplet index.
+// the mysql variant hands the original timestamp back as the insert id.
+char *sql_upsert_req   = "INSERT INTO %s AS r (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES(%s,%s,%s,%s,0,0,%ld) "
+			 "ON CONFLICT (address, sender, recipient) DO UPDATE SET seen = r.seen + 1, "
+			 "accepted = r.accepted + CASE WHEN excluded.timestamp - r.timestamp >= %ld THEN 1 ELSE 0 END "
+			 "RETURNING seen, timestamp";
+char *sql_upsert_mysql = "INSERT INTO %s (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES(%s,%s,%s,%s,0,0,%ld) "
+			 "ON DUPLICATE KEY UPDATE accepted = accepted + IF(VALUES(timestamp) - timestamp >= %ld, 1, 0), "
+			 "seen = seen + 1, timestamp = LAST_INSERT_ID(timestamp)";
+
+// the upsert is only used once the triplet index and a recent enough server
+// are known to be there, the queries return a row if it can be used. %s is
+// the table of the newest partition.
+char *sql_upsert_probe_sqlite3 = "SELECT sqlite_version() AS version FROM sqlite_master WHERE type = 'index' AND name = '%s_triplet'";
+char *sql_upsert_probe_mysql   = "SELECT 1 FROM information_schema.statistics WHERE table_schema = DATABASE() AND table_name = '%s' AND index_name = 'requests_triplet'";
+char *sql_upsert_probe_pgsql   = "SELECT 1 FROM pg_indexes WHERE tablename = '%s' AND indexname = '%s_triplet' AND current_setting('server_version_num')::integer >= 90500";
+
+#define UPSERT_UNKNOWN		0
+#define UPSERT_WORKS		1
+#define UPSERT_UNAVAILABLE	2
+
+static int upsert_state = UPSERT_UNKNOWN;
 
 /*
  * +---------------+----------------------+
@@ -47,9 +73,66 @@ char *sql_select_req = "SELECT id, seen, accepted, timestamp FROM requests WHERE
  */
 
 char *sql_create_sqlite = "CREATE TABLE requests ( id INTEGER PRIMARY KEY, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)";
-char *sql_create_mysql  = "CREATE TABLE requests ( id INTEGER PRIMARY KEY AUTO_INCREMENT, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)";
+char *sql_create_mysql  = "CREATE TABLE requests ( id INTEGER PRIMARY KEY AUTO_INCREMENT, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER, "
+			  "triplet BINARY(16) AS (" SQL_TRIPLET_MYSQL ") VIRTUAL)";
 char *sql_create_pgsql  = "CREATE TABLE requests ( id SERIAL, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)";
 
+// set before the table exists, gristool prune then hands the pages it frees
+// back a few at a time instead of holding the file for a full VACUUM
+char *sql_vacuum_sqlite = "PRAGMA auto_vacuum = INCREMENTAL";
+
+// every lookup is by triplet, the unique index also keeps concurrent inserts
+// of the same triplet from creating duplicate rows. mysql can only index a
+// prefix of a TEXT column, two triplets sharing the prefixes would be taken
+// for one, so it indexes the generated triplet column, a hash of all three.
+char *sql_index_sqlite = "CREATE UNIQUE INDEX requests_triplet ON requests (address, sender, recipient)";
+char *sql_index_mysql  = "CREATE UNIQUE INDEX requests_triplet ON requests (triplet)";
+char *sql_index_pgsql  = "CREATE UNIQUE INDEX requests_triplet ON requests (address, sender, recipient)";
+
+// stale triplets are expired by the time they were first seen, a slice at a
+// time, see db_expire.c
+char *sql_index_timestamp = "CREATE INDEX requests_timestamp ON requests (timestamp)";
+
+// migration of databases created without the index, duplicates left behind
+// by racing inserts are removed first keeping the oldest row of each triplet.
+// they go a range of ids at a time, looked up through a plain index on the
+// triplet that is dropped again once they are gone.
+char *sql_dedup_index_sqlite = "CREATE INDEX IF NOT EXISTS requests_dedup ON requests (address, sender, recipient)";
+char *sql_dedup_index_mysql  = "ALTER TABLE requests ADD INDEX requests_dedup (address(64), sender(255), recipient(255)), ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_dedup_index_pgsql  = "CREATE INDEX CONCURRENTLY IF NOT EXISTS requests_dedup ON requests (address, sender, recipient)";
+char *sql_dedup_drop_sqlite  = "DROP INDEX IF EXISTS requests_dedup";
+char *sql_dedup_drop_mysql   = "ALTER TABLE requests DROP INDEX requests_dedup, ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_dedup_drop_pgsql   = "DROP INDEX CONCURRENTLY IF EXISTS requests_dedup";
+char *sql_dedup_range        = "SELECT MIN(id) AS first, MAX(id) AS last FROM requests";
+char *sql_dedup_batch        = "DELETE FROM requests WHERE id >= %ld AND id < %ld AND EXISTS (SELECT 1 FROM requests o WHERE o.address = requests.address "
+			       "AND o.sender = requests.sender AND o.recipient = requests.recipient AND o.id < requests.id)";
+char *sql_dedup_batch_mysql  = "DELETE r FROM requests r JOIN requests o ON o.address = r.address AND o.sender = r.sender AND o.recipient = r.recipient "
+			       "AND o.id < r.id WHERE r.id >= %ld AND r.id < %ld";
+
+// the generated column is virtual, adding it and indexing it leave the table
+// as it is. a prefix index made by an older release is dropped first.
+char *sql_migrate_mysql_prefix = "SELECT 1 FROM information_schema.statistics WHERE table_schema = DATABASE() AND table_name = 'requests' "
+				 "AND index_name = 'requests_triplet' AND column_name = 'address'";
+char *sql_migrate_mysql_drop   = "ALTER TABLE requests DROP INDEX requests_triplet, ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_migrate_mysql_column = "ALTER TABLE requests ADD COLUMN triplet BINARY(16) AS (" SQL_TRIPLET_MYSQL ") VIRTUAL, ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_migrate_mysql  = "ALTER TABLE requests ADD UNIQUE INDEX requests_triplet (triplet), ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_migrate_pgsql  = "CREATE UNIQUE INDEX CONCURRENTLY requests_triplet ON requests (address, sender, recipient)";
+char *sql_migrate_pgsql_invalid = "SELECT 1 FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid WHERE c.relname = 'requests_triplet' AND NOT i.indisvalid";
+char *sql_migrate_pgsql_cleanup = "DROP INDEX CONCURRENTLY requests_triplet";
+char *sql_timestamp_sqlite = "CREATE INDEX IF NOT EXISTS requests_timestamp ON requests (timestamp)";
+char *sql_timestamp_mysql  = "ALTER TABLE requests ADD INDEX requests_timestamp (timestamp), ALGORITHM=INPLACE, LOCK=NONE";
+char *sql_timestamp_pgsql  = "CREATE INDEX CONCURRENTLY IF NOT EXISTS requests_timestamp ON requests (timestamp)";
+char *sql_timestamp_pgsql_invalid = "SELECT 1 FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid WHERE c.relname = 'requests_timestamp' AND NOT i.indisvalid";
+char *sql_timestamp_pgsql_cleanup = "DROP INDEX CONCURRENTLY requests_timestamp";
+
+// with db_partition_hours set, migration renames the requests table to that
+// of the current partition, %ld. its indexes go along under the names the
+// partition's have, sqlite can't rename them and builds them again.
+char *sql_partition_rename = "ALTER TABLE requests RENAME TO requests_%ld";
+char *sql_partition_indexes_sqlite[] = { "DROP INDEX IF EXISTS requests_triplet", "DROP INDEX IF EXISTS requests_timestamp", NULL };
+char *sql_partition_indexes_pgsql[]  = { "ALTER INDEX IF EXISTS requests_triplet RENAME TO requests_%ld_triplet",
+					 "ALTER INDEX IF EXISTS requests_timestamp RENAME TO requests_%ld_timestamp", NULL };
+
 void dbi_error_handler( dbi_conn *conn, void *u_arg ) {
 	_ASSERT( conn != NULL );	
 	
@@ -60,24 +143,36 @@ void dbi_error_handler( dbi_conn *conn, void *u_arg ) {
 	syslog(LOG_DEBUG|LOG_ERR, "dbi: code=%d msg=%s", errno, errmsg);
 }
 
-dbi_conn* db_open_database( struct t_grist_config config ) {
-	dbi_conn   conn;
-	dbi_result result;
-	dbi_driver driver;
+// set once db_initialize() has run, grist only loads libdbi for the
+// databases it may connect to through it
+static int dbi_loaded = 0;
 
+/**
+ * db_initialize - load the libdbi drivers
+ *
+ * Must be called once before the first connection is opened, and before any 
+ * worker threads are started since libdbi keeps its driver list in globals.
+ */
+int db_initialize( void ) {
 	int numdrivers;
 
-	// initialize libdbi
+	dbi_loaded = 1;
 	numdrivers = dbi_initialize(NULL);
 	if ( numdrivers < 0 ) {
 		syslog(LOG_DEBUG|LOG_ERR, "dbi: libdbi initialization failed.");
-		return NULL;
+		return 0;
 	} 
 	else if ( numdrivers == 0 ) {
 		syslog(LOG_DEBUG|LOG_ERR, "dbi: no database drivers found.");
-		return NULL;
+		return 0;
 	}
 
+	return 1;
+}
+
+dbi_conn* db_open_database( struct t_grist_config config ) {
+	dbi_conn   conn;
+
 	// get a database handle 
 	if ( ( conn = dbi_conn_new(config.db_driver) ) == NULL ) {
 		syslog(LOG_DEBUG|LOG_ERR, "dbi: unable to load '%s' driver.", config.db_driver);
@@ -92,8 +187,13 @@ dbi_conn* db_open_database( struct t_grist_config config ) {
 	dbi_conn_error_handler(conn, (void *)dbi_error_handler, NULL);
 
 	dbi_conn_set_option(conn, "dbname", config.db_name);
+	// the driver waits for locks held by other processes, within the budget
 	if ( strcmp(config.db_driver,"sqlite")==0 ) {
 		dbi_conn_set_option(conn, "sqlite_dbdir", config.db_path);
+		dbi_conn_set_option_numeric(conn, "sqlite_timeout", config.rq_max_latency_ms);
+	} else if ( strcmp(config.db_driver,"sqlite3")==0 ) {
+		dbi_conn_set_option(conn, "sqlite3_dbdir", config.db_path);
+		dbi_conn_set_option_numeric(conn, "sqlite3_timeout", config.rq_max_latency_ms);
 	} else if ( (strcmp(config.db_driver,"mysql")==0) || (strcmp(config.db_driver,"pgsql")==0) ) {
 		dbi_conn_set_option(conn, "host", config.db_host);
 		dbi_conn_set_option_numeric(conn, "port", config.db_port);
@@ -107,6 +207,7 @@ dbi_conn* db_open_database( struct t_grist_config config ) {
 	}
 
 	if ( dbi_conn_connect(conn) != 0) {
+		dbi_conn_close(conn);
 		return NULL;
 	}
 
@@ -117,16 +218,38 @@ int db_close_database( dbi_conn *conn ) {
 	_ASSERT( conn != NULL );
 
 	dbi_conn_close(conn);
-	dbi_shutdown();
 
 	return 1;
 }
 	
 
-int db_create_structure( dbi_conn *conn ) {
+/**
+ * db_create_partition - create the tables of period n, see db_partition.c
+ */
+static int db_create_partition( dbi_conn *conn, const char *driver_name, long n ) {
+	const char *errmsg;
+	dbi_result result;
+	char sql[512];
+	int i;
+
+	for ( i = 0; db_partition_sql(driver_name, n, i, sql, sizeof(sql)); i++ ) {
+		result = dbi_conn_query( conn, sql );
+		if ( result == NULL ) {
+			dbi_conn_error(conn, &errmsg);
+			fprintf(stderr, "fatal: unable to create the table of partition %ld: %s\n", n, errmsg ? errmsg : "unknown error");
+			return 0;
+		}
+		dbi_result_free(result);
+	}
+
+	return 1;
+}
+
+int db_create_structure( dbi_conn *conn, struct t_grist_config *config ) {
 	_ASSERT( conn != NULL );
 
 	const char *sql_create_str;
+	const char *sql_index_str;
 	const char *driver_name;
 	dbi_driver cur_driver;
 	dbi_result result;
@@ -135,22 +258,311 @@ int db_create_structure( dbi_conn *conn ) {
 	cur_driver  = dbi_conn_get_driver( conn );
 	driver_name = dbi_driver_get_name( cur_driver );
 
-	if ( strcmp(driver_name,"sqlite") == 0 ) {
+	if ( strcmp(driver_name,"sqlite") == 0 || strcmp(driver_name,"sqlite3") == 0 ) {
 		sql_create_str = sql_create_sqlite;
+		sql_index_str  = sql_index_sqlite;
+
+		result = dbi_conn_query( conn, sql_vacuum_sqlite );
+		if ( result != NULL ) { dbi_result_free(result); }
 	} else if( strcmp(driver_name,"mysql") == 0 ) {
 		sql_create_str = sql_create_mysql;
+		sql_index_str  = sql_index_mysql;
 	} else if( strcmp(driver_name,"pgsql") == 0 ) {
 		sql_create_str = sql_create_pgsql;
+		sql_index_str  = sql_index_pgsql;
 	} else {
 		fprintf(stderr, "error: cannot create database, operation not implemented for driver: %s\n", driver_name);
 		return -1;
 	}
+
+	// grist creates the tables of the partitions that follow as they start
+	if ( config->db_partition_hours > 0 ) {
+		return db_create_partition(conn, driver_name, db_partition_current(config)) ? 0 : 1;
+	}
 	
 	result = dbi_conn_query( conn, sql_create_str );
 	if ( result == NULL ) {
 		fprintf(stderr, "fatal: unable to create structure, have you already initialized the database?\n");
 		return 1;
 	}
+	dbi_result_free(result);
+
+	result = dbi_conn_query( conn, sql_index_str );
+	if ( result == NULL ) {
+		fprintf(stderr, "fatal: unable to create the triplet index.\n");
+		return 1;
+	}
+	dbi_result_free(result);
+
+	result = dbi_conn_query( conn, sql_index_timestamp );
+	if ( result == NULL ) {
+		fprintf(stderr, "fatal: unable to create the timestamp index.\n");
+		return 1;
+	}
+	dbi_result_free(result);
+
+	return 0;
+}
+
+/**
+ * db_migrate_timestamp - add the timestamp index expiry goes by
+ *
+ * Not fatal, without it each slice rq_pending_ttl and rq_accepted_ttl
+ * remove scans the table.
+ */
+static void db_migrate_timestamp( dbi_conn *conn, const char *driver_name ) {
+	const char *sql_index_str;
+	const char *errmsg;
+	dbi_result result;
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		sql_index_str = sql_timestamp_mysql;
+	} else if( strcmp(driver_name,"pgsql") == 0 ) {
+		sql_index_str = sql_timestamp_pgsql;
+
+		// IF NOT EXISTS would keep an invalid index left by a failed build
+		result = dbi_conn_query( conn, sql_timestamp_pgsql_invalid );
+		if ( result != NULL && dbi_result_get_numrows(result) > 0 ) {
+			dbi_result_free(result);
+			result = dbi_conn_query( conn, sql_timestamp_pgsql_cleanup );
+		}
+		if ( result != NULL ) { dbi_result_free(result); }
+	} else {
+		sql_index_str = sql_timestamp_sqlite;
+	}
+
+	result = dbi_conn_query( conn, sql_index_str );
+	if ( result == NULL ) {
+		dbi_conn_error(conn, &errmsg);
+		fprintf(stderr, "warning: unable to create the timestamp index: %s\n", errmsg ? errmsg : "unknown error");
+		return;
+	}
+	dbi_result_free(result);
+
+	printf("timestamp index in place.\n");
+}
+
+/**
+ * db_migrate_run - run a statement of the migration, 0 if it failed
+ */
+static int db_migrate_run( dbi_conn *conn, const char *sql ) {
+	dbi_result result;
+
+	result = dbi_conn_query( conn, sql );
+	if ( result == NULL ) { return 0; }
+	dbi_result_free(result);
+
+	return 1;
+}
+
+/**
+ * db_migrate_dedup - remove the rows of triplets stored more than once,
+ * keeping the oldest
+ *
+ * A batch of SQL_DEDUP_BATCH ids at a time, so grist is only ever held up
+ * by one short statement. Returns 0 if it failed.
+ */
+static int db_migrate_dedup( dbi_conn *conn, const char *driver_name ) {
+	const char *sql_batch, *sql_drop, *errmsg;
+	unsigned long long removed = 0;
+	dbi_result result;
+	long first, last, id;
+	char sql[512];
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		db_migrate_run(conn, sql_dedup_index_mysql);
+		sql_batch = sql_dedup_batch_mysql;
+		sql_drop  = sql_dedup_drop_mysql;
+	} else if ( strcmp(driver_name,"pgsql") == 0 ) {
+		db_migrate_run(conn, sql_dedup_index_pgsql);
+		sql_batch = sql_dedup_batch;
+		sql_drop  = sql_dedup_drop_pgsql;
+	} else {
+		db_migrate_run(conn, sql_dedup_index_sqlite);
+		sql_batch = sql_dedup_batch;
+		sql_drop  = sql_dedup_drop_sqlite;
+	}
+
+	result = dbi_conn_query( conn, sql_dedup_range );
+	if ( result == NULL || !dbi_result_next_row(result) ) {
+		dbi_conn_error(conn, &errmsg);
+		fprintf(stderr, "fatal: unable to remove duplicate triplets: %s\n", errmsg ? errmsg : "unknown error");
+		if ( result != NULL ) { dbi_result_free(result); }
+		return 0;
+	}
+	first = dbi_result_get_long(result, "first");
+	last  = dbi_result_get_long(result, "last");
+	dbi_result_free(result);
+
+	// an empty table has neither
+	for ( id = first; last > 0 && id <= last; id += SQL_DEDUP_BATCH ) {
+		snprintf(sql, sizeof(sql), sql_batch, id, id + SQL_DEDUP_BATCH);
+		result = dbi_conn_query( conn, sql );
+		if ( result == NULL ) {
+			dbi_conn_error(conn, &errmsg);
+			fprintf(stderr, "fatal: unable to remove duplicate triplets from id %ld on: %s\n", id, errmsg ? errmsg : "unknown error");
+			fprintf(stderr, "%llu removed so far, run migrate-schema again to carry on.\n", removed);
+			return 0;
+		}
+		removed += dbi_result_get_numrows_affected(result);
+		dbi_result_free(result);
+	}
+
+	db_migrate_run(conn, sql_drop);
+
+	printf("removed %llu duplicate triplet(s).\n", removed);
+
+	return 1;
+}
+
+/**
+ * db_migrate_mysql_triplet - key mysql's requests table on the hash of the
+ * triplet
+ *
+ * Returns the result of adding the unique index, NULL if that failed.
+ */
+static dbi_result db_migrate_mysql_triplet( dbi_conn *conn ) {
+	dbi_result result;
+	int prefix;
+
+	result = dbi_conn_query( conn, sql_migrate_mysql_prefix );
+	prefix = result != NULL && dbi_result_get_numrows(result) > 0;
+	if ( result != NULL ) { dbi_result_free(result); }
+
+	if ( prefix && db_migrate_run(conn, sql_migrate_mysql_drop) ) {
+		printf("prefix triplet index dropped.\n");
+	}
+
+	// fails once the column is there
+	db_migrate_run(conn, sql_migrate_mysql_column);
+
+	return dbi_conn_query( conn, sql_migrate_mysql );
+}
+
+/**
+ * db_migrate_partition - move the triplets of the requests table into the
+ * table of the current partition, with db_partition_hours set
+ *
+ * Renamed rather than copied, they stay live for db_partitions periods from
+ * now. Best run with grist stopped, the indexes may have to be built.
+ */
+static int db_migrate_partition( dbi_conn *conn, const char *driver_name, struct t_grist_config *config ) {
+	const char *errmsg;
+	char **sql_indexes = NULL;
+	char sql[128];
+	dbi_result result;
+	long n;
+	int  i;
+
+	n = db_partition_current(config);
+
+	// nothing to move into a database set up with partitions
+	result = dbi_conn_query( conn, "SELECT 1 FROM requests WHERE 1 = 0" );
+	if ( result == NULL ) {
+		return db_create_partition(conn, driver_name, n) ? 0 : 1;
+	}
+	dbi_result_free(result);
+
+	if ( !db_migrate_dedup(conn, driver_name) ) { return 1; }
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		// the table of a partition is only created with its keys if it isn't
+		// there, these fail for those the table has already
+		result = dbi_conn_query( conn, sql_timestamp_mysql );
+		if ( result != NULL ) { dbi_result_free(result); }
+		db_migrate_mysql_triplet(conn);
+	} else if ( strcmp(driver_name,"pgsql") == 0 ) {
+		sql_indexes = sql_partition_indexes_pgsql;
+	} else {
+		sql_indexes = sql_partition_indexes_sqlite;
+	}
+
+	snprintf(sql, sizeof(sql), sql_partition_rename, n);
+	result = dbi_conn_query( conn, sql );
+	if ( result == NULL ) {
+		dbi_conn_error(conn, &errmsg);
+		fprintf(stderr, "fatal: unable to move the triplets into partition %ld: %s\n", n, errmsg ? errmsg : "unknown error");
+		return 1;
+	}
+	dbi_result_free(result);
+
+	for ( i = 0; sql_indexes != NULL && sql_indexes[i] != NULL; i++ ) {
+		snprintf(sql, sizeof(sql), sql_indexes[i], n, n);
+		result = dbi_conn_query( conn, sql );
+		if ( result != NULL ) { dbi_result_free(result); }
+	}
+
+	if ( !db_create_partition(conn, driver_name, n) ) { return 1; }
+
+	printf("triplets moved into partition %ld.\n", n);
+
+	return 0;
+}
+
+/**
+ * db_migrate_structure - add the triplet and timestamp indexes to an
+ * existing database
+ *
+ * Meant to be run against a live database. pgsql builds the index without
+ * blocking writes and mysql adds it in place, sqlite holds its write lock
+ * for as long as the index build takes.
+ */
+int db_migrate_structure( dbi_conn *conn, struct t_grist_config *config ) {
+	_ASSERT( conn != NULL );
+
+	const char *sql_index_str;
+	const char *driver_name;
+	const char *errmsg;
+	dbi_driver cur_driver;
+	dbi_result result;
+
+	cur_driver  = dbi_conn_get_driver( conn );
+	driver_name = dbi_driver_get_name( cur_driver );
+
+	if ( strcmp(driver_name,"sqlite") == 0 || strcmp(driver_name,"sqlite3") == 0 ) {
+		sql_index_str = sql_index_sqlite;
+	} else if( strcmp(driver_name,"mysql") == 0 ) {
+		sql_index_str = sql_migrate_mysql;
+	} else if( strcmp(driver_name,"pgsql") == 0 ) {
+		sql_index_str = sql_migrate_pgsql;
+	} else {
+		fprintf(stderr, "error: cannot migrate database, operation not implemented for driver: %s\n", driver_name);
+		return -1;
+	}
+
+	if ( config->db_partition_hours > 0 ) {
+		return db_migrate_partition(conn, driver_name, config);
+	}
+
+	// first, a database that already has the triplet index stops below
+	db_migrate_timestamp(conn, driver_name);
+
+	if ( !db_migrate_dedup(conn, driver_name) ) { return 1; }
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		result = db_migrate_mysql_triplet(conn);
+	} else {
+		result = dbi_conn_query( conn, sql_index_str );
+	}
+	if ( result == NULL ) {
+		dbi_conn_error(conn, &errmsg);
+		fprintf(stderr, "fatal: unable to create the triplet index: %s\n", errmsg ? errmsg : "unknown error");
+		fprintf(stderr, "if the index already exists there is nothing left to do, otherwise run migrate-schema again.\n");
+
+		// a failed concurrent build leaves an invalid index behind
+		if ( strcmp(driver_name,"pgsql") == 0 ) {
+			result = dbi_conn_query( conn, sql_migrate_pgsql_invalid );
+			if ( result != NULL && dbi_result_get_numrows(result) > 0 ) {
+				dbi_result_free(result);
+				result = dbi_conn_query( conn, sql_migrate_pgsql_cleanup );
+			}
+			if ( result != NULL ) { dbi_result_free(result); }
+		}
+		return 1;
+	}
+	dbi_result_free(result);
+
+	printf("triplet index created.\n");
 
 	return 0;
 }
@@ -182,45 +594,292 @@ char *db_build_query_string( char *fmtstr, ... ) {
 	}
 }
 
-int db_check_request(dbi_conn *conn, struct t_request request, struct t_grist_config config) {
+/**
+ * db_query_retry - run a query, retrying while the database is busy
+ *
+ * Gives up once the request's rq_max_latency_ms is spent.
+ */
+static dbi_result db_query_retry( dbi_conn *conn, const char *query_str, struct t_request *request, struct t_grist_config *config ) {
+	dbi_result result;
+	int dbi_attempts = 0;
+
+	// the driver already waits out sqlite locks, see db_open_database()
+	do {
+		_DBG("dbi: attempting query #%d", dbi_attempts);
+		result = dbi_conn_query(conn, query_str);
+		if ( result != NULL ) { return result; }
+	} while ( db_backoff(request, config, dbi_attempts++) );
+
+	return NULL;
+}
+
+/**
+ * db_upsert_probe - find out whether the single statement upsert can be used
+ */
+static int db_upsert_probe( dbi_conn *conn, const char *driver_name, const char *table, struct t_request *request, struct t_grist_config *config ) {
+	dbi_result result;
+	const char *version;
+	char *query_str;
+	int state, major = 0, minor = 0;
+
+	if ( strcmp(driver_name,"sqlite3") == 0 ) {
+		query_str = db_build_query_string(sql_upsert_probe_sqlite3, table);
+	} else if ( strcmp(driver_name,"mysql") == 0 ) {
+		query_str = db_build_query_string(sql_upsert_probe_mysql, table);
+	} else if ( strcmp(driver_name,"pgsql") == 0 ) {
+		query_str = db_build_query_string(sql_upsert_probe_pgsql, table, table);
+	} else {
+		// sqlite 2 has no upsert
+		return UPSERT_UNAVAILABLE;
+	}
+	if ( query_str == NULL ) { return UPSERT_UNKNOWN; }
+
+	result = db_query_retry(conn, query_str, request, config);
+	_FREE(query_str);
+
+	// try again with the next request
+	if ( result == NULL ) { return UPSERT_UNKNOWN; }
+
+	state = UPSERT_UNAVAILABLE;
+	if ( dbi_result_next_row(result) ) {
+		state = UPSERT_WORKS;
+
+		// RETURNING arrived in sqlite 3.35
+		if ( strcmp(driver_name,"sqlite3") == 0 ) {
+			version = dbi_result_get_string(result, "version");
+			if ( version == NULL || sscanf(version, "%d.%d", &major, &minor) != 2
+			     || major < 3 || (major == 3 && minor < 35) ) {
+				state = UPSERT_UNAVAILABLE;
+			}
+		}
+	}
+	dbi_result_free(result);
+
+	if ( state == UPSERT_UNAVAILABLE ) {
+		syslog(LOG_WARNING, "dbi: single statement update unavailable, has 'grist migrate-schema' been run?");
+	}
+
+	return state;
+}
+
+/**
+ * db_upsert_request - insert a new triplet or bump its counts in one statement
+ *
+ * Returns the CHECK_* result, or -1 if the database can't do it and the
+ * triplet has to be looked up the old way.
+ */
+static int db_upsert_request( dbi_conn *conn, const char *driver_name, const char *table, char *q_client_address, char *q_client_name, char *q_sender, char *q_recipient, struct t_request *request, struct t_grist_config *config ) {
+	dbi_result result;
+	long r_seen, r_timestamp;
+	int  state;
+	char *query_str;
+
+	// decided once per process, workers racing here all reach the same answer
+	state = __atomic_load_n(&upsert_state, __ATOMIC_RELAXED);
+	if ( state == UPSERT_UNKNOWN ) {
+		state = db_upsert_probe(conn, driver_name, table, request, config);
+		__atomic_store_n(&upsert_state, state, __ATOMIC_RELAXED);
+	}
+	if ( state != UPSERT_WORKS ) { return -1; }
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		query_str = db_build_query_string(sql_upsert_mysql, table, q_client_address, q_client_name, q_sender, q_recipient, (long)request->timestamp, config->rq_cooldown);
+	} else {
+		query_str = db_build_query_string(sql_upsert_req, table, q_client_address, q_client_name, q_sender, q_recipient, (long)request->timestamp, config->rq_cooldown);
+	}
+	if ( query_str == NULL ) { return CHECK_ERR; }
+	_DBG("dbi: %s", query_str);
+
+	result = db_query_retry(conn, query_str, request, config);
+	_FREE(query_str);
+
+	if ( result == NULL ) {
+		syslog(LOG_DEBUG,"dbi: error updating request record.");
+		syslog(LOG_ERR,"dbi: error updating request record.");
+		return CHECK_ERR;
+	}
+
+	if ( strcmp(driver_name,"mysql") == 0 ) {
+		// one row affected for an insert, two when an existing row was updated,
+		// in which case the original timestamp was handed back as the insert id.
+		if ( dbi_result_get_numrows_affected(result) == 1 ) {
+			r_seen      = 0;
+			r_timestamp = request->timestamp;
+		} else {
+			r_seen      = 1;
+			r_timestamp = (long)dbi_conn_sequence_last(conn, NULL);
+		}
+	} else {
+		if ( dbi_result_next_row(result) == 0 ) {
+			syslog(LOG_ERR,"dbi: request record update returned no row.");
+			dbi_result_free(result);
+			return CHECK_ERR;
+		}
+		r_seen      = dbi_result_get_long(result, "seen");
+		r_timestamp = dbi_result_get_long(result, "timestamp");
+	}
+	dbi_result_free(result);
+
+	return db_triplet_action(r_seen, r_timestamp, request, config);
+}
+
+/**
+ * db_lookup_request - look a triplet up in the live partitions, in one query
+ *
+ * Returns the result, NULL on error. found is set if it holds the triplet,
+ * the row is then the current one and at the newest partition it is in.
+ */
+static dbi_result db_lookup_request( dbi_conn *conn, struct t_partitions *parts, char *q_client_address, char *q_sender, char *q_recipient, struct t_request *request, struct t_grist_config *config, int *at, int *found ) {
+	dbi_result result;
+	char *query_str, *where;
+	char table[32];
+
+	if ( parts->count == 1 ) {
+		db_partition_table(parts->n[0], table, sizeof(table));
+		query_str = db_build_query_string(sql_select_req, table, q_client_address, q_sender, q_recipient);
+	} else {
+		where     = db_build_query_string(sql_select_where, q_client_address, q_sender, q_recipient);
+		query_str = where != NULL ? db_partition_select_sql(parts, sql_select_columns, where) : NULL;
+		_FREE(where);
+	}
+	if ( query_str == NULL ) { return NULL; }
+	_DBG("dbi: %s", query_str);
+
+	result = db_query_retry(conn, query_str, request, config);
+	_FREE(query_str);
+	if ( result == NULL ) { return NULL; }
+
+	*at    = 0;
+	*found = dbi_result_next_row(result) != 0;
+
+	// whatever type the database gave the partition's place in the list
+	if ( *found && parts->count > 1 ) {
+		*at = (int)dbi_result_get_as_longlong(result, "part");
+	}
+
+	return result;
+}
+
+/**
+ * db_select_stored - look a triplet up before anything is written
+ *
+ * Returns the decision, or TRIPLET_UNKNOWN / TRIPLET_STORED, see
+ * db_stored_action(). at is set to the partition it was found in.
+ */
+static int db_select_stored( dbi_conn *conn, struct t_partitions *parts, char *q_client_address, char *q_sender, char *q_recipient, struct t_request *request, struct t_grist_config *config, int *at ) {
+	dbi_result result;
+	long r_id, r_timestamp;
+	int found;
+
+	result = db_lookup_request(conn, parts, q_client_address, q_sender, q_recipient, request, config, at, &found);
+	if ( result == NULL ) { return CHECK_ERR; }
+
+	if ( !found ) {
+		dbi_result_free(result);
+		return TRIPLET_UNKNOWN;
+	}
+
+	r_id        = dbi_result_get_long(result, "id");
+	r_timestamp = dbi_result_get_long(result, "timestamp");
+	dbi_result_free(result);
+
+	return db_stored_action(DB_PARTITION_KEY(parts->n[*at], r_id), r_timestamp, request, config);
+}
+
+int db_check_request(dbi_conn *conn, struct t_partitions *parts, struct t_request request, struct t_grist_config config) {
 	_ASSERT( conn != NULL );
 
 	dbi_result result;
 	long r_id, r_seen, r_timestamp, r_accepted;
-	int  return_code;
+	int  return_code, maybe_stored, at = 0;
 	char *query_str;
+	char table[32];
 	char *q_client_address, *q_client_name, *q_sender, *q_recipient;
 
 	// sanitize input strings
 	dbi_driver driver = dbi_conn_get_driver(conn);
-	dbi_driver_quote_string_copy(driver, request.client_address, &q_client_address);
+	dbi_driver_quote_string_copy(driver, request.client_key, &q_client_address);
 	dbi_driver_quote_string_copy(driver, request.client_name, &q_client_name);
 	dbi_driver_quote_string_copy(driver, request.sender, &q_sender);
 	dbi_driver_quote_string_copy(driver, request.recipient, &q_recipient);
 
+	// counts written behind and new triplets inserted in groups need to know
+	// whether the triplet is stored first, unless the filter has never seen it
+	maybe_stored = -1;
+	if ( db_lookup_first() ) {
+		return_code  = TRIPLET_UNKNOWN;
+		maybe_stored = db_bloom_check(&request);
+		if ( maybe_stored ) {
+			return_code = db_select_stored(conn, parts, q_client_address, q_sender, q_recipient, &request, &config, &at);
+			if ( return_code == TRIPLET_UNKNOWN ) { db_bloom_missed(); }
+		}
+		if ( return_code == TRIPLET_UNKNOWN ) { return_code = db_group_insert(&request, &config); }
+		if ( return_code >= 0 ) {
+			_FREE(q_client_address);
+			_FREE(q_client_name);
+			_FREE(q_sender);
+			_FREE(q_recipient);
+			return return_code;
+		}
+	}
+
+	// one round trip when the database can do it, unless the triplet may be
+	// in a partition other than the newest
+	if ( maybe_stored < 0 && parts->count > 1 ) {
+		return_code  = TRIPLET_UNKNOWN;
+		maybe_stored = db_bloom_check(&request);
+		if ( maybe_stored ) {
+			return_code = db_select_stored(conn, parts, q_client_address, q_sender, q_recipient, &request, &config, &at);
+			if ( return_code == TRIPLET_UNKNOWN ) { db_bloom_missed(); }
+		}
+		if ( return_code == CHECK_ERR ) {
+			_FREE(q_client_address);
+			_FREE(q_client_name);
+			_FREE(q_sender);
+			_FREE(q_recipient);
+			return CHECK_ERR;
+		}
+		maybe_stored = return_code != TRIPLET_UNKNOWN;
+	}
+
+	db_partition_table(parts->n[at], table, sizeof(table));
+	return_code = db_upsert_request(conn, dbi_driver_get_name(driver), table, q_client_address, q_client_name, q_sender, q_recipient, &request, &config);
+	if ( return_code != -1 ) {
+		_FREE(q_client_address);
+		_FREE(q_client_name);
+		_FREE(q_sender);
+		_FREE(q_recipient);
+		return return_code;
+	}
+
 	// in a perfect world the API would conform to it's documentation. apparently you
 	// cannot use printf style stuff with dbi_conn_query
 	//result = dbi_conn_query(conn, sql_select_req, request->client_address, request->sender, request->recipient);
 
-	// build query string
-	query_str = db_build_query_string(sql_select_req, q_client_address, q_sender, q_recipient);
-	_DBG("dbi: %s", query_str);
-	result = dbi_conn_query(conn, query_str);
-	_FREE(query_str);
-	if ( result == NULL ) {
-		syslog(LOG_DEBUG|LOG_ERR, "dbi: unable to query database.");
-		return CHECK_ERR;
-	}
+	// a triplet the filter has never seen goes straight to the insert
+	int result_rows = 0;
+	if ( maybe_stored < 0 ) { maybe_stored = db_bloom_check(&request); }
+lookup:
+	if ( maybe_stored ) {
+		result = db_lookup_request(conn, parts, q_client_address, q_sender, q_recipient, &request, &config, &at, &result_rows);
+		if ( result == NULL ) {
+			syslog(LOG_DEBUG|LOG_ERR, "dbi: unable to query database.");
+			_FREE(q_client_address);
+			_FREE(q_client_name);
+			_FREE(q_sender);
+			_FREE(q_recipient);
+			return CHECK_ERR;
+		}
+		_DBG("query result rows = %d", result_rows);
 
-	int result_rows = dbi_result_get_numrows(result);
-	_DBG("query result rows = %d", result_rows);
+		if ( result_rows == 0 ) { dbi_result_free(result); }
+	}
+	if ( maybe_stored && result_rows == 0 && !db_lookup_first() && parts->count == 1 ) { db_bloom_missed(); }
 
 	if ( result_rows > 0 ) {
 		_DBG("record exists, performing check.");
 
-		// exists
- 		dbi_result_next_row( result );	
-		
+		// exists, the row is already the current one
 		r_id        = dbi_result_get_long(result, "id");
 		r_seen      = dbi_result_get_long(result, "seen");
 		r_accepted  = dbi_result_get_long(result, "accepted");
@@ -244,71 +903,44 @@ int db_check_request(dbi_conn *conn, struct t_request request, struct t_grist_co
 			return_code = CHECK_OKAY;	
 		}
 
-		// update record 
-		query_str = db_build_query_string(sql_update_req, r_seen, r_accepted, r_id);
+		// update record, in the partition it was found in
+		db_partition_table(parts->n[at], table, sizeof(table));
+		query_str = db_build_query_string(sql_update_req, table, r_seen, r_accepted, r_id);
 		_DBG("dbi: %s", query_str);
 
-		// this nasty 'retry loop' is to prevent issues with sqlite locking, i think.
-		int dbi_attempts  = 0;
-		int query_success = 0;
-		while ( dbi_attempts < MAX_QUERY_ATTEMPTS && query_success == 0 ) {
-			_DBG("dbi: attempting update #%d", dbi_attempts);
-			result = dbi_conn_query(conn, query_str);
-			if ( result != NULL ) {
-				query_success = 1;
-				break; 
-			}
-			sleep(1);
-			++dbi_attempts;
-		}
-
-		if ( !query_success ) {
-			syslog(LOG_DEBUG,"dbi: warning unable to update counts for record id=%d", r_id);
-			syslog(LOG_ERR,"dbi: warning unable to update counts for record id=%d", r_id);
-			return CHECK_ERR;
-		}
-		/*
-		result = dbi_conn_query(conn, query_str);
+		result = db_query_retry(conn, query_str, &request, &config);
 		if ( result == NULL ) {
-			syslog(LOG_DEBUG|LOG_ERR,"dbi: warning unable to update counts for record id=%d", r_id);
+			syslog(LOG_DEBUG,"dbi: warning unable to update counts for record id=%ld", r_id);
+			syslog(LOG_ERR,"dbi: warning unable to update counts for record id=%ld", r_id);
+			return_code = CHECK_ERR;
 		}
-		*/
 		_FREE(query_str);
 	} else {
 		_DBG("record not found, adding to database");
 	
-		// new
-		query_str = db_build_query_string(sql_insert_req, q_client_address, q_client_name, q_sender, q_recipient, request.timestamp);
+		// new, in the newest partition
+		db_partition_table(parts->n[0], table, sizeof(table));
+		query_str = db_build_query_string(sql_insert_req, table, q_client_address, q_client_name, q_sender, q_recipient, request.timestamp);
 		_DBG("dbi: %s", query_str);
 		
-		// this nasty 'retry loop' is to prevent issues with sqlite locking, i think.
-		int dbi_attempts  = 0;
-		int query_success = 0;
-		while ( dbi_attempts < MAX_QUERY_ATTEMPTS && query_success == 0 ) {
-			_DBG("dbi: attempting insert #%d", dbi_attempts);
-			result = dbi_conn_query(conn, query_str);
-			if ( result != NULL ) {
-				query_success = 1;
-				break;
-			}
-			sleep(1);
-			++dbi_attempts;
-		}
+		// unlooked for it is tried once, a conflict isn't worth waiting out
+		result = maybe_stored ? db_query_retry(conn, query_str, &request, &config) : dbi_conn_query(conn, query_str);
 
-		if ( !query_success ) {
-			syslog(LOG_DEBUG,"dbi: error inserting new request record.");
-			syslog(LOG_ERR,"dbi: error inserting new request record.");
-			return CHECK_ERR;
+		return_code = CHECK_NEW;
+		if ( result == NULL && !maybe_stored ) {
+			// the filter only knows what this grist stored, another one
+			// may have stored it since. the triplet index turned it away,
+			// look it up and try again.
+			_FREE(query_str);
+			maybe_stored = 1;
+			goto lookup;
 		}
-
-		/* 
-		result = dbi_conn_query(conn, query_str);
 		if ( result == NULL ) {
-			syslog(LOG_DEBUG|LOG_ERR,"dbi: error inserting new request record.");
+			syslog(LOG_DEBUG,"dbi: error inserting new request record.");
+			syslog(LOG_ERR,"dbi: error inserting new request record.");
+			return_code = CHECK_ERR;
 		}
-		*/
 
-		return_code = CHECK_NEW;
 		_FREE(query_str);
 	}
 
@@ -323,3 +955,150 @@ int db_check_request(dbi_conn *conn, struct t_request request, struct t_grist_co
 	
 	return return_code;
 }
+
+// a libdbi connection and the partitions it looks through
+struct t_dbi {
+	dbi_conn conn;
+	struct t_partitions parts;
+};
+
+static int dbi_backend_execute( void *handle, const char *sql ) {
+	dbi_result result;
+
+	result = dbi_conn_query(((struct t_dbi *)handle)->conn, sql);
+	if ( result == NULL ) { return 0; }
+	dbi_result_free(result);
+
+	return 1;
+}
+
+static int dbi_list( void *handle, const char *sql, struct t_partitions *parts ) {
+	dbi_result result;
+
+	result = dbi_conn_query(((struct t_dbi *)handle)->conn, sql);
+	if ( result == NULL ) { return 0; }
+
+	while ( dbi_result_next_row(result) ) {
+		db_partition_found(parts, dbi_result_get_string(result, "name"));
+	}
+	dbi_result_free(result);
+
+	return 1;
+}
+
+static void *dbi_backend_open( struct t_grist_config *config ) {
+	struct t_dbi *handle;
+
+	handle = (struct t_dbi *)calloc(1, sizeof(struct t_dbi));
+	if ( handle == NULL ) { return NULL; }
+
+	handle->conn = db_open_database(*config);
+	if ( handle->conn == NULL ) {
+		free(handle);
+		return NULL;
+	}
+
+	if ( db_partition_rotate(&handle->parts, config, handle, dbi_backend_execute, dbi_list) < 0 ) {
+		db_close_database(handle->conn);
+		free(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+static void dbi_backend_close( void *handle ) {
+	db_close_database(((struct t_dbi *)handle)->conn);
+	free(handle);
+}
+
+static int dbi_backend_check( void *ptr, struct t_request *request, struct t_grist_config *config ) {
+	struct t_dbi *handle = (struct t_dbi *)ptr;
+
+	if ( db_partition_rotate(&handle->parts, config, handle, dbi_backend_execute, dbi_list) < 0 ) { return CHECK_ERR; }
+
+	return db_check_request(handle->conn, &handle->parts, *request, *config);
+}
+
+static char *dbi_backend_quote( void *handle, const char *str ) {
+	char *quoted = NULL;
+
+	if ( dbi_driver_quote_string_copy(dbi_conn_get_driver(((struct t_dbi *)handle)->conn), str, &quoted) == 0 ) {
+		return NULL;
+	}
+
+	return quoted;
+}
+
+/**
+ * dbi_backend_query - hand the triplets a statement returns to each()
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long dbi_backend_query( void *ptr, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_dbi *handle = (struct t_dbi *)ptr;
+	struct t_request triplet;
+	dbi_result result;
+	long n = 0;
+
+	result = dbi_conn_query(handle->conn, sql);
+	if ( result == NULL ) { return -1; }
+
+	memset(&triplet, 0, sizeof(triplet));
+	while ( dbi_result_next_row(result) ) {
+		triplet.client_key = dbi_result_get_string(result, "address");
+		triplet.sender     = dbi_result_get_string(result, "sender");
+		triplet.recipient  = dbi_result_get_string(result, "recipient");
+		if ( triplet.client_key == NULL || triplet.sender == NULL || triplet.recipient == NULL ) { continue; }
+
+		triplet.client_key_len = strlen(triplet.client_key);
+		triplet.sender_len     = strlen(triplet.sender);
+		triplet.recipient_len  = strlen(triplet.recipient);
+		triplet.timestamp      = (time_t)dbi_result_get_long(result, "timestamp");
+		each(&triplet, arg);
+		++n;
+	}
+	dbi_result_free(result);
+
+	return n;
+}
+
+/**
+ * dbi_backend_scan - hand every stored triplet to each(), with the time
+ * it was first seen
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long dbi_backend_scan( void *ptr, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_dbi *handle = (struct t_dbi *)ptr;
+	char table[32], sql[128];
+	long n = 0, rows;
+	int  i;
+
+	for ( i = 0; i < handle->parts.count; i++ ) {
+		db_partition_table(handle->parts.n[i], table, sizeof(table));
+		snprintf(sql, sizeof(sql), "SELECT address, sender, recipient, timestamp FROM %s", table);
+
+		if ( (rows = dbi_backend_query(handle, sql, each, arg)) < 0 ) { return -1; }
+		n += rows;
+	}
+
+	return n;
+}
+
+static void dbi_backend_shutdown( void ) {
+	if ( dbi_loaded ) { dbi_shutdown(); }
+}
+
+// every driver libdbi has, and what the native backends turn down
+const struct t_db_backend db_backend_dbi = {
+	NULL,
+	dbi_backend_open,
+	dbi_backend_close,
+	dbi_backend_check,
+	dbi_backend_execute,
+	dbi_backend_quote,
+	dbi_backend_scan,
+	dbi_backend_query,
+	dbi_backend_shutdown
+};
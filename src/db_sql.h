@@ -22,6 +22,17 @@
 
 #include <dbi/dbi.h>
 
+struct t_partitions;
+
+// what mysql's unique triplet key is on, a hash of the whole of all three
+// columns since it can only index a prefix of TEXT ones
+#define SQL_TRIPLET_MYSQL	"UNHEX(MD5(CONCAT_WS(CHAR(0), address, sender, recipient)))"
+#define SQL_DEDUP_BATCH		10000	// ids looked at by one statement removing duplicates
+
+int db_initialize( void );
 dbi_conn* db_open_database( struct t_grist_config config ); 
-int db_create_structure( dbi_conn *conn ); 
+int db_close_database( dbi_conn *conn );
+int db_create_structure( dbi_conn *conn, struct t_grist_config *config ); 
+int db_migrate_structure( dbi_conn *conn, struct t_grist_config *config );
+int db_check_request( dbi_conn *conn, struct t_partitions *parts, struct t_request request, struct t_grist_config config );
 
@@ -0,0 +1,389 @@
+/**
+ * file: db_sqlite3.c
+ * grist - sqlite3 backend with statements prepared once per connection
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#ifdef HAVE_LIBSQLITE3
+
+#include <sqlite3.h>
+
+// same upsert as the libdbi backend, with parameters bound instead of quoted.
+// %s is the table, requests or that of a partition, see db_partition.c
+static const char *sql_upsert = "INSERT INTO %s AS r (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES(?1,?2,?3,?4,0,0,?5) "
+				"ON CONFLICT (address, sender, recipient) DO UPDATE SET seen = r.seen + 1, "
+				"accepted = r.accepted + CASE WHEN excluded.timestamp - r.timestamp >= ?6 THEN 1 ELSE 0 END "
+				"RETURNING seen, timestamp";
+
+// a triplet is looked up in every live partition with one statement, the
+// first column is the place of the newest holding it, see
+// db_partition_select_sql()
+static const char *sql_select = "address = ?1 AND sender = ?2 AND recipient = ?3";
+static const char *sql_scan   = "SELECT address, sender, recipient, timestamp FROM %s";
+
+struct t_sqlite3 {
+	sqlite3      *db;
+	struct t_partitions parts;
+	sqlite3_stmt *upsert[PARTITION_MAX];	// one for every live partition
+	sqlite3_stmt *select;			// for deciding before the counts are written
+};
+
+static int sqlite3_backend_execute( void *ptr, const char *sql ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+
+	if ( sqlite3_exec(handle->db, sql, NULL, NULL, NULL) != SQLITE_OK ) {
+		syslog(LOG_ERR, "sqlite3: %s", sqlite3_errmsg(handle->db));
+		return 0;
+	}
+
+	return 1;
+}
+
+static void sqlite3_finalize_parts( struct t_sqlite3 *handle ) {
+	int i;
+
+	for ( i = 0; i < PARTITION_MAX; i++ ) {
+		sqlite3_finalize(handle->upsert[i]);
+		handle->upsert[i] = NULL;
+	}
+	sqlite3_finalize(handle->select);
+	handle->select = NULL;
+}
+
+/**
+ * sqlite3_prepare_sql - prepare a statement against the table of a partition
+ */
+static int sqlite3_prepare_sql( struct t_sqlite3 *handle, const char *fmt, long n, sqlite3_stmt **stmt ) {
+	char table[32], sql[512];
+
+	db_partition_table(n, table, sizeof(table));
+	snprintf(sql, sizeof(sql), fmt, table);
+
+	return sqlite3_prepare_v2(handle->db, sql, -1, stmt, NULL) == SQLITE_OK;
+}
+
+static int sqlite3_list( void *ptr, const char *sql, struct t_partitions *parts ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if ( sqlite3_prepare_v2(handle->db, sql, -1, &stmt, NULL) != SQLITE_OK ) { return 0; }
+
+	while ( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+		db_partition_found(parts, (const char *)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+
+	return rc == SQLITE_DONE;
+}
+
+/**
+ * sqlite3_rotate - prepare the statements for the live partitions, again
+ * whenever a new one starts
+ *
+ * Returns 0 if they can't be, the next check tries again.
+ */
+static int sqlite3_rotate( struct t_sqlite3 *handle, struct t_grist_config *config ) {
+	char *sql;
+	int i, rc;
+
+	rc = db_partition_rotate(&handle->parts, config, handle, sqlite3_backend_execute, sqlite3_list);
+	if ( rc <= 0 ) { return rc == 0; }
+
+	// fails without the triplet index or on sqlite older than 3.35
+	sqlite3_finalize_parts(handle);
+	for ( i = 0; i < handle->parts.count; i++ ) {
+		if ( !sqlite3_prepare_sql(handle, sql_upsert, handle->parts.n[i], &handle->upsert[i]) ) {
+			syslog(LOG_WARNING, "sqlite3: %s", sqlite3_errmsg(handle->db));
+			sqlite3_finalize_parts(handle);
+			handle->parts.count = 0;
+			return 0;
+		}
+	}
+
+	sql = db_partition_select_sql(&handle->parts, "id, timestamp", sql_select);
+	rc  = sql != NULL && sqlite3_prepare_v2(handle->db, sql, -1, &handle->select, NULL) == SQLITE_OK;
+	_FREE(sql);
+	if ( !rc ) {
+		syslog(LOG_WARNING, "sqlite3: unable to prepare the lookup: %s", sqlite3_errmsg(handle->db));
+		sqlite3_finalize_parts(handle);
+		handle->parts.count = 0;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void *sqlite3_backend_open( struct t_grist_config *config ) {
+	struct t_sqlite3 *handle;
+	char path[sizeof(config->db_path)+sizeof(config->db_name)+1];
+
+	snprintf(path, sizeof(path), "%s/%s", config->db_path, config->db_name);
+
+	handle = (struct t_sqlite3 *)calloc(1, sizeof(struct t_sqlite3));
+	if ( handle == NULL ) { return NULL; }
+
+	// the database is created by 'grist setup', never here
+	if ( sqlite3_open_v2(path, &handle->db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK ) {
+		syslog(LOG_ERR, "sqlite3: unable to open %s: %s", path, sqlite3_errmsg(handle->db));
+		sqlite3_close(handle->db);
+		free(handle);
+		return NULL;
+	}
+
+	// sqlite waits for a lock held by another process or worker itself, each
+	// check narrows this down to what is left of its budget
+	sqlite3_busy_timeout(handle->db, config->rq_max_latency_ms);
+
+	if ( !sqlite3_rotate(handle, config) ) {
+		syslog(LOG_WARNING, "sqlite3: falling back to libdbi. has 'grist migrate-schema' been run?");
+		sqlite3_close(handle->db);
+		free(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+static void sqlite3_backend_close( void *ptr ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+
+	sqlite3_finalize_parts(handle);
+	sqlite3_close(handle->db);
+	free(handle);
+}
+
+static char *sqlite3_backend_quote( void *ptr, const char *str ) {
+	char *literal, *quoted;
+
+	(void)ptr;
+
+	literal = sqlite3_mprintf("%Q", str);
+	if ( literal == NULL ) { return NULL; }
+
+	// sqlite's own allocator, the caller frees with free()
+	quoted = strdup(literal);
+	sqlite3_free(literal);
+
+	return quoted;
+}
+
+/**
+ * sqlite3_each - hand the triplets a prepared statement returns to each(),
+ * and finalize it
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long sqlite3_each( struct t_sqlite3 *handle, sqlite3_stmt *stmt, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_request triplet;
+	long n = 0;
+	int  rc;
+
+	memset(&triplet, 0, sizeof(triplet));
+	while ( (rc = sqlite3_step(stmt)) == SQLITE_ROW ) {
+		triplet.client_key     = (const char *)sqlite3_column_text(stmt, 0);
+		triplet.client_key_len = sqlite3_column_bytes(stmt, 0);
+		triplet.sender         = (const char *)sqlite3_column_text(stmt, 1);
+		triplet.sender_len     = sqlite3_column_bytes(stmt, 1);
+		triplet.recipient      = (const char *)sqlite3_column_text(stmt, 2);
+		triplet.recipient_len  = sqlite3_column_bytes(stmt, 2);
+		triplet.timestamp      = (time_t)sqlite3_column_int64(stmt, 3);
+		if ( triplet.client_key == NULL || triplet.sender == NULL || triplet.recipient == NULL ) { continue; }
+
+		each(&triplet, arg);
+		++n;
+	}
+	sqlite3_finalize(stmt);
+	if ( rc != SQLITE_DONE ) {
+		syslog(LOG_ERR, "sqlite3: error reading request records: %s", sqlite3_errmsg(handle->db));
+		return -1;
+	}
+
+	return n;
+}
+
+/**
+ * sqlite3_backend_scan - hand every stored triplet to each(), with the
+ * time it was first seen
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long sqlite3_backend_scan( void *ptr, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+	sqlite3_stmt *stmt;
+	long n = 0, rows;
+	int  i;
+
+	for ( i = 0; i < handle->parts.count; i++ ) {
+		if ( !sqlite3_prepare_sql(handle, sql_scan, handle->parts.n[i], &stmt) ) {
+			syslog(LOG_ERR, "sqlite3: %s", sqlite3_errmsg(handle->db));
+			return -1;
+		}
+		if ( (rows = sqlite3_each(handle, stmt, each, arg)) < 0 ) { return -1; }
+		n += rows;
+	}
+
+	return n;
+}
+
+/**
+ * sqlite3_backend_query - hand the triplets a statement returns to each()
+ *
+ * Returns how many there were, or -1 on error.
+ */
+static long sqlite3_backend_query( void *ptr, const char *sql, void (*each)( struct t_request *triplet, void *arg ), void *arg ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+	sqlite3_stmt *stmt;
+
+	if ( sqlite3_prepare_v2(handle->db, sql, -1, &stmt, NULL) != SQLITE_OK ) {
+		syslog(LOG_ERR, "sqlite3: %s", sqlite3_errmsg(handle->db));
+		return -1;
+	}
+
+	return sqlite3_each(handle, stmt, each, arg);
+}
+
+/**
+ * sqlite3_find - look a triplet up in the live partitions
+ *
+ * Returns 1 and the newest it was found in, 0 if it isn't stored, -1 on error.
+ */
+static int sqlite3_find( struct t_sqlite3 *handle, struct t_request *request, int *at, long *r_id, long *r_timestamp ) {
+	sqlite3_stmt *stmt = handle->select;
+	int rc;
+
+	sqlite3_bind_text(stmt, 1, request->client_key, request->client_key_len, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, request->sender, request->sender_len, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, request->recipient, request->recipient_len, SQLITE_STATIC);
+
+	rc = sqlite3_step(stmt);
+	if ( rc == SQLITE_ROW ) {
+		*at          = sqlite3_column_int(stmt, 0);
+		*r_id        = (long)sqlite3_column_int64(stmt, 1);
+		*r_timestamp = (long)sqlite3_column_int64(stmt, 2);
+	} else if ( rc != SQLITE_DONE ) {
+		syslog(LOG_ERR, "sqlite3: error looking up request record: %s", sqlite3_errmsg(handle->db));
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if ( rc == SQLITE_DONE ) { return 0; }
+
+	return rc == SQLITE_ROW ? 1 : -1;
+}
+
+/**
+ * sqlite3_select_stored - look a triplet up before anything is written
+ *
+ * Returns the decision, or TRIPLET_UNKNOWN / TRIPLET_STORED, see
+ * db_stored_action(). at is set to the partition it was found in.
+ */
+static int sqlite3_select_stored( struct t_sqlite3 *handle, struct t_request *request, struct t_grist_config *config, int *at ) {
+	long r_id = 0, r_timestamp = 0;
+	int  rc;
+
+	rc = sqlite3_find(handle, request, at, &r_id, &r_timestamp);
+	if ( rc == 0 ) { return TRIPLET_UNKNOWN; }
+	if ( rc < 0 ) { return CHECK_ERR; }
+
+	return db_stored_action(DB_PARTITION_KEY(handle->parts.n[*at], r_id), r_timestamp, request, config);
+}
+
+static int sqlite3_backend_check( void *ptr, struct t_request *request, struct t_grist_config *config ) {
+	struct t_sqlite3 *handle = (struct t_sqlite3 *)ptr;
+	sqlite3_stmt *stmt;
+	long r_seen, r_timestamp, left;
+	int  rc, at = 0;
+
+	left = db_time_left(request, config);
+	if ( left <= 0 ) { return CHECK_ERR; }
+	sqlite3_busy_timeout(handle->db, (int)left);
+
+	if ( !sqlite3_rotate(handle, config) ) { return CHECK_ERR; }
+
+	// counts written behind and new triplets inserted in groups need to know
+	// whether the triplet is stored first
+	if ( db_lookup_first() ) {
+		// a triplet the filter has never seen is inserted without looking
+		rc = TRIPLET_UNKNOWN;
+		if ( db_bloom_check(request) ) {
+			rc = sqlite3_select_stored(handle, request, config, &at);
+			if ( rc == TRIPLET_UNKNOWN ) { db_bloom_missed(); }
+		}
+		if ( rc == TRIPLET_UNKNOWN ) { rc = db_group_insert(request, config); }
+		if ( rc >= 0 ) { return rc; }
+	} else if ( handle->parts.count > 1 && db_bloom_check(request) ) {
+		// the upsert would store a triplet of an older partition again
+		rc = sqlite3_find(handle, request, &at, &r_seen, &r_timestamp);
+		if ( rc < 0 ) { return CHECK_ERR; }
+		if ( rc == 0 ) { db_bloom_missed(); }
+	}
+
+	// new triplets go in the newest partition
+	stmt = handle->upsert[at];
+
+	sqlite3_bind_text(stmt, 1, request->client_key, request->client_key_len, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, request->client_name, request->client_name_len, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, request->sender, request->sender_len, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 4, request->recipient, request->recipient_len, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 5, request->timestamp);
+	sqlite3_bind_int64(stmt, 6, config->rq_cooldown);
+
+	rc = sqlite3_step(stmt);
+	if ( rc != SQLITE_ROW ) {
+		syslog(LOG_ERR, "sqlite3: error updating request record: %s", sqlite3_errmsg(handle->db));
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		return CHECK_ERR;
+	}
+
+	r_seen      = (long)sqlite3_column_int64(stmt, 0);
+	r_timestamp = (long)sqlite3_column_int64(stmt, 1);
+
+	// the change is only committed once the statement has run to completion
+	rc = sqlite3_step(stmt);
+	if ( rc != SQLITE_DONE ) {
+		syslog(LOG_ERR, "sqlite3: error committing request record: %s", sqlite3_errmsg(handle->db));
+	}
+
+	// the bound views point into the request buffer, don't keep them around
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if ( rc != SQLITE_DONE ) { return CHECK_ERR; }
+
+	return db_triplet_action(r_seen, r_timestamp, request, config);
+}
+
+const struct t_db_backend db_backend_sqlite3 = {
+	"sqlite3",
+	sqlite3_backend_open,
+	sqlite3_backend_close,
+	sqlite3_backend_check,
+	sqlite3_backend_execute,
+	sqlite3_backend_quote,
+	sqlite3_backend_scan,
+	sqlite3_backend_query,
+	NULL
+};
+
+#endif /* HAVE_LIBSQLITE3 */
@@ -0,0 +1,252 @@
+/**
+ * file: domain.c
+ * grist - reversed label trie of mail domains and addresses
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <ctype.h>
+
+/*
+ * Domains are stored a label at a time from the right, so com, then
+ * example, then mail for mail.example.com, and an address is matched by
+ * walking its domain backwards from the end of the string. An entry is one
+ * of
+ *
+ *	example.com		the domain and every domain below it
+ *	tickets@example.com	that address only
+ *	postmaster@		that local part at any domain
+ *
+ * Labels and local parts are kept in lower case, the address being matched
+ * is compared as it is, so a lookup neither allocates nor copies.
+ */
+struct t_domain_node {
+	char   *label;
+	size_t len;
+	int    whole;		// the domain and all below it are listed
+	char   **locals;	// addresses listed at exactly this domain
+	int    nlocals;
+	struct t_domain_node **children;	// ordered by domain_compare
+	int    nchildren;
+};
+
+struct t_domain {
+	struct t_domain_node root;	// its locals are listed at any domain
+	long   entries;
+};
+
+/**
+ * domain_compare - order a stored label against one in an address
+ *
+ * The stored label is lower case, the other one is folded a byte at a time.
+ */
+static int domain_compare( const char *stored, size_t stored_len, const char *label, size_t len ) {
+	size_t i;
+	int diff;
+
+	for ( i = 0; i < stored_len && i < len; i++ ) {
+		diff = (unsigned char)stored[i] - tolower((unsigned char)label[i]);
+		if ( diff != 0 ) { return diff; }
+	}
+
+	return stored_len < len ? -1 : stored_len > len ? 1 : 0;
+}
+
+/**
+ * domain_child - find a child by label, or where it would go
+ */
+static struct t_domain_node *domain_child( struct t_domain_node *node, const char *label, size_t len, int *at ) {
+	int lo = 0, hi = node->nchildren - 1, mid, diff;
+
+	while ( lo <= hi ) {
+		mid  = (lo + hi) / 2;
+		diff = domain_compare(node->children[mid]->label, node->children[mid]->len, label, len);
+		if ( diff == 0 ) { return node->children[mid]; }
+		if ( diff < 0 ) { lo = mid + 1; } else { hi = mid - 1; }
+	}
+
+	if ( at != NULL ) { *at = lo; }
+
+	return NULL;
+}
+
+static struct t_domain_node *domain_add_child( struct t_domain_node *node, const char *label, size_t len ) {
+	struct t_domain_node *child, **children;
+	int at;
+
+	child = domain_child(node, label, len, &at);
+	if ( child != NULL ) { return child; }
+
+	child = (struct t_domain_node *)calloc(1, sizeof(struct t_domain_node));
+	if ( child == NULL ) { return NULL; }
+
+	child->label = strndup(label, len);
+	children = (struct t_domain_node **)realloc(node->children, (node->nchildren + 1) * sizeof(struct t_domain_node *));
+	if ( child->label == NULL || children == NULL ) {
+		_FREE(child->label);
+		free(child);
+		if ( children != NULL ) { node->children = children; }
+		return NULL;
+	}
+	child->len = len;
+
+	node->children = children;
+	memmove(&node->children[at + 1], &node->children[at], (node->nchildren - at) * sizeof(struct t_domain_node *));
+	node->children[at] = child;
+	++node->nchildren;
+
+	return child;
+}
+
+static int domain_add_local( struct t_domain_node *node, const char *local ) {
+	char **locals;
+
+	locals = (char **)realloc(node->locals, (node->nlocals + 1) * sizeof(char *));
+	if ( locals == NULL ) { return 0; }
+	node->locals = locals;
+
+	node->locals[node->nlocals] = strdup(local);
+	if ( node->locals[node->nlocals] == NULL ) { return 0; }
+	++node->nlocals;
+
+	return 1;
+}
+
+static int domain_has_local( struct t_domain_node *node, const char *local, size_t len ) {
+	int i;
+
+	for ( i = 0; i < node->nlocals; i++ ) {
+		if ( domain_compare(node->locals[i], strlen(node->locals[i]), local, len) == 0 ) { return 1; }
+	}
+
+	return 0;
+}
+
+struct t_domain *domain_create( void ) {
+	return (struct t_domain *)calloc(1, sizeof(struct t_domain));
+}
+
+/**
+ * domain_insert - add an entry, it is lower cased in place
+ *
+ * Returns 0 if it isn't a domain or address, or out of memory.
+ */
+int domain_insert( struct t_domain *tree, char *entry ) {
+	struct t_domain_node *node = &tree->root;
+	char *p, *at, *domain, *end;
+
+	for ( p = entry; *p != '\0'; p++ ) {
+		*p = tolower((unsigned char)*p);
+	}
+
+	at = strrchr(entry, '@');
+	domain = at != NULL ? at + 1 : entry;
+	if ( *domain == '.' ) { ++domain; }	// .example.com means the same as example.com
+
+	end = domain + strlen(domain);
+	if ( end > domain && end[-1] == '.' ) { --end; }
+
+	if ( at == entry ) { return 0; }
+
+	// a local part on its own
+	if ( at != NULL && end == domain ) {
+		*at = '\0';
+		if ( !domain_add_local(node, entry) ) { return 0; }
+		++tree->entries;
+		return 1;
+	}
+
+	for ( p = end; p > domain; end = p - 1 ) {
+		for ( p = end; p > domain && p[-1] != '.'; p-- ) ;
+		if ( p == end ) { return 0; }	// an empty label
+
+		node = domain_add_child(node, p, end - p);
+		if ( node == NULL ) { return 0; }
+	}
+	if ( node == &tree->root ) { return 0; }
+
+	if ( at != NULL ) {
+		*at = '\0';
+		if ( !domain_add_local(node, entry) ) { return 0; }
+	} else {
+		node->whole = 1;
+	}
+	++tree->entries;
+
+	return 1;
+}
+
+/**
+ * domain_match - whether an address, or a bare domain, is listed
+ */
+int domain_match( struct t_domain *tree, const char *address ) {
+	struct t_domain_node *node = &tree->root;
+	const char *at, *domain, *end, *p;
+	size_t local_len = 0;
+
+	at = strrchr(address, '@');
+	if ( at != NULL ) {
+		local_len = at - address;
+		domain    = at + 1;
+		if ( domain_has_local(node, address, local_len) ) { return 1; }
+	} else {
+		domain = address;
+	}
+
+	end = domain + strlen(domain);
+	if ( end > domain && end[-1] == '.' ) { --end; }
+	if ( end == domain ) { return 0; }
+
+	for ( p = end; p > domain; end = p - 1 ) {
+		for ( p = end; p > domain && p[-1] != '.'; p-- ) ;
+
+		node = domain_child(node, p, end - p, NULL);
+		if ( node == NULL ) { return 0; }
+		if ( node->whole ) { return 1; }
+	}
+
+	return at != NULL && domain_has_local(node, address, local_len);
+}
+
+long domain_count( struct t_domain *tree ) {
+	return tree->entries;
+}
+
+static void domain_free( struct t_domain_node *node ) {
+	int i;
+
+	for ( i = 0; i < node->nchildren; i++ ) {
+		domain_free(node->children[i]);
+		free(node->children[i]);
+	}
+	for ( i = 0; i < node->nlocals; i++ ) {
+		free(node->locals[i]);
+	}
+	_FREE(node->children);
+	_FREE(node->locals);
+	_FREE(node->label);
+}
+
+void domain_destroy( struct t_domain *tree ) {
+	if ( tree == NULL ) { return; }
+
+	domain_free(&tree->root);
+	free(tree);
+}
@@ -33,6 +33,12 @@
 #include <ctype.h> 
 #include <time.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define REQUEST_BUFFER_MAX  8192 // all attributes of one request, or several pipelined ones
+#define POLICY_PIPELINE_MAX 32	 // replies queued for one client before they must be written
+#define CLIENT_NETWORK_MAX  48	 // an IPv6 address as text
 
 struct t_grist_config {
 	char db_driver[30];
@@ -42,11 +48,77 @@ struct t_grist_config {
 	char db_name[30];
 	char db_username[30];
 	char db_password[30];
+	long db_max_triplets;
+	long db_sync_ms;
+	long db_snapshot_interval;
+	long db_write_behind_ms;
+	long db_group_commit_ms;
+	long db_group_commit_max;
+	long db_cache_mb;
+	long db_bloom_mb;
+	long db_partition_hours;
+	long db_partitions;
 	long rq_cooldown;
+	long rq_max_latency_ms;
+	long rq_auto_whitelist;
+	long rq_ipv4_netmask;
+	long rq_ipv6_netmask;
+	long rq_pending_ttl;
+	long rq_accepted_ttl;
+	char whitelist_clients[1024];
+	char whitelist_recipients[1024];
+	char whitelist_senders[1024];
 	char rq_defer_msg[1024];
+	char listen_unix[108];
+	char listen_address[60];
+	long listen_port;
+	long rq_workers;
+};
+
+/*
+ * The attributes of a request are pointer+length views into the buffer the
+ * request was read into, each terminated in place so they can double as C 
+ * strings. The buffer must stay put until the request has been answered.
+ */
+struct t_request {
+	const char *type;
+	size_t     type_len;
+	const char *client_address;
+	size_t     client_address_len;
+	const char *client_name;
+	size_t     client_name_len;
+	const char *sender;
+	size_t     sender_len;
+	const char *recipient;
+	size_t     recipient_len;
+	time_t     timestamp;
+	struct timespec received;	// on the monotonic clock, starts the latency budget
+	const char *client_key;		// what the triplet is stored under, see grist_mask_client()
+	size_t     client_key_len;
+	char       client_network[CLIENT_NETWORK_MAX];
+};
+
+// requests read from and replies queued for one client, see policy.c
+struct t_policy_io {
+	char   in[REQUEST_BUFFER_MAX];
+	size_t in_len;
+	size_t in_off;		// start of the request being parsed
+	size_t scanned;		// how far into it we looked for its end
+	struct iovec out[POLICY_PIPELINE_MAX];
+	int    out_cnt;
+	int    out_sent;
+};
+
+// a request handed to a worker thread, see pool.c
+struct t_job {
+	void   *owner;
+	int    slot;		// reply slot the decision goes into
+	struct t_request request;
+	int    action;
 };
 
 #include "db_sql.h"
+#include "db.h"
 
 #ifdef MEMWATCH
 	#include "memwatch.h"
@@ -68,6 +140,7 @@ struct t_grist_config {
 #define DB_SQLITE_PATH 	 "/tmp"
 #define SQL_QUERYSTR_MAX 2048
 #define INPUT_BUFFER_MAX 1024	 // 1k for 1 line of text input should be WAY more than is needed 
+#define RESPONSE_BUFFER_MAX 1152 // action, defer message and terminating empty line
 #define REQUEST_COOLDOWN 120 	 // wait in seconds before a req can be approved
 
 //
@@ -90,17 +163,96 @@ struct t_grist_config {
 #define CFG_BADDRIVER	5
 #define CFG_BADPORT 	10
 #define CFG_BADCOOLDOWN 15
+#define CFG_BADLISTEN	20
+#define CFG_BADWORKERS	25
+#define CFG_BADTRIPLETS	30
+#define CFG_BADSYNC	35
+#define CFG_BADSNAPSHOT	40
+#define CFG_BADLATENCY	45
+#define CFG_BADBEHIND	50
+#define CFG_BADGROUP	55
+#define CFG_BADCACHE	60
+#define CFG_BADWHITELIST 65
+#define CFG_BADNETMASK	70
+#define CFG_BADBLOOM	75
+#define CFG_BADTTL	80
+#define CFG_BADPARTITION 85
 
 #define CHECK_ERR     0
 #define CHECK_OKAY    1
 #define CHECK_COOLING 2
 #define CHECK_NEW     3
+#define CHECK_TIMEOUT 4	// the database took longer than rq_max_latency_ms
+#define CHECK_WHITELISTED 5
 
-struct t_request {
-	char   *client_address;
-	char   *client_name;
-	char   *sender;
-	char   *recipient;
-	time_t timestamp;
-} request;	
+// config.c
+int parse_config_file( char *filename, struct t_grist_config* grist_cfg );
+
+// policy.c
+void grist_reset_request( struct t_request *request );
+size_t grist_parse_request( struct t_request *request, char *buf, size_t len, size_t *scanned );
+int  grist_request_supported( struct t_request *request );
+int  grist_request_complete( struct t_request *request );
+void grist_log_action( int action, struct t_request *request );
+void grist_prepare_responses( struct t_grist_config *config );
+const char *grist_response( int action, size_t *len );
+void grist_io_init( struct t_policy_io *io );
+ssize_t grist_io_read( struct t_policy_io *io, int fd );
+int  grist_io_next( struct t_policy_io *io, struct t_request *request );
+int  grist_io_reserve( struct t_policy_io *io );
+void grist_io_reply( struct t_policy_io *io, int slot, int action );
+int  grist_io_flush( struct t_policy_io *io, int fd );
+void grist_io_compact( struct t_policy_io *io );
+int  grist_check_request( struct t_db **db, struct t_request *request, struct t_grist_config *config );
+
+// hash.c
+void grist_fingerprint( struct t_request *request, uint64_t seed, uint64_t hash[2] );
+uint64_t grist_hash( const void *data, size_t len, uint64_t seed );
+uint64_t grist_random_seed( void );
+uint64_t grist_mix64( uint64_t k );
+
+// radix.c
+#define RADIX_KEY_LEN	16	// IPv6 sized keys
+#define RADIX_V4_BITS	96	// IPv4 addresses are mapped into ::ffff:0:0/96
+
+struct t_radix;
+struct t_radix *radix_create( void );
+int   radix_key( const char *address, uint8_t key[RADIX_KEY_LEN] );
+long *radix_insert( struct t_radix *tree, const uint8_t *key, int bits );
+long *radix_find( struct t_radix *tree, const uint8_t *key, int bits );
+long *radix_match( struct t_radix *tree, const uint8_t *key, int bits );
+long  radix_count( struct t_radix *tree );
+void  radix_destroy( struct t_radix *tree );
+
+struct t_radix_table;
+struct t_radix_table *radix_compile( struct t_radix *tree );
+int   radix_table_match( struct t_radix_table *table, const uint8_t *key );
+void  radix_table_destroy( struct t_radix_table *table );
+
+// domain.c
+struct t_domain;
+struct t_domain *domain_create( void );
+int   domain_insert( struct t_domain *tree, char *entry );
+int   domain_match( struct t_domain *tree, const char *address );
+long  domain_count( struct t_domain *tree );
+void  domain_destroy( struct t_domain *tree );
+
+// whitelist.c
+int  grist_awl_start( struct t_grist_config *config );
+int  grist_awl_check( struct t_request *request, struct t_grist_config *config );
+void grist_awl_count( struct t_request *request, struct t_grist_config *config );
+void grist_awl_stop( void );
+int  grist_whitelist_load( struct t_grist_config *config, int compile );
+int  grist_whitelist_check( struct t_request *request );
+void grist_whitelist_free( void );
+
+// server.c
+int grist_server( struct t_grist_config *config );
+
+// pool.c
+struct t_pool;
+struct t_pool *pool_create( struct t_grist_config *config, int num_threads, int notify_fd );
+int  pool_submit( struct t_pool *pool, struct t_job *job );
+struct t_job *pool_completed( struct t_pool *pool );
+void pool_destroy( struct t_pool *pool );
 
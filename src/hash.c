@@ -0,0 +1,163 @@
+/**
+ * file: hash.c
+ * grist - fingerprints of triplets for the tables grist keeps itself
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <fcntl.h>
+
+/*
+ * MurmurHash3 x64 128 by Austin Appleby, placed in the public domain.
+ */
+static inline uint64_t rotl64( uint64_t x, int r ) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64( uint64_t k ) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static void murmur3_128( const unsigned char *data, size_t len, uint64_t seed, uint64_t out[2] ) {
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	size_t nblocks = len / 16;
+	const unsigned char *tail;
+	uint64_t h1 = seed, h2 = seed;
+	uint64_t k1, k2;
+	size_t i;
+
+	for ( i = 0; i < nblocks; i++ ) {
+		memcpy(&k1, data + i*16, 8);
+		memcpy(&k2, data + i*16 + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+	}
+
+	tail = data + nblocks*16;
+	k1 = 0;
+	k2 = 0;
+
+	switch ( len & 15 ) {
+		case 15: k2 ^= (uint64_t)tail[14] << 48;
+			 /* fall through */
+		case 14: k2 ^= (uint64_t)tail[13] << 40;
+			 /* fall through */
+		case 13: k2 ^= (uint64_t)tail[12] << 32;
+			 /* fall through */
+		case 12: k2 ^= (uint64_t)tail[11] << 24;
+			 /* fall through */
+		case 11: k2 ^= (uint64_t)tail[10] << 16;
+			 /* fall through */
+		case 10: k2 ^= (uint64_t)tail[ 9] << 8;
+			 /* fall through */
+		case  9: k2 ^= (uint64_t)tail[ 8];
+			 k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+			 /* fall through */
+		case  8: k1 ^= (uint64_t)tail[ 7] << 56;
+			 /* fall through */
+		case  7: k1 ^= (uint64_t)tail[ 6] << 48;
+			 /* fall through */
+		case  6: k1 ^= (uint64_t)tail[ 5] << 40;
+			 /* fall through */
+		case  5: k1 ^= (uint64_t)tail[ 4] << 32;
+			 /* fall through */
+		case  4: k1 ^= (uint64_t)tail[ 3] << 24;
+			 /* fall through */
+		case  3: k1 ^= (uint64_t)tail[ 2] << 16;
+			 /* fall through */
+		case  2: k1 ^= (uint64_t)tail[ 1] << 8;
+			 /* fall through */
+		case  1: k1 ^= (uint64_t)tail[ 0];
+			 k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	h1 ^= len; h2 ^= len;
+	h1 += h2;  h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;  h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
+
+/**
+ * grist_fingerprint - hash a triplet into the key it is stored under
+ *
+ * The first word is never zero so tables can use it to mark free slots.
+ */
+void grist_fingerprint( struct t_request *request, uint64_t seed, uint64_t hash[2] ) {
+	unsigned char buf[REQUEST_BUFFER_MAX];
+	size_t len = 0;
+
+	// the views are nul terminated, keeping the nuls tells "ab"+"c" from "a"+"bc"
+	memcpy(buf + len, request->client_key, request->client_key_len + 1);
+	len += request->client_key_len + 1;
+	memcpy(buf + len, request->sender, request->sender_len + 1);
+	len += request->sender_len + 1;
+	memcpy(buf + len, request->recipient, request->recipient_len);
+	len += request->recipient_len;
+
+	murmur3_128(buf, len, seed, hash);
+
+	if ( hash[0] == 0 ) { hash[0] = 1; }
+}
+
+/**
+ * grist_hash - hash a string for a table of our own
+ */
+uint64_t grist_hash( const void *data, size_t len, uint64_t seed ) {
+	uint64_t out[2];
+
+	murmur3_128((const unsigned char *)data, len, seed, out);
+
+	return out[0];
+}
+
+uint64_t grist_random_seed( void ) {
+	uint64_t seed = 0;
+	int fd;
+
+	// a seed nobody can guess keeps senders from picking colliding addresses
+	fd = open("/dev/urandom", O_RDONLY);
+	if ( fd >= 0 ) {
+		if ( read(fd, &seed, sizeof(seed)) != sizeof(seed) ) { seed = 0; }
+		close(fd);
+	}
+	if ( seed == 0 ) {
+		seed = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+	}
+
+	return seed;
+}
+
+uint64_t grist_mix64( uint64_t k ) {
+	return fmix64(k);
+}
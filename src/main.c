@@ -22,16 +22,17 @@
 
 #include "grist.h"
 
+#include <errno.h>
+
+struct t_request request;
+
 void grist_safe_exit( void );
 
 void grist_cleanup() {
 	_DBG("grist_cleanup(): executed.");
 
 	// cleanup
-	_FREE(request.client_address);
-	_FREE(request.client_name);
-	_FREE(request.sender);
-	_FREE(request.recipient);
+	grist_reset_request(&request);
 }
 
 void trap_sigint( int sig ) {
@@ -49,81 +50,106 @@ void grist_safe_exit( void ) {
 	exit(0);
 }
 
-int get_policy_attributes( struct t_request *request) {
+/**
+ * get_policy_attributes - read the next policy request from the client
+ *
+ * Returns 1 once a complete request is buffered and parsed, or 0 if the 
+ * client went away before sending one. The request points into io and is 
+ * only good until the buffer is compacted.
+ */
+int get_policy_attributes( struct t_policy_io *io, struct t_request *request ) {
+	ssize_t n;
+
+	while ( !grist_io_next(io, request) ) {
+		n = grist_io_read(io, STDIN_FILENO);
+		if ( n == 0 ) { return 0; }
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			if ( errno == ENOBUFS ) {
+				syslog(LOG_WARNING, "request too large, giving up on client.");
+			} else {
+				perror("client_read");
+			}
+			return 0;
+		}
+	}
 
-	char *input, *ret;
-	int  client_done = 0;
-	char eol[] 	 = "\n"; 
+	return 1;
+}
 
-	char *key, *value;
-	input = (char *)malloc( sizeof(char)*INPUT_BUFFER_MAX );
-	
-	int  ignore_client = 0; 
-	while ( !client_done ) {
-
-		bzero(input, INPUT_BUFFER_MAX);
-	 	ret = fgets( input, INPUT_BUFFER_MAX, stdin );	
-		if ( !ret ) {
-			if ( ret == NULL ) {
-				perror("client_read(null)");
-			} else {		
-				perror("client_read");	
-			}
-			break;	
+/**
+ * grist_daemon - answer policy requests until the client closes the connection
+ *
+ * Postfix keeps a policy connection open across many requests, so in daemon
+ * mode the database connection (and the libdbi driver behind it) is opened once
+ * and reused for every request read from stdin. Input is read in chunks and 
+ * when the client sent several requests ahead, all of them are answered with 
+ * a single write. The cache and the auto-whitelist last as long as the
+ * connection does.
+ */
+int grist_daemon( struct t_grist_config *config ) {
+	struct t_policy_io io;
+	struct t_db *db = NULL;
+	ssize_t n;
+	int action, batch;
+	int served = 0;
+
+	// a vanished client shows up as EOF on the next read
+	signal(SIGPIPE, SIG_IGN);
+
+	if ( !db_cache_start(config) || !grist_awl_start(config) ) {
+		syslog(LOG_ERR, "greylist: unable to set up the cache or the auto-whitelist.");
+		db_cache_stop();
+		return -1;
+	}
+
+	syslog(LOG_INFO, "greylist: daemon mode, waiting for requests.");
+
+	grist_io_init(&io);
+
+	for (;;) {
+		batch = 0;
+		while ( grist_io_next(&io, &request) ) {
+			action = grist_check_request(&db, &request, config);
+			grist_log_action(action, &request);
+			grist_io_reply(&io, grist_io_reserve(&io), action);
+			++batch;
 		}
 
-		if ( strcmp(input, eol) == 0 ) {
-			_DBG("received end of policy request.");
-			client_done = 1; // just in case
+		if ( grist_io_flush(&io, STDOUT_FILENO) < 0 ) {
+			perror("client_write");
 			break;
 		}
-	
-		if ( ignore_client ) { continue; }
+		served += batch;
 
-		_DBG("received: %s", input);
+		// a full batch may have left more requests in the buffer
+		if ( batch == POLICY_PIPELINE_MAX ) { continue; }
 
-		if ( index(input,'=') == NULL ) {
-			_DBG("malformed request attribute, skipping.");
-			continue;
-		}
+		grist_io_compact(&io);
 
-		key = strtok(input, "=");
-		value = strtok(NULL, "=");
-				
-		_DBG("attribute parsed: key=%s value=%s", key, value);
-
-		// check request type (if we want to check for protocol sanity
-		// this string should always come first from the client)	
-		if ( strcmp(key,(char*)"request" ) == 0 ) {
-			if ( strcmp(value, (char *)"smtpd_access_policy") != 0 ){
-				// asking us for a response we don't handle
-				syslog(LOG_WARNING, "unsupported request: %s, ignoring client.", value);
-				ignore_client = 1;	
-			}	
-		}
-			
-		// save keys we want to work with
-		if (strcmp(key,(char*)"sender") == 0 ) {
-			request->sender = strdup(value); 
-		} else 
-		if (strcmp(key,(char*)"recipient") == 0 ) {
-			request->recipient = strdup(value);	
-		} else
-		if (strcmp(key,(char*)"client_address") == 0 ) {
-			request->client_address = strdup(value);	
-		} else
-		if (strcmp(key,(char*)"client_name") == 0 ) {
-			request->client_name = strdup(value);	
+		n = grist_io_read(&io, STDIN_FILENO);
+		if ( n == 0 ) { break; }
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			if ( errno == ENOBUFS ) {
+				syslog(LOG_WARNING, "request too large, giving up on client.");
+			} else {
+				perror("client_read");
+			}
+			break;
 		}
-			
 	}
 
-	_FREE( input );
+	if ( db != NULL ) {
+		db_close(db);
+	}
+
+	grist_awl_stop();
+	db_cache_stop();
 
-	request->timestamp = time(NULL);
+	syslog(LOG_INFO, "greylist: client closed connection after %d request(s).", served);
 
 	return 0;
-
 }
 
 /**
@@ -131,9 +157,12 @@ int get_policy_attributes( struct t_request *request) {
  */
 int main( int argc, char **argv ) {
 
+	static struct t_policy_io io;
 	struct t_grist_config config;
 	int action;
 	int perform_db_setup = 0;
+	int perform_db_migrate = 0;
+	int opt_daemon = 0;
 	char *opt_config = "/usr/local/etc/grist.conf";
 
 	// install signal traps
@@ -151,6 +180,14 @@ int main( int argc, char **argv ) {
 			valid_opt = 1;
 			perform_db_setup = 1;
 		} else
+		if (strcmp(argv[idx],"migrate-schema")==0) {
+			valid_opt = 1;
+			perform_db_migrate = 1;
+		} else
+		if (strcmp(argv[idx],"--daemon")==0) {
+			valid_opt = 1;
+			opt_daemon = 1;
+		} else
 		if (strcmp(argv[idx],"--conf")==0) {
 			valid_opt = 1;
 			if ( argc >= (idx+1) ){
@@ -166,19 +203,64 @@ int main( int argc, char **argv ) {
 	}
 
 	if ( (argc > 1) && (valid_opt == 0) ) {
-		        printf("usage: grist [--version,--conf <filename>,setup]\n");
+		        printf("usage: grist [--version,--conf <filename>,--daemon,setup,migrate-schema]\n");
 			printf("Try 'man grist' for more information.\n");
 			exit(1);
 	}
 
 	// parse configuration file
-	if ( !parse_config_file(opt_config, &config) ) {
+	if ( parse_config_file(opt_config, &config) != 1 ) {
 		fprintf(stderr,"unable to parse configuration file: %s\n", opt_config);
 		fprintf(stderr,"try passing the correct path of your configuration file with the --conf option\n.");
 		grist_cleanup();
 		exit(1);
 	}
 
+	grist_prepare_responses(&config);
+
+	// the memory store has nothing to set up and only lasts as long as grist
+	if ( strcmp(config.db_driver,"memory")==0 ) {
+		if ( perform_db_setup || perform_db_migrate ) {
+			printf("the memory driver keeps no database, nothing to do.\n");
+			grist_cleanup();
+			exit(0);
+		}
+		if ( !opt_daemon || (config.listen_unix[0] == '\0' && config.listen_port <= 0) ) {
+			syslog(LOG_WARNING, "db_driver memory forgets each triplet as soon as grist exits, run one 'grist --daemon' with listen_unix or listen_port instead.");
+		}
+	}
+
+	// the mmap table is a file of its own, sized once when it is created
+	if ( strcmp(config.db_driver,"mmap")==0 ) {
+		if ( perform_db_setup ) {
+			action = mmap_create_table(&config);
+			grist_cleanup();
+			exit(action == 0 ? 0 : 1);
+		}
+		if ( perform_db_migrate ) {
+			printf("the mmap driver has no schema to migrate.\n");
+			grist_cleanup();
+			exit(0);
+		}
+	}
+
+	// the shm segment is made by the first grist to need it
+	if ( strcmp(config.db_driver,"shm")==0 && (perform_db_setup || perform_db_migrate) ) {
+		printf("the shm driver makes its segment on first use, nothing to do.\n");
+		grist_cleanup();
+		exit(0);
+	}
+
+	// load the database drivers once for the life of the process
+	if ( db_needs_dbi(&config) && !db_initialize() ) {
+		if ( perform_db_setup || perform_db_migrate ) {
+			fprintf(stderr,"unable to initialize libdbi.\n");
+			grist_cleanup();
+			exit(1);
+		}
+		grist_safe_exit();
+	}
+
 	if ( perform_db_setup ) {
 		// create database table structure
 		dbi_conn conn = db_open_database( config );
@@ -189,71 +271,96 @@ int main( int argc, char **argv ) {
 			exit(1);
 		}
 		
-		db_create_structure(conn);
+		db_create_structure(conn, &config);
 		db_close_database(conn);
+		db_shutdown();
 		exit(0);
 	} 
 
+	if ( perform_db_migrate ) {
+		// bring a database created by an older release up to date
+		dbi_conn conn = db_open_database( config );
+
+		if ( conn == NULL ) {
+			fprintf(stderr,"error establishing a connection with the database.\n");
+			grist_cleanup();
+			exit(1);
+		}
+
+		action = db_migrate_structure(conn, &config);
+		db_close_database(conn);
+		db_shutdown();
+		exit(action == 0 ? 0 : 1);
+	}
+
+	// these are only started by grist_server()
+	if ( !opt_daemon || (config.listen_unix[0] == '\0' && config.listen_port <= 0) ) {
+		if ( config.db_write_behind_ms > 0 ) {
+			syslog(LOG_WARNING, "db_write_behind_ms is ignored without listen_unix or listen_port.");
+		}
+		if ( config.db_group_commit_ms > 0 ) {
+			syslog(LOG_WARNING, "db_group_commit_ms is ignored without listen_unix or listen_port.");
+		}
+		if ( config.db_bloom_mb > 0 ) {
+			syslog(LOG_WARNING, "db_bloom_mb is ignored without listen_unix or listen_port.");
+		}
+		if ( config.rq_pending_ttl > 0 || config.rq_accepted_ttl > 0 ) {
+			syslog(LOG_WARNING, "rq_pending_ttl and rq_accepted_ttl are ignored without listen_unix or listen_port, run 'gristool prune' instead.");
+		}
+	}
+
+	if ( !grist_whitelist_load(&config, opt_daemon) ) {
+		if ( opt_daemon ) {
+			fprintf(stderr,"unable to load the whitelists.\n");
+			grist_cleanup();
+			exit(1);
+		}
+		grist_safe_exit();
+	}
+
+	if ( opt_daemon ) {
+		// listen on our own sockets if configured, otherwise serve stdin
+		if ( config.listen_unix[0] != '\0' || config.listen_port > 0 ) {
+			if ( grist_server(&config) != 0 ) {
+				grist_cleanup();
+				exit(1);
+			}
+		} else if ( grist_daemon(&config) != 0 ) {
+			grist_cleanup();
+			exit(1);
+		}
+		db_shutdown();
+		grist_whitelist_free();
+		grist_cleanup();
+		_DBG("grist exiting.");		
+		return 0;
+	}
+
 	// read from stdin (client)
-	get_policy_attributes(&request);
+	grist_io_init(&io);
+	get_policy_attributes(&io, &request);
 
 	// make sure we have everything before passing over to the database
-	if ( request.client_address == NULL ||
-	     request.client_name    == NULL ||
-	     request.sender         == NULL ||
-	     request.recipient      == NULL 
-	   ) 
-	{
+	if ( !grist_request_complete(&request) ) {
 		syslog(LOG_WARNING,"skipping lookup, received incomplete request criteria.");
 		grist_safe_exit();
 	}
 
-	dbi_conn conn = db_open_database(config);
-	action = db_check_request(conn, request, config);
-	db_close_database(conn);
-
-	// NOTE: The following redundant code needs to be refactored before 1.x
-	//	 let's just focus on needed features atm.
-
-	// log results
-	switch ( action ) {
-		case CHECK_OKAY: syslog(LOG_INFO,"greylist: action=%s; client=%s from=<%s> to=<%s>", 
-					   RESPOND_QUEUE, request.client_address, request.sender, request.recipient);
-				    break;
-		case CHECK_COOLING: syslog(LOG_INFO,"greylist: action=%s, cooling; client=%s from=<%s> to=<%s>",
-					   RESPOND_DEFER, request.client_address, request.sender, request.recipient);
-				    break;
-		case CHECK_NEW    : syslog(LOG_INFO,"greylist: action=%s, new; client=%s from=<%s> to=<%s>",
-					   RESPOND_DEFER, request.client_address, request.sender, request.recipient);
-				    break;
-		default: syslog(LOG_INFO,"greylist: action=%s, internal error; client=%s from=<%s> to=<%s>",
-					   RESPOND_QUEUE, request.client_address, request.sender, request.recipient);
-	}
-	
-	// notify the client of our decision
-	switch ( action ) {
-		case CHECK_ERR    : 
-		case CHECK_OKAY   : fprintf(stdout,"action=%s\n", RESPOND_QUEUE);
-				    break;
-		case CHECK_COOLING: 
-		case CHECK_NEW    : if ( config.rq_defer_msg == NULL ) {
-			  	  	fprintf(stdout,"action=%s %s\n", RESPOND_DEFER, DEFAULT_DEFER_MSG);
-			       	    } else {
-				  	fprintf(stdout,"action=%s %s\n", RESPOND_DEFER, config.rq_defer_msg);
-			       	    }
-			       	    break;
-		default: syslog(LOG_DEBUG|LOG_ERR,"got invalid response code, internal error allowing anyway.");
-			 fprintf(stdout,"action=%s\n", RESPOND_QUEUE);
+	struct t_db *db = NULL;
+	action = grist_check_request(&db, &request, &config);
+	if ( db != NULL ) {
+		db_close(db);
 	}
+	db_shutdown();
+
+	grist_log_action(action, &request);
+	grist_io_reply(&io, grist_io_reserve(&io), action);
+	grist_io_flush(&io, STDOUT_FILENO);
 
 	grist_cleanup();
 	
 	_DBG("grist exiting.");		
 
-	// tell client we are finished
-	fprintf(stdout,"\n");
-	
 	return 0;
 }
 
-
@@ -0,0 +1,459 @@
+/**
+ * file: policy.c
+ * grist - postfix policy delegation protocol helpers
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <arpa/inet.h>
+
+void grist_reset_request( struct t_request *request ) {
+	// views only, the buffer they point into belongs to the caller
+	memset(request, 0, sizeof(struct t_request));
+}
+
+#define KEY_IS(key, len, name) ( (len) == sizeof(name)-1 && memcmp((key), (name), sizeof(name)-1) == 0 )
+
+/**
+ * grist_parse_attribute - record a single name=value attribute
+ *
+ * Keys are told apart by length and first byte before the one possible
+ * candidate is compared in full, everything we don't use is skipped.
+ */
+static void grist_parse_attribute( struct t_request *request, const char *key, size_t key_len,
+				   const char *value, size_t value_len ) {
+
+	switch ( key_len ) {
+		case 6: // sender
+			if ( KEY_IS(key, key_len, "sender") ) {
+				request->sender     = value;
+				request->sender_len = value_len;
+			}
+			break;
+		case 7: // request
+			if ( KEY_IS(key, key_len, "request") ) {
+				request->type     = value;
+				request->type_len = value_len;
+			}
+			break;
+		case 9: // recipient
+			if ( KEY_IS(key, key_len, "recipient") ) {
+				request->recipient     = value;
+				request->recipient_len = value_len;
+			}
+			break;
+		case 11: // client_name
+			if ( key[0] == 'c' && KEY_IS(key, key_len, "client_name") ) {
+				request->client_name     = value;
+				request->client_name_len = value_len;
+			}
+			break;
+		case 14: // client_address
+			if ( key[0] == 'c' && KEY_IS(key, key_len, "client_address") ) {
+				request->client_address     = value;
+				request->client_address_len = value_len;
+			}
+			break;
+	}
+}
+
+/**
+ * grist_parse_request - parse a complete policy request in place
+ *
+ * Looks for the empty line ending a request in buf. Until it shows up 0 is
+ * returned and *scanned remembers how far we got, so calling again once more
+ * data arrived doesn't look at the same lines twice (*scanned must start out 
+ * as 0 for every new request). 
+ *
+ * Once the request is complete each attribute line is split at its first '=',
+ * the terminator is replaced with a NUL and the values we care about are
+ * recorded in request as views into buf. Nothing is copied or allocated.
+ * Returns the number of bytes the request took up, including the empty line.
+ */
+size_t grist_parse_request( struct t_request *request, char *buf, size_t len, size_t *scanned ) {
+	char   *line, *eol, *eq, *end;
+	size_t pos = *scanned;
+	size_t consumed;
+
+	// find the empty line
+	for (;;) {
+		line = buf + pos;
+		eol  = memchr(line, '\n', len - pos);
+		if ( eol == NULL ) {
+			*scanned = pos;
+			return 0;
+		}
+
+		if ( eol == line || (eol == line+1 && *line == '\r') ) { break; }
+
+		pos = eol - buf + 1;
+	}
+
+	_DBG("received end of policy request.");
+
+	end      = line;
+	consumed = eol - buf + 1;
+	grist_reset_request(request);
+
+	for ( line = buf; line < end; line = eol + 1 ) {
+		eol = memchr(line, '\n', end - line);
+
+		// terminate in place, the value must not include the line end
+		*eol = '\0';
+		if ( eol > line && eol[-1] == '\r' ) { eol[-1] = '\0'; }
+
+		// split at the first '=', the value may well contain more of them
+		eq = memchr(line, '=', eol - line);
+		if ( eq == NULL || eq == line ) {
+			_DBG("malformed request attribute, skipping.");
+			continue;
+		}
+
+		grist_parse_attribute(request, line, eq - line, eq + 1, strlen(eq + 1));
+	}
+
+	*scanned = 0;
+
+	return consumed;
+}
+
+/**
+ * grist_request_supported - check the request is one we know how to answer
+ */
+int grist_request_supported( struct t_request *request ) {
+	// the request type should always come first from the client, don't
+	// be too strict about it missing though
+	if ( request->type == NULL ) { return 1; }
+
+	return KEY_IS(request->type, request->type_len, "smtpd_access_policy");
+}
+
+/**
+ * grist_request_complete - make sure we have everything before passing
+ * the request over to the database
+ */
+int grist_request_complete( struct t_request *request ) {
+	if ( request->client_address == NULL ||
+	     request->client_name    == NULL ||
+	     request->sender         == NULL ||
+	     request->recipient      == NULL
+	   )
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * grist_log_action - log the decision made for a request
+ */
+void grist_log_action( int action, struct t_request *request ) {
+
+	// NOTE: The following redundant code needs to be refactored before 1.x
+	//	 let's just focus on needed features atm.
+
+	switch ( action ) {
+		case CHECK_OKAY: syslog(LOG_INFO,"greylist: action=%s; client=%s from=<%s> to=<%s>",
+					   RESPOND_QUEUE, request->client_address, request->sender, request->recipient);
+				    break;
+		case CHECK_COOLING: syslog(LOG_INFO,"greylist: action=%s, cooling; client=%s from=<%s> to=<%s>",
+					   RESPOND_DEFER, request->client_address, request->sender, request->recipient);
+				    break;
+		case CHECK_NEW    : syslog(LOG_INFO,"greylist: action=%s, new; client=%s from=<%s> to=<%s>",
+					   RESPOND_DEFER, request->client_address, request->sender, request->recipient);
+				    break;
+		case CHECK_WHITELISTED: syslog(LOG_INFO,"greylist: action=%s, whitelisted; client=%s from=<%s> to=<%s>",
+					   RESPOND_QUEUE, request->client_address, request->sender, request->recipient);
+				    break;
+		case CHECK_TIMEOUT: syslog(LOG_INFO,"greylist: action=%s, database too slow; client=%s from=<%s> to=<%s>",
+					   RESPOND_QUEUE, request->client_address, request->sender, request->recipient);
+				    break;
+		default: syslog(LOG_INFO,"greylist: action=%s, internal error; client=%s from=<%s> to=<%s>",
+					   RESPOND_QUEUE, request->client_address, request->sender, request->recipient);
+	}
+}
+
+static char   reply_queue[RESPONSE_BUFFER_MAX];
+static char   reply_defer[RESPONSE_BUFFER_MAX];
+static size_t reply_queue_len;
+static size_t reply_defer_len;
+
+/**
+ * grist_prepare_responses - format the replies we can send once, they only 
+ * depend on the configuration
+ */
+void grist_prepare_responses( struct t_grist_config *config ) {
+	int len;
+
+	reply_queue_len = snprintf(reply_queue, sizeof(reply_queue), "action=%s\n\n", RESPOND_QUEUE);
+
+	if ( config->rq_defer_msg[0] == '\0' ) {
+		len = snprintf(reply_defer, sizeof(reply_defer), "action=%s %s\n\n", RESPOND_DEFER, DEFAULT_DEFER_MSG);
+	} else {
+		len = snprintf(reply_defer, sizeof(reply_defer), "action=%s %s\n\n", RESPOND_DEFER, config->rq_defer_msg);
+	}
+
+	// a truncated reply is still terminated so the client isn't left hanging
+	if ( len < 0 || (size_t)len >= sizeof(reply_defer) ) {
+		len = snprintf(reply_defer, sizeof(reply_defer), "action=%s %s\n\n", RESPOND_DEFER, DEFAULT_DEFER_MSG);
+	}
+	reply_defer_len = len;
+}
+
+/**
+ * grist_response - the reply for a decision, including the empty line that 
+ * ends it
+ */
+const char *grist_response( int action, size_t *len ) {
+	switch ( action ) {
+		case CHECK_ERR    :
+		case CHECK_TIMEOUT:
+		case CHECK_WHITELISTED:
+		case CHECK_OKAY   : *len = reply_queue_len;
+				    return reply_queue;
+		case CHECK_COOLING:
+		case CHECK_NEW    : *len = reply_defer_len;
+				    return reply_defer;
+		default: syslog(LOG_DEBUG|LOG_ERR,"got invalid response code, internal error allowing anyway.");
+			 *len = reply_queue_len;
+			 return reply_queue;
+	}
+}
+
+/*
+ * Buffered client i/o. Input is read in large chunks and every complete 
+ * request in the buffer is parsed in place, a request split across reads is
+ * picked up where the scan left off. Replies are queued as iovecs pointing 
+ * at the prepared responses so a whole batch goes out with a single writev().
+ */
+
+void grist_io_init( struct t_policy_io *io ) {
+	io->in_len   = 0;
+	io->in_off   = 0;
+	io->scanned  = 0;
+	io->out_cnt  = 0;
+	io->out_sent = 0;
+}
+
+/**
+ * grist_io_read - read whatever the client sent into the free buffer space
+ *
+ * Returns what read() did, except that a full buffer is reported as -1 with
+ * errno set to ENOBUFS.
+ */
+ssize_t grist_io_read( struct t_policy_io *io, int fd ) {
+	ssize_t n;
+
+	if ( io->in_len == sizeof(io->in) ) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	n = read(fd, io->in + io->in_len, sizeof(io->in) - io->in_len);
+	if ( n > 0 ) { io->in_len += n; }
+
+	return n;
+}
+
+/**
+ * grist_io_next - parse the next complete request in the buffer
+ *
+ * Returns 0 if there is none yet, or if there is no room left to queue
+ * another reply until the pending ones are flushed.
+ */
+int grist_io_next( struct t_policy_io *io, struct t_request *request ) {
+	size_t n;
+
+	if ( io->out_cnt == POLICY_PIPELINE_MAX ) { return 0; }
+
+	n = grist_parse_request(request, io->in + io->in_off, io->in_len - io->in_off, &io->scanned);
+	if ( n == 0 ) { return 0; }
+
+	io->in_off += n;
+	request->timestamp = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &request->received);
+
+	return 1;
+}
+
+/**
+ * grist_io_reserve - reserve the next reply slot, to be filled in with 
+ * grist_io_reply() once the decision is made 
+ */
+int grist_io_reserve( struct t_policy_io *io ) {
+	io->out[io->out_cnt].iov_base = NULL;
+	io->out[io->out_cnt].iov_len  = 0;
+
+	return io->out_cnt++;
+}
+
+void grist_io_reply( struct t_policy_io *io, int slot, int action ) {
+	size_t len;
+
+	io->out[slot].iov_base = (void *)grist_response(action, &len);
+	io->out[slot].iov_len  = len;
+}
+
+/**
+ * grist_io_flush - write all queued replies
+ *
+ * Returns 1 once everything went out, 0 if the socket would block and -1 on
+ * error. Every reserved slot must have been filled in.
+ */
+int grist_io_flush( struct t_policy_io *io, int fd ) {
+	struct iovec *iov;
+	ssize_t n;
+
+	while ( io->out_sent < io->out_cnt ) {
+		n = writev(fd, io->out + io->out_sent, io->out_cnt - io->out_sent);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			if ( errno == EAGAIN || errno == EWOULDBLOCK ) { return 0; }
+			return -1;
+		}
+
+		// skip what was written, a partly written reply resumes mid-way
+		while ( n > 0 ) {
+			iov = &io->out[io->out_sent];
+			if ( (size_t)n < iov->iov_len ) {
+				iov->iov_base = (char *)iov->iov_base + n;
+				iov->iov_len -= n;
+				break;
+			}
+			n -= iov->iov_len;
+			++io->out_sent;
+		}
+	}
+
+	io->out_cnt  = 0;
+	io->out_sent = 0;
+
+	return 1;
+}
+
+/**
+ * grist_io_compact - drop the requests that have been dealt with from the 
+ * buffer, nothing may still point into them
+ */
+void grist_io_compact( struct t_policy_io *io ) {
+	if ( io->in_off == 0 ) { return; }
+
+	memmove(io->in, io->in + io->in_off, io->in_len - io->in_off);
+	io->in_len -= io->in_off;
+	io->in_off  = 0;
+}
+
+/**
+ * grist_mask_client - pick what the client part of the triplet is
+ *
+ * With rq_ipv4_netmask or rq_ipv6_netmask narrower than an address, the
+ * triplet is stored under the client's network rather than its address, so
+ * a sender retrying from another host of its pool isn't greylisted again.
+ * The network is written out as its first address, in the same text the
+ * address column holds for unmasked clients, so rows stored before and
+ * after a change of netmask share one column, one index and what gristool
+ * reads. The memory store keeps it as binary, the mmap store only hashes
+ * it.
+ */
+static void grist_mask_client( struct t_request *request, struct t_grist_config *config ) {
+	uint8_t key[RADIX_KEY_LEN];
+	int bits, v4, i;
+
+	request->client_key     = request->client_address;
+	request->client_key_len = request->client_address_len;
+
+	if ( config->rq_ipv4_netmask >= 32 && config->rq_ipv6_netmask >= 128 ) { return; }
+
+	// an IPv4 netmask counts from behind the prefix it is mapped under
+	if ( (bits = radix_key(request->client_address, key)) == 0 ) { return; }
+	v4   = bits == 32;
+	bits = v4 ? RADIX_V4_BITS + config->rq_ipv4_netmask : config->rq_ipv6_netmask;
+
+	for ( i = 0; i < RADIX_KEY_LEN; i++, bits -= 8 ) {
+		if ( bits <= 0 ) {
+			key[i] = 0;
+		} else if ( bits < 8 ) {
+			key[i] &= (uint8_t)(0xff << (8 - bits));
+		}
+	}
+
+	if ( v4 ) {
+		if ( inet_ntop(AF_INET, key + RADIX_V4_BITS/8, request->client_network, sizeof(request->client_network)) == NULL ) { return; }
+	} else if ( inet_ntop(AF_INET6, key, request->client_network, sizeof(request->client_network)) == NULL ) {
+		return;
+	}
+
+	request->client_key     = request->client_network;
+	request->client_key_len = strlen(request->client_network);
+}
+
+/**
+ * grist_check_request - check a complete request against the database
+ *
+ * The connection is opened on first use and dropped after an error, so a 
+ * database that went away underneath a long running process is reconnected
+ * on the next request instead of taking grist down with it.
+ */
+int grist_check_request( struct t_db **db, struct t_request *request, struct t_grist_config *config ) {
+	int action;
+
+	if ( !grist_request_supported(request) ) {
+		// asking us for a response we don't handle
+		syslog(LOG_WARNING, "unsupported request: %s, ignoring client.", request->type);
+		return CHECK_ERR;
+	}
+
+	if ( !grist_request_complete(request) ) {
+		syslog(LOG_WARNING,"skipping lookup, received incomplete request criteria.");
+		return CHECK_ERR;
+	}
+
+	// listed clients, recipients and senders and networks that have passed
+	// often enough aren't looked up at all
+	if ( grist_whitelist_check(request) || grist_awl_check(request, config) ) {
+		return CHECK_WHITELISTED;
+	}
+
+	grist_mask_client(request, config);
+
+	if ( *db == NULL ) {
+		*db = db_open(config);
+		if ( *db == NULL ) {
+			syslog(LOG_ERR, "greylist: unable to connect to the database.");
+			return CHECK_ERR;
+		}
+	}
+
+	action = db_check(*db, request, config);
+
+	// a connection that was only kept waiting on a lock is kept
+	if ( action == CHECK_ERR ) {
+		db_close(*db);
+		*db = NULL;
+	}
+
+	if ( action == CHECK_OKAY ) {
+		grist_awl_count(request, config);
+	}
+
+	return action;
+}
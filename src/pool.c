@@ -0,0 +1,281 @@
+/**
+ * file: pool.c
+ * grist - worker threads performing database checks for the server
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+#define CACHE_LINE	64
+
+/*
+ * Bounded multi-producer/multi-consumer queue of pointers. Each slot carries
+ * a sequence number telling whose turn it is, so producers and consumers only
+ * ever contend on a single compare-and-swap of their own position counter.
+ */
+struct t_queue_slot {
+	size_t seq;
+	void   *data;
+};
+
+struct t_queue {
+	struct t_queue_slot *slots;
+	size_t mask;
+	char   pad0[CACHE_LINE];
+	size_t enqueue_pos;
+	char   pad1[CACHE_LINE];
+	size_t dequeue_pos;
+	char   pad2[CACHE_LINE];
+};
+
+static int queue_init( struct t_queue *queue, size_t size ) {
+	size_t i;
+
+	// size must be a power of two for the index mask to work
+	_ASSERT( (size & (size-1)) == 0 );
+
+	queue->slots = (struct t_queue_slot *)malloc(sizeof(struct t_queue_slot)*size);
+	if ( queue->slots == NULL ) { return 0; }
+
+	for ( i = 0; i < size; i++ ) {
+		queue->slots[i].seq  = i;
+		queue->slots[i].data = NULL;
+	}
+
+	queue->mask        = size - 1;
+	queue->enqueue_pos = 0;
+	queue->dequeue_pos = 0;
+
+	return 1;
+}
+
+static int queue_push( struct t_queue *queue, void *data ) {
+	struct t_queue_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+
+	pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if ( diff == 0 ) {
+			if ( __atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos+1, 1,
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+				break;
+			}
+		} else if ( diff < 0 ) {
+			return 0; // full
+		} else {
+			pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->data = data;
+	__atomic_store_n(&slot->seq, pos+1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+static void *queue_pop( struct t_queue *queue ) {
+	struct t_queue_slot *slot;
+	size_t pos, seq;
+	intptr_t diff;
+	void *data;
+
+	pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &queue->slots[pos & queue->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (intptr_t)seq - (intptr_t)(pos+1);
+
+		if ( diff == 0 ) {
+			if ( __atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos+1, 1,
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+				break;
+			}
+		} else if ( diff < 0 ) {
+			return NULL; // empty
+		} else {
+			pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	data = slot->data;
+	__atomic_store_n(&slot->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+
+	return data;
+}
+
+struct t_pool {
+	struct t_grist_config *config;
+	struct t_queue jobs;		// submitted by the event loop, taken by workers
+	struct t_queue done;		// finished by workers, collected by the event loop
+	sem_t      pending;		// counts jobs waiting, idle workers sleep on it
+	int        notify_fd;		// written to whenever a job is finished
+	int        stop;
+	int        num_threads;
+	int        outstanding;		// only touched by the event loop
+	int        capacity;
+	pthread_t  *threads;
+};
+
+static void *pool_worker( void *arg ) {
+	struct t_pool *pool = (struct t_pool *)arg;
+	struct t_job  *job;
+	struct t_db *db = NULL;
+	uint64_t one = 1;
+
+	// every worker owns its connection, queries never wait on each other
+	while ( 1 ) {
+		if ( sem_wait(&pool->pending) != 0 ) {
+			if ( errno == EINTR ) { continue; }
+			break;
+		}
+
+		if ( __atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE) ) { break; }
+
+		job = (struct t_job *)queue_pop(&pool->jobs);
+		if ( job == NULL ) { continue; }
+
+		job->action = grist_check_request(&db, &job->request, pool->config);
+
+		// the loop never has more jobs outstanding than the queue holds
+		queue_push(&pool->done, job);
+
+		if ( write(pool->notify_fd, &one, sizeof(one)) < 0 ) {
+			syslog(LOG_ERR, "pool: unable to notify event loop.");
+		}
+	}
+
+	if ( db != NULL ) {
+		db_close(db);
+	}
+
+	return NULL;
+}
+
+/**
+ * pool_create - start the worker threads
+ *
+ * notify_fd is an eventfd the event loop waits on, it is bumped after each
+ * finished job so completions can be collected with pool_completed().
+ */
+struct t_pool *pool_create( struct t_grist_config *config, int num_threads, int notify_fd ) {
+	struct t_pool *pool;
+	int i, size;
+
+	pool = (struct t_pool *)calloc(1, sizeof(struct t_pool));
+	if ( pool == NULL ) { return NULL; }
+
+	// plenty of room for every worker to have a backlog
+	for ( size = 64; size < num_threads*64; size <<= 1 ) ;
+
+	pool->config      = config;
+	pool->notify_fd   = notify_fd;
+	pool->capacity    = size;
+	pool->num_threads = 0;
+
+	if ( !queue_init(&pool->jobs, size) || !queue_init(&pool->done, size) ) {
+		_FREE(pool->jobs.slots);
+		_FREE(pool->done.slots);
+		free(pool);
+		return NULL;
+	}
+
+	sem_init(&pool->pending, 0, 0);
+
+	pool->threads = (pthread_t *)calloc(num_threads, sizeof(pthread_t));
+	if ( pool->threads == NULL ) {
+		pool_destroy(pool);
+		return NULL;
+	}
+
+	for ( i = 0; i < num_threads; i++ ) {
+		if ( pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0 ) {
+			syslog(LOG_ERR, "pool: unable to start worker thread #%d.", i);
+			pool_destroy(pool);
+			return NULL;
+		}
+		++pool->num_threads;
+	}
+
+	syslog(LOG_INFO, "pool: started %d worker thread(s).", num_threads);
+
+	return pool;
+}
+
+/**
+ * pool_submit - hand a request over to the workers
+ *
+ * Returns 0 if the workers are too far behind to take it.
+ */
+int pool_submit( struct t_pool *pool, struct t_job *job ) {
+	if ( pool->outstanding >= pool->capacity ) { return 0; }
+
+	if ( !queue_push(&pool->jobs, job) ) { return 0; }
+
+	++pool->outstanding;
+	sem_post(&pool->pending);
+
+	return 1;
+}
+
+/**
+ * pool_completed - fetch the next finished job, NULL if there are none
+ */
+struct t_job *pool_completed( struct t_pool *pool ) {
+	struct t_job *job;
+
+	job = (struct t_job *)queue_pop(&pool->done);
+	if ( job != NULL ) { --pool->outstanding; }
+
+	return job;
+}
+
+/**
+ * pool_destroy - stop and join the workers
+ *
+ * Jobs still queued are not processed, the caller owns them as before.
+ */
+void pool_destroy( struct t_pool *pool ) {
+	int i;
+
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+
+	for ( i = 0; i < pool->num_threads; i++ ) {
+		sem_post(&pool->pending);
+	}
+	for ( i = 0; i < pool->num_threads; i++ ) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	sem_destroy(&pool->pending);
+
+	_FREE(pool->threads);
+	_FREE(pool->jobs.slots);
+	_FREE(pool->done.slots);
+	free(pool);
+}
@@ -0,0 +1,481 @@
+/**
+ * file: radix.c
+ * grist - path compressed binary radix tree of address prefixes
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <arpa/inet.h>
+
+/*
+ * Keys are 128 bit IPv6 addresses, IPv4 addresses are kept mapped into
+ * ::ffff:0:0/96 so both families share one tree. Nodes only exist where a
+ * prefix was inserted or where two prefixes part ways, a lookup visits at
+ * most one node per prefix length on its path. The tree does no locking of
+ * its own.
+ */
+struct t_radix_node {
+	uint8_t key[RADIX_KEY_LEN];	// bits past the node's length are zero
+	int     bits;
+	int     set;		// a prefix was inserted here, not just a fork
+	long    value;
+	struct t_radix_node *child[2];
+};
+
+struct t_radix {
+	struct t_radix_node *root;
+	long   nodes;
+};
+
+static int radix_bit( const uint8_t *key, int bit ) {
+	return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/**
+ * radix_common - how many leading bits two keys share, at most limit
+ */
+static int radix_common( const uint8_t *a, const uint8_t *b, int limit ) {
+	int i, bits = 0;
+	uint8_t diff;
+
+	for ( i = 0; bits < limit; i++, bits += 8 ) {
+		diff = a[i] ^ b[i];
+		if ( diff != 0 ) {
+			while ( !(diff & 0x80) ) { diff <<= 1; ++bits; }
+			break;
+		}
+	}
+
+	return bits < limit ? bits : limit;
+}
+
+static struct t_radix_node *radix_node( struct t_radix *tree, const uint8_t *key, int bits ) {
+	struct t_radix_node *node;
+	int i;
+
+	node = (struct t_radix_node *)calloc(1, sizeof(struct t_radix_node));
+	if ( node == NULL ) { return NULL; }
+
+	// keep only the prefix, later comparisons rely on the rest being zero
+	for ( i = 0; i < RADIX_KEY_LEN; i++ ) {
+		if ( bits >= (i+1)*8 ) {
+			node->key[i] = key[i];
+		} else if ( bits > i*8 ) {
+			node->key[i] = key[i] & (uint8_t)(0xff << (8 - (bits - i*8)));
+		}
+	}
+	node->bits = bits;
+	++tree->nodes;
+
+	return node;
+}
+
+struct t_radix *radix_create( void ) {
+	return (struct t_radix *)calloc(1, sizeof(struct t_radix));
+}
+
+/**
+ * radix_key - turn an address as postfix passes it into a key
+ *
+ * IPv4 addresses are mapped into ::ffff:0:0/96 so both kinds share one
+ * key space. Returns the length of the address, 32 for IPv4 and 128 for
+ * IPv6, or 0 if it isn't one. Either way the key is RADIX_KEY_LEN bytes
+ * long. The whitelists, the client netmask and the memory store all read
+ * addresses through it.
+ */
+int radix_key( const char *address, uint8_t key[RADIX_KEY_LEN] ) {
+	struct in_addr v4;
+
+	memset(key, 0, RADIX_KEY_LEN);
+
+	if ( inet_pton(AF_INET, address, &v4) == 1 ) {
+		key[10] = 0xff;
+		key[11] = 0xff;
+		memcpy(key + 12, &v4, 4);
+		return 32;
+	}
+
+	if ( inet_pton(AF_INET6, address, key) == 1 ) {
+		return 128;
+	}
+
+	return 0;
+}
+
+/**
+ * radix_insert - find or add the node for a prefix
+ *
+ * Returns the node's value to be filled in, NULL if out of memory.
+ */
+long *radix_insert( struct t_radix *tree, const uint8_t *key, int bits ) {
+	struct t_radix_node **link, *node, *fork, *leaf;
+	int common;
+
+	for ( link = &tree->root; (node = *link) != NULL; link = &node->child[radix_bit(key, node->bits)] ) {
+		common = radix_common(node->key, key, node->bits < bits ? node->bits : bits);
+
+		if ( common < node->bits ) {
+			// the new prefix parts from this node's, or lies above it
+			if ( common == bits ) {
+				leaf = radix_node(tree, key, bits);
+				if ( leaf == NULL ) { return NULL; }
+				leaf->child[radix_bit(node->key, bits)] = node;
+				*link = leaf;
+				leaf->set = 1;
+				return &leaf->value;
+			}
+
+			fork = radix_node(tree, key, common);
+			leaf = radix_node(tree, key, bits);
+			if ( fork == NULL || leaf == NULL ) {
+				_FREE(fork);
+				_FREE(leaf);
+				return NULL;
+			}
+			fork->child[radix_bit(node->key, common)] = node;
+			fork->child[radix_bit(key, common)]       = leaf;
+			*link = fork;
+			leaf->set = 1;
+			return &leaf->value;
+		}
+
+		if ( node->bits == bits ) {
+			node->set = 1;
+			return &node->value;
+		}
+	}
+
+	leaf = radix_node(tree, key, bits);
+	if ( leaf == NULL ) { return NULL; }
+	*link = leaf;
+	leaf->set = 1;
+
+	return &leaf->value;
+}
+
+/**
+ * radix_prefix - whether a node's prefix covers a key
+ */
+static int radix_prefix( const struct t_radix_node *node, const uint8_t *key ) {
+	int whole = node->bits >> 3, rest = node->bits & 7;
+
+	if ( memcmp(node->key, key, whole) != 0 ) { return 0; }
+
+	return rest == 0 || (node->key[whole] ^ key[whole]) >> (8 - rest) == 0;
+}
+
+/**
+ * radix_find - the value of exactly this prefix, NULL if it wasn't inserted
+ */
+long *radix_find( struct t_radix *tree, const uint8_t *key, int bits ) {
+	struct t_radix_node *node;
+
+	// only the bit each node branches on is looked at on the way down, the
+	// node found is checked against the whole key once
+	for ( node = tree->root; node != NULL && node->bits < bits; node = node->child[radix_bit(key, node->bits)] ) ;
+
+	if ( node == NULL || node->bits != bits || !node->set || !radix_prefix(node, key) ) { return NULL; }
+
+	return &node->value;
+}
+
+/**
+ * radix_match - the value of the longest inserted prefix of a key
+ *
+ * Returns NULL if no inserted prefix covers it.
+ */
+long *radix_match( struct t_radix *tree, const uint8_t *key, int bits ) {
+	struct t_radix_node *node, *path[129];
+	int n = 0;
+
+	for ( node = tree->root; node != NULL && node->bits <= bits; node = node->child[radix_bit(key, node->bits)] ) {
+		if ( node->set ) { path[n++] = node; }
+		if ( node->bits == bits ) { break; }
+	}
+
+	// a prefix that doesn't cover the key rules out the longer ones below it,
+	// so the deepest that does is the answer
+	while ( n-- > 0 ) {
+		if ( radix_prefix(path[n], key) ) { return &path[n]->value; }
+	}
+
+	return NULL;
+}
+
+/*
+ * A tree that no longer changes can be compiled into a table that only
+ * answers whether an address is covered. It is a poptrie: the first
+ * RADIX_DIRECT_BITS of an address index straight into an array, after that
+ * each node takes RADIX_STRIDE bits at once. A node keeps one bit per
+ * branch that goes on deeper and one per branch that ends covered, and
+ * the children it goes on to sit next to each other, found by counting the
+ * bits below the one taken. IPv4 and IPv6 each have a direct array, so an
+ * IPv4 lookup starts at its own first bit and touches at most five lines.
+ */
+#define RADIX_DIRECT_BITS	16
+#define RADIX_STRIDE		6
+#define RADIX_LEAF		0x80000000u	// a direct entry that ends there, covered in bit 0
+
+struct t_radix_table_node {
+	uint64_t deeper;	// branches with a child node
+	uint64_t covered;	// branches that end covered
+	uint32_t base;		// the first child node
+};
+
+struct t_radix_table {
+	uint32_t direct[2][1 << RADIX_DIRECT_BITS];	// IPv4, IPv6
+	struct t_radix_table_node *nodes;
+	uint32_t count;
+	uint32_t size;
+};
+
+static const uint8_t radix_v4_mapped[12] = { 0,0,0,0, 0,0,0,0, 0,0,0xff,0xff };
+
+/**
+ * radix_bits - n bits of a key starting at pos, n at most 16
+ */
+static unsigned radix_bits( const uint8_t *key, int pos, int n ) {
+	uint32_t window = 0;
+	int i, byte = pos >> 3;
+
+	for ( i = 0; i < 3 && byte + i < RADIX_KEY_LEN; i++ ) {
+		window |= (uint32_t)key[byte + i] << (16 - 8*i);
+	}
+
+	return (window >> (24 - (pos & 7) - n)) & ((1u << n) - 1);
+}
+
+static void radix_set_bits( uint8_t *key, int pos, int n, unsigned value ) {
+	int i, bit;
+
+	for ( i = 0; i < n; i++ ) {
+		bit = pos + i;
+		if ( (value >> (n - 1 - i)) & 1 ) {
+			key[bit >> 3] |= 0x80 >> (bit & 7);
+		} else {
+			key[bit >> 3] &= ~(0x80 >> (bit & 7));
+		}
+	}
+}
+
+/**
+ * table_walk - follow a branch of bits bits down the tree
+ *
+ * Starts from sub, the node the parent's walk ended at, and sets covered if
+ * an inserted prefix passed on the way covers the branch. Returns the node
+ * below which longer prefixes of the branch are, or NULL if there are none.
+ */
+static struct t_radix_node *table_walk( struct t_radix_node *sub, const uint8_t *key, int bits, int *covered ) {
+	struct t_radix_node *node;
+
+	for ( node = sub; node != NULL && node->bits < bits; node = node->child[radix_bit(key, node->bits)] ) {
+		if ( !radix_prefix(node, key) ) { return NULL; }
+		if ( node->set ) { *covered = 1; }
+	}
+
+	if ( node == NULL || radix_common(node->key, key, bits) < bits ) { return NULL; }
+
+	if ( node->bits == bits ) {
+		if ( node->set ) { *covered = 1; }
+		if ( node->child[0] == NULL && node->child[1] == NULL ) { return NULL; }
+	}
+
+	return node;
+}
+
+/**
+ * table_reserve - room for n child nodes next to each other
+ *
+ * Returns the index of the first, or 0 if out of memory, node 0 is never
+ * handed out so it can't be mistaken for one.
+ */
+static uint32_t table_reserve( struct t_radix_table *table, uint32_t n ) {
+	struct t_radix_table_node *nodes;
+	uint32_t first;
+
+	while ( table->count + n > table->size ) {
+		nodes = (struct t_radix_table_node *)realloc(table->nodes, table->size * 2 * sizeof(struct t_radix_table_node));
+		if ( nodes == NULL ) { return 0; }
+		table->nodes = nodes;
+		table->size *= 2;
+	}
+
+	first = table->count;
+	table->count += n;
+
+	return first;
+}
+
+/**
+ * table_build - fill in a node for the prefix of pos bits in key
+ */
+static int table_build( struct t_radix_table *table, uint32_t at, uint8_t *key, int pos, int covered, struct t_radix_node *sub ) {
+	struct t_radix_node *below[1 << RADIX_STRIDE];
+	uint64_t deeper = 0, leaves = 0;
+	uint32_t base = 0, next;
+	int stride, v, c, ok = 1;
+
+	stride = RADIX_KEY_LEN*8 - pos < RADIX_STRIDE ? RADIX_KEY_LEN*8 - pos : RADIX_STRIDE;
+
+	for ( v = 0; v < (1 << stride); v++ ) {
+		radix_set_bits(key, pos, stride, v);
+		c = covered;
+		below[v] = table_walk(sub, key, pos + stride, &c);
+		if ( below[v] != NULL ) { deeper |= 1ULL << v; }
+		if ( c ) { leaves |= 1ULL << v; }
+	}
+
+	if ( deeper != 0 ) {
+		base = table_reserve(table, __builtin_popcountll(deeper));
+		if ( base == 0 ) { ok = 0; }
+	}
+
+	table->nodes[at].deeper  = deeper;
+	table->nodes[at].covered = leaves;
+	table->nodes[at].base    = base;
+
+	for ( v = 0, next = base; ok && v < (1 << stride); v++ ) {
+		if ( !(deeper & (1ULL << v)) ) { continue; }
+		radix_set_bits(key, pos, stride, v);
+		ok = table_build(table, next++, key, pos + stride, (leaves >> v) & 1, below[v]);
+	}
+
+	radix_set_bits(key, pos, stride, 0);
+
+	return ok;
+}
+
+/**
+ * radix_compile - the table answering whether a tree covers an address
+ *
+ * The tree is left as it was. Returns NULL if out of memory.
+ */
+struct t_radix_table *radix_compile( struct t_radix *tree ) {
+	struct t_radix_table *table;
+	struct t_radix_node *sub, *top, *below;
+	uint8_t key[RADIX_KEY_LEN];
+	uint32_t at, *entry;
+	int family, pos, hi, lo, c_hi, c, covered, ok = 1;
+
+	table = (struct t_radix_table *)calloc(1, sizeof(struct t_radix_table));
+	if ( table == NULL ) { return NULL; }
+
+	table->size  = 1024;
+	table->count = 1;
+	table->nodes = (struct t_radix_table_node *)malloc(table->size * sizeof(struct t_radix_table_node));
+	if ( table->nodes == NULL ) {
+		free(table);
+		return NULL;
+	}
+
+	for ( family = 0; ok && family < 2; family++ ) {
+		memset(key, 0, RADIX_KEY_LEN);
+		covered = 0;
+		pos     = 0;
+		sub     = tree->root;
+
+		// IPv4 takes over where the prefixes above ::ffff:0:0/96 leave off
+		if ( family == 0 ) {
+			memcpy(key, radix_v4_mapped, sizeof(radix_v4_mapped));
+			pos = RADIX_V4_BITS;
+			sub = table_walk(tree->root, key, RADIX_V4_BITS, &covered);
+		}
+
+		// the direct array is filled a half at a time, so a range without
+		// longer prefixes is filled in without walking the tree for each entry
+		for ( hi = 0; ok && hi < (1 << RADIX_DIRECT_BITS/2); hi++ ) {
+			radix_set_bits(key, pos, RADIX_DIRECT_BITS/2, hi);
+			c_hi = covered;
+			top  = table_walk(sub, key, pos + RADIX_DIRECT_BITS/2, &c_hi);
+
+			for ( lo = 0; ok && lo < (1 << RADIX_DIRECT_BITS/2); lo++ ) {
+				radix_set_bits(key, pos + RADIX_DIRECT_BITS/2, RADIX_DIRECT_BITS/2, lo);
+				c     = c_hi;
+				below = table_walk(top, key, pos + RADIX_DIRECT_BITS, &c);
+				entry = &table->direct[family][hi << RADIX_DIRECT_BITS/2 | lo];
+				*entry = RADIX_LEAF | c;
+
+				if ( below != NULL ) {
+					at = table_reserve(table, 1);
+					ok = at != 0 && table_build(table, at, key, pos + RADIX_DIRECT_BITS, c, below);
+					*entry = at;
+				}
+			}
+		}
+	}
+
+	if ( !ok ) {
+		radix_table_destroy(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+/**
+ * radix_table_match - whether an address is covered, the key of a whole one
+ */
+int radix_table_match( struct t_radix_table *table, const uint8_t *key ) {
+	struct t_radix_table_node *node;
+	uint32_t entry;
+	unsigned v;
+	int pos, stride;
+
+	pos = memcmp(key, radix_v4_mapped, sizeof(radix_v4_mapped)) == 0 ? RADIX_V4_BITS : 0;
+
+	entry = table->direct[pos == 0][radix_bits(key, pos, RADIX_DIRECT_BITS)];
+	if ( entry & RADIX_LEAF ) { return entry & 1; }
+
+	pos += RADIX_DIRECT_BITS;
+	for ( node = &table->nodes[entry]; ; pos += stride ) {
+		stride = RADIX_KEY_LEN*8 - pos < RADIX_STRIDE ? RADIX_KEY_LEN*8 - pos : RADIX_STRIDE;
+		v = radix_bits(key, pos, stride);
+
+		if ( !(node->deeper & (1ULL << v)) ) { return (node->covered >> v) & 1; }
+
+		node = &table->nodes[node->base + __builtin_popcountll(node->deeper & ((1ULL << v) - 1))];
+	}
+}
+
+void radix_table_destroy( struct t_radix_table *table ) {
+	if ( table == NULL ) { return; }
+
+	_FREE(table->nodes);
+	free(table);
+}
+
+long radix_count( struct t_radix *tree ) {
+	return tree->nodes;
+}
+
+static void radix_free( struct t_radix_node *node ) {
+	if ( node == NULL ) { return; }
+
+	radix_free(node->child[0]);
+	radix_free(node->child[1]);
+	free(node);
+}
+
+void radix_destroy( struct t_radix *tree ) {
+	if ( tree == NULL ) { return; }
+
+	radix_free(tree->root);
+	free(tree);
+}
@@ -0,0 +1,574 @@
+/**
+ * file: server.c
+ * grist - standalone policy server listening on unix and tcp sockets
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define SERVER_MAX_EVENTS	64
+#define SERVER_MAX_LISTENERS	8
+
+/*
+ * Every smtpd process holds its own connection to us. A client is a small
+ * state machine: bytes are read into its buffer as they arrive, every 
+ * complete request found there is parsed in place and checked, and the 
+ * replies are queued until the socket takes them, all in one writev().
+ *
+ * With worker threads the checks run elsewhere: each request goes out in the
+ * job matching its reply slot and the client has jobs 'pending' until the 
+ * pool hands them back. Replies go out once all of them are back, in order.
+ */
+struct t_client {
+	int    fd;
+	int    events;		// epoll events currently registered
+	int    pending;		// requests out with the workers
+	int    eof;		// the client sent all it is going to
+	struct t_policy_io io;
+	struct t_request   request;
+	struct t_job       jobs[POLICY_PIPELINE_MAX];
+	struct t_client *prev, *next;
+};
+
+struct t_server {
+	int    epfd;
+	int    listeners[SERVER_MAX_LISTENERS];
+	int    num_listeners;
+	struct t_client *clients;
+	struct t_client *closed;	// freed once the current batch of events is done
+	int    num_clients;
+	struct t_db *db;
+	struct t_pool *pool;
+	int    notify_fd;
+	struct t_grist_config *config;
+};
+
+static volatile sig_atomic_t server_shutdown = 0;
+
+static void server_trap_signal( int sig ) {
+	(void)sig;
+	server_shutdown = 1;
+}
+
+static int server_add_listener( struct t_server *server, int fd ) {
+	struct epoll_event ev;
+
+	if ( server->num_listeners >= SERVER_MAX_LISTENERS ) {
+		syslog(LOG_ERR, "server: too many listening sockets.");
+		close(fd);
+		return -1;
+	}
+
+	if ( listen(fd, SOMAXCONN) != 0 ) {
+		syslog(LOG_ERR, "server: listen failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	// listeners are told apart from clients by pointing into this array
+	server->listeners[server->num_listeners] = fd;
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &server->listeners[server->num_listeners];
+	if ( epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 ) {
+		syslog(LOG_ERR, "server: epoll_ctl failed: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	++server->num_listeners;
+	return 0;
+}
+
+static int server_listen_unix( struct t_server *server, const char *path ) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if ( strlen(path) >= sizeof(addr.sun_path) ) {
+		syslog(LOG_ERR, "server: unix socket path too long: %s", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if ( fd < 0 ) {
+		syslog(LOG_ERR, "server: unable to create unix socket: %s", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	// a stale socket left behind by a previous run would make bind fail
+	unlink(path);
+
+	if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+		syslog(LOG_ERR, "server: unable to bind %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	syslog(LOG_INFO, "server: listening on unix:%s", path);
+	return server_add_listener(server, fd);
+}
+
+static int server_listen_tcp( struct t_server *server, const char *address, long port ) {
+	struct addrinfo hints, *res, *ai;
+	char   service[24];
+	int    fd, rc, on = 1;
+	int    bound = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = AI_PASSIVE;
+
+	snprintf(service, sizeof(service), "%ld", port);
+
+	// never listen on every interface unless told to
+	if ( address[0] == '\0' ) { address = "127.0.0.1"; }
+
+	if ( (rc = getaddrinfo(address, service, &hints, &res)) != 0 ) {
+		syslog(LOG_ERR, "server: unable to resolve %s: %s", address, gai_strerror(rc));
+		return -1;
+	}
+
+	for ( ai = res; ai != NULL; ai = ai->ai_next ) {
+		fd = socket(ai->ai_family, ai->ai_socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, ai->ai_protocol);
+		if ( fd < 0 ) { continue; }
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if ( ai->ai_family == AF_INET6 ) {
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+		}
+
+		if ( bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 ) {
+			syslog(LOG_ERR, "server: unable to bind %s:%ld: %s", address, port, strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		if ( server_add_listener(server, fd) == 0 ) { ++bound; }
+	}
+
+	freeaddrinfo(res);
+
+	if ( bound == 0 ) { return -1; }
+
+	syslog(LOG_INFO, "server: listening on tcp:%s:%ld", address, port);
+	return 0;
+}
+
+static void client_close( struct t_server *server, struct t_client *client ) {
+	_DBG("server: closing client fd=%d", client->fd);
+
+	// closing the descriptor also removes it from the epoll set
+	if ( client->fd >= 0 ) {
+		close(client->fd);
+		client->fd = -1;
+	}
+
+	// workers still hold our jobs, finish tearing down when they come back
+	if ( client->pending > 0 ) { return; }
+
+	if ( client->prev != NULL ) { client->prev->next = client->next; }
+	if ( client->next != NULL ) { client->next->prev = client->prev; }
+	if ( server->clients == client ) { server->clients = client->next; }
+	--server->num_clients;
+
+	// later events of the same epoll batch may still point at us
+	client->prev   = NULL;
+	client->next   = server->closed;
+	server->closed = client;
+}
+
+static void server_reap( struct t_server *server ) {
+	struct t_client *client;
+
+	while ( (client = server->closed) != NULL ) {
+		server->closed = client->next;
+		free(client);
+	}
+}
+
+static int client_set_events( struct t_server *server, struct t_client *client, int events ) {
+	struct epoll_event ev;
+
+	if ( client->events == events ) { return 0; }
+
+	ev.events   = events;
+	ev.data.ptr = client;
+	if ( epoll_ctl(server->epfd, EPOLL_CTL_MOD, client->fd, &ev) != 0 ) {
+		syslog(LOG_ERR, "server: epoll_ctl failed: %s", strerror(errno));
+		return -1;
+	}
+
+	client->events = events;
+	return 0;
+}
+
+static void server_accept( struct t_server *server, int lfd ) {
+	struct t_client *client;
+	struct epoll_event ev;
+	int fd;
+
+	// drain the backlog, the listener is level triggered anyway
+	while ( (fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0 ) {
+
+		client = (struct t_client *)calloc(1, sizeof(struct t_client));
+		if ( client == NULL ) {
+			syslog(LOG_ERR, "server: out of memory, dropping client.");
+			close(fd);
+			continue;
+		}
+
+		client->fd     = fd;
+		client->events = EPOLLIN;
+		grist_io_init(&client->io);
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = client;
+		if ( epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 ) {
+			syslog(LOG_ERR, "server: epoll_ctl failed: %s", strerror(errno));
+			close(fd);
+			free(client);
+			continue;
+		}
+
+		client->next = server->clients;
+		if ( server->clients != NULL ) { server->clients->prev = client; }
+		server->clients = client;
+		++server->num_clients;
+
+		_DBG("server: accepted client fd=%d, %d connected.", fd, server->num_clients);
+	}
+
+	if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+		syslog(LOG_ERR, "server: accept failed: %s", strerror(errno));
+	}
+}
+
+/**
+ * client_process_input - check every complete request in the input buffer
+ *
+ * Requests are parsed where they sit in the buffer, so it is only compacted 
+ * once no request is out with the workers. Returns 1 if we stopped because
+ * the reply queue is full, there may be more requests waiting then.
+ */
+static int client_process_input( struct t_server *server, struct t_client *client ) {
+	struct t_job *job;
+	int slot, action;
+
+	while ( grist_io_next(&client->io, &client->request) ) {
+		slot = grist_io_reserve(&client->io);
+
+		if ( server->pool != NULL ) {
+			job = &client->jobs[slot];
+			job->owner   = client;
+			job->slot    = slot;
+			job->request = client->request;
+			job->action  = CHECK_ERR;
+
+			if ( pool_submit(server->pool, job) ) {
+				++client->pending;
+				continue;
+			}
+
+			// workers are hopelessly behind, let the mail through rather than stall
+			syslog(LOG_WARNING, "server: worker queue full, skipping lookup.");
+			action = CHECK_ERR;
+		} else {
+			action = grist_check_request(&server->db, &client->request, server->config);
+		}
+
+		grist_log_action(action, &client->request);
+		grist_io_reply(&client->io, slot, action);
+	}
+
+	return client->io.out_cnt == POLICY_PIPELINE_MAX;
+}
+
+static void client_progress( struct t_server *server, struct t_client *client );
+
+static void client_event( struct t_server *server, struct t_client *client, int events ) {
+	ssize_t n;
+
+	if ( client->fd < 0 ) { return; }
+
+	if ( events & (EPOLLERR|EPOLLHUP) && !(events & EPOLLIN) ) {
+		client_close(server, client);
+		return;
+	}
+
+	if ( events & EPOLLIN ) {
+		n = grist_io_read(&client->io, client->fd);
+		if ( n == 0 ) {
+			// what it sent before hanging up still gets answered
+			_DBG("server: client fd=%d closed connection.", client->fd);
+			client->eof = 1;
+		}
+		if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ENOBUFS ) {
+			client_close(server, client);
+			return;
+		}
+	}
+
+	client_progress(server, client);
+}
+
+/**
+ * client_progress - answer what we can and wait for whatever comes next
+ */
+static void client_progress( struct t_server *server, struct t_client *client ) {
+	int want, done, full;
+
+	do {
+		full = client_process_input(server, client);
+
+		// replies are written in order, so wait until every one is in
+		if ( client->pending > 0 ) { break; }
+
+		done = grist_io_flush(&client->io, client->fd);
+		if ( done < 0 ) {
+			client_close(server, client);
+			return;
+		}
+
+		grist_io_compact(&client->io);
+
+	// a full batch of replies may have held back more buffered requests
+	} while ( done && full );
+
+	if ( client->io.in_len == sizeof(client->io.in) && client->io.out_cnt == 0 && client->pending == 0 ) {
+		syslog(LOG_WARNING, "server: request too large, dropping client.");
+		client_close(server, client);
+		return;
+	}
+
+	// a client that hung up is closed once its last reply is written
+	if ( client->eof && client->io.out_cnt == 0 && client->pending == 0 ) {
+		client_close(server, client);
+		return;
+	}
+
+	// stop reading while the buffer is full of requests we can't answer yet
+	want = 0;
+	if ( client->io.in_len < sizeof(client->io.in) && !client->eof ) { want |= EPOLLIN; }
+	if ( client->io.out_cnt > 0 && client->pending == 0 ) { want |= EPOLLOUT; }
+
+	if ( client_set_events(server, client, want) != 0 ) {
+		client_close(server, client);
+	}
+}
+
+static void server_close_listeners( struct t_server *server ) {
+	int i;
+
+	for ( i = 0; i < server->num_listeners; i++ ) {
+		close(server->listeners[i]);
+	}
+	server->num_listeners = 0;
+
+	if ( server->config->listen_unix[0] != '\0' ) {
+		unlink(server->config->listen_unix);
+	}
+}
+
+/**
+ * server_collect - pick up the requests the workers are done with
+ */
+static void server_collect( struct t_server *server ) {
+	struct t_client *client;
+	struct t_job *job;
+	uint64_t count;
+
+	if ( read(server->notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN ) {
+		syslog(LOG_ERR, "server: unable to read worker notification: %s", strerror(errno));
+	}
+
+	while ( (job = pool_completed(server->pool)) != NULL ) {
+		client = (struct t_client *)job->owner;
+		--client->pending;
+
+		if ( client->fd < 0 ) {
+			// went away while the workers were busy with it
+			if ( client->pending == 0 ) { client_close(server, client); }
+			continue;
+		}
+
+		grist_log_action(job->action, &job->request);
+		grist_io_reply(&client->io, job->slot, job->action);
+
+		if ( client->pending == 0 ) { client_progress(server, client); }
+	}
+}
+
+/**
+ * grist_server - accept policy clients on our own sockets and serve them
+ * from a single epoll loop until we are told to terminate
+ */
+int grist_server( struct t_grist_config *config ) {
+	struct t_server server;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+	int n, i;
+
+	memset(&server, 0, sizeof(server));
+	server.config = config;
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT,  server_trap_signal);
+	signal(SIGTERM, server_trap_signal);
+
+	if ( (server.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+		syslog(LOG_ERR, "server: epoll_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if ( config->listen_unix[0] != '\0' ) {
+		if ( server_listen_unix(&server, config->listen_unix) != 0 ) {
+			fprintf(stderr, "unable to listen on %s\n", config->listen_unix);
+			close(server.epfd);
+			return -1;
+		}
+	}
+
+	if ( config->listen_port > 0 ) {
+		if ( server_listen_tcp(&server, config->listen_address, config->listen_port) != 0 ) {
+			fprintf(stderr, "unable to listen on port %ld\n", config->listen_port);
+			server_close_listeners(&server);
+			close(server.epfd);
+			return -1;
+		}
+	}
+
+	if ( config->rq_workers > 0 ) {
+		struct epoll_event ev;
+
+		server.notify_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if ( server.notify_fd < 0 ) {
+			syslog(LOG_ERR, "server: eventfd failed: %s", strerror(errno));
+			server_close_listeners(&server);
+			close(server.epfd);
+			return -1;
+		}
+
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &server.notify_fd;
+		epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.notify_fd, &ev);
+
+		server.pool = pool_create(config, config->rq_workers, server.notify_fd);
+		if ( server.pool == NULL ) {
+			fprintf(stderr, "unable to start worker threads\n");
+			close(server.notify_fd);
+			server_close_listeners(&server);
+			close(server.epfd);
+			return -1;
+		}
+	}
+
+	if ( !db_bloom_start(config) || !db_expire_start(config) || !db_behind_start(config) || !db_group_start(config) || !db_cache_start(config) || !grist_awl_start(config) ) {
+		fprintf(stderr, "unable to set up the database filter, expiry, cache, writers or whitelist\n");
+		db_cache_stop();
+		db_group_stop();
+		db_behind_stop();
+		db_expire_stop();
+		db_bloom_stop();
+		if ( server.pool != NULL ) {
+			pool_destroy(server.pool);
+			close(server.notify_fd);
+		}
+		server_close_listeners(&server);
+		close(server.epfd);
+		return -1;
+	}
+
+	while ( !server_shutdown ) {
+		n = epoll_wait(server.epfd, events, SERVER_MAX_EVENTS, -1);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			syslog(LOG_ERR, "server: epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+
+		for ( i = 0; i < n; i++ ) {
+			int *p = (int *)events[i].data.ptr;
+
+			if ( p >= server.listeners && p < server.listeners + server.num_listeners ) {
+				server_accept(&server, *p);
+			} else if ( p == &server.notify_fd ) {
+				server_collect(&server);
+			} else {
+				client_event(&server, (struct t_client *)events[i].data.ptr, events[i].events);
+			}
+		}
+
+		server_reap(&server);
+	}
+
+	syslog(LOG_INFO, "server: shutting down, %d client(s) connected.", server.num_clients);
+
+	// once the workers are joined nobody else references a client
+	if ( server.pool != NULL ) {
+		pool_destroy(server.pool);
+		close(server.notify_fd);
+	}
+
+	while ( server.clients != NULL ) {
+		server.clients->pending = 0;
+		client_close(&server, server.clients);
+	}
+	server_reap(&server);
+
+	server_close_listeners(&server);
+
+	if ( server.db != NULL ) {
+		db_close(server.db);
+	}
+
+	// every check is done, what they counted can be written out
+	grist_awl_stop();
+	db_cache_stop();
+	db_group_stop();
+	db_behind_stop();
+	db_expire_stop();
+	db_bloom_stop();
+
+	close(server.epfd);
+
+	return 0;
+}
+
+#else
+
+int grist_server( struct t_grist_config *config ) {
+	fprintf(stderr, "listening sockets are not supported on this platform, use spawn with --daemon instead.\n");
+	return -1;
+}
+
+#endif
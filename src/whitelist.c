@@ -0,0 +1,367 @@
+/**
+ * file: whitelist.c
+ * grist - clients let through without looking their triplets up
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <pthread.h>
+#include <ctype.h>
+
+/*
+ * With rq_auto_whitelist set, a daemon counts the distinct triplets it
+ * accepts per client network, the /24 of an IPv4 client or the /64 of an
+ * IPv6 one. A triplet counts once, the first time it is accepted, so one
+ * sender retrying the same mail can't whitelist its network. The triplets
+ * counted are remembered by fingerprint in an open addressed set. Once a
+ * network has had rq_auto_whitelist of them, its clients are let through
+ * without their triplets being looked up. The counts are learned afresh
+ * each time grist starts.
+ */
+#define AWL_IPV4_PREFIX	24
+#define AWL_IPV6_PREFIX	64
+#define AWL_MAX_NODES	(1 << 21)		// bounds what counting networks may cost
+#define AWL_MAX_SEEN	(1 << 20)		// triplets remembered as counted
+#define AWL_SEEN_SLOTS	(AWL_MAX_SEEN*2)	// a power of two, probes stay short
+
+static struct {
+	pthread_rwlock_t lock;
+	struct t_radix   *tree;
+	uint64_t *seen;		// fingerprints of the triplets counted, 0 is free
+	size_t   seen_count;
+	uint64_t seed;
+	int running;
+	int full;		// warned that no more networks are counted
+	int seen_full;		// warned that no more triplets are counted
+} awl = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/**
+ * awl_network - the key and prefix length of a client's network
+ *
+ * Returns 0 for a client address that isn't an IP address.
+ */
+static int awl_network( struct t_request *request, uint8_t *key ) {
+	int bits;
+
+	bits = radix_key(request->client_address, key);
+	if ( bits == 0 ) { return 0; }
+
+	return bits == 32 ? RADIX_V4_BITS + AWL_IPV4_PREFIX : AWL_IPV6_PREFIX;
+}
+
+/**
+ * grist_awl_start - start counting, if rq_auto_whitelist is set
+ */
+int grist_awl_start( struct t_grist_config *config ) {
+	if ( config->rq_auto_whitelist <= 0 ) { return 1; }
+
+	awl.tree = radix_create();
+	awl.seen = (uint64_t *)calloc(AWL_SEEN_SLOTS, sizeof(uint64_t));
+	if ( awl.tree == NULL || awl.seen == NULL ) {
+		if ( awl.tree != NULL ) { radix_destroy(awl.tree); }
+		_FREE(awl.seen);
+		awl.tree = NULL;
+		awl.seen = NULL;
+		return 0;
+	}
+	awl.seen_count = 0;
+	awl.seed       = grist_random_seed();
+
+	__atomic_store_n(&awl.running, 1, __ATOMIC_RELEASE);
+	syslog(LOG_INFO, "whitelist: client networks are whitelisted after %ld accepted triplet(s).", config->rq_auto_whitelist);
+
+	return 1;
+}
+
+/**
+ * grist_awl_check - whether the client's network is whitelisted
+ */
+int grist_awl_check( struct t_request *request, struct t_grist_config *config ) {
+	uint8_t key[RADIX_KEY_LEN];
+	long *count;
+	int bits, listed;
+
+	if ( !__atomic_load_n(&awl.running, __ATOMIC_ACQUIRE) ) { return 0; }
+
+	bits = awl_network(request, key);
+	if ( bits == 0 ) { return 0; }
+
+	pthread_rwlock_rdlock(&awl.lock);
+	count  = radix_find(awl.tree, key, bits);
+	listed = count != NULL && *count >= config->rq_auto_whitelist;
+	pthread_rwlock_unlock(&awl.lock);
+
+	return listed;
+}
+
+/**
+ * awl_first - remember a triplet as counted, the caller holds the write lock
+ *
+ * Returns 1 the first time a triplet is accepted, 0 after that or once
+ * no more can be remembered.
+ */
+static int awl_first( struct t_request *request ) {
+	uint64_t hash[2];
+	size_t i;
+
+	grist_fingerprint(request, awl.seed, hash);
+
+	for ( i = hash[0] & (AWL_SEEN_SLOTS-1); awl.seen[i] != 0; i = (i+1) & (AWL_SEEN_SLOTS-1) ) {
+		if ( awl.seen[i] == hash[0] ) { return 0; }
+	}
+
+	if ( awl.seen_count >= AWL_MAX_SEEN ) {
+		if ( !awl.seen_full ) {
+			syslog(LOG_WARNING, "whitelist: counted too many triplets, new ones are not counted.");
+			awl.seen_full = 1;
+		}
+		return 0;
+	}
+
+	awl.seen[i] = hash[0];
+	++awl.seen_count;
+
+	return 1;
+}
+
+/**
+ * grist_awl_count - count an accepted triplet against the client's network
+ *
+ * Only the first accepted request of a triplet counts.
+ */
+void grist_awl_count( struct t_request *request, struct t_grist_config *config ) {
+	uint8_t key[RADIX_KEY_LEN];
+	long *count;
+	int bits;
+
+	if ( !__atomic_load_n(&awl.running, __ATOMIC_ACQUIRE) ) { return; }
+
+	bits = awl_network(request, key);
+	if ( bits == 0 ) { return; }
+
+	pthread_rwlock_wrlock(&awl.lock);
+
+	if ( !awl_first(request) ) {
+		pthread_rwlock_unlock(&awl.lock);
+		return;
+	}
+
+	count = radix_find(awl.tree, key, bits);
+	if ( count == NULL ) {
+		if ( radix_count(awl.tree) < AWL_MAX_NODES ) {
+			count = radix_insert(awl.tree, key, bits);
+		} else if ( !awl.full ) {
+			syslog(LOG_WARNING, "whitelist: counting too many client networks, new ones are not counted.");
+			awl.full = 1;
+		}
+	}
+
+	if ( count != NULL && ++*count == config->rq_auto_whitelist ) {
+		syslog(LOG_INFO, "whitelist: network of client %s whitelisted.", request->client_address);
+	}
+
+	pthread_rwlock_unlock(&awl.lock);
+}
+
+/**
+ * grist_awl_stop - forget the counts
+ *
+ * Every worker must have been stopped.
+ */
+void grist_awl_stop( void ) {
+	if ( !awl.running ) { return; }
+
+	__atomic_store_n(&awl.running, 0, __ATOMIC_RELEASE);
+
+	radix_destroy(awl.tree);
+	awl.tree = NULL;
+	_FREE(awl.seen);
+	awl.seen = NULL;
+}
+
+/*
+ * whitelist_clients names a file of addresses and prefixes, one per line,
+ * whose clients are never greylisted. It is read into a radix tree once at
+ * startup, a daemon then compiles the tree into a table answering in a few
+ * memory reads while a process answering a single request looks its client
+ * up in the tree. whitelist_recipients and whitelist_senders do the same
+ * for domains and addresses, see domain.c.
+ */
+static struct {
+	struct t_radix       *clients;
+	struct t_radix_table *table;
+	struct t_domain      *recipients;
+	struct t_domain      *senders;
+} lists;
+
+/**
+ * clients_parse - add one line of the whitelist_clients file
+ *
+ * Returns 0 if it isn't an address or prefix.
+ */
+static int clients_parse( void *list, char *line ) {
+	uint8_t key[RADIX_KEY_LEN];
+	char *slash, *end;
+	long length = -1;
+	int bits;
+	long *value;
+
+	slash = strchr(line, '/');
+	if ( slash != NULL ) {
+		*slash = '\0';
+		length = strtol(slash + 1, &end, 10);
+		if ( end == slash + 1 || *end != '\0' || length < 0 ) { return 0; }
+	}
+
+	bits = radix_key(line, key);
+	if ( bits == 0 ) { return 0; }
+
+	if ( length > bits ) { return 0; }
+	if ( length < 0 ) { length = bits; }
+
+	// an IPv4 prefix counts from the start of the IPv4 address
+	if ( bits == 32 ) { length += RADIX_V4_BITS; }
+
+	value = radix_insert((struct t_radix *)list, key, (int)length);
+	if ( value == NULL ) { return 0; }
+	*value = 1;
+
+	return 1;
+}
+
+static int domains_parse( void *list, char *line ) {
+	return domain_insert((struct t_domain *)list, line);
+}
+
+/**
+ * whitelist_read - add the entries of a whitelist file to a list
+ *
+ * Entries that can't be parsed are logged and skipped. Returns how many
+ * were added, or -1 if the file can't be read.
+ */
+static int whitelist_read( const char *filename, int (*parse)( void *list, char *line ), void *list ) {
+	FILE *fh;
+	char line[1024], *p, *q;
+	int n = 0, loaded = 0;
+
+	if ( (fh = fopen(filename, "r")) == NULL ) {
+		syslog(LOG_ERR, "whitelist: unable to open %s.", filename);
+		return -1;
+	}
+
+	while ( fgets(line, sizeof(line), fh) != NULL ) {
+		++n;
+
+		// one entry, then maybe a comment
+		for ( p = line; isspace((unsigned char)*p); p++ ) ;
+		for ( q = p; *q != '\0' && *q != '#' && !isspace((unsigned char)*q); q++ ) ;
+		*q = '\0';
+		if ( *p == '\0' ) { continue; }
+
+		if ( !parse(list, p) ) {
+			syslog(LOG_WARNING, "whitelist: %s line %d is not a valid entry, ignored.", filename, n);
+			continue;
+		}
+		++loaded;
+	}
+	fclose(fh);
+
+	syslog(LOG_INFO, "whitelist: %d line(s) loaded from %s.", loaded, filename);
+
+	return loaded;
+}
+
+/**
+ * whitelist_domains - read whitelist_recipients or whitelist_senders
+ */
+static int whitelist_domains( const char *filename, struct t_domain **list ) {
+	if ( filename[0] == '\0' ) { return 1; }
+
+	*list = domain_create();
+	if ( *list == NULL ) { return 0; }
+
+	return whitelist_read(filename, domains_parse, *list) >= 0;
+}
+
+/**
+ * grist_whitelist_load - read the whitelists that are set
+ *
+ * compile is set by a process that answers more than one request.
+ */
+int grist_whitelist_load( struct t_grist_config *config, int compile ) {
+	if ( !whitelist_domains(config->whitelist_recipients, &lists.recipients)
+	     || !whitelist_domains(config->whitelist_senders, &lists.senders) ) {
+		grist_whitelist_free();
+		return 0;
+	}
+
+	if ( config->whitelist_clients[0] == '\0' ) { return 1; }
+
+	lists.clients = radix_create();
+	if ( lists.clients == NULL || whitelist_read(config->whitelist_clients, clients_parse, lists.clients) < 0 ) {
+		grist_whitelist_free();
+		return 0;
+	}
+
+	if ( compile ) {
+		lists.table = radix_compile(lists.clients);
+		if ( lists.table == NULL ) {
+			syslog(LOG_ERR, "whitelist: unable to compile the client prefixes of %s.", config->whitelist_clients);
+			grist_whitelist_free();
+			return 0;
+		}
+		radix_destroy(lists.clients);
+		lists.clients = NULL;
+	}
+
+	return 1;
+}
+
+/**
+ * grist_whitelist_check - whether the client, recipient or sender is on a
+ * whitelist
+ */
+int grist_whitelist_check( struct t_request *request ) {
+	uint8_t key[RADIX_KEY_LEN];
+
+	if ( lists.recipients != NULL && domain_match(lists.recipients, request->recipient) ) { return 1; }
+	if ( lists.senders != NULL && request->sender[0] != '\0' && domain_match(lists.senders, request->sender) ) { return 1; }
+
+	if ( lists.table == NULL && lists.clients == NULL ) { return 0; }
+
+	if ( radix_key(request->client_address, key) == 0 ) { return 0; }
+
+	if ( lists.table != NULL ) {
+		return radix_table_match(lists.table, key);
+	}
+
+	return radix_match(lists.clients, key, RADIX_KEY_LEN*8) != NULL;
+}
+
+void grist_whitelist_free( void ) {
+	radix_table_destroy(lists.table);
+	radix_destroy(lists.clients);
+	domain_destroy(lists.recipients);
+	domain_destroy(lists.senders);
+	lists.table      = NULL;
+	lists.clients    = NULL;
+	lists.recipients = NULL;
+	lists.senders    = NULL;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# awl_test.sh - a client network is let through once rq_auto_whitelist
+# distinct triplets from it were accepted, until grist is restarted, with
+# its own listener and on stdin
+#
+. ${srcdir:-.}/lib.sh
+
+configure "db_driver = memory" "rq_auto_whitelist = 2"
+start
+
+got=`{
+	request 192.0.2.1 a@example.com b@example.org
+	request 192.0.2.2 b@example.com b@example.org
+	request 198.51.100.1 a@example.com b@example.org
+	request 2001:db8::1 a@example.com b@example.org
+	request 2001:db8::2 b@example.com b@example.org
+	sleep 3
+	request 192.0.2.1 a@example.com b@example.org
+	request 192.0.2.2 b@example.com b@example.org
+	request 198.51.100.1 a@example.com b@example.org
+	request 198.51.100.1 a@example.com b@example.org
+	request 2001:db8::1 a@example.com b@example.org
+	request 2001:db8::2 b@example.com b@example.org
+	request 192.0.2.77 new@example.com b@example.org
+	request 192.0.3.1 new@example.com b@example.org
+	request 198.51.100.2 new@example.com b@example.org
+	request 2001:db8::ffff new@example.com b@example.org
+	request 2001:db8:0:1::1 new@example.com b@example.org
+} | send`
+expect "before and after" "`repeat $D 5` `repeat $OK 6` $OK $D $D $OK $D" "$got"
+
+stop
+start
+got=`request 192.0.2.88 new@example.com b@example.org | send`
+expect "after a restart" "$D" "$got"
+stop
+
+got=`{
+	request 203.0.113.1 a@example.com b@example.org
+	request 203.0.113.2 b@example.com b@example.org
+	sleep 3
+	request 203.0.113.1 a@example.com b@example.org
+	request 203.0.113.2 b@example.com b@example.org
+	request 203.0.113.77 new@example.com b@example.org
+} | ask`
+expect "on stdin" "$D $D $OK $OK $OK" "$got"
+
+exit 0
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# behind_test.sh - with db_write_behind_ms the seen and accepted counts of
+# stored triplets reach the sqlite3 database in batches, and those still
+# held are written when grist stops
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3" "db_write_behind_ms = 300" "rq_workers = 4"
+setup sqlite3
+
+counts() {
+	count "SELECT seen, accepted FROM requests WHERE address = '192.0.2.1' AND sender = '$1'"
+}
+
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 b@example.com b@example.org; sleep 2; } | send`
+expect "new triplets" "$D $D" "$got"
+
+got=`{ requests 1 192.0.2.1 a; request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 b@example.com b@example.org; } | send`
+expect "stored triplets" "$D $OK $OK $OK" "$got"
+sleep 1
+expect "a written behind" "2|2" "`counts a@example.com`"
+expect "b written behind" "1|1" "`counts b@example.com`"
+
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 b@example.com b@example.org; } | send`
+expect "stored triplets again" "$OK $OK" "$got"
+stop
+expect "a written on stop" "3|3" "`counts a@example.com`"
+expect "b written on stop" "2|2" "`counts b@example.com`"
+expect "one row each" "3" "`count 'SELECT COUNT(*) FROM requests'`"
+
+exit 0
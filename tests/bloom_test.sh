@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# bloom_test.sh - with db_bloom_mb the triplets stored before grist started
+# are looked up, new ones inserted once, and a triplet stored behind the
+# filter's back is still not taken for a new one
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3"
+setup sqlite3
+
+got=`request 192.0.2.1 a@example.com b@example.org | ask`
+expect "stored before" "$D" "$got"
+
+configure "db_driver = sqlite3" "db_bloom_mb = 1" "rq_workers = 4"
+for with in alone behind group; do
+	case $with in
+		alone)  start ;;
+		behind) start "db_write_behind_ms = 200" ;;
+		group)  start "db_group_commit_ms = 10" ;;
+	esac
+
+	count "INSERT INTO requests (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES ('192.0.2.9', 'test', 'behind$with@example.com', 'b@example.org', 1, 0, strftime('%s', 'now') - 3600)"
+	sleep 2
+	got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.9 behind$with@example.com b@example.org; requests 50 192.0.2.2 new$with; } | send`
+	expect "$with: stored before, behind its back, new" "$OK $OK `repeat $D 50`" "$got"
+
+	sleep 2
+	got=`requests 50 192.0.2.2 new$with | send`
+	expect "$with: retried" "`repeat $OK 50`" "$got"
+	stop
+
+	expect "$with: counted behind its back" "2" "`count \"SELECT seen FROM requests WHERE sender = 'behind$with@example.com'\"`"
+done
+expect "rows" "154" "`count 'SELECT COUNT(*) FROM requests'`"
+
+exit 0
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# cache_test.sh - with db_cache_mb triplets past rq_cooldown are answered
+# from the cache, which still counts them in the sqlite3 database
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3" "db_cache_mb = 1" "rq_workers = 4"
+setup sqlite3
+
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 b@example.com b@example.org; sleep 3; request 192.0.2.1 a@example.com b@example.org; } | send`
+expect "a retried" "$D $D $OK" "$got"
+
+# the database now says both are cooling, only a was cached
+count "UPDATE requests SET timestamp = timestamp + 3600"
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 b@example.com b@example.org; } | send`
+expect "a from the cache" "$OK $OK $D" "$got"
+expect "a counted" "3|3" "`count \"SELECT seen, accepted FROM requests WHERE sender = 'a@example.com'\"`"
+stop
+
+# the cache starts out empty
+start
+got=`request 192.0.2.1 a@example.com b@example.org | send`
+expect "a after a restart" "$D" "$got"
+stop
+
+# a 'grist --daemon' on stdin caches c once retried, for as long as it runs
+got=`{
+	request 192.0.2.2 c@example.com b@example.org
+	sleep 3
+	request 192.0.2.2 c@example.com b@example.org
+	sleep 1
+	count "UPDATE requests SET timestamp = timestamp + 3600" >/dev/null
+	request 192.0.2.2 c@example.com b@example.org
+} | ask`
+expect "c on stdin" "$D $OK $OK" "$got"
+expect "c counted" "2|2" "`count \"SELECT seen, accepted FROM requests WHERE sender = 'c@example.com'\"`"
+
+exit 0
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# cidr_test.sh - clients in whitelist_clients are never greylisted, those
+# next to them are
+#
+. ${srcdir:-.}/lib.sh
+
+cat > "$work/clients" <<END
+# relays of our own
+192.0.2.25
+198.51.100.0/24
+10.0.0.0/8	# the office
+
+2001:db8::/32
+END
+
+configure "db_driver = memory" "whitelist_clients = $work/clients"
+
+got=`{
+	request 192.0.2.25 a@example.com b@example.org
+	request 192.0.2.26 a@example.com b@example.org
+	request 198.51.100.200 a@example.com b@example.org
+	request 198.51.101.1 a@example.com b@example.org
+	request 10.255.0.1 a@example.com b@example.org
+	request 11.0.0.1 a@example.com b@example.org
+	request 2001:db8:ffff::1 a@example.com b@example.org
+	request 2001:db9::1 a@example.com b@example.org
+	request ::ffff:192.0.2.25 a@example.com b@example.org
+	request unknown a@example.com b@example.org
+} | ask`
+expect "daemon" "$OK $D $OK $D $OK $D $OK $D $OK $D" "$got"
+
+got=`request 198.51.100.1 a@example.com b@example.org | ask_once`
+expect "spawn" "$OK" "$got"
+
+configure "db_driver = memory" "whitelist_clients = $work/missing"
+request 192.0.2.25 a@example.com b@example.org | "$GRIST" --conf "$work/grist.conf" --daemon >/dev/null 2>&1 && fail "grist ran without its whitelist"
+
+exit 0
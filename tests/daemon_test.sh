@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# daemon_test.sh - one 'grist --daemon' answers every request on stdin,
+# and grist without it answers the one request spawn hands it
+#
+. ${srcdir:-.}/lib.sh
+
+configure "db_driver = sqlite"
+setup sqlite
+
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.1 a@example.com b@example.org; sleep 3; request 192.0.2.1 a@example.com b@example.org; request 192.0.2.2 a@example.com b@example.org; } | ask`
+expect "greylisted, cooling, retried, another client" "$D $D $OK $D" "$got"
+
+# requests may arrive a few bytes at a time
+got=`{ request 192.0.2.3 c@example.com d@example.org | while IFS= read -r line; do printf '%s\n' "$line"; sleep 0.05; done; } | ask`
+expect "request sent a line at a time" "$D" "$got"
+
+got=`printf 'request=smtpd_access_policy\nclient_address=192.0.2.4\n' | ask`
+expect "request cut short" "" "$got"
+
+# every spawned grist opens the database the daemon uses
+got=`request 192.0.2.5 a@example.com b@example.org | ask_once`
+expect "spawn, new triplet" "$D" "$got"
+sleep 2
+got=`request 192.0.2.5 a@example.com b@example.org | ask_once`
+expect "spawn, retried" "$OK" "$got"
+
+exit 0
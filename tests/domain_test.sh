@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# domain_test.sh - recipients and senders in whitelist_recipients and
+# whitelist_senders are never greylisted, others close to them are
+#
+. ${srcdir:-.}/lib.sh
+
+cat > "$work/recipients" <<END
+# whole domains
+example.com
+# single addresses
+tickets@example.net
+postmaster@
+END
+
+cat > "$work/senders" <<END
+lists.example.org
+END
+
+configure "db_driver = memory" "whitelist_recipients = $work/recipients" "whitelist_senders = $work/senders"
+
+got=`{
+	request 192.0.2.1 a@example.org x@example.com
+	request 192.0.2.1 a@example.org x@mail.example.com
+	request 192.0.2.1 a@example.org x@MAIL.Example.COM
+	request 192.0.2.1 a@example.org x@notexample.com
+	request 192.0.2.1 a@example.org x@example.com.example.org
+	request 192.0.2.1 a@example.org tickets@example.net
+	request 192.0.2.1 a@example.org sales@example.net
+	request 192.0.2.1 a@example.org tickets@mail.example.net
+	request 192.0.2.1 a@example.org postmaster@anywhere.example
+	request 192.0.2.1 a@example.org postmasters@anywhere.example
+	request 192.0.2.1 a@lists.example.org y@example.org
+	request 192.0.2.1 a@a.lists.example.org y@example.org
+	request 192.0.2.1 a@example.org y@example.org
+	request 192.0.2.1 x@example.com y@example.org
+} | ask`
+expect "daemon" "$OK $OK $OK $D $D $OK $D $D $OK $D $OK $OK $D $D" "$got"
+
+got=`request 192.0.2.1 a@example.org x@sub.example.com | ask_once`
+expect "spawn" "$OK" "$got"
+
+exit 0
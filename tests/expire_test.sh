@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# expire_test.sh - a 'grist --daemon' with rq_pending_ttl and
+# rq_accepted_ttl removes the stale triplets of a sqlite3 database, a slice
+# at a time, and leaves the others be
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3" "rq_pending_ttl = 3600" "rq_accepted_ttl = 86400"
+setup sqlite3
+
+# rows first seen age seconds ago, seen that many times
+rows() {
+	count "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < $1)
+	       INSERT INTO requests (address, hostname, sender, recipient, seen, accepted, timestamp)
+	       SELECT '192.0.2.1', 'test', '$2' || i || '@example.com', 'b@example.org', $3, $3, strftime('%s', 'now') - $4 FROM n"
+}
+
+rows 1200 pending 0 7200
+rows 10 recent 0 600
+rows 10 accepted 3 7200
+rows 10 stale 3 100000
+
+start
+eventually "never retried" "0" "SELECT COUNT(*) FROM requests WHERE sender LIKE 'pending%'"
+eventually "accepted long ago" "0" "SELECT COUNT(*) FROM requests WHERE sender LIKE 'stale%'"
+expect "not yet due" "10 10" "`count \"SELECT COUNT(*) FROM requests WHERE sender LIKE 'recent%'\"` `count \"SELECT COUNT(*) FROM requests WHERE sender LIKE 'accepted%'\"`"
+
+# a triplet that expired is new again
+got=`request 192.0.2.1 pending1@example.com b@example.org | send`
+expect "expired triplet" "$D" "$got"
+stop
+
+exit 0
@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# group_test.sh - new triplets from clients at once are inserted together
+# with db_group_commit_ms, once each, however many clients sent them
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3" "db_group_commit_ms = 20" "db_group_commit_max = 16" "rq_workers = 8" "rq_cooldown = 4"
+setup sqlite3
+
+# every client sends the same 50 triplets and 50 of its own
+clients() {
+	for client in 1 2 3 4; do
+		{ requests 50 192.0.2.1 same; requests 50 192.0.2.1$client own; } | send > "$work/client.$client" &
+		clients="$clients $!"
+	done
+	wait $clients
+	clients=
+}
+
+start
+clients
+for client in 1 2 3 4; do
+	expect "client $client, new triplets" "`repeat $D 100`" "`cat $work/client.$client`"
+done
+expect "rows" "250" "`count 'SELECT COUNT(*) FROM requests'`"
+
+sleep 4
+clients
+for client in 1 2 3 4; do
+	expect "client $client, retried" "`repeat $OK 100`" "`cat $work/client.$client`"
+done
+stop
+expect "rows after retries" "250" "`count 'SELECT COUNT(*) FROM requests'`"
+expect "seen" "7" "`count \"SELECT MAX(seen) FROM requests WHERE sender = 'same0@example.com'\"`"
+
+exit 0
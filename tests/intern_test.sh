@@ -0,0 +1,56 @@
+#!/bin/sh
+#
+# intern_test.sh - the memory store keeps every kind of triplet apart once
+# its domains are interned, and keeps the domains it still needs when
+# triplets are given up or grist is restarted
+#
+. ${srcdir:-.}/lib.sh
+
+long=`printf '%0300d' 0`
+
+# each pair differs in one part only
+odd() {
+	request 192.0.2.1 a@example.com b@example.org
+	request 192.0.2.1 b@example.com b@example.org
+	request 192.0.2.1 a@example.net b@example.org
+	request 192.0.2.1 a@example.com a@example.org
+	request 192.0.2.1 a@example.com b@example.net
+	request 192.0.2.1 a@example.com@example.org b@example.org
+	request 192.0.2.1 a b@example.org
+	request 192.0.2.1 a@ b@example.org
+	request 192.0.2.1 "" b@example.org
+	request 192.0.2.1 a@$long.example.com b@example.org
+	request 192.0.2.1 a@${long}x.example.com b@example.org
+	request 2001:db8::1 a@example.com b@example.org
+	request ::ffff:192.0.2.1 a@example.com b@example.org
+	request unknown a@example.com b@example.org
+	request 192.0.2.1 a@example.com.example.org b@example.org
+	request 192.0.2.1 a@example.comexample.org b@example.org
+}
+
+configure "db_driver = memory" "db_sync_ms = 100" "db_max_triplets = 1000"
+start
+got=`{ odd; sleep 3; odd; } | send`
+expect "distinct triplets" "`repeat $D 16` `repeat $OK 16`" "$got"
+
+# new triplets, each with domains of its own, crowd out those never retried
+got=`{
+	request 192.0.2.9 kept@kept.example.com b@kept.example.org
+	sleep 3
+	request 192.0.2.9 kept@kept.example.com b@kept.example.org
+	i=0
+	while [ $i -lt 3000 ]; do
+		request 192.0.2.9 new@$i.example.com b@$i.example.org
+		i=$((i + 1))
+	done
+} | send`
+expect "domains of their own" "$D $OK `repeat $D 3000`" "$got"
+
+sleep 0.5
+stop KILL
+start
+got=`{ odd; request 192.0.2.9 kept@kept.example.com b@kept.example.org; request 192.0.2.9 other@kept.example.com b@kept.example.org; } | send`
+expect "killed, domains kept" "`repeat $OK 16` $OK $D" "$got"
+stop
+
+exit 0
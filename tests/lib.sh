@@ -0,0 +1,152 @@
+#
+# lib.sh - sourced by the grist test scripts
+#
+# Each script writes its own grist.conf into a scratch directory, starts
+# grist against it and compares the actions grist answers with those it
+# expects. A script exits 0 when they match, 1 when they don't and 77 when
+# this build or host cannot run it.
+#
+
+GRIST=${GRIST:-../src/grist}
+CLIENT=${CLIENT:-./policy_client}
+
+work=`mktemp -d "${TMPDIR:-/tmp}/grist-test.XXXXXX"` || exit 99
+pid=
+
+# a script names the files it makes outside of $work in scratch
+cleanup() {
+	stop
+	rm -rf "$work" $scratch
+}
+trap cleanup 0
+trap 'exit 1' 1 2 15
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+skip() {
+	echo "SKIP: $*"
+	exit 77
+}
+
+# configure - write the configuration, one setting per argument
+configure() {
+	{
+		echo "rq_cooldown  = 2"
+		echo "rq_defer_msg = greylisted"
+		echo "db_path      = $work"
+		echo "db_name      = grist.db"
+		for setting in "$@"; do
+			echo "$setting"
+		done
+	} > "$work/grist.conf"
+}
+
+# request - a policy request for client, sender and recipient
+request() {
+	printf 'request=smtpd_access_policy\nclient_address=%s\nclient_name=test\nsender=%s\nrecipient=%s\n\n' "$1" "$2" "$3"
+}
+
+# requests - n requests from client for senders named prefix<i>
+requests() {
+	i=0
+	while [ $i -lt $1 ]; do
+		request $2 $3$i@example.com b@example.org
+		i=$((i + 1))
+	done
+}
+
+# repeat - word n times, on one line
+repeat() {
+	i=0
+	while [ $i -lt $2 ]; do
+		printf '%s ' $1
+		i=$((i + 1))
+	done | sed 's/ $//'
+}
+
+# actions - the actions of the replies on stdin, on one line
+actions() {
+	sed -n 's/^action=\([A-Z_]*\).*/\1/p' | tr '\n' ' ' | sed 's/ $//'
+}
+
+# ask - answer the requests on stdin with one 'grist --daemon' on stdin/stdout
+ask() {
+	"$GRIST" --conf "$work/grist.conf" --daemon | actions
+}
+
+# ask_once - answer the request on stdin with one grist as spawn runs it
+ask_once() {
+	"$GRIST" --conf "$work/grist.conf" | actions
+}
+
+# setup - create the database, skip the test if this build can't
+setup() {
+	"$GRIST" --conf "$work/grist.conf" setup >/dev/null 2>&1 || skip "grist setup failed for: $*"
+}
+
+# start - run 'grist --daemon' on listen_unix in the background, with the
+# settings given as arguments on top of the configuration
+start() {
+	{
+		cat "$work/grist.conf"
+		echo "listen_unix = $work/grist.sock"
+		for setting in "$@"; do
+			echo "$setting"
+		done
+	} > "$work/server.conf"
+	rm -f "$work/grist.sock"
+	"$GRIST" --conf "$work/server.conf" --daemon &
+	pid=$!
+
+	tries=0
+	while [ ! -S "$work/grist.sock" ]; do
+		kill -0 $pid 2>/dev/null || fail "grist exited on start"
+		tries=$((tries + 1))
+		[ $tries -le 50 ] || fail "grist did not listen on $work/grist.sock"
+		sleep 0.1
+	done
+}
+
+# stop - stop the background grist as an init script would
+stop() {
+	if [ -n "$pid" ]; then
+		kill -${1:-TERM} $pid 2>/dev/null
+		wait $pid 2>/dev/null
+		pid=
+	fi
+}
+
+# send - answer the requests on stdin with the background grist
+send() {
+	"$CLIENT" "$work/grist.sock" $1 | actions
+}
+
+# expect - compare what a check answered with what it should have
+expect() {
+	[ "$3" = "$2" ] || fail "$1: expected '$2', got '$3'"
+}
+
+# count - the rows of an sql query on the sqlite3 database
+count() {
+	sqlite3 -cmd ".timeout 5000" "$work/grist.db" "$1"
+}
+
+# eventually - like expect, for a query whose answer grist gets round to
+eventually() {
+	tries=0
+	while [ "`count \"$3\"`" != "$2" ] && [ $tries -lt 50 ]; do
+		tries=$((tries + 1))
+		sleep 0.1
+	done
+	expect "$1" "$2" "`count \"$3\"`"
+}
+
+need_sqlite3() {
+	command -v sqlite3 >/dev/null 2>&1 || skip "no sqlite3 shell to look into the database"
+}
+
+D=DEFER_IF_PERMIT
+OK=DUNNO
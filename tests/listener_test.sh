@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# listener_test.sh - one 'grist --daemon' answers clients on its unix and
+# tcp listeners from the same store, whole requests or in pieces
+#
+. ${srcdir:-.}/lib.sh
+
+port=$((20000 + $$ % 20000))
+
+configure "db_driver = sqlite"
+setup sqlite
+start "listen_address = 127.0.0.1" "listen_port = $port"
+
+got=`request 192.0.2.1 a@example.com b@example.org | send`
+expect "unix, new triplet" "$D" "$got"
+
+got=`request 192.0.2.1 a@example.com b@example.org | "$CLIENT" 127.0.0.1:$port | actions`
+expect "tcp, same triplet cooling" "$D" "$got"
+
+got=`request 192.0.2.2 a@example.com b@example.org | send 1`
+expect "request sent a byte at a time" "$D" "$got"
+
+# clients connected at the same time each get their own replies
+for client in 1 2 3 4; do
+	{ request 192.0.2.1$client a@example.com b@example.org; sleep 1; request 192.0.2.1$client x@example.com b@example.org; } | send > "$work/client.$client" &
+	clients="$clients $!"
+done
+wait $clients
+for client in 1 2 3 4; do
+	expect "concurrent client $client" "$D $D" "`cat $work/client.$client`"
+done
+
+sleep 1
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.2 a@example.com b@example.org; } | "$CLIENT" 127.0.0.1:$port | actions`
+expect "tcp, both retried" "$OK $OK" "$got"
+
+stop
+[ ! -S "$work/grist.sock" ] || fail "the unix socket was left behind"
+
+exit 0
@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# memory_test.sh - the memory store greylists each triplet on its own and,
+# once full, gives up triplets never retried before those that were
+#
+. ${srcdir:-.}/lib.sh
+
+configure "db_driver = memory"
+
+got=`{
+	request 192.0.2.1 a@example.com b@example.org
+	request 192.0.2.1 a@example.com b@example.org
+	sleep 3
+	request 192.0.2.1 a@example.com b@example.org
+	request 192.0.2.2 a@example.com b@example.org
+	request 192.0.2.1 c@example.com b@example.org
+	request 192.0.2.1 a@example.com c@example.org
+} | ask`
+expect "new, cooling, retried, then one field changed" "$D $D $OK $D $D $D" "$got"
+
+# a table of 100 triplets takes 2000 new ones
+configure "db_driver = memory" "db_max_triplets = 100"
+got=`{
+	request 192.0.2.1 kept@example.com b@example.org
+	sleep 3
+	request 192.0.2.1 kept@example.com b@example.org
+	requests 2000 192.0.2.1 new
+	sleep 3
+	request 192.0.2.1 kept@example.com b@example.org
+	requests 10 192.0.2.1 new
+} | ask`
+expect "full table" "$D $OK `repeat $D 2000` $OK `repeat $D 10`" "$got"
+
+exit 0
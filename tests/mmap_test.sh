@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# mmap_test.sh - processes that each answer one request share the mmap
+# table with a 'grist --daemon', which gives triplets up once it is full.
+# shm_test.sh runs the same checks on the shm segment.
+#
+. ${srcdir:-.}/lib.sh
+
+driver=${driver:-mmap}
+
+table() {
+	if [ $driver = mmap ]; then
+		configure "db_driver = mmap" "$@"
+		rm -f "$work/grist.db"
+		setup mmap
+	else
+		configure "db_driver = shm" "db_name = $shm_name" "$@"
+		rm -f /dev/shm/$shm_name
+	fi
+}
+
+table "db_max_triplets = 1000"
+
+got=`request 192.0.2.1 a@example.com b@example.org | ask_once`
+expect "spawn, new triplet" "$D" "$got"
+
+# spawned processes at once, each with its own triplet
+for client in 1 2 3 4 5 6 7 8; do
+	request 192.0.2.1$client a@example.com b@example.org | ask_once > "$work/client.$client" &
+	clients="$clients $!"
+done
+wait $clients
+for client in 1 2 3 4 5 6 7 8; do
+	expect "spawn $client at once" "$D" "`cat $work/client.$client`"
+done
+
+start
+got=`request 192.0.2.2 a@example.com b@example.org | send`
+expect "daemon, new triplet" "$D" "$got"
+sleep 2
+
+got=`request 192.0.2.2 a@example.com b@example.org | ask_once`
+expect "spawn, triplet the daemon stored" "$OK" "$got"
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.18 a@example.com b@example.org; } | send`
+expect "daemon, triplets spawn stored" "$OK $OK" "$got"
+stop
+
+table "db_max_triplets = 100"
+start
+got=`{
+	request 192.0.2.1 kept@example.com b@example.org
+	sleep 3
+	request 192.0.2.1 kept@example.com b@example.org
+	requests 2000 192.0.2.1 new
+	sleep 3
+	request 192.0.2.1 kept@example.com b@example.org
+	requests 10 192.0.2.1 new
+} | send`
+expect "full table" "$D $OK `repeat $D 2000` $OK `repeat $D 10`" "$got"
+stop
+
+exit 0
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# netmask_test.sh - with rq_ipv4_netmask and rq_ipv6_netmask a triplet
+# retried from another host of the same network is let through, by every
+# store that has it
+#
+. ${srcdir:-.}/lib.sh
+
+netmask() {
+	got=`{
+		request 192.0.2.1 a@example.com b@example.org
+		request 2001:db8::1 a@example.com b@example.org
+		sleep 3
+		request 192.0.2.200 a@example.com b@example.org
+		request 192.0.3.1 a@example.com b@example.org
+		request 2001:db8::2:1 a@example.com b@example.org
+		request 2001:db8:0:1::1 a@example.com b@example.org
+	} | ask`
+	expect "$1" "$D $D $OK $D $OK $D" "$got"
+}
+
+configure "db_driver = memory" "rq_ipv4_netmask = 24" "rq_ipv6_netmask = 64"
+netmask memory
+
+configure "db_driver = mmap" "rq_ipv4_netmask = 24" "rq_ipv6_netmask = 64"
+setup mmap
+netmask mmap
+
+configure "db_driver = sqlite3" "db_name = grist.sqlite" "rq_ipv4_netmask = 24" "rq_ipv6_netmask = 64"
+if command -v sqlite3 >/dev/null 2>&1 && "$GRIST" --conf "$work/grist.conf" setup >/dev/null 2>&1; then
+	netmask sqlite3
+	expect "stored networks" "192.0.2.0 2001:db8:: 192.0.3.0 2001:db8:0:1::" "`sqlite3 $work/grist.sqlite 'SELECT address FROM requests ORDER BY id' | tr '\n' ' ' | sed 's/ $//'`"
+fi
+
+exit 0
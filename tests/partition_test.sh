@@ -0,0 +1,47 @@
+#!/bin/sh
+#
+# partition_test.sh - with db_partition_hours triplets go in the table of
+# the period they were first seen in, lookups take the newest of the live
+# tables holding the triplet, and the table of the period before those is
+# dropped whole
+#
+. ${srcdir:-.}/lib.sh
+
+need_sqlite3
+configure "db_driver = sqlite3"
+setup sqlite3
+got=`{ request 192.0.2.1 before@example.com b@example.org; sleep 3; request 192.0.2.1 before@example.com b@example.org; } | ask`
+expect "before partitions" "$D $OK" "$got"
+
+configure "db_driver = sqlite3" "db_partition_hours = 1" "db_partitions = 3"
+"$GRIST" --conf "$work/grist.conf" migrate-schema >/dev/null 2>&1 || fail "migrate-schema failed"
+
+now=`count "SELECT strftime('%s', 'now') / 3600"`
+
+# a triplet in each of the periods before
+for n in 1 3 4; do
+	count "CREATE TABLE requests_$((now - n)) ( id INTEGER PRIMARY KEY, address TEXT, hostname TEXT, sender TEXT, recipient TEXT, seen INTEGER, accepted INTEGER, timestamp INTEGER)"
+	count "CREATE UNIQUE INDEX requests_$((now - n))_triplet ON requests_$((now - n)) (address, sender, recipient)"
+	count "INSERT INTO requests_$((now - n)) (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES ('192.0.2.1', 'test', 'old$n@example.com', 'b@example.org', 1, 1, ($now - $n) * 3600)"
+done
+
+# one stored in two live tables is cooling in the newest
+count "INSERT INTO requests_$((now - 1)) (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES ('192.0.2.1', 'test', 'both@example.com', 'b@example.org', 1, 1, ($now - 1) * 3600)"
+count "INSERT INTO requests_$now (address, hostname, sender, recipient, seen, accepted, timestamp) VALUES ('192.0.2.1', 'test', 'both@example.com', 'b@example.org', 0, 0, strftime('%s', 'now'))"
+
+got=`{
+	request 192.0.2.1 before@example.com b@example.org
+	request 192.0.2.1 old1@example.com b@example.org
+	request 192.0.2.1 old3@example.com b@example.org
+	request 192.0.2.1 new@example.com b@example.org
+	request 192.0.2.1 both@example.com b@example.org
+} | ask`
+expect "migrated, live, out of the live ones, new, in two" "$OK $OK $D $D $D" "$got"
+
+tables=`count "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB 'requests_*' ORDER BY name" | tr '\n' ' ' | sed 's/ $//'`
+expect "tables" "requests_$((now - 3)) requests_$((now - 1)) requests_$now" "$tables"
+expect "retried in its own period" "2" "`count \"SELECT seen FROM requests_$((now - 1)) WHERE sender = 'old1@example.com'\"`"
+expect "new ones in the current period" "old3@example.com new@example.com" "`count \"SELECT sender FROM requests_$now WHERE sender NOT IN ('before@example.com', 'both@example.com') ORDER BY id\" | tr '\n' ' ' | sed 's/ $//'`"
+expect "the newest counted" "1 1" "`count \"SELECT seen FROM requests_$now WHERE sender = 'both@example.com'\"` `count \"SELECT seen FROM requests_$((now - 1)) WHERE sender = 'both@example.com'\"`"
+
+exit 0
@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# persist_test.sh - the memory store comes back from its snapshot and
+# journal after grist is stopped, killed, or left a torn journal
+#
+. ${srcdir:-.}/lib.sh
+
+configure "db_driver = memory" "db_sync_ms = 100" "db_snapshot_interval = 1"
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; sleep 3; request 192.0.2.1 a@example.com b@example.org; } | send`
+expect "retried" "$D $OK" "$got"
+stop
+
+[ -f "$work/grist.db.snapshot" ] || fail "no snapshot written on stop"
+
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.2 a@example.com b@example.org; } | send`
+expect "stopped, retried one kept, new one" "$OK $D" "$got"
+
+# the journal is synced every 100 ms and snapshots follow every second
+sleep 0.5
+stop KILL
+start
+sleep 2
+got=`{ request 192.0.2.2 a@example.com b@example.org; requests 100 192.0.2.3 new; } | send`
+expect "killed, first seen kept" "$OK `repeat $D 100`" "$got"
+
+sleep 3
+stop KILL
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; requests 100 192.0.2.3 new; } | send`
+expect "killed after a snapshot" "$OK `repeat $OK 100`" "$got"
+
+# a record cut short by the crash is dropped, those before it kept
+sleep 0.5
+stop KILL
+printf 'torn' >> "$work/grist.db.journal"
+start
+got=`{ request 192.0.2.1 a@example.com b@example.org; request 192.0.2.2 a@example.com b@example.org; } | send`
+expect "torn journal" "$OK $OK" "$got"
+stop
+
+exit 0
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# pipeline_test.sh - requests sent ahead on one connection are all answered,
+# in the order they were sent, with or without worker threads
+#
+. ${srcdir:-.}/lib.sh
+
+# more requests than grist answers in one batch
+batch=100
+
+# a retried triplet between new ones tells the replies apart
+pipeline() {
+	i=0
+	while [ $i -lt $batch ]; do
+		request 192.0.2.1 known@example.com b@example.org
+		request 192.0.2.1 new$1.$i@example.com b@example.org
+		i=$((i + 1))
+	done
+}
+
+expected=`i=0; while [ $i -lt $batch ]; do printf '%s %s ' $OK $D; i=$((i + 1)); done | sed 's/ $//'`
+
+configure "db_driver = sqlite"
+setup sqlite
+got=`{ request 192.0.2.1 known@example.com b@example.org; sleep 3; pipeline stdin; } | ask`
+expect "stdin, $batch pairs" "$D $expected" "$got"
+
+for workers in 0 4; do
+	configure "db_driver = sqlite" "rq_workers = $workers"
+	start
+	request 192.0.2.1 known@example.com b@example.org | send >/dev/null
+	sleep 2
+
+	got=`pipeline $workers | send`
+	expect "$workers workers, $batch pairs" "$expected" "$got"
+
+	got=`pipeline $workers.split | send 100`
+	expect "$workers workers, $batch pairs in pieces" "$expected" "$got"
+	stop
+done
+
+exit 0
@@ -0,0 +1,137 @@
+/**
+ * file: policy_client.c
+ * grist - sends policy requests to a listening grist for the test scripts
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * policy_client <socket|host:port> [chunk]
+ *
+ * Everything on stdin goes to grist as one connection, the way smtpd
+ * pipelines its requests, then the replies are copied to stdout until grist
+ * closes the connection. With chunk the requests are written that many
+ * bytes at a time with a pause in between, so grist sees them in pieces.
+ */
+#define CLIENT_BUFFER	65536
+
+static int client_connect( const char *where ) {
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port;
+	int fd;
+
+	port = strrchr(where, ':');
+	if ( port == NULL ) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if ( fd < 0 ) { return -1; }
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, where, sizeof(sun.sun_path) - 1);
+		if ( connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 ) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	snprintf(host, sizeof(host), "%.*s", (int)(port - where), where);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo(host, port + 1, &hints, &res) != 0 ) { return -1; }
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if ( fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0 ) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static int write_all( int fd, const char *buf, size_t len ) {
+	ssize_t n;
+
+	while ( len > 0 ) {
+		n = write(fd, buf, len);
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			return -1;
+		}
+		buf += n;
+		len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+int main( int argc, char **argv ) {
+	static char buf[CLIENT_BUFFER];
+	size_t chunk = 0, len, off;
+	ssize_t n;
+	int fd;
+
+	if ( argc < 2 ) {
+		fprintf(stderr, "usage: policy_client <socket|host:port> [chunk]\n");
+		return 2;
+	}
+	if ( argc > 2 ) { chunk = (size_t)atoi(argv[2]); }
+
+	signal(SIGPIPE, SIG_IGN);
+
+	fd = client_connect(argv[1]);
+	if ( fd < 0 ) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	while ( (n = read(STDIN_FILENO, buf, sizeof(buf))) > 0 ) {
+		for ( off = 0; off < (size_t)n; off += len ) {
+			len = (size_t)n - off;
+			if ( chunk > 0 && len > chunk ) { len = chunk; }
+			if ( write_all(fd, buf + off, len) != 0 ) {
+				perror("write");
+				return 1;
+			}
+			if ( chunk > 0 ) { usleep(2000); }
+		}
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ( (n = read(fd, buf, sizeof(buf))) != 0 ) {
+		if ( n < 0 ) {
+			if ( errno == EINTR ) { continue; }
+			perror("read");
+			return 1;
+		}
+		if ( write_all(STDOUT_FILENO, buf, (size_t)n) != 0 ) { return 1; }
+	}
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,276 @@
+/**
+ * file: radix_test.c
+ * grist - checks the radix tree and its compiled table against a linear scan
+ *
+ * Copyright (C) 2005 Michael Hubbard <mhubbard@digital-fallout.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ *
+ */
+
+#include "grist.h"
+
+/*
+ * Random IPv4 and IPv6 prefixes go into a tree and into a plain array.
+ * Every lookup has to give the same answer from radix_match(), from the
+ * table radix_compile() makes of the tree, and from scanning the array
+ * for the longest prefix that covers the address. Run with "bench" it
+ * also times the lookups against the number of prefixes.
+ */
+#define TEST_LOOKUPS	200000
+#define BENCH_LOOKUPS	2000000
+
+struct t_prefix {
+	uint8_t key[RADIX_KEY_LEN];
+	int bits;
+	long value;
+};
+
+static uint64_t rng_state = 1;
+
+// splitmix64, the same addresses every run
+static uint64_t rng( void ) {
+	uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void random_key( uint8_t key[RADIX_KEY_LEN], int v4 ) {
+	uint64_t r[2] = { rng(), rng() };
+
+	memcpy(key, r, RADIX_KEY_LEN);
+	if ( v4 ) {
+		memset(key, 0, 10);
+		key[10] = 0xff;
+		key[11] = 0xff;
+	}
+}
+
+static void mask_key( uint8_t key[RADIX_KEY_LEN], int bits ) {
+	int i;
+
+	for ( i = 0; i < RADIX_KEY_LEN; i++ ) {
+		if ( bits >= 8 ) { bits -= 8; continue; }
+		key[i] &= (uint8_t)(0xff00 >> bits);
+		bits = 0;
+	}
+}
+
+static int covers( const struct t_prefix *prefix, const uint8_t *key ) {
+	int whole = prefix->bits >> 3, rest = prefix->bits & 7;
+
+	if ( memcmp(prefix->key, key, whole) != 0 ) { return 0; }
+
+	return rest == 0 || (prefix->key[whole] ^ key[whole]) >> (8 - rest) == 0;
+}
+
+/**
+ * linear_match - the value of the longest prefix covering a key, -1 if none
+ */
+static long linear_match( const struct t_prefix *prefixes, int n, const uint8_t *key ) {
+	int i, best = -1;
+
+	for ( i = 0; i < n; i++ ) {
+		if ( covers(&prefixes[i], key) && (best < 0 || prefixes[i].bits > prefixes[best].bits) ) { best = i; }
+	}
+
+	return best < 0 ? -1 : prefixes[best].value;
+}
+
+/**
+ * build - n random prefixes, two thirds IPv4 with lengths as seen in routing tables
+ */
+static struct t_radix *build( struct t_prefix *prefixes, int n ) {
+	struct t_radix *tree;
+	long *value;
+	int i, v4;
+
+	tree = radix_create();
+	if ( tree == NULL ) { return NULL; }
+
+	for ( i = 0; i < n; i++ ) {
+		v4 = rng() % 3 != 0;
+		random_key(prefixes[i].key, v4);
+		prefixes[i].bits  = v4 ? RADIX_V4_BITS + 8 + (int)(rng() % 25) : 16 + (int)(rng() % 113);
+		prefixes[i].value = i + 1;
+		mask_key(prefixes[i].key, prefixes[i].bits);
+
+		value = radix_insert(tree, prefixes[i].key, prefixes[i].bits);
+		if ( value == NULL ) { return NULL; }
+		*value = prefixes[i].value;
+	}
+
+	// a prefix drawn twice keeps the value inserted last
+	for ( i = 0; i < n; i++ ) {
+		prefixes[i].value = *radix_find(tree, prefixes[i].key, prefixes[i].bits);
+	}
+
+	return tree;
+}
+
+/**
+ * lookup_key - an address to look up, half of them inside a prefix
+ */
+static void lookup_key( uint8_t key[RADIX_KEY_LEN], const struct t_prefix *prefixes, int n ) {
+	const struct t_prefix *prefix;
+	uint8_t r[RADIX_KEY_LEN], mask;
+	int i;
+
+	random_key(key, rng() & 1);
+	if ( n == 0 || rng() & 1 ) { return; }
+
+	// the prefix's bits, the rest random
+	prefix = &prefixes[rng() % n];
+	random_key(r, 0);
+	for ( i = 0; i < RADIX_KEY_LEN; i++ ) {
+		if ( (i+1)*8 <= prefix->bits ) {
+			mask = 0xff;
+		} else if ( i*8 >= prefix->bits ) {
+			mask = 0;
+		} else {
+			mask = (uint8_t)(0xff00 >> (prefix->bits - i*8));
+		}
+		key[i] = (prefix->key[i] & mask) | (r[i] & (uint8_t)~mask);
+	}
+}
+
+static int check( int n ) {
+	struct t_prefix *prefixes;
+	struct t_radix *tree;
+	struct t_radix_table *table;
+	uint8_t key[RADIX_KEY_LEN];
+	long *value, expect;
+	int i, failed = 0;
+
+	prefixes = (struct t_prefix *)calloc(n + 1, sizeof(struct t_prefix));
+	tree     = prefixes != NULL ? build(prefixes, n) : NULL;
+	table    = tree != NULL ? radix_compile(tree) : NULL;
+	if ( table == NULL ) {
+		fprintf(stderr, "radix: out of memory with %d prefixes\n", n);
+		return 0;
+	}
+
+	for ( i = 0; i < TEST_LOOKUPS && failed < 10; i++ ) {
+		lookup_key(key, prefixes, n);
+
+		expect = linear_match(prefixes, n, key);
+		value  = radix_match(tree, key, RADIX_KEY_LEN*8);
+		if ( (value == NULL ? -1 : *value) != expect ) {
+			fprintf(stderr, "radix: %d prefixes, radix_match found %ld, the scan %ld\n", n, value == NULL ? -1 : *value, expect);
+			++failed;
+		}
+		if ( radix_table_match(table, key) != (expect >= 0) ) {
+			fprintf(stderr, "radix: %d prefixes, the table says %d, the scan %ld\n", n, radix_table_match(table, key), expect);
+			++failed;
+		}
+	}
+
+	// every prefix finds itself
+	for ( i = 0; i < n && failed < 10; i++ ) {
+		if ( radix_find(tree, prefixes[i].key, prefixes[i].bits) == NULL ) {
+			fprintf(stderr, "radix: prefix %d of %d not found\n", i, n);
+			++failed;
+		}
+	}
+
+	radix_table_destroy(table);
+	radix_destroy(tree);
+	free(prefixes);
+
+	printf("radix: %d prefixes, %s\n", n, failed ? "FAILED" : "ok");
+
+	return !failed;
+}
+
+static double elapsed_ns( struct timespec *from ) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - from->tv_sec) * 1e9 + (now.tv_nsec - from->tv_nsec);
+}
+
+static void bench( int n ) {
+	struct t_prefix *prefixes;
+	struct t_radix *tree;
+	struct t_radix_table *table;
+	struct timespec start;
+	uint8_t *keys;
+	double compile, tree_ns, table_ns, linear_ns;
+	long hits = 0;
+	int i, linear_lookups;
+
+	prefixes = (struct t_prefix *)calloc(n + 1, sizeof(struct t_prefix));
+	keys     = (uint8_t *)malloc((size_t)BENCH_LOOKUPS * RADIX_KEY_LEN);
+	tree     = prefixes != NULL && keys != NULL ? build(prefixes, n) : NULL;
+	if ( tree == NULL ) { return; }
+
+	for ( i = 0; i < BENCH_LOOKUPS; i++ ) {
+		lookup_key(keys + (size_t)i * RADIX_KEY_LEN, prefixes, n);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	table   = radix_compile(tree);
+	compile = elapsed_ns(&start) / 1e6;
+	if ( table == NULL ) { return; }
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for ( i = 0; i < BENCH_LOOKUPS; i++ ) {
+		hits += radix_match(tree, keys + (size_t)i * RADIX_KEY_LEN, RADIX_KEY_LEN*8) != NULL;
+	}
+	tree_ns = elapsed_ns(&start) / BENCH_LOOKUPS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for ( i = 0; i < BENCH_LOOKUPS; i++ ) {
+		hits += radix_table_match(table, keys + (size_t)i * RADIX_KEY_LEN);
+	}
+	table_ns = elapsed_ns(&start) / BENCH_LOOKUPS;
+
+	// the scan is slow enough that fewer lookups do
+	linear_lookups = BENCH_LOOKUPS / (n / 100 + 1);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for ( i = 0; i < linear_lookups; i++ ) {
+		hits += linear_match(prefixes, n, keys + (size_t)i * RADIX_KEY_LEN) >= 0;
+	}
+	linear_ns = elapsed_ns(&start) / linear_lookups;
+
+	printf("%10d %10.1f %10.1f %12.1f %10.1f   (%ld)\n", n, tree_ns, table_ns, linear_ns, compile, hits);
+
+	radix_table_destroy(table);
+	radix_destroy(tree);
+	free(prefixes);
+	free(keys);
+}
+
+int main( int argc, char **argv ) {
+	static const int sizes[] = { 1000, 10000, 50000, 200000 };
+	int i, ok = 1;
+
+	ok &= check(0);
+	ok &= check(1);
+	ok &= check(100);
+	ok &= check(2000);
+
+	if ( argc > 1 && strcmp(argv[1], "bench") == 0 ) {
+		printf("%10s %10s %10s %12s %10s\n", "prefixes", "tree ns", "table ns", "linear ns", "compile ms");
+		for ( i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++ ) {
+			bench(sizes[i]);
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+#
+# shm_test.sh - the checks of mmap_test.sh on a shared memory segment
+#
+[ -d /dev/shm ] || { echo "SKIP: no /dev/shm"; exit 77; }
+
+driver=shm
+shm_name=grist-test.$$
+scratch=/dev/shm/$shm_name
+
+. ${srcdir:-.}/mmap_test.sh